@@ -0,0 +1,207 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "arena.h"
+
+#define ALIGN       64
+#define MIN_BLOCK   (1 << 20)
+#define HUGE_PAGE   (2 << 20)
+
+typedef struct arena_block
+{
+   struct arena_block *prev;
+   size_t size;      /* bytes for allocations */
+   size_t mapped;    /* bytes mapped, the header included */
+   size_t base;      /* arena position of the first byte */
+   size_t used;
+} arena_block;
+
+/* the header, rounded up so allocations stay aligned */
+#define HEADER ((sizeof(arena_block) + ALIGN - 1) & ~(size_t)(ALIGN - 1))
+
+struct arena
+{
+   arena_block *top;
+   size_t high;      /* most ever in use */
+};
+
+static size_t round_up(size_t n, size_t to)
+{
+   return((n + to - 1) / to * to);
+}
+
+static void *map_pages(size_t size)
+{
+#ifdef WIN32
+   return(VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+   void *p;
+
+#ifdef MAP_HUGETLB
+   /* only there when huge pages have been set aside */
+   if(size % HUGE_PAGE == 0)
+   {
+      p = mmap(0, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(p != MAP_FAILED) return(p);
+   }
+#endif
+
+   p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+   if(p == MAP_FAILED) return(0);
+
+#ifdef MADV_HUGEPAGE
+   /* transparent huge pages, where they are not used for everything */
+   if(size % HUGE_PAGE == 0)
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+   return(p);
+#endif
+}
+
+static void unmap_pages(void *p, size_t size)
+{
+#ifdef WIN32
+   VirtualFree(p, 0, MEM_RELEASE);
+#else
+   munmap(p, size);
+#endif
+}
+
+static arena_block *block_new(size_t size, size_t base)
+{
+   arena_block *b;
+   size_t mapped = HEADER + size;
+
+   if(mapped < MIN_BLOCK)
+      mapped = MIN_BLOCK;
+   else if(mapped >= HUGE_PAGE)
+      mapped = round_up(mapped, HUGE_PAGE);
+
+   b = map_pages(mapped);
+   if(b == 0) return(0);
+
+   b->prev = 0;
+   b->size = mapped - HEADER;
+   b->mapped = mapped;
+   b->base = base;
+   b->used = 0;
+
+   return(b);
+}
+
+static void block_free(arena_block *b)
+{
+   unmap_pages(b, b->mapped);
+}
+
+arena *arena_new(void)
+{
+   return(calloc(1, sizeof(arena)));
+}
+
+void arena_free(arena *a)
+{
+   arena_block *b;
+
+   if(a == 0) return;
+
+   while((b = a->top) != 0)
+   {
+      a->top = b->prev;
+      block_free(b);
+   }
+   free(a);
+}
+
+size_t arena_mark(const arena *a)
+{
+   return(a->top ? a->top->base + a->top->used : 0);
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+   arena_block *b = a->top;
+   size_t pos, want;
+   void *p;
+
+   size = round_up(size ? size : 1, ALIGN);
+
+   if(b == 0 || b->size - b->used < size)
+   {
+      pos = arena_mark(a);
+
+      /* at least double, so a growing run chains few blocks */
+      want = size;
+      if(b && want < b->size * 2) want = b->size * 2;
+      if(a->high > pos && want < a->high - pos) want = a->high - pos;
+
+      b = block_new(want, pos);
+      if(b == 0)
+      {
+         b = block_new(size, pos);
+         if(b == 0) return(0);
+      }
+      b->prev = a->top;
+      a->top = b;
+   }
+
+   p = (char *)b + HEADER + b->used;
+   b->used += size;
+
+   if(b->base + b->used > a->high)
+      a->high = b->base + b->used;
+
+   return(p);
+}
+
+void arena_release(arena *a, size_t mark)
+{
+   arena_block *b;
+
+   while((b = a->top) != 0 && b->base >= mark && b->prev)
+   {
+      a->top = b->prev;
+      block_free(b);
+   }
+
+   if(b == 0) return;
+
+   b->used = (mark > b->base) ? mark - b->base : 0;
+
+   /* back at the start with a block smaller than has been needed, replace
+      it with one that holds everything */
+   if(mark == 0 && b->size < a->high)
+   {
+      a->top = 0;
+      block_free(b);
+      a->top = block_new(a->high, 0);
+   }
+}
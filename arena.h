@@ -0,0 +1,57 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/* Scratch memory handed out by moving a pointer along large blocks and
+ * given back all at once, for the buffers of a conversion that live no
+ * longer than it.  Kept from one run to the next, an arena stops the
+ * preview and batch conversions from mapping, faulting in and returning
+ * the same hundreds of megabytes every time.
+ *
+ * When a request does not fit another block is chained on.  Going back
+ * to position 0 folds the blocks into one the size of the most ever in
+ * use, so from then on a run of the same size never allocates.  Blocks of
+ * 2 MB and more are backed by huge pages where the system allows.
+ *
+ * An arena is not locked, it belongs to one thread at a time.
+ */
+
+typedef struct arena arena;
+
+/* Returns NULL if out of memory. */
+arena *arena_new(void);
+
+void arena_free(arena *a);
+
+/* 'size' bytes aligned to 64, or NULL if out of memory. */
+void *arena_alloc(arena *a, size_t size);
+
+/* The position to go back to with arena_release(), which gives back
+ * everything allocated since.  Marks nest.
+ */
+size_t arena_mark(const arena *a);
+void arena_release(arena *a, size_t mark);
+
+#endif
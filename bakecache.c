@@ -0,0 +1,661 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bakecache.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* part of every key, bump it when libnormalmap changes what it writes so
+   old entries are no longer found */
+#define BAKE_CACHE_VERSION 1
+
+#define ENTRY_MAGIC "NMBAKE01"
+#define HEADER_SIZE 32   /* magic, key, payload size */
+
+#define COPY_SIZE (1 << 20)
+
+/* temporary files older than this were left by a writer that died */
+#define STALE_SECONDS 3600
+
+struct bake_cache
+{
+   char *dir;
+   long long max_bytes;
+   long long used;          /* estimate, others may share the directory */
+   unsigned int counter;    /* for temporary file names */
+   pthread_mutex_t lock;    /* one eviction at a time */
+};
+
+typedef struct
+{
+   char name[34];           /* "XX/" and the rest of the key in hex */
+   time_t mtime;
+   long long size;
+} cache_entry;
+
+/* xxHash64, fast enough to key a texture in a fraction of its bake time */
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+static unsigned long long rotl64(unsigned long long x, int r)
+{
+   return((x << r) | (x >> (64 - r)));
+}
+
+static unsigned long long read64(const unsigned char *p)
+{
+   return((unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+          ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+          ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+          ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56));
+}
+
+static unsigned long long read32(const unsigned char *p)
+{
+   return((unsigned long long)p[0] | ((unsigned long long)p[1] << 8) |
+          ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24));
+}
+
+static unsigned long long xxh_round(unsigned long long acc,
+                                    unsigned long long input)
+{
+   acc += input * PRIME2;
+   acc = rotl64(acc, 31);
+   return(acc * PRIME1);
+}
+
+static unsigned long long xxh_merge(unsigned long long h,
+                                    unsigned long long v)
+{
+   h ^= xxh_round(0, v);
+   return(h * PRIME1 + PRIME4);
+}
+
+static unsigned long long xxh64(const void *data, size_t len,
+                                unsigned long long seed)
+{
+   const unsigned char *p = (const unsigned char *)data;
+   const unsigned char *end = p + len;
+   unsigned long long v1, v2, v3, v4, h;
+
+   if(len >= 32)
+   {
+      v1 = seed + PRIME1 + PRIME2;
+      v2 = seed + PRIME2;
+      v3 = seed;
+      v4 = seed - PRIME1;
+      do
+      {
+         v1 = xxh_round(v1, read64(p));
+         v2 = xxh_round(v2, read64(p + 8));
+         v3 = xxh_round(v3, read64(p + 16));
+         v4 = xxh_round(v4, read64(p + 24));
+         p += 32;
+      } while(p + 32 <= end);
+      h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+      h = xxh_merge(h, v1);
+      h = xxh_merge(h, v2);
+      h = xxh_merge(h, v3);
+      h = xxh_merge(h, v4);
+   }
+   else
+      h = seed + PRIME5;
+
+   h += (unsigned long long)len;
+
+   while(p + 8 <= end)
+   {
+      h ^= xxh_round(0, read64(p));
+      h = rotl64(h, 27) * PRIME1 + PRIME4;
+      p += 8;
+   }
+   if(p + 4 <= end)
+   {
+      h ^= read32(p) * PRIME1;
+      h = rotl64(h, 23) * PRIME2 + PRIME3;
+      p += 4;
+   }
+   while(p < end)
+   {
+      h ^= (*p++) * PRIME5;
+      h = rotl64(h, 11) * PRIME1;
+   }
+
+   h ^= h >> 33;
+   h *= PRIME2;
+   h ^= h >> 29;
+   h *= PRIME3;
+   h ^= h >> 32;
+
+   return(h);
+}
+
+/* two seeds make the 128 bits a key needs */
+static void hash128(unsigned long long h[2], const void *data, size_t len)
+{
+   h[0] = xxh64(data, len, 0);
+   h[1] = xxh64(data, len, PRIME5);
+}
+
+static void put64(unsigned char *p, unsigned long long v)
+{
+   int i;
+
+   for(i = 0; i < 8; ++i)
+      p[i] = (unsigned char)(v >> (i * 8));
+}
+
+typedef struct
+{
+   unsigned char buf[512];
+   int len;
+} key_desc;
+
+static void desc_u64(key_desc *d, unsigned long long v)
+{
+   if(d->len + 8 <= (int)sizeof(d->buf))
+   {
+      put64(d->buf + d->len, v);
+      d->len += 8;
+   }
+}
+
+static void desc_float(key_desc *d, float f)
+{
+   unsigned int u;
+
+   memcpy(&u, &f, sizeof(u));
+   desc_u64(d, u);
+}
+
+void bake_cache_key(bake_key *key, const void *src, size_t size,
+                    const normalmap_params *p, const char *tag)
+{
+   key_desc d;
+   unsigned long long h[2];
+   int n;
+
+   d.len = 0;
+   desc_u64(&d, BAKE_CACHE_VERSION);
+
+   hash128(h, src, size);
+   desc_u64(&d, h[0]);
+   desc_u64(&d, h[1]);
+   desc_u64(&d, size);
+
+   desc_u64(&d, p->filter);
+   desc_float(&d, p->minz);
+   desc_float(&d, p->scale);
+   desc_u64(&d, p->wrap);
+   desc_u64(&d, p->height_source);
+   desc_u64(&d, p->alpha);
+   desc_u64(&d, p->conversion);
+   desc_u64(&d, p->dudv);
+   desc_u64(&d, p->xinvert);
+   desc_u64(&d, p->yinvert);
+   desc_u64(&d, p->swapRGB);
+   desc_float(&d, p->contrast);
+   desc_u64(&d, p->encoding);
+   desc_u64(&d, p->height_format);
+
+   if(p->alpha == ALPHA_MAP && p->alphamap)
+   {
+      hash128(h, p->alphamap,
+              (size_t)p->alphamap_width * p->alphamap_height);
+      desc_u64(&d, p->alphamap_width);
+      desc_u64(&d, p->alphamap_height);
+      desc_u64(&d, h[0]);
+      desc_u64(&d, h[1]);
+   }
+
+   if(tag)
+   {
+      n = strlen(tag);
+      if(n > (int)sizeof(d.buf) - d.len) n = (int)sizeof(d.buf) - d.len;
+      memcpy(d.buf + d.len, tag, n);
+      d.len += n;
+   }
+
+   hash128(key->h, d.buf, d.len);
+}
+
+static int make_dir(const char *path)
+{
+#ifdef WIN32
+   if(mkdir(path) != 0 && errno != EEXIST)
+#else
+   if(mkdir(path, 0777) != 0 && errno != EEXIST)
+#endif
+      return(-1);
+   return(0);
+}
+
+static void entry_path(char *path, int len, const bake_cache *c,
+                       const bake_key *key)
+{
+   char hex[33];
+
+   snprintf(hex, sizeof(hex), "%016llx%016llx", key->h[0], key->h[1]);
+   snprintf(path, len, "%s/%.2s/%s", c->dir, hex, hex + 2);
+}
+
+static int is_hex_name(const char *name, int len)
+{
+   int i;
+
+   for(i = 0; i < len; ++i)
+   {
+      if(!((name[i] >= '0' && name[i] <= '9') ||
+           (name[i] >= 'a' && name[i] <= 'f')))
+         return(0);
+   }
+   return(name[len] == 0);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+   const cache_entry *ea = (const cache_entry *)a;
+   const cache_entry *eb = (const cache_entry *)b;
+
+   if(ea->mtime != eb->mtime) return(ea->mtime < eb->mtime ? -1 : 1);
+   return(strcmp(ea->name, eb->name));
+}
+
+/* Lists the entries, removing temporary files left behind by writers that
+   died.  Returns the number found, or -1 if out of memory.
+ */
+static int scan_entries(bake_cache *c, cache_entry **entries,
+                        long long *total)
+{
+   DIR *top, *sub;
+   struct dirent *de, *se;
+   struct stat st;
+   char path[4096];
+   cache_entry *list = 0, *tmp;
+   int count = 0, size = 0;
+   time_t now = time(0);
+
+   *total = 0;
+   *entries = 0;
+
+   top = opendir(c->dir);
+   if(top == 0) return(0);
+
+   while((de = readdir(top)) != 0)
+   {
+      if(!is_hex_name(de->d_name, 2)) continue;
+
+      snprintf(path, sizeof(path), "%s/%s", c->dir, de->d_name);
+      sub = opendir(path);
+      if(sub == 0) continue;
+
+      while((se = readdir(sub)) != 0)
+      {
+         snprintf(path, sizeof(path), "%s/%s/%s", c->dir, de->d_name,
+                  se->d_name);
+
+         if(!strncmp(se->d_name, ".tmp.", 5))
+         {
+            if(stat(path, &st) == 0 && now - st.st_mtime > STALE_SECONDS)
+               unlink(path);
+            continue;
+         }
+
+         if(!is_hex_name(se->d_name, 30) || stat(path, &st) != 0)
+            continue;
+
+         if(count == size)
+         {
+            size = size ? size * 2 : 256;
+            tmp = realloc(list, size * sizeof(cache_entry));
+            if(tmp == 0)
+            {
+               free(list);
+               closedir(sub);
+               closedir(top);
+               return(-1);
+            }
+            list = tmp;
+         }
+
+         snprintf(list[count].name, sizeof(list[count].name), "%.2s/%.30s",
+                  de->d_name, se->d_name);
+         list[count].mtime = st.st_mtime;
+         list[count].size = st.st_size;
+         *total += st.st_size;
+         ++count;
+      }
+
+      closedir(sub);
+   }
+
+   closedir(top);
+
+   *entries = list;
+   return(count);
+}
+
+/* Removes the least recently used entries until the cache is an eighth
+   under its limit, so it is not trimmed again on every store.  Counts the
+   directory afresh, other processes may have filled it too.
+ */
+static void evict(bake_cache *c)
+{
+   cache_entry *entries;
+   long long total, target;
+   char path[4096];
+   int i, count;
+
+   count = scan_entries(c, &entries, &total);
+   if(count < 0) return;
+
+   target = c->max_bytes - c->max_bytes / 8;
+
+   if(total > c->max_bytes)
+   {
+      qsort(entries, count, sizeof(cache_entry), compare_entries);
+      for(i = 0; i < count && total > target; ++i)
+      {
+         snprintf(path, sizeof(path), "%s/%s", c->dir, entries[i].name);
+         /* readers that already have it open keep reading it */
+         if(unlink(path) == 0 || errno == ENOENT)
+            total -= entries[i].size;
+      }
+   }
+
+   c->used = total;
+   free(entries);
+}
+
+bake_cache *bake_cache_open(const char *dir, long long max_bytes,
+                            char *err, int errlen)
+{
+   bake_cache *c;
+
+   if(make_dir(dir) != 0)
+   {
+      snprintf(err, errlen, "%s: %s", dir, strerror(errno));
+      return(0);
+   }
+
+   c = calloc(1, sizeof(bake_cache));
+   if(c == 0 || (c->dir = strdup(dir)) == 0)
+   {
+      free(c);
+      snprintf(err, errlen, "out of memory");
+      return(0);
+   }
+
+   c->max_bytes = (max_bytes > 0) ? max_bytes : BAKE_CACHE_DEFAULT_SIZE;
+   pthread_mutex_init(&c->lock, 0);
+
+   evict(c);
+
+   return(c);
+}
+
+void bake_cache_close(bake_cache *c)
+{
+   if(c == 0) return;
+
+   pthread_mutex_destroy(&c->lock);
+   free(c->dir);
+   free(c);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+   const unsigned char *p = (const unsigned char *)data;
+   ssize_t n;
+
+   while(size > 0)
+   {
+      n = write(fd, p, size);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return(-1);
+      p += n;
+      size -= n;
+   }
+   return(0);
+}
+
+static int read_all(int fd, void *data, size_t size)
+{
+   unsigned char *p = (unsigned char *)data;
+   ssize_t n;
+
+   while(size > 0)
+   {
+      n = read(fd, p, size);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return(-1);
+      p += n;
+      size -= n;
+   }
+   return(0);
+}
+
+/* copies 'size' bytes from one file to another */
+static int copy_fd(int dst, int src, unsigned long long size)
+{
+   unsigned char *buf;
+   size_t n;
+   int ret = 0;
+
+   buf = malloc(COPY_SIZE);
+   if(buf == 0) return(-1);
+
+   while(ret == 0 && size > 0)
+   {
+      n = (size > COPY_SIZE) ? COPY_SIZE : (size_t)size;
+      if(read_all(src, buf, n) != 0 || write_all(dst, buf, n) != 0)
+         ret = -1;
+      size -= n;
+   }
+
+   free(buf);
+   return(ret);
+}
+
+/* Opens the entry for 'key' and checks its header.  Returns the descriptor,
+   positioned at the payload, or -1 on a miss.
+ */
+static int open_entry(bake_cache *c, const bake_key *key, char *path,
+                      int len, unsigned long long *size)
+{
+   unsigned char header[HEADER_SIZE], expect[24];
+   int fd;
+
+   entry_path(path, len, c, key);
+
+   fd = open(path, O_RDONLY | O_BINARY);
+   if(fd < 0) return(-1);
+
+   memcpy(expect, ENTRY_MAGIC, 8);
+   put64(expect + 8, key->h[0]);
+   put64(expect + 16, key->h[1]);
+
+   /* a short or foreign file is a miss, renames only publish whole
+      entries but a crash may still leave one truncated on disk */
+   if(read_all(fd, header, HEADER_SIZE) != 0 || memcmp(header, expect, 24))
+   {
+      close(fd);
+      return(-1);
+   }
+   *size = read64(header + 24);
+
+   return(fd);
+}
+
+static int fetch(bake_cache *c, const bake_key *key, void *data,
+                 size_t size, const char *fn)
+{
+   char path[4096];
+   unsigned long long payload;
+   struct stat st;
+   int fd, out, ret;
+
+   fd = open_entry(c, key, path, sizeof(path), &payload);
+   if(fd < 0) return(-1);
+
+   if(fstat(fd, &st) != 0 ||
+      (unsigned long long)st.st_size != HEADER_SIZE + payload ||
+      (fn == 0 && payload != size))
+   {
+      close(fd);
+      return(-1);
+   }
+
+   if(fn)
+   {
+      out = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+      ret = -1;
+      if(out >= 0)
+      {
+         ret = copy_fd(out, fd, payload);
+         if(close(out) != 0) ret = -1;
+         if(ret != 0) remove(fn);
+      }
+   }
+   else
+      ret = read_all(fd, data, size);
+
+   close(fd);
+
+   /* the modification time is the last use the eviction goes by */
+   if(ret == 0)
+      utime(path, 0);
+
+   return(ret);
+}
+
+/* Writes the entry to a temporary file next to it and renames it into
+   place.  The payload is 'data', or read from 'src_fd' when it is NULL.
+ */
+static int store(bake_cache *c, const bake_key *key, const void *data,
+                 int src_fd, size_t size)
+{
+   char path[4096], tmp[4096], *slash;
+   unsigned char header[HEADER_SIZE];
+   struct stat st;
+   int fd, ret;
+
+   if((long long)size + HEADER_SIZE > c->max_bytes)
+      return(-1);
+
+   entry_path(path, sizeof(path), c, key);
+
+   /* another worker got there first, the entry is the same */
+   if(stat(path, &st) == 0 && st.st_size == (off_t)(HEADER_SIZE + size))
+   {
+      utime(path, 0);
+      return(0);
+   }
+
+   strcpy(tmp, path);
+   slash = strrchr(tmp, '/');
+   *slash = 0;
+   if(make_dir(tmp) != 0)
+      return(-1);
+   snprintf(slash, sizeof(tmp) - (slash - tmp), "/.tmp.%ld.%u",
+            (long)getpid(), __sync_fetch_and_add(&c->counter, 1));
+
+   fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+   if(fd < 0) return(-1);
+
+   memcpy(header, ENTRY_MAGIC, 8);
+   put64(header + 8, key->h[0]);
+   put64(header + 16, key->h[1]);
+   put64(header + 24, size);
+
+   ret = write_all(fd, header, HEADER_SIZE);
+   if(ret == 0)
+      ret = data ? write_all(fd, data, size) : copy_fd(fd, src_fd, size);
+   if(close(fd) != 0) ret = -1;
+
+   if(ret == 0 && rename(tmp, path) != 0)
+      ret = -1;
+   if(ret != 0)
+   {
+      unlink(tmp);
+      return(-1);
+   }
+
+   pthread_mutex_lock(&c->lock);
+   c->used += HEADER_SIZE + size;
+   if(c->used > c->max_bytes)
+      evict(c);
+   pthread_mutex_unlock(&c->lock);
+
+   return(0);
+}
+
+int bake_cache_get(bake_cache *c, const bake_key *key, void *data,
+                   size_t size)
+{
+   return(fetch(c, key, data, size, 0));
+}
+
+int bake_cache_get_file(bake_cache *c, const bake_key *key, const char *fn)
+{
+   return(fetch(c, key, 0, 0, fn));
+}
+
+int bake_cache_put(bake_cache *c, const bake_key *key, const void *data,
+                   size_t size)
+{
+   return(store(c, key, data, -1, size));
+}
+
+int bake_cache_put_file(bake_cache *c, const bake_key *key, const char *fn)
+{
+   struct stat st;
+   int fd, ret;
+
+   fd = open(fn, O_RDONLY | O_BINARY);
+   if(fd < 0) return(-1);
+
+   ret = -1;
+   if(fstat(fd, &st) == 0)
+      ret = store(c, key, 0, fd, (size_t)st.st_size);
+
+   close(fd);
+   return(ret);
+}
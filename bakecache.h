@@ -0,0 +1,81 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __BAKECACHE_H
+#define __BAKECACHE_H
+
+#include <stddef.h>
+
+#include "libnormalmap.h"
+
+/* Content addressed on-disk cache of bake results, so a job repeated with
+ * the same source and settings skips the conversion.  Entries are files in
+ * the cache directory named by a 128-bit hash of the source and of every
+ * parameter that changes the result.  They are written to a temporary file
+ * and renamed into place, so any number of processes can share a directory
+ * and only ever see whole entries.  A hit touches the entry's modification
+ * time, and once the directory grows past its limit the least recently
+ * used entries are removed.
+ */
+
+#define BAKE_CACHE_DEFAULT_SIZE (1024LL * 1024 * 1024)
+
+typedef struct bake_cache bake_cache;
+
+typedef struct
+{
+   unsigned long long h[2];
+} bake_key;
+
+/* Opens the cache in 'dir', creating the directory if it does not exist,
+ * to hold up to 'max_bytes', or BAKE_CACHE_DEFAULT_SIZE if it is <= 0.  A
+ * cache may be used from several threads at once.  Returns NULL on failure
+ * with a message in 'err'.
+ */
+bake_cache *bake_cache_open(const char *dir, long long max_bytes,
+                            char *err, int errlen);
+void bake_cache_close(bake_cache *c);
+
+/* The key of a bake of the 'size' bytes at 'src' with 'p', the alpha map
+ * included.  'tag' names whatever else decides the result and is not in
+ * the source bytes, such as the image size and sample formats, or the
+ * output file format.
+ */
+void bake_cache_key(bake_key *key, const void *src, size_t size,
+                    const normalmap_params *p, const char *tag);
+
+/* Copies the entry for 'key' into 'data', which must be 'size' bytes, or
+ * into the file 'fn'.  Returns 0 on a hit, -1 on a miss.  An entry that
+ * fails to read counts as a miss, with 'data' then partly written.
+ */
+int bake_cache_get(bake_cache *c, const bake_key *key, void *data,
+                   size_t size);
+int bake_cache_get_file(bake_cache *c, const bake_key *key, const char *fn);
+
+/* Stores 'size' bytes at 'data', or the file 'fn', as the entry for 'key'.
+ * Returns 0, or -1 if it could not be written; a cache that fails only
+ * costs the next run the bake.
+ */
+int bake_cache_put(bake_cache *c, const bake_key *key, const void *data,
+                   size_t size);
+int bake_cache_put_file(bake_cache *c, const bake_key *key, const char *fn);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "bcenc.h"
+#include "threadpool.h"
+
+#define MAX_THREADS 64
+
+#define SQR_INT(x)  ((x) * (x))
+
+typedef struct
+{
+   unsigned char *dst;
+   int format;
+   const unsigned char *src;
+   int stride, w, h, bpp;
+   int blocks_w, blocks_h;
+   int next_row;
+} compress_job;
+
+size_t bc_image_size(int w, int h)
+{
+   return((size_t)((w + 3) / 4) * ((h + 3) / 4) * 16);
+}
+
+/* Picks the closest of the eight values between a0 and a1 (a0 > a1) for
+ * every texel.  pos[] receives 0 to 7, the steps from a0 towards a1.
+ * Returns the squared error.
+ */
+static int bc4_fit(int *pos, const unsigned char *v, int a0, int a1)
+{
+   int pal[8], i, k, d, best, err = 0;
+
+   for(k = 0; k < 8; ++k)
+      pal[k] = ((7 - k) * a0 + k * a1 + 3) / 7;
+
+   for(i = 0; i < 16; ++i)
+   {
+      pos[i] = 0;
+      best = SQR_INT(v[i] - pal[0]);
+      for(k = 1; k < 8; ++k)
+      {
+         d = SQR_INT(v[i] - pal[k]);
+         if(d < best)
+         {
+            best = d;
+            pos[i] = k;
+         }
+      }
+      err += best;
+   }
+
+   return(err);
+}
+
+static void bc4_pack(unsigned char *block, const int *pos, int a0, int a1)
+{
+   unsigned long long bits = 0;
+   int i, code;
+
+   for(i = 0; i < 16; ++i)
+   {
+      /* codes 0 and 1 are the endpoints, 2 to 7 the steps between */
+      code = (pos[i] == 0) ? 0 : (pos[i] == 7) ? 1 : pos[i] + 1;
+      bits |= (unsigned long long)code << (3 * i);
+   }
+
+   block[0] = (unsigned char)a0;
+   block[1] = (unsigned char)a1;
+   for(i = 0; i < 6; ++i)
+      block[2 + i] = (unsigned char)(bits >> (8 * i));
+}
+
+/* Single channel block.  The range of the block is fitted first, then the
+ * endpoints are moved to the least squares solution for the chosen steps
+ * and kept if that lowers the error.
+ */
+static void bc4_encode(unsigned char *block, const unsigned char *v)
+{
+   int pos[16], pos2[16];
+   int i, lo = 255, hi = 0, a0, a1, err, err2;
+   float t, st = 0, stt = 0, sv = 0, stv = 0, det, f0, f1;
+
+   for(i = 0; i < 16; ++i)
+   {
+      if(v[i] < lo) lo = v[i];
+      if(v[i] > hi) hi = v[i];
+   }
+
+   if(lo == hi)
+   {
+      memset(block, 0, 8);
+      block[0] = block[1] = (unsigned char)lo;
+      return;
+   }
+
+   a0 = hi;
+   a1 = lo;
+   err = bc4_fit(pos, v, a0, a1);
+
+   /* v = a0 + t * (a1 - a0) */
+   for(i = 0; i < 16; ++i)
+   {
+      t = pos[i] / 7.0f;
+      st += t;
+      stt += t * t;
+      sv += v[i];
+      stv += t * v[i];
+   }
+   det = 16.0f * stt - st * st;
+   if(err > 0 && det > 1e-6f)
+   {
+      /* normal equations for a0 and d = a1 - a0 */
+      f1 = (16.0f * stv - st * sv) / det;
+      f0 = (sv - f1 * st) / 16.0f;
+      f1 += f0;
+      a0 = (int)(f0 + 0.5f);
+      a1 = (int)(f1 + 0.5f);
+      if(a0 > 255) a0 = 255;
+      if(a1 < 0) a1 = 0;
+      if(a0 > a1)
+      {
+         err2 = bc4_fit(pos2, v, a0, a1);
+         if(err2 < err)
+         {
+            bc4_pack(block, pos2, a0, a1);
+            return;
+         }
+      }
+   }
+
+   bc4_pack(block, pos, hi, lo);
+}
+
+/* Color block of a BC3 texture with only green varying, red at 1. */
+static void green_encode(unsigned char *block, const unsigned char *g)
+{
+   int i, k, d, best, idx, lo = 255, hi = 0, g0, g1, pal[4];
+   unsigned int c0, c1, bits = 0;
+   /* palette entries in the order they run from c0 to c1 */
+   static const int code[4] = {0, 2, 3, 1};
+
+   for(i = 0; i < 16; ++i)
+   {
+      if(g[i] < lo) lo = g[i];
+      if(g[i] > hi) hi = g[i];
+   }
+
+   g0 = (hi * 63 + 127) / 255;
+   g1 = (lo * 63 + 127) / 255;
+   c0 = 0xf800 | (g0 << 5);
+   c1 = 0xf800 | (g1 << 5);
+
+   /* c0 > c1 selects the four color mode, with c0 == c1 every index is 0 */
+   if(g0 != g1)
+   {
+      pal[0] = (g0 << 2) | (g0 >> 4);
+      pal[3] = (g1 << 2) | (g1 >> 4);
+      pal[1] = (2 * pal[0] + pal[3]) / 3;
+      pal[2] = (pal[0] + 2 * pal[3]) / 3;
+
+      for(i = 0; i < 16; ++i)
+      {
+         idx = 0;
+         best = SQR_INT(g[i] - pal[0]);
+         for(k = 1; k < 4; ++k)
+         {
+            d = SQR_INT(g[i] - pal[k]);
+            if(d < best)
+            {
+               best = d;
+               idx = k;
+            }
+         }
+         bits |= (unsigned int)code[idx] << (2 * i);
+      }
+   }
+
+   block[0] = c0 & 0xff;
+   block[1] = c0 >> 8;
+   block[2] = c1 & 0xff;
+   block[3] = c1 >> 8;
+   block[4] = bits & 0xff;
+   block[5] = (bits >> 8) & 0xff;
+   block[6] = (bits >> 16) & 0xff;
+   block[7] = bits >> 24;
+}
+
+static void *compress_thread(void *data)
+{
+   compress_job *job = (compress_job *)data;
+   unsigned char x[16], y[16], *d;
+   const unsigned char *p;
+   int bx, by, i, j, sx, sy;
+
+   while((by = __sync_fetch_and_add(&job->next_row, 1)) < job->blocks_h)
+   {
+      d = job->dst + (size_t)by * job->blocks_w * 16;
+      for(bx = 0; bx < job->blocks_w; ++bx, d += 16)
+      {
+         for(j = 0; j < 4; ++j)
+         {
+            sy = by * 4 + j;
+            if(sy >= job->h) sy = job->h - 1;
+            for(i = 0; i < 4; ++i)
+            {
+               sx = bx * 4 + i;
+               if(sx >= job->w) sx = job->w - 1;
+               p = job->src + (size_t)sy * job->stride + sx * job->bpp;
+               x[j * 4 + i] = p[0];
+               y[j * 4 + i] = p[1];
+            }
+         }
+
+         if(job->format == BC_BC3NM)
+         {
+            bc4_encode(d, x);
+            green_encode(d + 8, y);
+         }
+         else
+         {
+            bc4_encode(d, x);
+            bc4_encode(d + 8, y);
+         }
+      }
+   }
+
+   return(0);
+}
+
+void bc_compress(unsigned char *dst, int format, const unsigned char *src,
+                 int stride, int w, int h, int bpp, int nthreads)
+{
+   compress_job job;
+   pthread_t threads[MAX_THREADS];
+   int i, started = 0;
+
+   job.dst = dst;
+   job.format = format;
+   job.src = src;
+   job.stride = stride;
+   job.w = w;
+   job.h = h;
+   job.bpp = bpp;
+   job.blocks_w = (w + 3) / 4;
+   job.blocks_h = (h + 3) / 4;
+   job.next_row = 0;
+
+   if(nthreads <= 0) nthreads = threadpool_num_processors();
+   if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+   if(nthreads > job.blocks_h) nthreads = job.blocks_h;
+
+   /* the calling thread is one of the workers */
+   for(i = 1; i < nthreads; ++i)
+   {
+      if(pthread_create(&threads[started], 0, compress_thread, &job) == 0)
+         ++started;
+   }
+
+   compress_thread(&job);
+
+   for(i = 0; i < started; ++i)
+      pthread_join(threads[i], 0);
+}
+
+void bc_downsample_normals(unsigned char *dst, const unsigned char *src,
+                           int stride, int w, int h, int bpp)
+{
+   int dw = (w > 1) ? w / 2 : 1, dh = (h > 1) ? h / 2 : 1;
+   int x, y, i, j, sx, sy, c, a;
+   const unsigned char *p;
+   float n[3], len, x0, y0;
+
+   for(y = 0; y < dh; ++y)
+   {
+      for(x = 0; x < dw; ++x)
+      {
+         n[0] = n[1] = n[2] = 0;
+         a = 0;
+         for(j = 0; j < 2; ++j)
+         {
+            sy = (h > 1) ? 2 * y + j : 0;
+            for(i = 0; i < 2; ++i)
+            {
+               sx = (w > 1) ? 2 * x + i : 0;
+               p = src + (size_t)sy * stride + sx * bpp;
+               x0 = p[0] / 127.5f - 1.0f;
+               y0 = p[1] / 127.5f - 1.0f;
+               n[0] += x0;
+               n[1] += y0;
+               n[2] += sqrtf(fmaxf(0.0f, 1.0f - x0 * x0 - y0 * y0));
+               if(bpp == 4) a += p[3];
+            }
+         }
+
+         len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+         if(len > 1e-04f)
+         {
+            n[0] /= len;
+            n[1] /= len;
+            n[2] /= len;
+         }
+         else
+         {
+            n[0] = n[1] = 0;
+            n[2] = 1;
+         }
+
+         for(c = 0; c < 3; ++c)
+            *dst++ = (unsigned char)((n[c] + 1.0f) * 127.5f);
+         if(bpp == 4)
+            *dst++ = (unsigned char)((a + 2) / 4);
+      }
+   }
+}
@@ -0,0 +1,64 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __BCENC_H
+#define __BCENC_H
+
+#include <stddef.h>
+
+/* Block compression of tangent space normal maps, for the two formats GPUs
+ * sample normals from:
+ *
+ *   BC_BC5     x in red, y in green, one BC4 block each (ATI2)
+ *   BC_BC3NM   "DXT5nm", x in alpha and y in green of a BC3 (DXT5) block,
+ *              red is 1 and blue 0, so x = r * a works for both formats
+ *
+ * Both leave z out, the shaders rebuild it as sqrt(1 - dot(N.xy, N.xy)).
+ * Sources are 8-bit biased normal maps, bpp 3 or 4, with x in the first and
+ * y in the second channel.
+ */
+
+enum BC_FORMAT
+{
+   BC_BC5 = 0, BC_BC3NM,
+   MAX_BC_FORMAT
+};
+
+/* Bytes of compressed data for a w x h image, 16 per 4x4 block. */
+size_t bc_image_size(int w, int h);
+
+/* Compresses a w x h image into bc_image_size(w, h) bytes at dst, block
+ * rows in order.  Edge blocks of sizes that are not a multiple of 4 repeat
+ * the last row and column.  Runs in 'nthreads' threads, or one per
+ * processor if nthreads <= 0.
+ */
+void bc_compress(unsigned char *dst, int format, const unsigned char *src,
+                 int stride, int w, int h, int bpp, int nthreads);
+
+/* Next mip level of an 8-bit biased normal map, max(1, w / 2) x
+ * max(1, h / 2) and tightly packed.  Normals are averaged and renormalized,
+ * alpha is averaged.  Z is rebuilt from x and y, which is all BC5 and BC3nm
+ * keep, so two channel XY maps filter the same as full ones.
+ */
+void bc_downsample_normals(unsigned char *dst, const unsigned char *src,
+                           int stride, int w, int h, int bpp);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "conemap.h"
+#include "threadpool.h"
+
+#define MAX_THREADS 64
+#define TILE_SIZE   8
+
+typedef struct
+{
+   unsigned char *dst;
+   int dst_bpp;
+   const float *depth;
+   int w, h, wrap;
+   float min_depth;
+   float *tile_min;   /* shallowest depth in each TILE_SIZE square */
+   int tiles_w, tiles_h;
+   int next_row;
+} bake_job;
+
+/* distance in texels from x to the closest texel in [lo, hi] */
+static int interval_distance(int x, int lo, int hi, int size, int wrap)
+{
+   int d1, d2;
+
+   if(x >= lo && x <= hi) return(0);
+
+   if(!wrap)
+      return(x < lo ? lo - x : x - hi);
+
+   d1 = ((lo - x) % size + size) % size;
+   d2 = ((x - hi) % size + size) % size;
+   return(d1 < d2 ? d1 : d2);
+}
+
+/* Squared cone ratio for texel (x, y).  Tiles are visited in square rings
+ * of growing radius.  A tile is skipped when even its shallowest texel at
+ * its nearest point would not narrow the cone.  Every texel in ring r is
+ * at least about (r - 1) * TILE_SIZE texels away and at most
+ * (d - min_depth) higher, so once that ratio exceeds the best one found no
+ * further ring can lower it.
+ */
+static float cone_ratio2(const bake_job *job, int x, int y)
+{
+   const float *depth = job->depth;
+   int w = job->w, h = job->h, tw = job->tiles_w, th = job->tiles_h;
+   int r, i, k, tx, ty, sx, sy, dx, dy, x0, y0, x1, y1, rmax, ring;
+   float d, dd, dist2, c2 = 1.0f, bound, tmin;
+   float iw2 = 1.0f / ((float)w * (float)w);
+   float ih2 = 1.0f / ((float)h * (float)h);
+   float isize = 1.0f / (float)((w > h) ? w : h);
+
+   d = depth[y * w + x];
+   if(d - job->min_depth <= 0.0f) return(c2);
+
+   rmax = (tw > th) ? tw : th;
+   if(job->wrap) rmax = rmax / 2 + 1;
+
+   for(r = 0; r <= rmax; ++r)
+   {
+      /* a partial tile at the wrap seam can be up to a tile closer */
+      ring = (r - 1 - (job->wrap ? 1 : 0)) * TILE_SIZE + 1;
+      if(ring > 0)
+      {
+         bound = (float)ring * isize / (d - job->min_depth);
+         if(bound * bound >= c2) break;
+      }
+
+      for(k = 0; k < (r ? 8 * r : 1); ++k)
+      {
+         /* walk the ring as four edges of 2r tiles each */
+         i = r ? (k % (2 * r)) - r : 0;
+         switch(r ? k / (2 * r) : 0)
+         {
+            case 0:  tx =  i; ty = -r; break;
+            case 1:  tx =  r; ty =  i; break;
+            case 2:  tx = -i; ty =  r; break;
+            default: tx = -r; ty = -i; break;
+         }
+
+         tx += x / TILE_SIZE;
+         ty += y / TILE_SIZE;
+         if(job->wrap)
+         {
+            tx = ((tx % tw) + tw) % tw;
+            ty = ((ty % th) + th) % th;
+         }
+         else if(tx < 0 || tx >= tw || ty < 0 || ty >= th)
+            continue;
+
+         tmin = job->tile_min[ty * tw + tx];
+         dd = d - tmin;
+         if(dd <= 0.0f) continue;
+
+         x0 = tx * TILE_SIZE;
+         y0 = ty * TILE_SIZE;
+         x1 = (x0 + TILE_SIZE < w) ? x0 + TILE_SIZE : w;
+         y1 = (y0 + TILE_SIZE < h) ? y0 + TILE_SIZE : h;
+
+         sx = interval_distance(x, x0, x1 - 1, w, job->wrap);
+         sy = interval_distance(y, y0, y1 - 1, h, job->wrap);
+         dist2 = (float)(sx * sx) * iw2 + (float)(sy * sy) * ih2;
+         if(dist2 >= c2 * dd * dd) continue;
+
+         for(sy = y0; sy < y1; ++sy)
+         {
+            dy = abs(sy - y);
+            if(job->wrap && dy > h - dy) dy = h - dy;
+            for(sx = x0; sx < x1; ++sx)
+            {
+               dd = d - depth[sy * w + sx];
+               if(dd <= 0.0f) continue;
+
+               dx = abs(sx - x);
+               if(job->wrap && dx > w - dx) dx = w - dx;
+               dist2 = (float)(dx * dx) * iw2 + (float)(dy * dy) * ih2;
+               if(dist2 < c2 * dd * dd)
+                  c2 = dist2 / (dd * dd);
+            }
+         }
+      }
+   }
+
+   return(c2);
+}
+
+static void *bake_thread(void *data)
+{
+   bake_job *job = (bake_job *)data;
+   unsigned char *d;
+   int x, y, v;
+
+   /* rows take very different amounts of time, hand them out one by one */
+   while((y = __sync_fetch_and_add(&job->next_row, 1)) < job->h)
+   {
+      d = job->dst + y * job->w * job->dst_bpp;
+      for(x = 0; x < job->w; ++x)
+      {
+         /* sqrt(ratio) = ratio2^(1/4) */
+         v = (int)(sqrtf(sqrtf(cone_ratio2(job, x, y))) * 255.0f);
+         if(v > 255) v = 255;
+         *d = (unsigned char)v;
+         d += job->dst_bpp;
+      }
+   }
+
+   return(0);
+}
+
+int conemap_bake(unsigned char *dst, int dst_bpp, const float *depth,
+                 int w, int h, int wrap, int nthreads)
+{
+   bake_job job;
+   pthread_t threads[MAX_THREADS];
+   int i, x, y, t, started = 0;
+
+   job.dst = dst;
+   job.dst_bpp = dst_bpp;
+   job.depth = depth;
+   job.w = w;
+   job.h = h;
+   job.wrap = wrap;
+   job.next_row = 0;
+
+   job.tiles_w = (w + TILE_SIZE - 1) / TILE_SIZE;
+   job.tiles_h = (h + TILE_SIZE - 1) / TILE_SIZE;
+   job.tile_min = malloc(job.tiles_w * job.tiles_h * sizeof(float));
+   if(job.tile_min == 0) return(-1);
+
+   for(i = 0; i < job.tiles_w * job.tiles_h; ++i)
+      job.tile_min[i] = 1.0f;
+
+   job.min_depth = 1.0f;
+   for(y = 0; y < h; ++y)
+   {
+      for(x = 0; x < w; ++x)
+      {
+         t = (y / TILE_SIZE) * job.tiles_w + (x / TILE_SIZE);
+         if(depth[y * w + x] < job.tile_min[t])
+            job.tile_min[t] = depth[y * w + x];
+         if(depth[y * w + x] < job.min_depth)
+            job.min_depth = depth[y * w + x];
+      }
+   }
+
+   if(nthreads <= 0) nthreads = threadpool_num_processors();
+   if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+   if(nthreads > h) nthreads = h;
+
+   /* the calling thread is one of the workers */
+   for(i = 1; i < nthreads; ++i)
+   {
+      if(pthread_create(&threads[started], 0, bake_thread, &job) == 0)
+         ++started;
+   }
+
+   bake_thread(&job);
+
+   for(i = 0; i < started; ++i)
+      pthread_join(threads[i], 0);
+
+   free(job.tile_min);
+
+   return(0);
+}
@@ -0,0 +1,41 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __CONEMAP_H
+#define __CONEMAP_H
+
+/* Cone step map generation (Dummer, "Cone Step Mapping").
+ *
+ * 'depth' holds w * h values in [0, 1], 0 being the top of the surface, as
+ * read by the relief shaders.  For every texel the widest upward cone that
+ * stays above the surface is found, as the ratio of its radius (in texture
+ * coordinates) to its height, clamped to 1.  dst receives sqrt(ratio) scaled
+ * to 0-255, rounded down so the cones stay conservative, one byte every
+ * 'dst_bpp' bytes.
+ *
+ * The search runs in 'nthreads' threads, or one per processor if
+ * nthreads <= 0.  Returns 0 on success, -1 if memory could not be
+ * allocated.
+ */
+int conemap_bake(unsigned char *dst, int dst_bpp, const float *depth,
+                 int w, int h, int wrap, int nthreads);
+
+#endif
@@ -0,0 +1,620 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for the conversion kernels in libnormalmap.  Every filter, with
+ * and without wrapping, is run against every conversion, alpha, DU/DV,
+ * encoding and height format, each changed from the defaults on its own,
+ * followed by every pair of sample formats and by scale_pixels().
+ * make_heightmap() only runs as the last step of CONVERT_HEIGHTMAP and is
+ * measured there.
+ *
+ * The sources are a synthetic heightmap at each of the --sizes, and any
+ * images given with --input at their own size and precision.  The results
+ * go to stdout as JSON, one object per case with the median time of the
+ * iterations, Mpixels/s, ns and cycles per pixel and the peak RSS of the
+ * process while the case ran.  On Linux the high-water mark is reset
+ * before each case, elsewhere it is the peak so far.  Cycles are read
+ * from the time stamp counter, which ticks at a fixed rate, and are null
+ * where there is none.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "libnormalmap.h"
+#include "scale.h"
+#include "imageio.h"
+
+#define MAX_SIZES 16
+#define ALPHAMAP_SIZE 256
+
+static const char *filter_names[MAX_FILTER_TYPE] =
+{
+   "4sample", "sobel3x3", "sobel5x5", "prewitt3x3", "prewitt5x5",
+   "3x3", "5x5", "7x7", "9x9"
+};
+
+static const char *alpha_names[MAX_ALPHA_TYPE] =
+{
+   "none", "height", "inverse-height", "zero", "one", "invert", "map"
+};
+
+static const char *conversion_names[MAX_CONVERSION_TYPE] =
+{
+   "none", "biased", "red", "green", "blue", "max", "min", "colorspace",
+   "normalize", "dudv-to-normal", "heightmap"
+};
+
+static const char *dudv_names[MAX_DUDV_TYPE] =
+{
+   "none", "8bit", "8bit-unsigned", "16bit", "16bit-unsigned"
+};
+
+static const char *encoding_names[MAX_ENCODING] =
+{
+   "xyz", "xy", "octahedral"
+};
+
+static const char *height_format_names[MAX_HEIGHT_FORMAT] =
+{
+   "float", "16"
+};
+
+static const char *format_names[MAX_NORMALMAP_FORMAT] =
+{
+   "u8", "u16", "f32"
+};
+
+typedef struct
+{
+   const char *source;      /* "synthetic" or the file name */
+   const unsigned char *pixels;
+   int format;
+   int width, height, bpp;
+} bench_source;
+
+typedef struct
+{
+   double ms;
+   unsigned long long cycles;
+} timing;
+
+static int iterations = 3;
+static int first_result = 1;
+static unsigned char *alphamap = 0;
+
+static double now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0);
+}
+
+static unsigned long long read_cycles(void)
+{
+#ifdef HAVE_TSC
+   return(__rdtsc());
+#else
+   return(0);
+#endif
+}
+
+/* brings the high-water mark down to what is resident now */
+static void reset_peak_rss(void)
+{
+#ifdef __linux__
+   FILE *f = fopen("/proc/self/clear_refs", "w");
+
+   if(f == 0) return;
+   fputs("5", f);
+   fclose(f);
+#endif
+}
+
+static long peak_rss_kb(void)
+{
+   struct rusage ru;
+#ifdef __linux__
+   char line[128];
+   long kb = -1;
+   FILE *f = fopen("/proc/self/status", "r");
+
+   if(f)
+   {
+      while(kb < 0 && fgets(line, sizeof(line), f))
+      {
+         if(sscanf(line, "VmHWM: %ld", &kb) != 1)
+            kb = -1;
+      }
+      fclose(f);
+      if(kb >= 0) return(kb);
+   }
+#endif
+
+   if(getrusage(RUSAGE_SELF, &ru) != 0) return(0);
+#ifdef __APPLE__
+   return(ru.ru_maxrss / 1024);
+#else
+   return(ru.ru_maxrss);
+#endif
+}
+
+/* rolling hills with some grain on top, the height in RGB and alpha, so
+   the smoothing filters and the branches in the converters see something
+   like a real texture */
+static unsigned char *make_heightmap_source(int size)
+{
+   unsigned char *pixels, *p;
+   unsigned int seed = 12345;
+   int x, y;
+   float fx, fy, h;
+   const float f = 2.0f * M_PI * 8.0f / (float)size;
+
+   pixels = malloc((size_t)size * size * 4);
+   if(pixels == 0) return(0);
+
+   for(y = 0; y < size; ++y)
+   {
+      for(x = 0; x < size; ++x)
+      {
+         fx = (float)x * f;
+         fy = (float)y * f;
+         seed = seed * 1664525 + 1013904223;
+         h = 0.5f + 0.2f * (sinf(fx) + sinf(fy) * cosf(fx * 0.37f)) +
+            0.05f * ((float)(seed >> 24) / 255.0f - 0.5f);
+         if(h < 0) h = 0;
+         if(h > 1) h = 1;
+
+         p = &pixels[((size_t)y * size + x) * 4];
+         p[0] = (unsigned char)(h * 255.0f);
+         p[1] = (unsigned char)(h * 240.0f + 8.0f);
+         p[2] = (unsigned char)(h * 220.0f + 16.0f);
+         p[3] = (unsigned char)(h * 255.0f);
+      }
+   }
+
+   return(pixels);
+}
+
+/* 'src' widened to 'format', or a copy of it for NORMALMAP_U8 */
+static unsigned char *widen(const unsigned char *src, size_t n, int format)
+{
+   unsigned char *dst;
+   unsigned short *d16;
+   float *d32;
+   size_t i;
+
+   dst = malloc(n * normalmap_format_size(format));
+   if(dst == 0) return(0);
+
+   if(format == NORMALMAP_U8)
+      memcpy(dst, src, n);
+   else if(format == NORMALMAP_U16)
+   {
+      d16 = (unsigned short *)dst;
+      for(i = 0; i < n; ++i)
+         d16[i] = (unsigned short)(src[i] * 257);
+   }
+   else
+   {
+      d32 = (float *)dst;
+      for(i = 0; i < n; ++i)
+         d32[i] = (float)src[i] / 255.0f;
+   }
+
+   return(dst);
+}
+
+static int compare_timings(const void *a, const void *b)
+{
+   double da = ((const timing *)a)->ms, db = ((const timing *)b)->ms;
+
+   return((da > db) - (da < db));
+}
+
+/* one untimed run to fault the buffers in, then the median of the rest */
+static int time_convert(timing *t, const bench_source *s, int dst_format,
+                        const normalmap_params *p, unsigned char *dst)
+{
+   timing runs[64];
+   int i, n = iterations;
+   double t0;
+   unsigned long long c0;
+
+   if(n > 64) n = 64;
+
+   reset_peak_rss();
+
+   for(i = -1; i < n; ++i)
+   {
+      t0 = now_ms();
+      c0 = read_cycles();
+      if(normalmap_convert_format(dst, s->width * s->bpp *
+                                  normalmap_format_size(dst_format),
+                                  dst_format, s->pixels,
+                                  s->width * s->bpp *
+                                  normalmap_format_size(s->format),
+                                  s->format, s->width, s->height, s->bpp,
+                                  p, 0, 0, 0) != 0)
+         return(-1);
+      if(i >= 0)
+      {
+         runs[i].cycles = read_cycles() - c0;
+         runs[i].ms = now_ms() - t0;
+      }
+   }
+
+   qsort(runs, n, sizeof(timing), compare_timings);
+   *t = runs[n / 2];
+
+   return(0);
+}
+
+static void print_timing(const timing *t, double pixels)
+{
+   printf("\"ms\": %.3f, \"mpix_s\": %.2f, \"ns_per_pixel\": %.3f, ",
+          t->ms, t->ms > 0 ? pixels / (t->ms * 1000.0) : 0.0,
+          t->ms * 1000000.0 / pixels);
+#ifdef HAVE_TSC
+   printf("\"cycles_per_pixel\": %.2f, ", (double)t->cycles / pixels);
+#else
+   printf("\"cycles_per_pixel\": null, ");
+#endif
+   printf("\"peak_rss_kb\": %ld}", peak_rss_kb());
+}
+
+static void json_string(const char *s)
+{
+   putchar('"');
+   for(; *s; ++s)
+   {
+      if(*s == '"' || *s == '\\')
+         printf("\\%c", *s);
+      else if((unsigned char)*s < 0x20)
+         printf("\\u%04x", *s);
+      else
+         putchar(*s);
+   }
+   putchar('"');
+}
+
+static void begin_result(const char *kernel, const bench_source *s)
+{
+   printf("%s\n    {\"kernel\": \"%s\", \"source\": ",
+          first_result ? "" : ",", kernel);
+   json_string(s->source);
+   printf(", \"width\": %d, \"height\": %d, \"bpp\": %d, ",
+          s->width, s->height, s->bpp);
+   first_result = 0;
+}
+
+static void convert_case(const bench_source *s, int dst_format,
+                         const normalmap_params *p, unsigned char *dst)
+{
+   timing t;
+
+   if(time_convert(&t, s, dst_format, p, dst) != 0)
+   {
+      fprintf(stderr, "%s: conversion failed\n", s->source);
+      return;
+   }
+
+   begin_result("convert", s);
+   printf("\"filter\": \"%s\", \"wrap\": %d, \"conversion\": \"%s\", "
+          "\"alpha\": \"%s\", \"dudv\": \"%s\", \"encoding\": \"%s\", "
+          "\"heights\": \"%s\", \"src_format\": \"%s\", "
+          "\"dst_format\": \"%s\", ",
+          filter_names[p->filter], p->wrap, conversion_names[p->conversion],
+          alpha_names[p->alpha], dudv_names[p->dudv],
+          encoding_names[p->encoding], height_format_names[p->height_format],
+          format_names[s->format], format_names[dst_format]);
+   print_timing(&t, (double)s->width * s->height);
+   fflush(stdout);
+}
+
+/* the conversions that do not read heights ignore the filter, one run of
+   them is enough */
+static int mode_uses_filter(const normalmap_params *p)
+{
+   return(p->dudv || (p->conversion != CONVERT_NORMALIZE_ONLY &&
+                      p->conversion != CONVERT_DUDV_TO_NORMAL));
+}
+
+static void bench_modes(const bench_source *s, unsigned char *dst)
+{
+   normalmap_params p;
+   int filter, wrap, axis, mode, count;
+
+   for(filter = 0; filter < MAX_FILTER_TYPE; ++filter)
+   {
+      for(wrap = 0; wrap < 2; ++wrap)
+      {
+         /* axis 0 is the defaults, then one mode at a time */
+         for(axis = 0; axis < 6; ++axis)
+         {
+            count = (axis == 0) ? 1 :
+                    (axis == 1) ? MAX_CONVERSION_TYPE :
+                    (axis == 2) ? MAX_ALPHA_TYPE :
+                    (axis == 3) ? MAX_DUDV_TYPE :
+                    (axis == 4) ? MAX_ENCODING : MAX_HEIGHT_FORMAT;
+
+            for(mode = (axis == 0) ? 0 : 1; mode < count; ++mode)
+            {
+               normalmap_default_params(&p);
+               p.filter = filter;
+               p.wrap = wrap;
+               if(axis == 1) p.conversion = mode;
+               if(axis == 2) p.alpha = mode;
+               if(axis == 3) p.dudv = mode;
+               if(axis == 4) p.encoding = mode;
+               if(axis == 5) p.height_format = mode;
+
+               if(p.alpha == ALPHA_MAP)
+               {
+                  p.alphamap = alphamap;
+                  p.alphamap_width = ALPHAMAP_SIZE;
+                  p.alphamap_height = ALPHAMAP_SIZE;
+               }
+
+               if(s->bpp != 4 && (p.dudv == DUDV_16BIT_SIGNED ||
+                                  p.dudv == DUDV_16BIT_UNSIGNED))
+                  continue;
+               if(filter > 0 && !mode_uses_filter(&p))
+                  continue;
+
+               convert_case(s, s->format, &p, dst);
+            }
+         }
+      }
+   }
+}
+
+static void bench_formats(const bench_source *s, unsigned char *dst)
+{
+   bench_source wide = *s;
+   normalmap_params p;
+   unsigned char *pixels;
+   int src_format, dst_format;
+
+   normalmap_default_params(&p);
+
+   for(src_format = 0; src_format < MAX_NORMALMAP_FORMAT; ++src_format)
+   {
+      pixels = widen(s->pixels, (size_t)s->width * s->height * s->bpp,
+                     src_format);
+      if(pixels == 0)
+      {
+         fprintf(stderr, "out of memory\n");
+         return;
+      }
+      wide.pixels = pixels;
+      wide.format = src_format;
+
+      for(dst_format = 0; dst_format < MAX_NORMALMAP_FORMAT; ++dst_format)
+         convert_case(&wide, dst_format, &p, dst);
+
+      free(pixels);
+   }
+}
+
+static void bench_scale(const bench_source *s)
+{
+   static const int preview_size = 150;
+   int sizes[2][2], i, k, n = iterations;
+   unsigned char *dst;
+   timing runs[64];
+   double t0;
+   unsigned long long c0;
+
+   if(n > 64) n = 64;
+
+   /* the preview the plugin draws, and half size */
+   sizes[0][0] = sizes[0][1] = preview_size;
+   sizes[1][0] = s->width / 2 > 0 ? s->width / 2 : 1;
+   sizes[1][1] = s->height / 2 > 0 ? s->height / 2 : 1;
+
+   for(k = 0; k < 2; ++k)
+   {
+      dst = malloc((size_t)sizes[k][0] * sizes[k][1] * s->bpp);
+      if(dst == 0) return;
+
+      reset_peak_rss();
+
+      for(i = -1; i < n; ++i)
+      {
+         t0 = now_ms();
+         c0 = read_cycles();
+         scale_pixels(dst, sizes[k][0], sizes[k][1],
+                      (unsigned char *)s->pixels, s->width, s->height,
+                      s->bpp);
+         if(i >= 0)
+         {
+            runs[i].cycles = read_cycles() - c0;
+            runs[i].ms = now_ms() - t0;
+         }
+      }
+      qsort(runs, n, sizeof(timing), compare_timings);
+
+      begin_result("scale_pixels", s);
+      printf("\"dst_width\": %d, \"dst_height\": %d, ",
+             sizes[k][0], sizes[k][1]);
+      /* per source pixel, like the conversions */
+      print_timing(&runs[n / 2], (double)s->width * s->height);
+      fflush(stdout);
+
+      free(dst);
+   }
+}
+
+static void bench_source_all(const bench_source *s)
+{
+   unsigned char *dst;
+
+   /* room for the widest destination */
+   dst = malloc((size_t)s->width * s->height * s->bpp *
+                normalmap_format_size(NORMALMAP_F32));
+   if(dst == 0)
+   {
+      fprintf(stderr, "%s: out of memory\n", s->source);
+      return;
+   }
+
+   fprintf(stderr, "%s %dx%d\n", s->source, s->width, s->height);
+
+   bench_modes(s, dst);
+   if(s->format == NORMALMAP_U8)
+   {
+      bench_formats(s, dst);
+      bench_scale(s);
+   }
+
+   free(dst);
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr,
+           "usage: %s [--sizes N,N,...] [--iterations N] [--input FILE]...\n"
+           "\n"
+           "  --sizes         synthetic heightmaps to run, N x N each, up to\n"
+           "                  16384 (default 512, 0 for none)\n"
+           "  --iterations    timed runs per case, the median is reported\n"
+           "                  (default 3)\n"
+           "  --input         also run on FILE at its own size and precision\n",
+           prog);
+}
+
+int main(int argc, char **argv)
+{
+   int sizes[MAX_SIZES] = {512};
+   int num_sizes = 1, num_inputs = 0, i;
+   const char **inputs;
+   bench_source s;
+   image_data img;
+   unsigned char *pixels;
+   char *arg, *tok, err[256];
+
+   inputs = calloc(argc, sizeof(char *));
+   if(inputs == 0) return(1);
+
+   for(i = 1; i < argc; ++i)
+   {
+      if(!strcmp(argv[i], "--sizes") && i + 1 < argc)
+      {
+         arg = argv[++i];
+         num_sizes = 0;
+         for(tok = strtok(arg, ","); tok && num_sizes < MAX_SIZES;
+             tok = strtok(0, ","))
+         {
+            sizes[num_sizes] = atoi(tok);
+            if(sizes[num_sizes] < 0 || sizes[num_sizes] > 16384)
+            {
+               usage(argv[0]);
+               return(1);
+            }
+            if(sizes[num_sizes] > 0) ++num_sizes;
+         }
+      }
+      else if(!strcmp(argv[i], "--iterations") && i + 1 < argc)
+         iterations = atoi(argv[++i]);
+      else if(!strcmp(argv[i], "--input") && i + 1 < argc)
+         inputs[num_inputs++] = argv[++i];
+      else
+      {
+         usage(argv[0]);
+         return(1);
+      }
+   }
+   if(iterations < 1) iterations = 1;
+
+   alphamap = make_heightmap_source(ALPHAMAP_SIZE);
+   if(alphamap == 0)
+   {
+      fprintf(stderr, "out of memory\n");
+      return(1);
+   }
+
+   printf("{\n  \"compiler\": ");
+   json_string(__VERSION__);
+   printf(",\n  \"iterations\": %d,\n  \"cycle_counter\": %s,\n"
+          "  \"results\": [", iterations,
+#ifdef HAVE_TSC
+          "\"tsc\""
+#else
+          "null"
+#endif
+          );
+
+   for(i = 0; i < num_sizes; ++i)
+   {
+      pixels = make_heightmap_source(sizes[i]);
+      if(pixels == 0)
+      {
+         fprintf(stderr, "synthetic %dx%d: out of memory\n", sizes[i],
+                 sizes[i]);
+         continue;
+      }
+
+      s.source = "synthetic";
+      s.pixels = pixels;
+      s.format = NORMALMAP_U8;
+      s.width = s.height = sizes[i];
+      s.bpp = 4;
+      bench_source_all(&s);
+
+      free(pixels);
+   }
+
+   for(i = 0; i < num_inputs; ++i)
+   {
+      if(image_load(&img, inputs[i], 1, err, sizeof(err)) != 0)
+      {
+         fprintf(stderr, "%s: %s\n", inputs[i], err);
+         continue;
+      }
+
+      s.source = inputs[i];
+      s.pixels = img.pixels;
+      s.format = img.sample_format;
+      s.width = img.width;
+      s.height = img.height;
+      s.bpp = img.bpp;
+      bench_source_all(&s);
+
+      image_free(&img);
+   }
+
+   printf("\n  ]\n}\n");
+
+   free(alphamap);
+   free(inputs);
+
+   return(0);
+}
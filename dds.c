@@ -0,0 +1,159 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bcenc.h"
+#include "dds.h"
+
+#define DDSD_CAPS         0x00000001
+#define DDSD_HEIGHT       0x00000002
+#define DDSD_WIDTH        0x00000004
+#define DDSD_PIXELFORMAT  0x00001000
+#define DDSD_MIPMAPCOUNT  0x00020000
+#define DDSD_LINEARSIZE   0x00080000
+
+#define DDPF_FOURCC       0x00000004
+
+#define DDSCAPS_COMPLEX   0x00000008
+#define DDSCAPS_TEXTURE   0x00001000
+#define DDSCAPS_MIPMAP    0x00400000
+
+static void put32(unsigned char *p, unsigned int v)
+{
+   p[0] = v & 0xff;
+   p[1] = (v >> 8) & 0xff;
+   p[2] = (v >> 16) & 0xff;
+   p[3] = v >> 24;
+}
+
+static int write_header(FILE *fp, int w, int h, int levels, int format)
+{
+   unsigned char hdr[128];
+
+   memset(hdr, 0, sizeof(hdr));
+   memcpy(hdr, "DDS ", 4);
+   put32(hdr + 4, 124);
+   put32(hdr + 8, DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT |
+         DDSD_LINEARSIZE | (levels > 1 ? DDSD_MIPMAPCOUNT : 0));
+   put32(hdr + 12, h);
+   put32(hdr + 16, w);
+   put32(hdr + 20, (unsigned int)bc_image_size(w, h));
+   put32(hdr + 28, levels);
+
+   /* pixel format */
+   put32(hdr + 76, 32);
+   put32(hdr + 80, DDPF_FOURCC);
+   memcpy(hdr + 84, (format == BC_BC3NM) ? "DXT5" : "ATI2", 4);
+
+   put32(hdr + 108, DDSCAPS_TEXTURE |
+         (levels > 1 ? DDSCAPS_COMPLEX | DDSCAPS_MIPMAP : 0));
+
+   return(fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) ? 0 : -1);
+}
+
+int dds_save(const image_data *img, const char *fn, int format, int mips,
+             int nthreads, char *err, int errlen)
+{
+   FILE *fp;
+   unsigned char *blocks = 0, *level[2] = {0, 0};
+   const unsigned char *src;
+   int w = img->width, h = img->height, stride = image_stride(img);
+   int levels = 1, i, ret = -1;
+   size_t size;
+
+   if(img->sample_format != NORMALMAP_U8)
+   {
+      snprintf(err, errlen, "only 8-bit images can be compressed");
+      return(-1);
+   }
+
+   if(mips)
+   {
+      while(w > 1 || h > 1)
+      {
+         w = (w > 1) ? w / 2 : 1;
+         h = (h > 1) ? h / 2 : 1;
+         ++levels;
+      }
+      w = img->width;
+      h = img->height;
+   }
+
+   blocks = malloc(bc_image_size(w, h));
+   if(levels > 1)
+   {
+      /* mips are built from the level above, two buffers are enough */
+      size = (size_t)((w + 1) / 2) * ((h + 1) / 2) * img->bpp;
+      level[0] = malloc(size);
+      level[1] = malloc(size);
+   }
+   if(blocks == 0 || (levels > 1 && (level[0] == 0 || level[1] == 0)))
+   {
+      snprintf(err, errlen, "out of memory");
+      goto done;
+   }
+
+   fp = fopen(fn, "wb");
+   if(fp == 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      goto done;
+   }
+
+   ret = write_header(fp, w, h, levels, format);
+
+   src = img->pixels;
+   for(i = 0; i < levels && ret == 0; ++i)
+   {
+      bc_compress(blocks, format, src, stride, w, h, img->bpp, nthreads);
+      size = bc_image_size(w, h);
+      if(fwrite(blocks, 1, size, fp) != size)
+         ret = -1;
+
+      if(i + 1 < levels)
+      {
+         bc_downsample_normals(level[i & 1], src, stride, w, h, img->bpp);
+         src = level[i & 1];
+         w = (w > 1) ? w / 2 : 1;
+         h = (h > 1) ? h / 2 : 1;
+         stride = w * img->bpp;
+      }
+   }
+
+   if(fclose(fp) != 0)
+      ret = -1;
+   if(ret != 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      remove(fn);
+   }
+
+done:
+   free(blocks);
+   free(level[0]);
+   free(level[1]);
+
+   return(ret);
+}
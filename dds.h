@@ -0,0 +1,36 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __DDS_H
+#define __DDS_H
+
+#include "imageio.h"
+
+/* Writes an 8-bit normal map as a DDS file, compressed to BC_BC5 (FourCC
+ * ATI2) or BC_BC3NM (FourCC DXT5), down to 1x1 when 'mips' is set.
+ * Compression runs in 'nthreads' threads, one per processor if
+ * nthreads <= 0.  Returns 0 on success, -1 on failure with a message in
+ * 'err'.
+ */
+int dds_save(const image_data *img, const char *fn, int format, int mips,
+             int nthreads, char *err, int errlen);
+
+#endif
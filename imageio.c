@@ -0,0 +1,1517 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <png.h>
+
+#include "imageio.h"
+
+enum
+{
+   FORMAT_UNKNOWN = 0, FORMAT_PNG, FORMAT_TGA, FORMAT_PNM, FORMAT_RAW,
+   FORMAT_PFM, FORMAT_EXR
+};
+
+#define MAX_HEADER 256
+
+static int image_format(const char *fn)
+{
+   const char *ext = strrchr(fn, '.');
+
+   if(ext == 0) return(FORMAT_UNKNOWN);
+   if(!strcasecmp(ext, ".png")) return(FORMAT_PNG);
+   if(!strcasecmp(ext, ".tga")) return(FORMAT_TGA);
+   if(!strcasecmp(ext, ".pgm") || !strcasecmp(ext, ".ppm") ||
+      !strcasecmp(ext, ".pnm") || !strcasecmp(ext, ".pam"))
+      return(FORMAT_PNM);
+   if(!strcasecmp(ext, ".raw")) return(FORMAT_RAW);
+   if(!strcasecmp(ext, ".pfm")) return(FORMAT_PFM);
+   if(!strcasecmp(ext, ".exr")) return(FORMAT_EXR);
+   return(FORMAT_UNKNOWN);
+}
+
+int image_format_supported(const char *fn)
+{
+   int format = image_format(fn);
+
+   return(format != FORMAT_UNKNOWN && format != FORMAT_EXR);
+}
+
+int image_format_writable(const char *fn)
+{
+   return(image_format(fn) != FORMAT_UNKNOWN);
+}
+
+static int host_big_endian(void)
+{
+   const unsigned short one = 1;
+
+   return(*(const unsigned char *)&one == 0);
+}
+
+int image_stride(const image_data *img)
+{
+   return(img->width * img->bpp * normalmap_format_size(img->sample_format));
+}
+
+/* sample 'i' of a row as 0 to 1 */
+static float sample_value(const unsigned char *p, int i, int format)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16: return(((const unsigned short *)p)[i] / 65535.0f);
+      case NORMALMAP_F32: return(((const float *)p)[i]);
+      default:            return(p[i] / 255.0f);
+   }
+}
+
+/* sample 'i' of a row widened or quantized to 16 bits */
+static unsigned int sample_u16(const unsigned char *p, int i, int format)
+{
+   float v;
+
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         return(((const unsigned short *)p)[i]);
+      case NORMALMAP_F32:
+         v = ((const float *)p)[i];
+         if(!(v >= 0)) v = 0;
+         if(v > 1) v = 1;
+         return((unsigned int)(v * 65535.0f + 0.5f));
+      default:
+         return(p[i] * 257u);
+   }
+}
+
+static void put_float_le(unsigned char *d, float v)
+{
+   unsigned char b[4];
+
+   memcpy(b, &v, 4);
+   if(host_big_endian())
+   {
+      d[0] = b[3]; d[1] = b[2]; d[2] = b[1]; d[3] = b[0];
+   }
+   else
+      memcpy(d, b, 4);
+}
+
+void image_free(image_data *img)
+{
+   if(img->map)
+      munmap(img->map, img->map_size);
+   else
+      free(img->pixels);
+   img->pixels = 0;
+   img->map = 0;
+   img->map_size = 0;
+   img->writeback = 0;
+}
+
+/* PNG */
+
+static void png_error_func(png_structp png, png_const_charp msg)
+{
+   char *err = (char *)png_get_error_ptr(png);
+
+   if(err) snprintf(err, 256, "%s", msg);
+   png_longjmp(png, 1);
+}
+
+static void png_warning_func(png_structp png, png_const_charp msg)
+{
+}
+
+/* everything becomes RGB or RGBA, 8-bit unless 16 was asked for */
+static void png_read_setup(png_structp png, png_infop info, int wide,
+                           image_data *img)
+{
+   int color_type = png_get_color_type(png, info);
+
+   png_set_expand(png);
+   if(wide && png_get_bit_depth(png, info) == 16)
+   {
+      if(!host_big_endian()) png_set_swap(png);
+      img->sample_format = NORMALMAP_U16;
+   }
+   else
+      png_set_strip_16(png);
+   if(color_type == PNG_COLOR_TYPE_GRAY ||
+      color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+      png_set_gray_to_rgb(png);
+   png_set_interlace_handling(png);
+   png_read_update_info(png, info);
+
+   img->width = png_get_image_width(png, info);
+   img->height = png_get_image_height(png, info);
+   img->bpp = png_get_channels(png, info);
+}
+
+static int load_png(image_data *img, FILE *fp, int wide, char *err,
+                    int errlen)
+{
+   png_structp png;
+   png_infop info;
+   png_bytep *volatile rows = 0;
+   char png_err[256] = "";
+   int y;
+
+   png = png_create_read_struct(PNG_LIBPNG_VER_STRING, png_err,
+                                png_error_func, png_warning_func);
+   if(png == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+   info = png_create_info_struct(png);
+   if(info == 0)
+   {
+      png_destroy_read_struct(&png, 0, 0);
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   if(setjmp(png_jmpbuf(png)))
+   {
+      free(rows);
+      image_free(img);
+      png_destroy_read_struct(&png, &info, 0);
+      snprintf(err, errlen, "%s", png_err);
+      return(-1);
+   }
+
+   png_init_io(png, fp);
+   png_read_info(png, info);
+   png_read_setup(png, info, wide, img);
+
+   img->pixels = malloc((size_t)img->height * image_stride(img));
+   rows = malloc(img->height * sizeof(png_bytep));
+   if(img->pixels == 0 || rows == 0)
+   {
+      snprintf(png_err, sizeof(png_err), "out of memory");
+      png_longjmp(png, 1);
+   }
+
+   for(y = 0; y < img->height; ++y)
+      rows[y] = img->pixels + (size_t)y * image_stride(img);
+
+   png_read_image(png, rows);
+   png_read_end(png, 0);
+
+   free(rows);
+   png_destroy_read_struct(&png, &info, 0);
+
+   return(0);
+}
+
+/* TGA, uncompressed and RLE true color or grey */
+
+static int load_tga(image_data *img, FILE *fp, char *err, int errlen)
+{
+   unsigned char hdr[18], pix[4], *p, *row, *tmp;
+   int type, depth, src_bpp, top_down, rle, n, i, k, count = 0, packet = 0;
+   int y;
+
+   if(fread(hdr, 1, 18, fp) != 18)
+   {
+      snprintf(err, errlen, "truncated TGA header");
+      return(-1);
+   }
+
+   type = hdr[2];
+   depth = hdr[16];
+   rle = (type == 10 || type == 11);
+   top_down = (hdr[17] & 0x20) != 0;
+
+   if(hdr[1] != 0 || (type != 2 && type != 3 && type != 10 && type != 11) ||
+      ((type == 2 || type == 10) && depth != 24 && depth != 32) ||
+      ((type == 3 || type == 11) && depth != 8))
+   {
+      snprintf(err, errlen, "unsupported TGA type %d, %d bits", type, depth);
+      return(-1);
+   }
+
+   img->width = hdr[12] | (hdr[13] << 8);
+   img->height = hdr[14] | (hdr[15] << 8);
+   src_bpp = depth / 8;
+   img->bpp = (depth == 32) ? 4 : 3;
+
+   if(hdr[0] && fseek(fp, hdr[0], SEEK_CUR) != 0)
+   {
+      snprintf(err, errlen, "truncated TGA header");
+      return(-1);
+   }
+
+   img->pixels = malloc((size_t)img->width * img->height * img->bpp);
+   if(img->pixels == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   n = img->width * img->height;
+   p = img->pixels;
+   for(i = 0; i < n; ++i)
+   {
+      if(rle && count == 0)
+      {
+         if((k = fgetc(fp)) == EOF) break;
+         packet = k & 0x80;
+         count = (k & 0x7f) + 1;
+         if(packet && fread(pix, 1, src_bpp, fp) != (size_t)src_bpp) break;
+      }
+      if(!rle || !packet)
+      {
+         if(fread(pix, 1, src_bpp, fp) != (size_t)src_bpp) break;
+      }
+      if(rle) --count;
+
+      /* stored as BGR(A) */
+      if(src_bpp == 1)
+      {
+         p[0] = p[1] = p[2] = pix[0];
+      }
+      else
+      {
+         p[0] = pix[2];
+         p[1] = pix[1];
+         p[2] = pix[0];
+         if(src_bpp == 4) p[3] = pix[3];
+      }
+      p += img->bpp;
+   }
+
+   if(i < n)
+   {
+      image_free(img);
+      snprintf(err, errlen, "truncated TGA data");
+      return(-1);
+   }
+
+   if(!top_down)
+   {
+      k = img->width * img->bpp;
+      tmp = malloc(k);
+      if(tmp == 0)
+      {
+         image_free(img);
+         snprintf(err, errlen, "out of memory");
+         return(-1);
+      }
+      for(y = 0; y < img->height / 2; ++y)
+      {
+         row = img->pixels + (size_t)y * k;
+         p = img->pixels + (size_t)(img->height - 1 - y) * k;
+         memcpy(tmp, row, k);
+         memcpy(row, p, k);
+         memcpy(p, tmp, k);
+      }
+      free(tmp);
+   }
+
+   return(0);
+}
+
+/* netpbm, PFM and raw, memory mapped */
+
+enum
+{
+   SAMPLE_INT = 0, SAMPLE_FLOAT
+};
+
+typedef struct
+{
+   int width, height, channels;
+   int type;            /* SAMPLE_INT or SAMPLE_FLOAT */
+   int maxval;          /* 255 or 65535 style range of SAMPLE_INT */
+   int big_endian;      /* for 16 and 32-bit samples */
+   int bottom_up;       /* rows stored last first */
+   size_t header;       /* bytes before the pixels */
+} raw_layout;
+
+static const unsigned char *pnm_token(const unsigned char *p,
+                                      const unsigned char *end, int *value)
+{
+   /* whitespace and comments between header fields */
+   while(p < end && (isspace(*p) || *p == '#'))
+   {
+      if(*p == '#')
+      {
+         while(p < end && *p != '\n') ++p;
+      }
+      else
+         ++p;
+   }
+   if(p >= end || !isdigit(*p)) return(0);
+
+   *value = 0;
+   while(p < end && isdigit(*p) && *value < 1000000)
+      *value = *value * 10 + (*p++ - '0');
+
+   return(p);
+}
+
+static int parse_pnm(const unsigned char *data, size_t size, raw_layout *l,
+                     char *err, int errlen)
+{
+   const unsigned char *p, *end = data + (size < 4096 ? size : 4096);
+   char line[128], key[32], value[64];
+   int n;
+
+   l->type = SAMPLE_INT;
+   l->big_endian = 1;
+   l->bottom_up = 0;
+
+   if(size < 3 || data[0] != 'P' ||
+      (data[1] != '5' && data[1] != '6' && data[1] != '7'))
+   {
+      snprintf(err, errlen, "not a binary PGM, PPM or PAM file");
+      return(-1);
+   }
+
+   if(data[1] != '7')
+   {
+      l->channels = (data[1] == '5') ? 1 : 3;
+      p = data + 2;
+      if((p = pnm_token(p, end, &l->width)) == 0 ||
+         (p = pnm_token(p, end, &l->height)) == 0 ||
+         (p = pnm_token(p, end, &l->maxval)) == 0 ||
+         p >= end || !isspace(*p))
+      {
+         snprintf(err, errlen, "bad netpbm header");
+         return(-1);
+      }
+      l->header = p + 1 - data;
+      return(0);
+   }
+
+   /* PAM, "KEY value" lines up to ENDHDR */
+   l->width = l->height = l->channels = l->maxval = 0;
+   p = data + 2;
+   for(;;)
+   {
+      while(p < end && isspace(*p)) ++p;
+      for(n = 0; p < end && *p != '\n' && n < (int)sizeof(line) - 1; ++n)
+         line[n] = *p++;
+      line[n] = 0;
+      if(p >= end)
+      {
+         snprintf(err, errlen, "bad PAM header");
+         return(-1);
+      }
+      ++p;
+
+      if(line[0] == '#' || sscanf(line, "%31s %63s", key, value) < 1)
+         continue;
+      if(!strcmp(key, "ENDHDR")) break;
+      if(!strcmp(key, "WIDTH")) l->width = atoi(value);
+      else if(!strcmp(key, "HEIGHT")) l->height = atoi(value);
+      else if(!strcmp(key, "DEPTH")) l->channels = atoi(value);
+      else if(!strcmp(key, "MAXVAL")) l->maxval = atoi(value);
+   }
+   l->header = p - data;
+
+   return(0);
+}
+
+static int parse_raw_sidecar(const char *fn, raw_layout *l,
+                             char *err, int errlen)
+{
+   FILE *fp;
+   char hdr[4096], key[32];
+   int value, bits = 8;
+
+   snprintf(hdr, sizeof(hdr), "%s.hdr", fn);
+   fp = fopen(hdr, "r");
+   if(fp == 0)
+   {
+      snprintf(err, errlen, "%s: %s", hdr, strerror(errno));
+      return(-1);
+   }
+
+   l->width = l->height = l->channels = 0;
+   while(fscanf(fp, "%31s %d", key, &value) == 2)
+   {
+      if(!strcmp(key, "width")) l->width = value;
+      else if(!strcmp(key, "height")) l->height = value;
+      else if(!strcmp(key, "channels")) l->channels = value;
+      else if(!strcmp(key, "bits")) bits = value;
+   }
+   fclose(fp);
+
+   if(bits != 8 && bits != 16 && bits != 32)
+   {
+      snprintf(err, errlen, "%s: bits must be 8, 16 or 32", hdr);
+      return(-1);
+   }
+
+   l->type = (bits == 32) ? SAMPLE_FLOAT : SAMPLE_INT;
+   l->maxval = (bits == 32) ? 1 : (1 << bits) - 1;
+   l->big_endian = 0;
+   l->bottom_up = 0;
+   l->header = 0;
+
+   return(0);
+}
+
+/* PFM, "PF" (RGB) or "Pf" (grey), the size, and a scale whose sign gives
+   the byte order, followed by float rows from the bottom up */
+static int parse_pfm(const unsigned char *data, size_t size, raw_layout *l,
+                     char *err, int errlen)
+{
+   char text[128], *p;
+   size_t n, lines = 0;
+   double scale;
+
+   if(size < 3 || data[0] != 'P' || (data[1] != 'F' && data[1] != 'f'))
+   {
+      snprintf(err, errlen, "not a PFM file");
+      return(-1);
+   }
+
+   /* three lines of header text */
+   for(n = 0; n < size && n < sizeof(text) - 1 && lines < 3; ++n)
+   {
+      text[n] = data[n];
+      if(data[n] == '\n') ++lines;
+   }
+   text[n] = 0;
+   if(lines < 3 ||
+      sscanf(text + 2, "%d %d %lf", &l->width, &l->height, &scale) != 3 ||
+      scale == 0)
+   {
+      snprintf(err, errlen, "bad PFM header");
+      return(-1);
+   }
+   p = text + n;
+
+   l->channels = (data[1] == 'F') ? 3 : 1;
+   l->type = SAMPLE_FLOAT;
+   l->maxval = 1;
+   l->big_endian = scale > 0;
+   l->bottom_up = 1;
+   l->header = p - text;
+
+   return(0);
+}
+
+/* header text for a bpp 1, 3 or 4 netpbm file */
+static int pnm_header(char *hdr, int width, int height, int bpp, int maxval)
+{
+   if(bpp == 4)
+      return(snprintf(hdr, MAX_HEADER,
+                      "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL %d\n"
+                      "TUPLTYPE RGB_ALPHA\nENDHDR\n", width, height, maxval));
+
+   return(snprintf(hdr, MAX_HEADER, "P%c\n%d %d\n%d\n",
+                   (bpp == 1) ? '5' : '6', width, height, maxval));
+}
+
+static int write_raw_sidecar(const char *fn, int width, int height, int bpp,
+                             int bits, char *err, int errlen)
+{
+   FILE *fp;
+   char hdr[4096];
+
+   snprintf(hdr, sizeof(hdr), "%s.hdr", fn);
+   fp = fopen(hdr, "w");
+   if(fp == 0)
+   {
+      snprintf(err, errlen, "%s: %s", hdr, strerror(errno));
+      return(-1);
+   }
+   fprintf(fp, "width %d\nheight %d\nchannels %d\nbits %d\n",
+           width, height, bpp, bits);
+   if(fclose(fp) != 0)
+   {
+      snprintf(err, errlen, "%s: %s", hdr, strerror(errno));
+      return(-1);
+   }
+
+   return(0);
+}
+
+static unsigned int sample_size(const raw_layout *l)
+{
+   if(l->type == SAMPLE_FLOAT) return(4);
+   return((l->maxval > 255) ? 2 : 1);
+}
+
+static float read_float(const unsigned char *p, int big_endian)
+{
+   unsigned char b[4];
+   float v;
+
+   if(big_endian == host_big_endian())
+      memcpy(b, p, 4);
+   else
+   {
+      b[0] = p[3]; b[1] = p[2]; b[2] = p[1]; b[3] = p[0];
+   }
+   memcpy(&v, b, 4);
+
+   return(v);
+}
+
+/* Samples that are not already in a layout the converter takes get copied
+   into the heap: grey is expanded, integer ranges are rescaled to 8 or
+   16 bits, and with 'wide' unset everything is brought down to 8 bits. */
+static int convert_samples(image_data *img, const unsigned char *data,
+                           const raw_layout *l, int wide,
+                           char *err, int errlen)
+{
+   int x, y, c, k, out_bpp, out_size, src_bytes = sample_size(l);
+   unsigned int v, s[4];
+   float f[4];
+   const unsigned char *src;
+   unsigned char *d;
+
+   img->bpp = (l->channels == 2 || l->channels == 4) ? 4 : 3;
+   if(!wide)
+      img->sample_format = NORMALMAP_U8;
+   else if(l->type == SAMPLE_FLOAT)
+      img->sample_format = NORMALMAP_F32;
+   else
+      img->sample_format = (l->maxval > 255) ? NORMALMAP_U16 : NORMALMAP_U8;
+
+   out_bpp = img->bpp;
+   out_size = normalmap_format_size(img->sample_format);
+   img->pixels = malloc((size_t)l->height * image_stride(img));
+   if(img->pixels == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   d = img->pixels;
+   for(y = 0; y < l->height; ++y)
+   {
+      src = data + (size_t)(l->bottom_up ? l->height - 1 - y : y) *
+         l->width * l->channels * src_bytes;
+
+      for(x = 0; x < l->width; ++x)
+      {
+         for(c = 0; c < l->channels; ++c, src += src_bytes)
+         {
+            if(l->type == SAMPLE_FLOAT)
+            {
+               f[c] = read_float(src, l->big_endian);
+               if(!(f[c] >= 0)) f[c] = 0;
+               if(f[c] > 1) f[c] = 1;
+               s[c] = (unsigned int)(f[c] * 255.0f + 0.5f);
+               continue;
+            }
+
+            if(src_bytes == 1)
+               v = src[0];
+            else if(l->big_endian)
+               v = (src[0] << 8) | src[1];
+            else
+               v = src[0] | (src[1] << 8);
+
+            if(out_size == 2)
+               s[c] = (v * 65535u + l->maxval / 2) / l->maxval;
+            else
+               s[c] = (v * 255u + l->maxval / 2) / l->maxval;
+         }
+
+         /* grey and grey-alpha spread over RGB */
+         for(k = 0; k < out_bpp; ++k)
+         {
+            if(l->channels <= 2)
+               c = (k < 3) ? 0 : 1;
+            else
+               c = k;
+
+            if(out_size == 4)
+               ((float *)d)[k] = f[c];
+            else if(out_size == 2)
+               ((unsigned short *)d)[k] = s[c];
+            else
+               d[k] = s[c];
+         }
+         d += out_bpp * out_size;
+      }
+   }
+
+   return(0);
+}
+
+static int load_mapped(image_data *img, const char *fn, int format,
+                       int wide, char *err, int errlen)
+{
+   int fd;
+   struct stat st;
+   unsigned char *data;
+   raw_layout l;
+   size_t needed;
+   int ret;
+
+   fd = open(fn, O_RDONLY);
+   if(fd < 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      return(-1);
+   }
+   if(fstat(fd, &st) != 0 || st.st_size == 0)
+   {
+      snprintf(err, errlen, "%s", st.st_size ? strerror(errno) : "empty file");
+      close(fd);
+      return(-1);
+   }
+
+   /* private and writable, pages are only copied if something writes */
+   data = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(data == MAP_FAILED)
+   {
+      snprintf(err, errlen, "mmap: %s", strerror(errno));
+      return(-1);
+   }
+
+   if(format == FORMAT_PNM)
+      ret = parse_pnm(data, st.st_size, &l, err, errlen);
+   else if(format == FORMAT_PFM)
+      ret = parse_pfm(data, st.st_size, &l, err, errlen);
+   else
+      ret = parse_raw_sidecar(fn, &l, err, errlen);
+
+   if(ret == 0 && (l.width < 1 || l.height < 1 || l.channels < 1 ||
+                   l.channels > 4 || l.maxval < 1 || l.maxval > 65535))
+   {
+      snprintf(err, errlen, "unsupported image layout");
+      ret = -1;
+   }
+
+   needed = (size_t)l.width * l.height * l.channels * sample_size(&l);
+   if(ret == 0 && (size_t)st.st_size < l.header + needed)
+   {
+      snprintf(err, errlen, "truncated image data");
+      ret = -1;
+   }
+
+   if(ret != 0)
+   {
+      munmap(data, st.st_size);
+      return(-1);
+   }
+
+   img->width = l.width;
+   img->height = l.height;
+
+   /* already what the converter takes, read it in place */
+   if((l.channels == 3 || l.channels == 4) && !l.bottom_up &&
+      ((l.type == SAMPLE_INT && l.maxval == 255) ||
+       (wide && l.type == SAMPLE_INT && l.maxval == 65535 &&
+        l.big_endian == host_big_endian()) ||
+       (wide && l.type == SAMPLE_FLOAT && l.big_endian == host_big_endian())))
+   {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      img->bpp = l.channels;
+      if(l.type == SAMPLE_FLOAT)
+         img->sample_format = NORMALMAP_F32;
+      else
+         img->sample_format = (l.maxval > 255) ? NORMALMAP_U16 : NORMALMAP_U8;
+      img->pixels = data + l.header;
+      img->map = data;
+      img->map_size = st.st_size;
+      return(0);
+   }
+
+   ret = convert_samples(img, data + l.header, &l, wide, err, errlen);
+   munmap(data, st.st_size);
+
+   return(ret);
+}
+
+/* netpbm keeps 8-bit samples and takes anything wider as big endian
+   16-bit, raw files keep the sample format, little endian */
+static int stream_maxval(const image_data *img)
+{
+   return((img->sample_format == NORMALMAP_U8) ? 255 : 65535);
+}
+
+static int raw_bits(const image_data *img)
+{
+   return(normalmap_format_size(img->sample_format) * 8);
+}
+
+/* whether the pixels can be the file as they are */
+static int stream_native(const image_data *img, int format)
+{
+   if(img->sample_format == NORMALMAP_U8) return(1);
+   return(format == FORMAT_RAW && !host_big_endian());
+}
+
+/* little endian float RGB or grey rows, bottom up */
+static int save_pfm(const image_data *img, FILE *fp, char *err, int errlen)
+{
+   unsigned char *row, *d;
+   const unsigned char *p;
+   int x, y, n;
+
+   if(img->bpp != 1 && img->bpp != 3)
+   {
+      snprintf(err, errlen, "PFM has no alpha channel");
+      return(-1);
+   }
+
+   n = img->width * img->bpp;
+   row = malloc((size_t)n * 4);
+   if(row == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   fprintf(fp, "P%c\n%d %d\n-1.0\n", (img->bpp == 3) ? 'F' : 'f',
+           img->width, img->height);
+
+   for(y = img->height - 1; y >= 0; --y)
+   {
+      p = img->pixels + (size_t)y * image_stride(img);
+      d = row;
+      for(x = 0; x < n; ++x, d += 4)
+         put_float_le(d, sample_value(p, x, img->sample_format));
+      if(fwrite(row, 4, n, fp) != (size_t)n)
+      {
+         snprintf(err, errlen, "%s", strerror(errno));
+         free(row);
+         return(-1);
+      }
+   }
+
+   free(row);
+
+   return(0);
+}
+
+/* OpenEXR, scanline, uncompressed 32-bit float channels */
+
+static unsigned char *put_u32_le(unsigned char *d, unsigned int v)
+{
+   d[0] = v & 0xff;
+   d[1] = (v >> 8) & 0xff;
+   d[2] = (v >> 16) & 0xff;
+   d[3] = (v >> 24) & 0xff;
+   return(d + 4);
+}
+
+static unsigned char *exr_attribute(unsigned char *d, const char *name,
+                                    const char *type, unsigned int size)
+{
+   strcpy((char *)d, name);
+   d += strlen(name) + 1;
+   strcpy((char *)d, type);
+   d += strlen(type) + 1;
+   return(put_u32_le(d, size));
+}
+
+static int save_exr(const image_data *img, FILE *fp, char *err, int errlen)
+{
+   /* channels are stored in name order, with the pixel channel each takes */
+   static const char *names[4] = {"A", "B", "G", "R"};
+   static const int rgb_channels[4] = {3, 2, 1, 0};
+   unsigned char hdr[512], *d, *row;
+   const unsigned char *s;
+   int i, x, y, c, first, nch = img->bpp;
+   size_t chunk, offset;
+
+   /* grey is Y, colour channels skip A without alpha */
+   first = (img->bpp == 3) ? 1 : 0;
+   chunk = 8 + (size_t)img->width * nch * 4;
+
+   d = hdr;
+   d = put_u32_le(d, 20000630);
+   d = put_u32_le(d, 2);
+
+   d = exr_attribute(d, "channels", "chlist", nch * 18 + 1);
+   for(i = 0; i < nch; ++i)
+   {
+      *d++ = (img->bpp == 1) ? 'Y' : names[first + i][0];
+      *d++ = 0;
+      d = put_u32_le(d, 2);          /* FLOAT */
+      memset(d, 0, 4);               /* pLinear, reserved */
+      d += 4;
+      d = put_u32_le(d, 1);
+      d = put_u32_le(d, 1);
+   }
+   *d++ = 0;
+
+   d = exr_attribute(d, "compression", "compression", 1);
+   *d++ = 0;
+   d = exr_attribute(d, "dataWindow", "box2i", 16);
+   d = put_u32_le(put_u32_le(d, 0), 0);
+   d = put_u32_le(put_u32_le(d, img->width - 1), img->height - 1);
+   d = exr_attribute(d, "displayWindow", "box2i", 16);
+   d = put_u32_le(put_u32_le(d, 0), 0);
+   d = put_u32_le(put_u32_le(d, img->width - 1), img->height - 1);
+   d = exr_attribute(d, "lineOrder", "lineOrder", 1);
+   *d++ = 0;
+   d = exr_attribute(d, "pixelAspectRatio", "float", 4);
+   put_float_le(d, 1.0f);
+   d += 4;
+   d = exr_attribute(d, "screenWindowCenter", "v2f", 8);
+   put_float_le(d, 0.0f);
+   put_float_le(d + 4, 0.0f);
+   d += 8;
+   d = exr_attribute(d, "screenWindowWidth", "float", 4);
+   put_float_le(d, 1.0f);
+   d += 4;
+   *d++ = 0;
+
+   if(fwrite(hdr, 1, d - hdr, fp) != (size_t)(d - hdr))
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      return(-1);
+   }
+
+   /* line offset table, one line per chunk */
+   offset = (d - hdr) + (size_t)img->height * 8;
+   for(y = 0; y < img->height; ++y, offset += chunk)
+   {
+      put_u32_le(put_u32_le(hdr, offset & 0xffffffffu),
+                 (unsigned int)((unsigned long long)offset >> 32));
+      if(fwrite(hdr, 1, 8, fp) != 8)
+      {
+         snprintf(err, errlen, "%s", strerror(errno));
+         return(-1);
+      }
+   }
+
+   row = malloc(chunk);
+   if(row == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   for(y = 0; y < img->height; ++y)
+   {
+      s = img->pixels + (size_t)y * image_stride(img);
+      d = put_u32_le(row, y);
+      d = put_u32_le(d, chunk - 8);
+      /* each line holds all of one channel, then the next */
+      for(i = 0; i < nch; ++i)
+      {
+         c = (img->bpp == 1) ? 0 : rgb_channels[first + i];
+         for(x = 0; x < img->width; ++x, d += 4)
+            put_float_le(d, sample_value(s, x * img->bpp + c,
+                                         img->sample_format));
+      }
+      if(fwrite(row, 1, chunk, fp) != chunk)
+      {
+         snprintf(err, errlen, "%s", strerror(errno));
+         free(row);
+         return(-1);
+      }
+   }
+
+   free(row);
+
+   return(0);
+}
+
+static int create_mapped(image_data *img, const char *fn, int format,
+                         char *err, int errlen)
+{
+   char hdr[MAX_HEADER];
+   size_t header = 0, size;
+   unsigned char *data;
+   int fd, ret;
+
+   if(format == FORMAT_PNM)
+      header = pnm_header(hdr, img->width, img->height, img->bpp,
+                          stream_maxval(img));
+   else if(write_raw_sidecar(fn, img->width, img->height, img->bpp,
+                             raw_bits(img), err, errlen) != 0)
+      return(-1);
+
+   size = header + (size_t)img->height * image_stride(img);
+
+   fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0666);
+   if(fd < 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      return(-1);
+   }
+
+   /* allocate the blocks now, running out of space while writing through
+      the mapping would be a SIGBUS rather than an error */
+   ret = posix_fallocate(fd, 0, size);
+   if(ret != 0)
+   {
+      snprintf(err, errlen, "%s", strerror(ret));
+      close(fd);
+      remove(fn);
+      return(-1);
+   }
+
+   data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(data == MAP_FAILED)
+   {
+      snprintf(err, errlen, "mmap: %s", strerror(errno));
+      remove(fn);
+      return(-1);
+   }
+
+   memcpy(data, hdr, header);
+
+   img->pixels = data + header;
+   img->map = data;
+   img->map_size = size;
+   img->writeback = 1;
+
+   return(0);
+}
+
+/* Row by row reading and writing */
+
+struct image_reader
+{
+   FILE *fp;
+   png_structp png;
+   png_infop info;
+   char png_err[256];
+};
+
+struct image_writer
+{
+   int format;
+   image_data img;      /* the size and samples, no pixels */
+   int rows;
+   char *fn;
+   FILE *fp;
+   png_structp png;
+   png_infop info;
+   char png_err[256];
+   unsigned char *row;   /* samples converted for the file */
+};
+
+int image_reader_open(image_reader **reader, const char *fn, int wide,
+                      image_data *img, char *err, int errlen)
+{
+   image_reader *r;
+
+   *reader = 0;
+   memset(img, 0, sizeof(image_data));
+   img->sample_format = NORMALMAP_U8;
+
+   if(image_format(fn) != FORMAT_PNG)
+      return(1);
+
+   r = calloc(1, sizeof(image_reader));
+   if(r == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   r->fp = fopen(fn, "rb");
+   if(r->fp == 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      free(r);
+      return(-1);
+   }
+
+   r->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, r->png_err,
+                                   png_error_func, png_warning_func);
+   if(r->png) r->info = png_create_info_struct(r->png);
+   if(r->png == 0 || r->info == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      image_reader_close(r);
+      return(-1);
+   }
+
+   if(setjmp(png_jmpbuf(r->png)))
+   {
+      snprintf(err, errlen, "%s", r->png_err);
+      image_reader_close(r);
+      return(-1);
+   }
+
+   png_init_io(r->png, r->fp);
+   png_read_info(r->png, r->info);
+
+   /* interlaced rows only come together in the last pass */
+   if(png_get_interlace_type(r->png, r->info) != PNG_INTERLACE_NONE)
+   {
+      image_reader_close(r);
+      return(1);
+   }
+
+   png_read_setup(r->png, r->info, wide, img);
+
+   *reader = r;
+
+   return(0);
+}
+
+int image_reader_read(image_reader *r, unsigned char *row,
+                      char *err, int errlen)
+{
+   if(setjmp(png_jmpbuf(r->png)))
+   {
+      snprintf(err, errlen, "%s", r->png_err);
+      return(-1);
+   }
+
+   png_read_row(r->png, row, 0);
+
+   return(0);
+}
+
+void image_reader_close(image_reader *r)
+{
+   if(r == 0) return;
+
+   if(r->png)
+      png_destroy_read_struct(&r->png, r->info ? &r->info : 0, 0);
+   if(r->fp)
+      fclose(r->fp);
+   free(r);
+}
+
+static int writer_header(image_writer *w, char *err, int errlen)
+{
+   unsigned char tga[18];
+   char hdr[MAX_HEADER];
+   int color_type, n;
+
+   if(w->format == FORMAT_PNG)
+   {
+      w->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, w->png_err,
+                                       png_error_func, png_warning_func);
+      if(w->png) w->info = png_create_info_struct(w->png);
+      if(w->png == 0 || w->info == 0)
+      {
+         snprintf(err, errlen, "out of memory");
+         return(-1);
+      }
+
+      if(setjmp(png_jmpbuf(w->png)))
+      {
+         snprintf(err, errlen, "%s", w->png_err);
+         return(-1);
+      }
+
+      switch(w->img.bpp)
+      {
+         case 1:  color_type = PNG_COLOR_TYPE_GRAY;       break;
+         case 3:  color_type = PNG_COLOR_TYPE_RGB;        break;
+         default: color_type = PNG_COLOR_TYPE_RGB_ALPHA;  break;
+      }
+
+      png_init_io(w->png, w->fp);
+      png_set_IHDR(w->png, w->info, w->img.width, w->img.height,
+                   (w->img.sample_format == NORMALMAP_U8) ? 8 : 16, color_type,
+                   PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                   PNG_FILTER_TYPE_DEFAULT);
+      /* normal maps compress poorly, favour speed */
+      png_set_compression_level(w->png, 3);
+      png_write_info(w->png, w->info);
+      return(0);
+   }
+
+   if(w->format == FORMAT_TGA)
+   {
+      memset(tga, 0, sizeof(tga));
+      tga[2] = (w->img.bpp == 1) ? 3 : 2;
+      tga[12] = w->img.width & 0xff;
+      tga[13] = (w->img.width >> 8) & 0xff;
+      tga[14] = w->img.height & 0xff;
+      tga[15] = (w->img.height >> 8) & 0xff;
+      tga[16] = w->img.bpp * 8;
+      /* top-left origin, alpha bits */
+      tga[17] = 0x20 | ((w->img.bpp == 4) ? 8 : 0);
+      n = fwrite(tga, 1, 18, w->fp);
+      if(n != 18)
+      {
+         snprintf(err, errlen, "%s", strerror(errno));
+         return(-1);
+      }
+      return(0);
+   }
+
+   if(w->format == FORMAT_PNM)
+   {
+      n = pnm_header(hdr, w->img.width, w->img.height, w->img.bpp,
+                     stream_maxval(&w->img));
+      if(fwrite(hdr, 1, n, w->fp) != (size_t)n)
+      {
+         snprintf(err, errlen, "%s", strerror(errno));
+         return(-1);
+      }
+      return(0);
+   }
+
+   return(write_raw_sidecar(w->fn, w->img.width, w->img.height, w->img.bpp,
+                            raw_bits(&w->img), err, errlen));
+}
+
+int image_writer_open(image_writer **writer, const char *fn,
+                      const image_data *img, char *err, int errlen)
+{
+   image_writer *w;
+   int format = image_format(fn);
+
+   *writer = 0;
+
+   if(format != FORMAT_PNG && format != FORMAT_TGA &&
+      format != FORMAT_PNM && format != FORMAT_RAW)
+      return(1);
+   if(format == FORMAT_TGA && img->sample_format != NORMALMAP_U8)
+   {
+      snprintf(err, errlen, "TGA only holds 8-bit images");
+      return(-1);
+   }
+
+   w = calloc(1, sizeof(image_writer));
+   if(w == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+   w->format = format;
+   w->img = *img;
+   w->img.pixels = 0;
+   w->fn = strdup(fn);
+   /* room for any sample converted to what the file holds */
+   w->row = malloc((size_t)w->img.width * w->img.bpp * 4);
+   if(w->fn == 0 || w->row == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      image_writer_close(w, 0, 0);
+      return(-1);
+   }
+
+   w->fp = fopen(fn, "wb");
+   if(w->fp == 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      image_writer_close(w, 0, 0);
+      return(-1);
+   }
+
+   if(writer_header(w, err, errlen) != 0)
+   {
+      image_writer_close(w, 0, 0);
+      return(-1);
+   }
+
+   *writer = w;
+
+   return(0);
+}
+
+int image_writer_write(image_writer *w, const unsigned char *row,
+                       char *err, int errlen)
+{
+   const unsigned char *s = row;
+   unsigned char *d = w->row;
+   size_t rowbytes;
+   unsigned int v;
+   int x, n = w->img.width * w->img.bpp;
+
+   if(w->format == FORMAT_PNG)
+   {
+      if(setjmp(png_jmpbuf(w->png)))
+      {
+         snprintf(err, errlen, "%s", w->png_err);
+         return(-1);
+      }
+      /* 16 and float samples go out as big endian 16-bit */
+      if(w->img.sample_format != NORMALMAP_U8)
+      {
+         for(x = 0; x < n; ++x)
+         {
+            v = sample_u16(row, x, w->img.sample_format);
+            d[2 * x] = v >> 8;
+            d[2 * x + 1] = v & 0xff;
+         }
+         s = d;
+      }
+      png_write_row(w->png, (png_bytep)s);
+      ++w->rows;
+      return(0);
+   }
+
+   rowbytes = image_stride(&w->img);
+
+   if(w->format == FORMAT_TGA)
+   {
+      for(x = 0; x < w->img.width; ++x, s += w->img.bpp)
+      {
+         if(w->img.bpp == 1)
+            *d++ = s[0];
+         else
+         {
+            *d++ = s[2];
+            *d++ = s[1];
+            *d++ = s[0];
+            if(w->img.bpp == 4) *d++ = s[3];
+         }
+      }
+      s = w->row;
+   }
+   else if(w->format == FORMAT_PNM && w->img.sample_format != NORMALMAP_U8)
+   {
+      /* netpbm takes anything wider as big endian 16-bit */
+      for(x = 0; x < n; ++x)
+      {
+         v = sample_u16(row, x, w->img.sample_format);
+         d[2 * x] = v >> 8;
+         d[2 * x + 1] = v & 0xff;
+      }
+      s = d;
+      rowbytes = (size_t)n * 2;
+   }
+   else if(w->format == FORMAT_RAW && host_big_endian())
+   {
+      /* raw samples are little endian */
+      for(x = 0; x < n; ++x)
+      {
+         if(w->img.sample_format == NORMALMAP_F32)
+            put_float_le(d + 4 * x, ((const float *)row)[x]);
+         else if(w->img.sample_format == NORMALMAP_U16)
+         {
+            v = ((const unsigned short *)row)[x];
+            d[2 * x] = v & 0xff;
+            d[2 * x + 1] = v >> 8;
+         }
+         else
+            d[x] = row[x];
+      }
+      s = d;
+   }
+
+   if(fwrite(s, 1, rowbytes, w->fp) != rowbytes)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      return(-1);
+   }
+   ++w->rows;
+
+   return(0);
+}
+
+static int png_finish(image_writer *w)
+{
+   if(setjmp(png_jmpbuf(w->png)))
+      return(-1);
+
+   png_write_end(w->png, w->info);
+
+   return(0);
+}
+
+int image_writer_close(image_writer *w, char *err, int errlen)
+{
+   int ret = 0;
+
+   if(w == 0) return(0);
+
+   if(w->rows < w->img.height)
+   {
+      if(err) snprintf(err, errlen, "incomplete image");
+      ret = -1;
+   }
+
+   if(w->png)
+   {
+      if(ret == 0 && png_finish(w) != 0)
+      {
+         if(err) snprintf(err, errlen, "%s", w->png_err);
+         ret = -1;
+      }
+      png_destroy_write_struct(&w->png, w->info ? &w->info : 0);
+   }
+
+   if(w->fp && fclose(w->fp) != 0 && ret == 0)
+   {
+      if(err) snprintf(err, errlen, "%s", strerror(errno));
+      ret = -1;
+   }
+   if(w->fp && ret != 0)
+      remove(w->fn);
+
+   free(w->row);
+   free(w->fn);
+   free(w);
+
+   return(ret);
+}
+
+int image_create(image_data *img, const char *fn, int width, int height,
+                 int bpp, int sample_format, char *err, int errlen)
+{
+   int format;
+
+   img->width = width;
+   img->height = height;
+   img->bpp = bpp;
+   img->pixels = 0;
+   img->map = 0;
+   img->map_size = 0;
+   img->writeback = 0;
+
+   img->sample_format = sample_format;
+
+   if(fn)
+   {
+      format = image_format(fn);
+      if(format == FORMAT_UNKNOWN)
+      {
+         snprintf(err, errlen, "unknown image format");
+         return(-1);
+      }
+
+      if((format == FORMAT_PNM || format == FORMAT_RAW) &&
+         stream_native(img, format))
+         return(create_mapped(img, fn, format, err, errlen));
+   }
+
+   img->pixels = malloc((size_t)height * image_stride(img));
+   if(img->pixels == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      return(-1);
+   }
+
+   return(0);
+}
+
+int image_load(image_data *img, const char *fn, int wide,
+               char *err, int errlen)
+{
+   FILE *fp;
+   int format, ret;
+
+   img->sample_format = NORMALMAP_U8;
+   img->pixels = 0;
+   img->map = 0;
+   img->map_size = 0;
+   img->writeback = 0;
+
+   format = image_format(fn);
+   if(format == FORMAT_UNKNOWN)
+   {
+      snprintf(err, errlen, "unknown image format");
+      return(-1);
+   }
+   if(format == FORMAT_EXR)
+   {
+      snprintf(err, errlen, "EXR files can only be written");
+      return(-1);
+   }
+
+   if(format == FORMAT_PNM || format == FORMAT_RAW || format == FORMAT_PFM)
+      return(load_mapped(img, fn, format, wide, err, errlen));
+
+   fp = fopen(fn, "rb");
+   if(fp == 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      return(-1);
+   }
+
+   if(format == FORMAT_PNG)
+      ret = load_png(img, fp, wide, err, errlen);
+   else
+      ret = load_tga(img, fp, err, errlen);
+
+   fclose(fp);
+
+   return(ret);
+}
+
+int image_save(const image_data *img, const char *fn, char *err, int errlen)
+{
+   image_writer *w;
+   FILE *fp;
+   int format, ret, y;
+
+   format = image_format(fn);
+   if(format == FORMAT_UNKNOWN)
+   {
+      snprintf(err, errlen, "unknown image format");
+      return(-1);
+   }
+   if(format == FORMAT_TGA && img->sample_format != NORMALMAP_U8)
+   {
+      snprintf(err, errlen, "TGA only holds 8-bit images");
+      return(-1);
+   }
+
+   /* written through the mapping already */
+   if(img->writeback)
+      return(0);
+
+   if(format != FORMAT_PFM && format != FORMAT_EXR)
+   {
+      if(image_writer_open(&w, fn, img, err, errlen) != 0)
+         return(-1);
+      for(y = 0; y < img->height; ++y)
+      {
+         if(image_writer_write(w, img->pixels + (size_t)y * image_stride(img),
+                               err, errlen) != 0)
+            break;
+      }
+      /* short of rows after a failed write, which removes the file */
+      ret = image_writer_close(w, (y < img->height) ? 0 : err, errlen);
+      return(ret);
+   }
+
+   fp = fopen(fn, "wb");
+   if(fp == 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      return(-1);
+   }
+
+   if(format == FORMAT_PFM)
+      ret = save_pfm(img, fp, err, errlen);
+   else
+      ret = save_exr(img, fp, err, errlen);
+
+   if(fclose(fp) != 0 && ret == 0)
+   {
+      snprintf(err, errlen, "%s", strerror(errno));
+      ret = -1;
+   }
+   if(ret != 0)
+      remove(fn);
+
+   return(ret);
+}
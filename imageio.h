@@ -0,0 +1,135 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __IMAGEIO_H
+#define __IMAGEIO_H
+
+#include <stddef.h>
+
+#include "libnormalmap.h"
+
+/* Image file loading and saving for the command line tools.  The format is
+ * picked from the file name extension:
+ *
+ *   .png                     libpng
+ *   .tga                     uncompressed or RLE true color and grey
+ *   .pgm .ppm .pnm .pam      binary netpbm (P5, P6, P7)
+ *   .pfm                     float RGB or grey
+ *   .exr                     uncompressed float OpenEXR, written only
+ *   .raw                     headerless pixels, described by a text
+ *                            sidecar NAME.raw.hdr with the lines
+ *                            "width W", "height H", "channels C" and
+ *                            "bits 8", "bits 16" or "bits 32" (float), all
+ *                            little endian
+ *
+ * Netpbm, PFM and raw files are memory mapped.  When they already hold RGB
+ * or RGBA in a sample format the converter takes the pixels are used in
+ * place, and images created for them with image_create() are written
+ * straight into the mapped output file, so textures larger than memory
+ * stream through the page cache.  On output netpbm files are written as
+ * P5, P6 or P7 by bpp, whatever the extension.
+ *
+ * 16-bit and float images are saved at their precision where the format
+ * has it: 16-bit PNG and netpbm, raw files with the sample format as is,
+ * PFM and EXR as floats.  TGA is 8-bit only.
+ */
+
+typedef struct
+{
+   int width;
+   int height;
+   int bpp;              /* 3 (RGB) or 4 (RGBA) */
+   int sample_format;    /* NORMALMAP_U8, NORMALMAP_U16 or NORMALMAP_F32 */
+   unsigned char *pixels;  /* tightly packed rows, top row first */
+   void *map;            /* file mapping holding the pixels, if any */
+   size_t map_size;
+   int writeback;        /* mapped output, the pixels are the file */
+} image_data;
+
+/* Whether 'fn' has the extension of a format that can be loaded, or of one
+ * that can be saved.
+ */
+int image_format_supported(const char *fn);
+int image_format_writable(const char *fn);
+
+/* Bytes per row. */
+int image_stride(const image_data *img);
+
+/* Loads 'fn' as RGB or RGBA, expanding grey and palette images.  With
+ * 'wide' set 16-bit and float images keep their precision as NORMALMAP_U16
+ * and NORMALMAP_F32, otherwise everything is brought down to 8 bits.
+ * Returns 0 on success, -1 on failure with a message in 'err'.
+ */
+int image_load(image_data *img, const char *fn, int wide,
+               char *err, int errlen);
+
+/* Sets up a bpp 1, 3 or 4 image of NORMALMAP_FORMAT 'sample_format' to be
+ * saved as 'fn'.  For the mapped formats the file is created and sized here
+ * when the samples are stored as they are in memory.  'fn' may be NULL for
+ * an image that is only kept in memory.  Returns 0 on success, -1 on
+ * failure with a message in 'err'.
+ */
+int image_create(image_data *img, const char *fn, int width, int height,
+                 int bpp, int sample_format, char *err, int errlen);
+
+/* Saves a bpp 1, 3 or 4 image.  Returns 0 on success, -1 on failure with a
+ * message in 'err'.  For an image from image_create() mapping 'fn' there is
+ * nothing left to write.
+ */
+int image_save(const image_data *img, const char *fn, char *err, int errlen);
+
+void image_free(image_data *img);
+
+/* Row by row reading and writing, for images too large to hold whole.
+ * Rows are in the layout image_load() gives and image_save() takes, top
+ * row first.
+ */
+typedef struct image_reader image_reader;
+typedef struct image_writer image_writer;
+
+/* Opens 'fn' and fills in the size and sample format of 'img', leaving it
+ * without pixels.  Non-interlaced PNG can be read this way.  Returns 0 on
+ * success, 1 if the file cannot be read by rows and -1 on failure with a
+ * message in 'err'.
+ */
+int image_reader_open(image_reader **reader, const char *fn, int wide,
+                      image_data *img, char *err, int errlen);
+int image_reader_read(image_reader *r, unsigned char *row,
+                      char *err, int errlen);
+void image_reader_close(image_reader *r);
+
+/* Starts writing an image the size and sample format of 'img' to 'fn'.
+ * PNG, TGA, netpbm and raw files can be written this way.  Returns 0 on
+ * success, 1 if the format needs the whole image and -1 on failure with a
+ * message in 'err'.
+ */
+int image_writer_open(image_writer **writer, const char *fn,
+                      const image_data *img, char *err, int errlen);
+int image_writer_write(image_writer *w, const unsigned char *row,
+                       char *err, int errlen);
+
+/* Finishes the file.  If not every row was written, or anything failed,
+ * the file is removed and -1 returned, with a message in 'err' unless it
+ * is NULL.
+ */
+int image_writer_close(image_writer *w, char *err, int errlen);
+
+#endif
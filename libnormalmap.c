@@ -0,0 +1,2118 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "scale.h"
+#include "arena.h"
+#include "perfcount.h"
+#include "libnormalmap.h"
+
+#define MAX_KERNEL_ELEMENTS 81
+/* rows above and below a pixel the largest kernel, 9x9, reaches */
+#define MAX_KERNEL_RADIUS   4
+/* the filter pass tiles, until normalmap_set_tiling() is told otherwise */
+#define DEFAULT_TILE_COLUMNS 1024
+#define DEFAULT_TILE_ROWS    64
+
+static const float oneover255 = 1.0f / 255.0f;
+
+#ifndef min
+# ifdef __GNUC__
+#  define min(a,b)  ({typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b;})
+# else
+#  define min(a,b)  ((a)<(b) ? (a) : (b))
+# endif
+#endif
+
+#ifndef max
+# ifdef __GNUC__
+#  define max(a,b)  ({typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b;})
+# else
+#  define max(a,b)  ((a)>(b) ? (a) : (b))
+# endif
+#endif
+
+#ifdef __GNUC__
+# define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+# define ALWAYS_INLINE inline
+#endif
+
+#define SQR(x)      ((x) * (x))
+#define LERP(a,b,c) ((a) + ((b) - (a)) * (c))
+
+static inline void NORMALIZE(float *v)
+{
+   float len = sqrtf(SQR(v[0]) + SQR(v[1]) + SQR(v[2]));
+
+   if(len > 1e-04f)
+   {
+      len = 1.0f / len;
+      v[0] *= len;
+      v[1] *= len;
+      v[2] *= len;
+   }
+   else
+      v[0] = v[1] = v[2] = 0;
+}
+
+typedef struct
+{
+   int x,y;
+   float w;
+} kernel_element;
+
+static const int format_size[MAX_NORMALMAP_FORMAT] = {1, 2, 4};
+
+/* statistics of the calling thread, see normalmap_collect_stats() */
+static __thread normalmap_stats *stats = 0;
+
+void normalmap_collect_stats(normalmap_stats *s)
+{
+   stats = s;
+}
+
+/* hardware counters of the calling thread, see normalmap_profile() */
+static __thread perf_group profile_group;
+static __thread int profiled = 0;   /* the events counted */
+
+int normalmap_profile(int enable, char *err, int errlen)
+{
+   if(profiled)
+   {
+      perf_group_close(&profile_group);
+      profiled = 0;
+   }
+   if(!enable) return(0);
+
+   profiled = perf_group_open(&profile_group, err, errlen);
+   return(profiled ? 0 : -1);
+}
+
+static double stats_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0);
+}
+
+/* Where a stage of a conversion started.  The conversions go from one
+ * stage to the next with stage_end(), which charges what was spent since
+ * the mark to a stage and moves the mark on.
+ */
+typedef struct
+{
+   double ms;
+   long long count[PERF_NUM_EVENTS];
+} stage_mark;
+
+static void stage_start(stage_mark *m)
+{
+   if(profiled) perf_group_read(&profile_group, m->count);
+   m->ms = stats_ms();
+}
+
+/* Returns the milliseconds charged. */
+static double stage_end(stage_mark *m, double *ms, normalmap_counters *c)
+{
+   stage_mark now;
+   double t;
+
+   stage_start(&now);
+
+   t = now.ms - m->ms;
+   *ms += t;
+   if(profiled && c)
+   {
+      c->cycles += now.count[PERF_CYCLES] - m->count[PERF_CYCLES];
+      c->instructions +=
+         now.count[PERF_INSTRUCTIONS] - m->count[PERF_INSTRUCTIONS];
+      c->cache_misses +=
+         now.count[PERF_CACHE_MISSES] - m->count[PERF_CACHE_MISSES];
+      c->branch_misses +=
+         now.count[PERF_BRANCH_MISSES] - m->count[PERF_BRANCH_MISSES];
+      stats->counted |= profiled;
+   }
+
+   *m = now;
+   return(t);
+}
+
+/* malloc() and calloc() counted in the statistics */
+static void *stats_malloc(size_t size)
+{
+   if(stats)
+   {
+      ++stats->allocations;
+      stats->allocated_bytes += size;
+   }
+   return(malloc(size));
+}
+
+static void *stats_calloc(size_t n, size_t size)
+{
+   if(stats)
+   {
+      ++stats->allocations;
+      stats->allocated_bytes += n * size;
+   }
+   return(calloc(n, size));
+}
+
+/* arena of the calling thread, see normalmap_scratch_arena() */
+static __thread arena *scratch = 0;
+
+arena *normalmap_scratch_arena(arena *a)
+{
+   arena *prev = scratch;
+
+   scratch = a;
+   return(prev);
+}
+
+/* Buffers that live for one call.  From the arena they go back all at
+ * once with scratch_release(), from malloc() one by one with
+ * scratch_free().  A call takes the arena once when it starts and hands
+ * it to all of these, so its buffers go back where they came from even
+ * if the thread's arena is changed while it runs, by a progress callback
+ * starting another conversion.
+ */
+static size_t scratch_mark(arena *a)
+{
+   return(a ? arena_mark(a) : 0);
+}
+
+static void *scratch_alloc(arena *a, size_t size)
+{
+   return(a ? arena_alloc(a, size) : stats_malloc(size));
+}
+
+static void scratch_free(arena *a, void *p)
+{
+   if(a == 0) free(p);
+}
+
+static void scratch_release(arena *a, size_t mark)
+{
+   if(a) arena_release(a, mark);
+}
+
+static void add_counters(normalmap_counters *sum, const normalmap_counters *c)
+{
+   sum->cycles += c->cycles;
+   sum->instructions += c->instructions;
+   sum->cache_misses += c->cache_misses;
+   sum->branch_misses += c->branch_misses;
+}
+
+void normalmap_stats_add(normalmap_stats *sum, const normalmap_stats *s)
+{
+   sum->total_ms += s->total_ms;
+   sum->bias_ms += s->bias_ms;
+   sum->heights_ms += s->heights_ms;
+   sum->convert_ms += s->convert_ms;
+   sum->heightmap_ms += s->heightmap_ms;
+   sum->progress_ms += s->progress_ms;
+   sum->conversions += s->conversions;
+   sum->pixels += s->pixels;
+   sum->taps += s->taps;
+   sum->alphamap_samples += s->alphamap_samples;
+   sum->bytes_read += s->bytes_read;
+   sum->bytes_written += s->bytes_written;
+   sum->allocations += s->allocations;
+   sum->allocated_bytes += s->allocated_bytes;
+   sum->counted |= s->counted;
+   add_counters(&sum->bias_counters, &s->bias_counters);
+   add_counters(&sum->heights_counters, &s->heights_counters);
+   add_counters(&sum->convert_counters, &s->convert_counters);
+   add_counters(&sum->heightmap_counters, &s->heightmap_counters);
+}
+
+/* snprintf() at 'n' characters into 'buf', returning the new length */
+static int append(char *buf, int len, int n, const char *fmt, ...)
+{
+   va_list ap;
+   int ret;
+
+   va_start(ap, fmt);
+   if(n < len)
+      ret = vsnprintf(buf + n, len - n, fmt, ap);
+   else
+      ret = vsnprintf(0, 0, fmt, ap);
+   va_end(ap);
+
+   return(ret < 0 ? ret : n + ret);
+}
+
+static int append_count(char *buf, int len, int n, const char *name,
+                        long long count, int counted)
+{
+   if(counted)
+      return(append(buf, len, n, "\"%s\": %lld, ", name, count));
+   return(append(buf, len, n, "\"%s\": null, ", name));
+}
+
+static int append_ratio(char *buf, int len, int n, const char *name,
+                        double a, double b, int counted)
+{
+   if(counted && b > 0)
+      return(append(buf, len, n, "\"%s\": %.3f", name, a / b));
+   return(append(buf, len, n, "\"%s\": null", name));
+}
+
+static int append_counters(char *buf, int len, int n, const char *stage,
+                           const normalmap_counters *c, int counted)
+{
+   int cycles = counted & NORMALMAP_COUNTED_CYCLES;
+   int instructions = counted & NORMALMAP_COUNTED_INSTRUCTIONS;
+   int cache = counted & NORMALMAP_COUNTED_CACHE_MISSES;
+   int branch = counted & NORMALMAP_COUNTED_BRANCH_MISSES;
+
+   n = append(buf, len, n, "\"%s\": {", stage);
+   n = append_count(buf, len, n, "cycles", c->cycles, cycles);
+   n = append_count(buf, len, n, "instructions", c->instructions,
+                    instructions);
+   n = append_count(buf, len, n, "cache_misses", c->cache_misses, cache);
+   n = append_count(buf, len, n, "branch_misses", c->branch_misses, branch);
+   n = append_ratio(buf, len, n, "ipc", c->instructions, c->cycles,
+                    cycles && instructions);
+   n = append(buf, len, n, ", ");
+   n = append_ratio(buf, len, n, "cache_mpki", c->cache_misses * 1000.0,
+                    c->instructions, cache && instructions);
+   n = append(buf, len, n, ", ");
+   n = append_ratio(buf, len, n, "branch_mpki", c->branch_misses * 1000.0,
+                    c->instructions, branch && instructions);
+   return(append(buf, len, n, "}"));
+}
+
+int normalmap_stats_json(const normalmap_stats *s, char *buf, int len)
+{
+   int n;
+
+   n = append(buf, len, 0,
+              "\"total_ms\": %.3f, \"bias_ms\": %.3f, "
+              "\"heights_ms\": %.3f, \"convert_ms\": %.3f, "
+              "\"heightmap_ms\": %.3f, \"progress_ms\": %.3f, "
+              "\"conversions\": %lld, \"pixels\": %lld, "
+              "\"taps\": %lld, \"alphamap_samples\": %lld, "
+              "\"bytes_read\": %lld, \"bytes_written\": %lld, "
+              "\"allocations\": %lld, \"allocated_bytes\": %lld",
+              s->total_ms, s->bias_ms, s->heights_ms, s->convert_ms,
+              s->heightmap_ms, s->progress_ms, s->conversions,
+              s->pixels, s->taps, s->alphamap_samples, s->bytes_read,
+              s->bytes_written, s->allocations, s->allocated_bytes);
+
+   if(s->counted)
+   {
+      n = append(buf, len, n, ", \"counters\": {");
+      n = append_counters(buf, len, n, "bias", &s->bias_counters,
+                          s->counted);
+      n = append(buf, len, n, ", ");
+      n = append_counters(buf, len, n, "heights", &s->heights_counters,
+                          s->counted);
+      n = append(buf, len, n, ", ");
+      n = append_counters(buf, len, n, "convert", &s->convert_counters,
+                          s->counted);
+      n = append(buf, len, n, ", ");
+      n = append_counters(buf, len, n, "heightmap", &s->heightmap_counters,
+                          s->counted);
+      n = append(buf, len, n, "}");
+   }
+
+   return(n);
+}
+
+int normalmap_format_size(int format)
+{
+   if(format < 0 || format >= MAX_NORMALMAP_FORMAT) return(0);
+   return(format_size[format]);
+}
+
+/* Sample 'i' of a pixel in the 0 to 255 range the conversions were written
+ * for.  Wider samples keep their precision as fractions.
+ */
+static ALWAYS_INLINE float fetch_sample(const unsigned char *s, int i,
+                                        int format)
+{
+   float v;
+
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         return((float)((const unsigned short *)s)[i] * (255.0f / 65535.0f));
+      case NORMALMAP_F32:
+         v = ((const float *)s)[i];
+         if(!(v >= 0)) v = 0;
+         if(v > 1) v = 1;
+         return(v * 255.0f);
+      default:
+         return((float)s[i]);
+   }
+}
+
+/* Stores a 0 to 1 value as sample 'i', or one minus it when 'invert' is
+ * set, truncating the way the 8-bit output always has.
+ */
+static ALWAYS_INLINE void store_sample(unsigned char *d, int i, int format,
+                                       float v, int invert)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] = (unsigned short)(v * 65535.0f);
+         if(invert)
+            ((unsigned short *)d)[i] = 65535 - ((unsigned short *)d)[i];
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = invert ? 1.0f - v : v;
+         break;
+      default:
+         d[i] = (unsigned char)(v * 255.0f);
+         if(invert) d[i] = 255 - d[i];
+         break;
+   }
+}
+
+/* A -1 to 1 normal component, biased into the unsigned range. */
+static ALWAYS_INLINE void store_normal(unsigned char *d, int i, int format,
+                                       float n)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] = (unsigned short)((n + 1.0f) * 32767.5f);
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = (n + 1.0f) * 0.5f;
+         break;
+      default:
+         d[i] = (unsigned char)((n + 1.0f) * 127.5f);
+         break;
+   }
+}
+
+/* A -1 to 1 component of an encoded normal, rounded to the nearest code
+ * since it is all the precision the two channels have.
+ */
+static ALWAYS_INLINE void store_encoded(unsigned char *d, int i, int format,
+                                        float n)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] =
+            (unsigned short)((n + 1.0f) * 32767.5f + 0.5f);
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = (n + 1.0f) * 0.5f;
+         break;
+      default:
+         d[i] = (unsigned char)((n + 1.0f) * 127.5f + 0.5f);
+         break;
+   }
+}
+
+/* Unit vector to octahedral coordinates in n[0] and n[1], the lower
+ * hemisphere folded over the diagonals.
+ */
+static ALWAYS_INLINE void oct_encode(float *n)
+{
+   float t, l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+
+   if(l1 < 1e-6f)
+   {
+      n[0] = n[1] = 0;
+      return;
+   }
+
+   n[0] /= l1;
+   n[1] /= l1;
+
+   if(n[2] < 0)
+   {
+      t = (1.0f - fabsf(n[1])) * (n[0] >= 0 ? 1.0f : -1.0f);
+      n[1] = (1.0f - fabsf(n[0])) * (n[1] >= 0 ? 1.0f : -1.0f);
+      n[0] = t;
+   }
+}
+
+/* Copies sample 'i' between formats, inverted if asked.  Unlike computed
+ * values these are rounded, so 8 and 16-bit samples survive a round trip.
+ */
+static ALWAYS_INLINE void copy_sample(unsigned char *d, int dst_format,
+                                      const unsigned char *s, int src_format,
+                                      int i, int invert)
+{
+   float v;
+
+   if(src_format == NORMALMAP_U8 && dst_format == NORMALMAP_U8)
+   {
+      d[i] = invert ? 255 - s[i] : s[i];
+      return;
+   }
+
+   v = fetch_sample(s, i, src_format) / 255.0f;
+   if(invert) v = 1.0f - v;
+
+   switch(dst_format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] = (unsigned short)(v * 65535.0f + 0.5f);
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = v;
+         break;
+      default:
+         d[i] = (unsigned char)(v * 255.0f + 0.5f);
+         break;
+   }
+}
+
+static void make_kernel(kernel_element *k, float *weights, int size)
+{
+   int x, y, idx;
+
+   for(y = 0; y < size; ++y)
+   {
+      for(x = 0; x < size; ++x)
+      {
+         idx = x + y * size;
+         k[idx].x = x - (size / 2);
+         k[idx].y = (size / 2) - y;
+         k[idx].w = weights[idx];
+      }
+   }
+}
+
+static void rotate_array(float *dst, float *src, int size)
+{
+   int x, y, newx, newy;
+
+   for(y = 0; y < size; ++y)
+   {
+      for(x = 0; x < size; ++x)
+      {
+         newy = size - x - 1;
+         newx = y;
+         dst[newx + newy * size] = src[x + y * size];
+      }
+   }
+}
+
+static int sample_alpha_map(const unsigned char *pixels, int x, int y,
+                            int w, int h, int sw, int sh)
+{
+   int ix, iy, wx, wy, v;
+   int a, b, c, d;
+   const unsigned char *s;
+
+   if(sh > 1)
+   {
+      iy = (((h - 1) * y) << 7) / (sh - 1);
+      if(y == sh - 1) --iy;
+      wy = iy & 0x7f;
+      iy >>= 7;
+   }
+   else
+      iy = wy = 0;
+
+   if(sw > 1)
+   {
+      ix = (((w - 1) * x) << 7) / (sw - 1);
+      if(x == sw - 1) --ix;
+      wx = ix & 0x7f;
+      ix >>= 7;
+   }
+   else
+      ix = wx = 0;
+
+   s = pixels + ((iy - 1) * w + (ix - 1));
+
+   b = icerp(s[w + 0],
+             s[w + 1],
+             s[w + 2],
+             s[w + 3], wx);
+   if(iy > 0)
+   {
+      a = icerp(s[0],
+                s[1],
+                s[2],
+                s[3], wx);
+   }
+   else
+      a = b;
+
+   c = icerp(s[2 * w + 0],
+             s[2 * w + 1],
+             s[2 * w + 2],
+             s[2 * w + 3], wx);
+   if(iy < sh - 1)
+   {
+      d = icerp(s[3 * w + 0],
+                s[3 * w + 1],
+                s[3 * w + 2],
+                s[3 * w + 3], wx);
+   }
+   else
+      d = c;
+
+   v = icerp(a, b, c, d, wy);
+
+   if(v <   0) v = 0;
+   if(v > 255) v = 255;
+
+   return((unsigned char)v);
+}
+
+static int make_heightmap(unsigned char *image, int stride, int format,
+                          int w, int h, int bpp, float contrast)
+{
+   size_t i, num_pixels = (size_t)w * h;
+   int x, y;
+   float v, hmin, hmax;
+   float *s, *r;
+   unsigned char *p;
+   int pixel_size = bpp * format_size[format];
+   arena *a = scratch;
+   size_t mark = scratch_mark(a);
+
+   s = (float*)scratch_alloc(a, (size_t)w * h * 3 * sizeof(float));
+   if(s == 0)
+      return(-1);
+   r = (float*)scratch_alloc(a, (size_t)w * h * 4 * sizeof(float));
+   if(r == 0)
+   {
+      scratch_free(a, s);
+      scratch_release(a, mark);
+      return(-1);
+   }
+
+   /* scale into 0 to 1 range, make signed -1 to 1 */
+   for(y = 0; y < h; ++y)
+   {
+      p = image + (size_t)y * stride;
+      for(x = 0; x < w; ++x, p += pixel_size)
+      {
+         i = (size_t)y * w + x;
+         s[3 * i + 0] = ((fetch_sample(p, 0, format) / 255.0f) - 0.5) * 2.0f;
+         s[3 * i + 1] = ((fetch_sample(p, 1, format) / 255.0f) - 0.5) * 2.0f;
+         s[3 * i + 2] = ((fetch_sample(p, 2, format) / 255.0f) - 0.5) * 2.0f;
+      }
+   }
+
+   memset(r, 0, (size_t)w * h * 4 * sizeof(float));
+
+#define S(x, y, n) s[(size_t)(y) * (w * 3) + ((x) * 3) + (n)]
+#define R(x, y, n) r[(size_t)(y) * (w * 4) + ((x) * 4) + (n)]
+
+   /* top-left to bottom-right */
+   for(x = 1; x < w; ++x)
+      R(x, 0, 0) = R(x - 1, 0, 0) + S(x - 1, 0, 0);
+   for(y = 1; y < h; ++y)
+      R(0, y, 0) = R(0, y - 1, 0) + S(0, y - 1, 1);
+   for(y = 1; y < h; ++y)
+   {
+      for(x = 1; x < w; ++x)
+      {
+         R(x, y, 0) = (R(x, y - 1, 0) + R(x - 1, y, 0) +
+                       S(x - 1, y, 0) + S(x, y - 1, 1)) * 0.5f;
+      }
+   }
+
+   /* top-right to bottom-left */
+   for(x = w - 2; x >= 0; --x)
+      R(x, 0, 1) = R(x + 1, 0, 1) - S(x + 1, 0, 0);
+   for(y = 1; y < h; ++y)
+      R(0, y, 1) = R(0, y - 1, 1) + S(0, y - 1, 1);
+   for(y = 1; y < h; ++y)
+   {
+      for(x = w - 2; x >= 0; --x)
+      {
+         R(x, y, 1) = (R(x, y - 1, 1) + R(x + 1, y, 1) -
+                       S(x + 1, y, 0) + S(x, y - 1, 1)) * 0.5f;
+      }
+   }
+
+   /* bottom-left to top-right */
+   for(x = 1; x < w; ++x)
+      R(x, 0, 2) = R(x - 1, 0, 2) + S(x - 1, 0, 0);
+   for(y = h - 2; y >= 0; --y)
+      R(0, y, 2) = R(0, y + 1, 2) - S(0, y + 1, 1);
+   for(y = h - 2; y >= 0; --y)
+   {
+      for(x = 1; x < w; ++x)
+      {
+         R(x, y, 2) = (R(x, y + 1, 2) + R(x - 1, y, 2) +
+                       S(x - 1, y, 0) - S(x, y + 1, 1)) * 0.5f;
+      }
+   }
+
+   /* bottom-right to top-left */
+   for(x = w - 2; x >= 0; --x)
+      R(x, 0, 3) = R(x + 1, 0, 3) - S(x + 1, 0, 0);
+   for(y = h - 2; y >= 0; --y)
+      R(0, y, 3) = R(0, y + 1, 3) - S(0, y + 1, 1);
+   for(y = h - 2; y >= 0; --y)
+   {
+      for(x = w - 2; x >= 0; --x)
+      {
+         R(x, y, 3) = (R(x, y + 1, 3) + R(x + 1, y, 3) -
+                       S(x + 1, y, 0) - S(x, y + 1, 1)) * 0.5f;
+      }
+   }
+
+#undef S
+#undef R
+
+   /* accumulate, find min/max */
+   hmin =  1e10f;
+   hmax = -1e10f;
+   for(i = 0; i < num_pixels; ++i)
+   {
+      r[4 * i] += r[4 * i + 1] + r[4 * i + 2] + r[4 * i + 3];
+      if(r[4 * i] < hmin) hmin = r[4 * i];
+      if(r[4 * i] > hmax) hmax = r[4 * i];
+   }
+
+   /* scale into 0 - 1 range */
+   for(i = 0; i < num_pixels; ++i)
+   {
+      v = (r[4 * i] - hmin) / (hmax - hmin);
+      /* adjust contrast */
+      v = (v - 0.5f) * contrast + v;
+      if(v < 0) v = 0;
+      if(v > 1) v = 1;
+      r[4 * i] = v;
+   }
+
+   /* write out results */
+   for(y = 0; y < h; ++y)
+   {
+      p = image + (size_t)y * stride;
+      for(x = 0; x < w; ++x, p += pixel_size)
+      {
+         v = r[4 * ((size_t)y * w + x)];
+         store_sample(p, 0, format, v, 0);
+         store_sample(p, 1, format, v, 0);
+         store_sample(p, 2, format, v, 0);
+      }
+   }
+
+   scratch_free(a, s);
+   scratch_free(a, r);
+   scratch_release(a, mark);
+
+   return(0);
+}
+
+/* Fills in the du and dv sampling kernels for 'filter', which must have room
+ * for MAX_KERNEL_ELEMENTS each.  Returns the number of elements used.
+ */
+static int make_kernels(int filter, kernel_element *kernel_du,
+                        kernel_element *kernel_dv)
+{
+   int num_elements = 0;
+   float weight;
+
+   switch(filter)
+   {
+      case FILTER_NONE:
+         num_elements = 2;
+
+         kernel_du[0].x = -1; kernel_du[0].y = 0; kernel_du[0].w = -0.5f;
+         kernel_du[1].x =  1; kernel_du[1].y = 0; kernel_du[1].w =  0.5f;
+
+         kernel_dv[0].x = 0; kernel_dv[0].y =  1; kernel_dv[0].w =  0.5f;
+         kernel_dv[1].x = 0; kernel_dv[1].y = -1; kernel_dv[1].w = -0.5f;
+
+         break;
+      case FILTER_SOBEL_3x3:
+         num_elements = 6;
+
+         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -1.0f;
+         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -2.0f;
+         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -1.0f;
+         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  1.0f;
+         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  2.0f;
+         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  1.0f;
+
+         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  1.0f;
+         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  2.0f;
+         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  1.0f;
+         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -1.0f;
+         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -2.0f;
+         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -1.0f;
+
+         break;
+      case FILTER_SOBEL_5x5:
+         num_elements = 20;
+
+         kernel_du[ 0].x = -2; kernel_du[ 0].y =  2; kernel_du[ 0].w =  -1.0f;
+         kernel_du[ 1].x = -2; kernel_du[ 1].y =  1; kernel_du[ 1].w =  -4.0f;
+         kernel_du[ 2].x = -2; kernel_du[ 2].y =  0; kernel_du[ 2].w =  -6.0f;
+         kernel_du[ 3].x = -2; kernel_du[ 3].y = -1; kernel_du[ 3].w =  -4.0f;
+         kernel_du[ 4].x = -2; kernel_du[ 4].y = -2; kernel_du[ 4].w =  -1.0f;
+         kernel_du[ 5].x = -1; kernel_du[ 5].y =  2; kernel_du[ 5].w =  -2.0f;
+         kernel_du[ 6].x = -1; kernel_du[ 6].y =  1; kernel_du[ 6].w =  -8.0f;
+         kernel_du[ 7].x = -1; kernel_du[ 7].y =  0; kernel_du[ 7].w = -12.0f;
+         kernel_du[ 8].x = -1; kernel_du[ 8].y = -1; kernel_du[ 8].w =  -8.0f;
+         kernel_du[ 9].x = -1; kernel_du[ 9].y = -2; kernel_du[ 9].w =  -2.0f;
+         kernel_du[10].x =  1; kernel_du[10].y =  2; kernel_du[10].w =   2.0f;
+         kernel_du[11].x =  1; kernel_du[11].y =  1; kernel_du[11].w =   8.0f;
+         kernel_du[12].x =  1; kernel_du[12].y =  0; kernel_du[12].w =  12.0f;
+         kernel_du[13].x =  1; kernel_du[13].y = -1; kernel_du[13].w =   8.0f;
+         kernel_du[14].x =  1; kernel_du[14].y = -2; kernel_du[14].w =   2.0f;
+         kernel_du[15].x =  2; kernel_du[15].y =  2; kernel_du[15].w =   1.0f;
+         kernel_du[16].x =  2; kernel_du[16].y =  1; kernel_du[16].w =   4.0f;
+         kernel_du[17].x =  2; kernel_du[17].y =  0; kernel_du[17].w =   6.0f;
+         kernel_du[18].x =  2; kernel_du[18].y = -1; kernel_du[18].w =   4.0f;
+         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =   1.0f;
+
+         kernel_dv[ 0].x = -2; kernel_dv[ 0].y =  2; kernel_dv[ 0].w =   1.0f;
+         kernel_dv[ 1].x = -1; kernel_dv[ 1].y =  2; kernel_dv[ 1].w =   4.0f;
+         kernel_dv[ 2].x =  0; kernel_dv[ 2].y =  2; kernel_dv[ 2].w =   6.0f;
+         kernel_dv[ 3].x =  1; kernel_dv[ 3].y =  2; kernel_dv[ 3].w =   4.0f;
+         kernel_dv[ 4].x =  2; kernel_dv[ 4].y =  2; kernel_dv[ 4].w =   1.0f;
+         kernel_dv[ 5].x = -2; kernel_dv[ 5].y =  1; kernel_dv[ 5].w =   2.0f;
+         kernel_dv[ 6].x = -1; kernel_dv[ 6].y =  1; kernel_dv[ 6].w =   8.0f;
+         kernel_dv[ 7].x =  0; kernel_dv[ 7].y =  1; kernel_dv[ 7].w =  12.0f;
+         kernel_dv[ 8].x =  1; kernel_dv[ 8].y =  1; kernel_dv[ 8].w =   8.0f;
+         kernel_dv[ 9].x =  2; kernel_dv[ 9].y =  1; kernel_dv[ 9].w =   2.0f;
+         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w =  -2.0f;
+         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w =  -8.0f;
+         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -12.0f;
+         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w =  -8.0f;
+         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w =  -2.0f;
+         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w =  -1.0f;
+         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w =  -4.0f;
+         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w =  -6.0f;
+         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w =  -4.0f;
+         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w =  -1.0f;
+
+         break;
+      case FILTER_PREWITT_3x3:
+         num_elements = 6;
+
+         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -1.0f;
+         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -1.0f;
+         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -1.0f;
+         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  1.0f;
+         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  1.0f;
+         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  1.0f;
+
+         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  1.0f;
+         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  1.0f;
+         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  1.0f;
+         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -1.0f;
+         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -1.0f;
+         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -1.0f;
+
+         break;
+      case FILTER_PREWITT_5x5:
+         num_elements = 20;
+
+         kernel_du[ 0].x = -2; kernel_du[ 0].y =  2; kernel_du[ 0].w = -1.0f;
+         kernel_du[ 1].x = -2; kernel_du[ 1].y =  1; kernel_du[ 1].w = -1.0f;
+         kernel_du[ 2].x = -2; kernel_du[ 2].y =  0; kernel_du[ 2].w = -1.0f;
+         kernel_du[ 3].x = -2; kernel_du[ 3].y = -1; kernel_du[ 3].w = -1.0f;
+         kernel_du[ 4].x = -2; kernel_du[ 4].y = -2; kernel_du[ 4].w = -1.0f;
+         kernel_du[ 5].x = -1; kernel_du[ 5].y =  2; kernel_du[ 5].w = -2.0f;
+         kernel_du[ 6].x = -1; kernel_du[ 6].y =  1; kernel_du[ 6].w = -2.0f;
+         kernel_du[ 7].x = -1; kernel_du[ 7].y =  0; kernel_du[ 7].w = -2.0f;
+         kernel_du[ 8].x = -1; kernel_du[ 8].y = -1; kernel_du[ 8].w = -2.0f;
+         kernel_du[ 9].x = -1; kernel_du[ 9].y = -2; kernel_du[ 9].w = -2.0f;
+         kernel_du[10].x =  1; kernel_du[10].y =  2; kernel_du[10].w =  2.0f;
+         kernel_du[11].x =  1; kernel_du[11].y =  1; kernel_du[11].w =  2.0f;
+         kernel_du[12].x =  1; kernel_du[12].y =  0; kernel_du[12].w =  2.0f;
+         kernel_du[13].x =  1; kernel_du[13].y = -1; kernel_du[13].w =  2.0f;
+         kernel_du[14].x =  1; kernel_du[14].y = -2; kernel_du[14].w =  2.0f;
+         kernel_du[15].x =  2; kernel_du[15].y =  2; kernel_du[15].w =  1.0f;
+         kernel_du[16].x =  2; kernel_du[16].y =  1; kernel_du[16].w =  1.0f;
+         kernel_du[17].x =  2; kernel_du[17].y =  0; kernel_du[17].w =  1.0f;
+         kernel_du[18].x =  2; kernel_du[18].y = -1; kernel_du[18].w =  1.0f;
+         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =  1.0f;
+
+         kernel_dv[ 0].x = -2; kernel_dv[ 0].y =  2; kernel_dv[ 0].w =  1.0f;
+         kernel_dv[ 1].x = -1; kernel_dv[ 1].y =  2; kernel_dv[ 1].w =  1.0f;
+         kernel_dv[ 2].x =  0; kernel_dv[ 2].y =  2; kernel_dv[ 2].w =  1.0f;
+         kernel_dv[ 3].x =  1; kernel_dv[ 3].y =  2; kernel_dv[ 3].w =  1.0f;
+         kernel_dv[ 4].x =  2; kernel_dv[ 4].y =  2; kernel_dv[ 4].w =  1.0f;
+         kernel_dv[ 5].x = -2; kernel_dv[ 5].y =  1; kernel_dv[ 5].w =  2.0f;
+         kernel_dv[ 6].x = -1; kernel_dv[ 6].y =  1; kernel_dv[ 6].w =  2.0f;
+         kernel_dv[ 7].x =  0; kernel_dv[ 7].y =  1; kernel_dv[ 7].w =  2.0f;
+         kernel_dv[ 8].x =  1; kernel_dv[ 8].y =  1; kernel_dv[ 8].w =  2.0f;
+         kernel_dv[ 9].x =  2; kernel_dv[ 9].y =  1; kernel_dv[ 9].w =  2.0f;
+         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w = -2.0f;
+         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w = -2.0f;
+         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -2.0f;
+         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w = -2.0f;
+         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w = -2.0f;
+         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w = -1.0f;
+         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w = -1.0f;
+         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w = -1.0f;
+         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w = -1.0f;
+         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w = -1.0f;
+
+         break;
+      case FILTER_3x3:
+         num_elements = 6;
+
+         weight = 1.0f / 6.0f;
+
+         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -weight;
+         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -weight;
+         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -weight;
+         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  weight;
+         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  weight;
+         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  weight;
+
+         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  weight;
+         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  weight;
+         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  weight;
+         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -weight;
+         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -weight;
+         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -weight;
+         break;
+      case FILTER_5x5:
+      {
+         int n;
+         float usum = 0, vsum = 0;
+         float wt22 = 1.0f / 16.0f;
+         float wt12 = 1.0f / 10.0f;
+         float wt02 = 1.0f / 8.0f;
+         float wt11 = 1.0f / 2.8f;
+         num_elements = 20;
+
+         kernel_du[0 ].x = -2; kernel_du[0 ].y =  2; kernel_du[0 ].w = -wt22;
+         kernel_du[1 ].x = -1; kernel_du[1 ].y =  2; kernel_du[1 ].w = -wt12;
+         kernel_du[2 ].x =  1; kernel_du[2 ].y =  2; kernel_du[2 ].w =  wt12;
+         kernel_du[3 ].x =  2; kernel_du[3 ].y =  2; kernel_du[3 ].w =  wt22;
+         kernel_du[4 ].x = -2; kernel_du[4 ].y =  1; kernel_du[4 ].w = -wt12;
+         kernel_du[5 ].x = -1; kernel_du[5 ].y =  1; kernel_du[5 ].w = -wt11;
+         kernel_du[6 ].x =  1; kernel_du[6 ].y =  1; kernel_du[6 ].w =  wt11;
+         kernel_du[7 ].x =  2; kernel_du[7 ].y =  1; kernel_du[7 ].w =  wt12;
+         kernel_du[8 ].x = -2; kernel_du[8 ].y =  0; kernel_du[8 ].w = -wt02;
+         kernel_du[9 ].x = -1; kernel_du[9 ].y =  0; kernel_du[9 ].w = -0.5f;
+         kernel_du[10].x =  1; kernel_du[10].y =  0; kernel_du[10].w =  0.5f;
+         kernel_du[11].x =  2; kernel_du[11].y =  0; kernel_du[11].w =  wt02;
+         kernel_du[12].x = -2; kernel_du[12].y = -1; kernel_du[12].w = -wt12;
+         kernel_du[13].x = -1; kernel_du[13].y = -1; kernel_du[13].w = -wt11;
+         kernel_du[14].x =  1; kernel_du[14].y = -1; kernel_du[14].w =  wt11;
+         kernel_du[15].x =  2; kernel_du[15].y = -1; kernel_du[15].w =  wt12;
+         kernel_du[16].x = -2; kernel_du[16].y = -2; kernel_du[16].w = -wt22;
+         kernel_du[17].x = -1; kernel_du[17].y = -2; kernel_du[17].w = -wt12;
+         kernel_du[18].x =  1; kernel_du[18].y = -2; kernel_du[18].w =  wt12;
+         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =  wt22;
+
+         kernel_dv[0 ].x = -2; kernel_dv[0 ].y =  2; kernel_dv[0 ].w =  wt22;
+         kernel_dv[1 ].x = -1; kernel_dv[1 ].y =  2; kernel_dv[1 ].w =  wt12;
+         kernel_dv[2 ].x =  0; kernel_dv[2 ].y =  2; kernel_dv[2 ].w =  0.25f;
+         kernel_dv[3 ].x =  1; kernel_dv[3 ].y =  2; kernel_dv[3 ].w =  wt12;
+         kernel_dv[4 ].x =  2; kernel_dv[4 ].y =  2; kernel_dv[4 ].w =  wt22;
+         kernel_dv[5 ].x = -2; kernel_dv[5 ].y =  1; kernel_dv[5 ].w =  wt12;
+         kernel_dv[6 ].x = -1; kernel_dv[6 ].y =  1; kernel_dv[6 ].w =  wt11;
+         kernel_dv[7 ].x =  0; kernel_dv[7 ].y =  1; kernel_dv[7 ].w =  0.5f;
+         kernel_dv[8 ].x =  1; kernel_dv[8 ].y =  1; kernel_dv[8 ].w =  wt11;
+         kernel_dv[9 ].x =  2; kernel_dv[9 ].y =  1; kernel_dv[9 ].w =  wt22;
+         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w = -wt22;
+         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w = -wt11;
+         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -0.5f;
+         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w = -wt11;
+         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w = -wt12;
+         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w = -wt22;
+         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w = -wt12;
+         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w = -0.25f;
+         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w = -wt12;
+         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w = -wt22;
+
+         for(n = 0; n < 20; ++n)
+         {
+            usum += fabsf(kernel_du[n].w);
+            vsum += fabsf(kernel_dv[n].w);
+         }
+         for(n = 0; n < 20; ++n)
+         {
+            kernel_du[n].w /= usum;
+            kernel_dv[n].w /= vsum;
+         }
+
+         break;
+      }
+      case FILTER_7x7:
+      {
+         float du_weights[]=
+         {
+            -1, -2, -3, 0, 3, 2, 1,
+            -2, -3, -4, 0, 4, 3, 2,
+            -3, -4, -5, 0, 5, 4, 3,
+            -4, -5, -6, 0, 6, 5, 4,
+            -3, -4, -5, 0, 5, 4, 3,
+            -2, -3, -4, 0, 4, 3, 2,
+            -1, -2, -3, 0, 3, 2, 1
+         };
+         float dv_weights[49];
+         int n;
+         float usum = 0, vsum = 0;
+
+         num_elements = 49;
+
+         make_kernel(kernel_du, du_weights, 7);
+         rotate_array(dv_weights, du_weights, 7);
+         make_kernel(kernel_dv, dv_weights, 7);
+
+         for(n = 0; n < 49; ++n)
+         {
+            usum += fabsf(kernel_du[n].w);
+            vsum += fabsf(kernel_dv[n].w);
+         }
+         for(n = 0; n < 49; ++n)
+         {
+            kernel_du[n].w /= usum;
+            kernel_dv[n].w /= vsum;
+         }
+
+         break;
+      }
+      case FILTER_9x9:
+      {
+         float du_weights[]=
+         {
+            -1, -2, -3, -4, 0, 4, 3, 2, 1,
+            -2, -3, -4, -5, 0, 5, 4, 3, 2,
+            -3, -4, -5, -6, 0, 6, 5, 4, 3,
+            -4, -5, -6, -7, 0, 7, 6, 5, 4,
+            -5, -6, -7, -8, 0, 8, 7, 6, 5,
+            -4, -5, -6, -7, 0, 7, 6, 5, 4,
+            -3, -4, -5, -6, 0, 6, 5, 4, 3,
+            -2, -3, -4, -5, 0, 5, 4, 3, 2,
+            -1, -2, -3, -4, 0, 4, 3, 2, 1
+         };
+         float dv_weights[81];
+         int n;
+         float usum = 0, vsum = 0;
+
+         num_elements = 81;
+
+         make_kernel(kernel_du, du_weights, 9);
+         rotate_array(dv_weights, du_weights, 9);
+         make_kernel(kernel_dv, dv_weights, 9);
+
+         for(n = 0; n < 81; ++n)
+         {
+            usum += fabsf(kernel_du[n].w);
+            vsum += fabsf(kernel_dv[n].w);
+         }
+         for(n = 0; n < 81; ++n)
+         {
+            kernel_du[n].w /= usum;
+            kernel_dv[n].w /= vsum;
+         }
+
+         break;
+      }
+   }
+
+   return(num_elements);
+}
+
+void normalmap_default_params(normalmap_params *p)
+{
+   memset(p, 0, sizeof(normalmap_params));
+   p->filter = FILTER_NONE;
+   p->minz = 0.0f;
+   p->scale = 1.0f;
+   p->alpha = ALPHA_NONE;
+   p->conversion = CONVERT_NONE;
+   p->dudv = DUDV_NONE;
+   p->contrast = 0.0f;
+}
+
+/* approximated average color of the image
+ * scale to 16x16, accumulate the pixels and average */
+static int average_color(float *rgb_bias, const unsigned char *src,
+                         int stride, int format, int width, int height,
+                         int bpp)
+{
+   unsigned char *tmp, *packed = 0, *s, *d;
+   const unsigned char *p;
+   unsigned int sum[3];
+   int x, y, c;
+   arena *a = scratch;
+   size_t mark = scratch_mark(a);
+
+   /* scale_pixels() wants tightly packed 8-bit rows */
+   if(format != NORMALMAP_U8)
+   {
+      packed = scratch_alloc(a, (size_t)width * height * bpp);
+      if(packed == 0) return(-1);
+      d = packed;
+      for(y = 0; y < height; ++y)
+      {
+         p = src + (size_t)y * stride;
+         for(x = 0; x < width; ++x, p += bpp * format_size[format])
+         {
+            for(c = 0; c < bpp; ++c)
+               *d++ = (unsigned char)fetch_sample(p, c, format);
+         }
+      }
+   }
+   else if(stride != width * bpp)
+   {
+      packed = scratch_alloc(a, (size_t)width * height * bpp);
+      if(packed == 0) return(-1);
+      for(y = 0; y < height; ++y)
+         memcpy(packed + (size_t)y * width * bpp, src + (size_t)y * stride,
+                width * bpp);
+   }
+
+   tmp = scratch_alloc(a, 16 * 16 * bpp);
+   if(tmp == 0)
+   {
+      scratch_free(a, packed);
+      scratch_release(a, mark);
+      return(-1);
+   }
+   scale_pixels(tmp, 16, 16, packed ? packed : (unsigned char *)src,
+                width, height, bpp);
+
+   sum[0] = sum[1] = sum[2] = 0;
+
+   s = tmp;
+   for(y = 0; y < 16; ++y)
+   {
+      for(x = 0; x < 16; ++x)
+      {
+         sum[0] += *s++;
+         sum[1] += *s++;
+         sum[2] += *s++;
+         if(bpp == 4) s++;
+      }
+   }
+
+   rgb_bias[0] = (float)sum[0] / 256.0f;
+   rgb_bias[1] = (float)sum[1] / 256.0f;
+   rgb_bias[2] = (float)sum[2] / 256.0f;
+
+   scratch_free(a, tmp);
+   scratch_free(a, packed);
+   scratch_release(a, mark);
+
+   return(0);
+}
+
+typedef struct
+{
+   const normalmap_params *p;
+   int width, height, bpp, dudv, encoding;
+   int height_format;       /* of the rows of heights, HEIGHTS_FLOAT or U16 */
+   const float *rgb_bias;
+   int num_elements;
+   const kernel_element *kernel_du;
+   const kernel_element *kernel_dv;
+} convert_state;
+
+/* a height of 0 to 1 into a row of heights in 'hfmt' */
+static ALWAYS_INLINE void store_height(void *h, int x, int hfmt, float v)
+{
+   if(hfmt == HEIGHTS_U16)
+      ((unsigned short *)h)[x] = (unsigned short)(v * 65535.0f + 0.5f);
+   else
+      ((float *)h)[x] = v;
+}
+
+/* A height as it is stored, 16-bit ones are scaled to 0 to 1 once the
+ * taps are summed.
+ */
+static ALWAYS_INLINE float fetch_height(const void *h, int x, int hfmt)
+{
+   if(hfmt == HEIGHTS_U16)
+      return((float)((const unsigned short *)h)[x]);
+   return(((const float *)h)[x]);
+}
+
+/* Heights of a source row into 'h'.  Always inlined with a constant
+ * format, so the 8-bit case compiles to the plain byte loop.
+ */
+static ALWAYS_INLINE void height_row(const convert_state *cs,
+                                     const unsigned char *s, void *h,
+                                     int format, int hfmt)
+{
+   const normalmap_params *p = cs->p;
+   const float *rgb_bias = cs->rgb_bias;
+   int x, pixel_size = cs->bpp * format_size[format];
+   float val, r, g, b;
+
+   for(x = 0; x < cs->width; ++x, s += pixel_size)
+   {
+      if(p->height_source)
+      {
+         store_height(h, x, hfmt, fetch_sample(s, 3, format) * oneover255);
+         continue;
+      }
+
+      r = fetch_sample(s, 0, format);
+      g = fetch_sample(s, 1, format);
+      b = fetch_sample(s, 2, format);
+
+      switch(p->conversion)
+      {
+         case CONVERT_NONE:
+            val = r * 0.3f + g * 0.59f + b * 0.11f;
+            break;
+         case CONVERT_BIASED_RGB:
+            val = (((float)max(0, r - rgb_bias[0])) * 0.3f ) +
+                  (((float)max(0, g - rgb_bias[1])) * 0.59f) +
+                  (((float)max(0, b - rgb_bias[2])) * 0.11f);
+            break;
+         case CONVERT_RED:
+            val = r;
+            break;
+         case CONVERT_GREEN:
+            val = g;
+            break;
+         case CONVERT_BLUE:
+            val = b;
+            break;
+         case CONVERT_MAX_RGB:
+            val = max(r, max(g, b));
+            break;
+         case CONVERT_MIN_RGB:
+            val = min(r, min(g, b));
+            break;
+         case CONVERT_COLORSPACE:
+            val = (1.0f - ((1.0f - (r / 255.0f)) *
+                           (1.0f - (g / 255.0f)) *
+                           (1.0f - (b / 255.0f)))) * 255.0f;
+            break;
+         default:
+            val = 255.0f;
+            break;
+      }
+
+      store_height(h, x, hfmt, val * oneover255);
+   }
+}
+
+/* Columns x0 to x1 - 1 of a row of output, 'd' and 's' point at the
+ * start of the row.  Inlined like height_row(), with constant formats for
+ * the 8-bit to 8-bit case.  'hrows[j]' is the row of heights in 'hfmt' j
+ * rows below this one, for j from -radius to radius, already clamped or
+ * wrapped at the top and bottom edges.
+ */
+static ALWAYS_INLINE void convert_row(const convert_state *cs,
+                                      unsigned char *d, int dst_format,
+                                      const unsigned char *s, int src_format,
+                                      int y, int x0, int x1,
+                                      const void *const *hrows, int hfmt)
+{
+   const normalmap_params *p = cs->p;
+   const kernel_element *kernel_du = cs->kernel_du;
+   const kernel_element *kernel_dv = cs->kernel_dv;
+   int width = cs->width, height = cs->height, bpp = cs->bpp;
+   int dudv = cs->dudv, num_elements = cs->num_elements;
+   int src_size = bpp * format_size[src_format];
+   int dst_size = bpp * format_size[dst_format];
+   int x, i;
+   float val, du, dv, n[3];
+   const float hscale = (hfmt == HEIGHTS_U16) ? 1.0f / 65535.0f : 1.0f;
+
+#define HEIGHT(x,y) \
+   fetch_height(hrows[(y)], max(0, min(width - 1, (x))), hfmt)
+#define HEIGHT_WRAP(x,y) \
+   fetch_height(hrows[(y)], \
+                (x) < 0 ? (width + (x)) : ((x) >= width ? ((x) - width) : (x)), \
+                hfmt)
+
+   s += x0 * src_size;
+   d += x0 * dst_size;
+   for(x = x0; x < x1; ++x, s += src_size, d += dst_size)
+   {
+      if(p->conversion == CONVERT_NORMALIZE_ONLY ||
+         p->conversion == CONVERT_HEIGHTMAP)
+      {
+         n[0] = ((fetch_sample(s, 0, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[1] = ((fetch_sample(s, 1, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[2] = ((fetch_sample(s, 2, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[0] *= p->scale;
+         n[1] *= p->scale;
+      }
+      else if(p->conversion == CONVERT_DUDV_TO_NORMAL)
+      {
+         n[0] = ((fetch_sample(s, 0, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[1] = ((fetch_sample(s, 1, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[2] = sqrtf(1.0f - (n[0] * n[0] - n[1] * n[1]));
+         n[0] *= p->scale;
+         n[1] *= p->scale;
+      }
+      else
+      {
+         du = 0; dv = 0;
+         if(!p->wrap)
+         {
+            for(i = 0; i < num_elements; ++i)
+               du += HEIGHT(x + kernel_du[i].x,
+                            kernel_du[i].y) * kernel_du[i].w;
+            for(i = 0; i < num_elements; ++i)
+               dv += HEIGHT(x + kernel_dv[i].x,
+                            kernel_dv[i].y) * kernel_dv[i].w;
+         }
+         else
+         {
+            for(i = 0; i < num_elements; ++i)
+               du += HEIGHT_WRAP(x + kernel_du[i].x,
+                                 kernel_du[i].y) * kernel_du[i].w;
+            for(i = 0; i < num_elements; ++i)
+               dv += HEIGHT_WRAP(x + kernel_dv[i].x,
+                                 kernel_dv[i].y) * kernel_dv[i].w;
+         }
+
+         n[0] = -du * hscale * p->scale;
+         n[1] = -dv * hscale * p->scale;
+         n[2] = 1.0f;
+      }
+
+      NORMALIZE(n);
+
+      if(n[2] < p->minz)
+      {
+         n[2] = p->minz;
+         NORMALIZE(n);
+      }
+
+      if(p->xinvert) n[0] = -n[0];
+      if(p->yinvert) n[1] = -n[1];
+      if(p->swapRGB)
+      {
+         val = n[0];
+         n[0] = n[2];
+         n[2] = val;
+      }
+
+      if(!dudv)
+      {
+         if(cs->encoding == ENCODE_XYZ)
+         {
+            store_normal(d, 0, dst_format, n[0]);
+            store_normal(d, 1, dst_format, n[1]);
+            store_normal(d, 2, dst_format, n[2]);
+         }
+         else
+         {
+            if(cs->encoding == ENCODE_OCTAHEDRAL)
+               oct_encode(n);
+            store_encoded(d, 0, dst_format, n[0]);
+            store_encoded(d, 1, dst_format, n[1]);
+            store_sample(d, 2, dst_format, 0.0f, 0);
+         }
+
+         if(bpp == 4)
+         {
+            val = fetch_height(hrows[0], x, hfmt) * hscale;
+            switch(p->alpha)
+            {
+               case ALPHA_NONE:
+                  copy_sample(d, dst_format, s, src_format, 3, 0); break;
+               case ALPHA_HEIGHT:
+                  store_sample(d, 3, dst_format, val, 0); break;
+               case ALPHA_INVERSE_HEIGHT:
+                  store_sample(d, 3, dst_format, val, 1); break;
+               case ALPHA_ZERO:
+                  store_sample(d, 3, dst_format, 0.0f, 0); break;
+               case ALPHA_ONE:
+                  store_sample(d, 3, dst_format, 1.0f, 0); break;
+               case ALPHA_INVERT:
+                  copy_sample(d, dst_format, s, src_format, 3, 1); break;
+               case ALPHA_MAP:
+                  if(p->alphamap)
+                  {
+                     i = sample_alpha_map(p->alphamap, x, y,
+                                          p->alphamap_width,
+                                          p->alphamap_height,
+                                          width, height);
+                     if(dst_format == NORMALMAP_U8)
+                        d[3] = (unsigned char)i;
+                     else
+                        store_sample(d, 3, dst_format, i / 255.0f, 0);
+                     break;
+                  }
+                  /* fall through */
+               default:
+                  copy_sample(d, dst_format, s, src_format, 3, 0); break;
+            }
+         }
+      }
+      else if(dst_format != NORMALMAP_U8)
+      {
+         if(dudv == DUDV_8BIT_UNSIGNED || dudv == DUDV_16BIT_UNSIGNED)
+         {
+            store_normal(d, 0, dst_format, n[0]);
+            store_normal(d, 1, dst_format, n[1]);
+         }
+         else if(dst_format == NORMALMAP_U16)
+         {
+            ((short *)d)[0] = (short)(n[0] * 32767.0f);
+            ((short *)d)[1] = (short)(n[1] * 32767.0f);
+         }
+         else
+         {
+            ((float *)d)[0] = n[0];
+            ((float *)d)[1] = n[1];
+         }
+         store_sample(d, 2, dst_format, 0.0f, 0);
+         if(bpp == 4) store_sample(d, 3, dst_format, 1.0f, 0);
+      }
+      else if(dudv == DUDV_8BIT_SIGNED || dudv == DUDV_8BIT_UNSIGNED)
+      {
+         if(dudv == DUDV_8BIT_UNSIGNED)
+         {
+            n[0] += 1.0f;
+            n[1] += 1.0f;
+         }
+         d[0] = (unsigned char)(n[0] * 127.5f);
+         d[1] = (unsigned char)(n[1] * 127.5f);
+         d[2] = 0;
+         if(bpp == 4) d[3] = 255;
+      }
+      else if(dudv == DUDV_16BIT_SIGNED || dudv == DUDV_16BIT_UNSIGNED)
+      {
+         unsigned short du16, dv16;
+
+         if(dudv == DUDV_16BIT_UNSIGNED)
+         {
+            n[0] += 1.0f;
+            n[1] += 1.0f;
+         }
+         /* little endian whatever the host, see normalmap_convert() */
+         du16 = (unsigned short)(int)(n[0] * 32767.5f);
+         dv16 = (unsigned short)(int)(n[1] * 32767.5f);
+         d[0] = du16 & 0xff;
+         d[1] = du16 >> 8;
+         d[2] = dv16 & 0xff;
+         d[3] = dv16 >> 8;
+      }
+   }
+
+#undef HEIGHT
+#undef HEIGHT_WRAP
+}
+
+/* 'h' is a row of heights in cs->height_format */
+static void height_row_any(const convert_state *cs, const unsigned char *s,
+                           void *h, int format)
+{
+   if(cs->height_format == HEIGHTS_U16)
+   {
+      if(format == NORMALMAP_U8)
+         height_row(cs, s, h, NORMALMAP_U8, HEIGHTS_U16);
+      else if(format == NORMALMAP_U16)
+         height_row(cs, s, h, NORMALMAP_U16, HEIGHTS_U16);
+      else
+         height_row(cs, s, h, NORMALMAP_F32, HEIGHTS_U16);
+   }
+   else if(format == NORMALMAP_U8)
+      height_row(cs, s, h, NORMALMAP_U8, HEIGHTS_FLOAT);
+   else if(format == NORMALMAP_U16)
+      height_row(cs, s, h, NORMALMAP_U16, HEIGHTS_FLOAT);
+   else
+      height_row(cs, s, h, NORMALMAP_F32, HEIGHTS_FLOAT);
+}
+
+static void convert_row_any(const convert_state *cs, unsigned char *d,
+                            int dst_format, const unsigned char *s,
+                            int src_format, int y, int x0, int x1,
+                            const void *const *hrows)
+{
+   int u8 = (src_format == NORMALMAP_U8 && dst_format == NORMALMAP_U8);
+
+   if(cs->height_format == HEIGHTS_U16)
+   {
+      if(u8)
+         convert_row(cs, d, NORMALMAP_U8, s, NORMALMAP_U8, y, x0, x1,
+                     hrows, HEIGHTS_U16);
+      else
+         convert_row(cs, d, dst_format, s, src_format, y, x0, x1,
+                     hrows, HEIGHTS_U16);
+   }
+   else if(u8)
+      convert_row(cs, d, NORMALMAP_U8, s, NORMALMAP_U8, y, x0, x1,
+                  hrows, HEIGHTS_FLOAT);
+   else
+      convert_row(cs, d, dst_format, s, src_format, y, x0, x1,
+                  hrows, HEIGHTS_FLOAT);
+}
+
+/* whether the normals come from heights rather than the source colors */
+static int uses_heights(const normalmap_params *p)
+{
+   return(p->conversion != CONVERT_NORMALIZE_ONLY &&
+          p->conversion != CONVERT_DUDV_TO_NORMAL &&
+          p->conversion != CONVERT_HEIGHTMAP);
+}
+
+/* Counts 'rows' rows of output in the statistics. */
+static void count_rows(const convert_state *cs, int src_format,
+                       int dst_format, int rows)
+{
+   const normalmap_params *p = cs->p;
+   long long n = (long long)cs->width * rows;
+
+   stats->pixels += n;
+   if(uses_heights(p))
+      stats->taps += n * 2 * cs->num_elements;
+   if(!cs->dudv && cs->bpp == 4 && p->alpha == ALPHA_MAP && p->alphamap)
+      stats->alphamap_samples += n;
+   stats->bytes_read += n * cs->bpp * format_size[src_format];
+   stats->bytes_written += n * cs->bpp * format_size[dst_format];
+}
+
+/* Row 'y' moved inside the image the way the edges are handled. */
+static int edge_row(int y, int height, int wrap)
+{
+   if(y >= 0 && y < height) return(y);
+   if(!wrap) return((y < 0) ? 0 : height - 1);
+   y %= height;
+   return((y < 0) ? y + height : y);
+}
+
+/* Columns and rows of the tiles the filter pass goes by, 0 for the
+   defaults.  Set once by the front ends before converting. */
+static int tiling_columns = 0;
+static int tiling_rows = 0;
+
+/* the width normalmap_tune_tiling() is timing on this thread, 0 when it
+   is not, so the trial runs leave the shared tiling alone */
+static __thread int trial_columns = 0;
+
+void normalmap_set_tiling(int columns, int rows)
+{
+   tiling_columns = max(0, columns);
+   tiling_rows = max(0, rows);
+}
+
+void normalmap_get_tiling(int *columns, int *rows)
+{
+   *columns = tiling_columns > 0 ? tiling_columns : DEFAULT_TILE_COLUMNS;
+   *rows = tiling_rows > 0 ? tiling_rows : DEFAULT_TILE_ROWS;
+}
+
+/* The tile for a conversion.  Kernels reaching a row or less above and
+   below keep their three rows in the cache anyway, they go a whole row at
+   a time. */
+static void get_tiling(const convert_state *cs, int radius, int *columns,
+                       int *rows)
+{
+   if(radius < 2)
+   {
+      *columns = cs->width;
+      *rows = 1;
+      return;
+   }
+   if(trial_columns > 0)
+   {
+      *columns = trial_columns;
+      *rows = DEFAULT_TILE_ROWS;
+      return;
+   }
+   normalmap_get_tiling(columns, rows);
+}
+
+/* Everything but the heights and bias, shared by the whole image and
+ * streaming conversions.  Returns the kernel radius in rows.
+ */
+static int setup_state(convert_state *cs, normalmap_params *params,
+                       const normalmap_params *p, int width, int height,
+                       int bpp, kernel_element *kernel_du,
+                       kernel_element *kernel_dv)
+{
+   int i, filter, dudv, encoding, radius = 0;
+
+   *params = *p;
+   filter = p->filter;
+   dudv = p->dudv;
+   encoding = p->encoding;
+
+   if(encoding < 0 || encoding >= MAX_ENCODING ||
+      p->conversion == CONVERT_HEIGHTMAP)
+      encoding = ENCODE_XYZ;
+   if(filter < 0 || filter >= MAX_FILTER_TYPE)
+      filter = FILTER_NONE;
+   if(bpp != 4) params->height_source = 0;
+   if(bpp != 4 && (dudv == DUDV_16BIT_SIGNED || dudv == DUDV_16BIT_UNSIGNED))
+      dudv = DUDV_NONE;
+
+   cs->p = params;
+   cs->width = width;
+   cs->height = height;
+   cs->bpp = bpp;
+   cs->dudv = dudv;
+   cs->encoding = encoding;
+   cs->height_format = HEIGHTS_FLOAT;
+   cs->rgb_bias = 0;
+   cs->num_elements = make_kernels(filter, kernel_du, kernel_dv);
+   cs->kernel_du = kernel_du;
+   cs->kernel_dv = kernel_dv;
+
+   if(uses_heights(p))
+   {
+      for(i = 0; i < cs->num_elements; ++i)
+      {
+         radius = max(radius, abs(kernel_du[i].y));
+         radius = max(radius, abs(kernel_dv[i].y));
+      }
+   }
+
+   return(radius);
+}
+
+int normalmap_convert_format(unsigned char *dst, int dst_stride,
+                             int dst_format,
+                             const unsigned char *src, int src_stride,
+                             int src_format,
+                             int width, int height, int bpp,
+                             const normalmap_params *p, float *heights,
+                             normalmap_progress_func progress, void *data)
+{
+   int y, y0, y1, x0, x1, j, radius, ret, tile_columns, tile_rows;
+   normalmap_params params;
+   void *own_heights = 0;
+   unsigned char *hbuf;
+   size_t hrow;
+   arena *a = scratch;
+   size_t scratch_start = scratch_mark(a);
+   double t0 = 0;
+   stage_mark mark;
+   float rgb_bias[3];
+   const void *rows[2 * MAX_KERNEL_RADIUS + 1];
+   kernel_element kernel_du[MAX_KERNEL_ELEMENTS];
+   kernel_element kernel_dv[MAX_KERNEL_ELEMENTS];
+   convert_state cs;
+
+   if(src_format < 0 || src_format >= MAX_NORMALMAP_FORMAT ||
+      dst_format < 0 || dst_format >= MAX_NORMALMAP_FORMAT)
+      return(-1);
+
+   /* in place, each pixel of output only reads the one it replaces */
+   if(dst == src && (dst_stride != src_stride || dst_format != src_format))
+      return(-1);
+
+   radius = setup_state(&cs, &params, p, width, height, bpp,
+                        kernel_du, kernel_dv);
+
+   if(stats)
+   {
+      stage_start(&mark);
+      t0 = mark.ms;
+      ++stats->conversions;
+      count_rows(&cs, src_format, dst_format, height);
+   }
+
+   /* without heights alpha from heights reads one zeroed row, the way a
+      stream has it */
+   if(!uses_heights(p))
+   {
+      own_heights = scratch_alloc(a, (size_t)width * sizeof(float));
+      if(own_heights == 0)
+         return(-1);
+      memset(own_heights, 0, (size_t)width * sizeof(float));
+   }
+   else if(heights == 0)
+   {
+      /* nobody sees these, they can be kept at 16 bits */
+      if(p->height_format == HEIGHTS_U16)
+         cs.height_format = HEIGHTS_U16;
+      own_heights = scratch_alloc(a, (size_t)width * height *
+                                  (cs.height_format == HEIGHTS_U16 ?
+                                   sizeof(unsigned short) : sizeof(float)));
+      if(own_heights == 0)
+         return(-1);
+   }
+   hbuf = heights ? (unsigned char *)heights : own_heights;
+   hrow = (size_t)width * (cs.height_format == HEIGHTS_U16 ?
+                           sizeof(unsigned short) : sizeof(float));
+
+   if(p->conversion == CONVERT_BIASED_RGB)
+   {
+      if(average_color(rgb_bias, src, src_stride, src_format, width, height,
+                       bpp) != 0)
+      {
+         scratch_free(a, own_heights);
+         scratch_release(a, scratch_start);
+         return(-1);
+      }
+      if(stats)
+         stage_end(&mark, &stats->bias_ms, &stats->bias_counters);
+   }
+   else
+   {
+      rgb_bias[0] = 0;
+      rgb_bias[1] = 0;
+      rgb_bias[2] = 0;
+   }
+   cs.rgb_bias = rgb_bias;
+
+   if(uses_heights(p))
+   {
+      for(y = 0; y < height; ++y)
+         height_row_any(&cs, src + (size_t)y * src_stride,
+                        hbuf + (size_t)y * hrow,
+                        src_format);
+      if(stats)
+         stage_end(&mark, &stats->heights_ms, &stats->heights_counters);
+   }
+
+   /* A band of tile_rows rows at a time, tile_columns wide, so the rows of
+      heights the kernel spans stay in the cache down the band however wide
+      the image is.  Only the filters reach far enough above and below for
+      it to matter. */
+   get_tiling(&cs, radius, &tile_columns, &tile_rows);
+
+   ret = 0;
+   for(y0 = 0; y0 < height && ret == 0; y0 = y1)
+   {
+      y1 = min(height, y0 + tile_rows);
+
+      for(x0 = 0; x0 < width; x0 = x1)
+      {
+         x1 = min(width, x0 + tile_columns);
+
+         for(y = y0; y < y1; ++y)
+         {
+            if(uses_heights(p))
+            {
+               for(j = -radius; j <= radius; ++j)
+                  rows[MAX_KERNEL_RADIUS + j] = hbuf + hrow *
+                     edge_row(y + j, height, p->wrap);
+            }
+            else
+               rows[MAX_KERNEL_RADIUS] = own_heights;
+
+            convert_row_any(&cs, dst + (size_t)y * dst_stride, dst_format,
+                            src + (size_t)y * src_stride, src_format, y,
+                            x0, x1, rows + MAX_KERNEL_RADIUS);
+         }
+      }
+
+      if(progress)
+      {
+         if(stats)
+         {
+            stage_end(&mark, &stats->convert_ms, &stats->convert_counters);
+            ret = progress((float)y1 / (float)height, data);
+            stage_end(&mark, &stats->progress_ms, 0);
+         }
+         else
+            ret = progress((float)y1 / (float)height, data);
+         if(ret)
+            ret = 1;
+      }
+   }
+
+   scratch_free(a, own_heights);
+   scratch_release(a, scratch_start);
+
+   if(stats)
+      stage_end(&mark, &stats->convert_ms, &stats->convert_counters);
+
+   if(ret == 0 && p->conversion == CONVERT_HEIGHTMAP)
+   {
+      if(make_heightmap(dst, dst_stride, dst_format, width, height, bpp,
+                        p->contrast) != 0)
+         ret = -1;
+      if(stats)
+         stage_end(&mark, &stats->heightmap_ms, &stats->heightmap_counters);
+   }
+
+   if(stats)
+      stats->total_ms += mark.ms - t0;
+
+   return(ret);
+}
+
+struct normalmap_stream
+{
+   convert_state cs;
+   normalmap_params params;
+   kernel_element kernel_du[MAX_KERNEL_ELEMENTS];
+   kernel_element kernel_dv[MAX_KERNEL_ELEMENTS];
+   float rgb_bias[3];
+   int src_format, dst_format, radius;
+   int rows_in, rows_out, primed;
+   size_t src_size;
+   float *ring;           /* heights of the last 2 * radius + 1 rows */
+   float *top;            /* the first radius rows, wrapped to at the end */
+   float *bottom;         /* the last radius rows, from the priming */
+   unsigned char *src_ring;  /* the last radius + 1 source rows */
+};
+
+int normalmap_stream_supported(const normalmap_params *p)
+{
+   return(p->conversion != CONVERT_BIASED_RGB &&
+          p->conversion != CONVERT_HEIGHTMAP);
+}
+
+normalmap_stream *normalmap_stream_new(int width, int height, int bpp,
+                                       int src_format, int dst_format,
+                                       const normalmap_params *p)
+{
+   normalmap_stream *s;
+   int r;
+
+   if(!normalmap_stream_supported(p) ||
+      src_format < 0 || src_format >= MAX_NORMALMAP_FORMAT ||
+      dst_format < 0 || dst_format >= MAX_NORMALMAP_FORMAT)
+      return(0);
+
+   s = stats_calloc(1, sizeof(normalmap_stream));
+   if(s == 0) return(0);
+
+   r = s->radius = setup_state(&s->cs, &s->params, p, width, height, bpp,
+                               s->kernel_du, s->kernel_dv);
+   s->cs.rgb_bias = s->rgb_bias;
+   s->src_format = src_format;
+   s->dst_format = dst_format;
+   s->src_size = (size_t)width * bpp * format_size[src_format];
+
+   /* zeroed, alpha from heights reads 0 where there are none */
+   s->ring = stats_calloc((size_t)(2 * r + 1) * width, sizeof(float));
+   s->top = stats_calloc((size_t)(r + 1) * width, sizeof(float));
+   s->bottom = stats_calloc((size_t)(r + 1) * width, sizeof(float));
+   s->src_ring = stats_malloc((r + 1) * s->src_size);
+   if(s->ring == 0 || s->top == 0 || s->bottom == 0 || s->src_ring == 0)
+   {
+      normalmap_stream_free(s);
+      return(0);
+   }
+
+   if(stats) ++stats->conversions;
+
+   return(s);
+}
+
+int normalmap_stream_radius(const normalmap_stream *s)
+{
+   return(s->radius);
+}
+
+int normalmap_stream_prime(normalmap_stream *s, const unsigned char *src)
+{
+   stage_mark mark;
+
+   if(s->primed >= s->radius) return(-1);
+
+   if(stats) stage_start(&mark);
+
+   height_row_any(&s->cs, src, s->bottom + (size_t)s->primed * s->cs.width,
+                  s->src_format);
+   ++s->primed;
+
+   if(stats)
+      stats->total_ms += stage_end(&mark, &stats->heights_ms,
+                                   &stats->heights_counters);
+
+   return(0);
+}
+
+/* heights of row 'y', which has been pushed or primed */
+static const float *stream_heights(const normalmap_stream *s, int y)
+{
+   int n = 2 * s->radius + 1, height = s->cs.height;
+
+   y = edge_row(y, height, s->params.wrap);
+
+   if(y >= s->rows_in - n && y < s->rows_in)
+      return(s->ring + (size_t)(y % n) * s->cs.width);
+   if(y < s->radius)
+      return(s->top + (size_t)y * s->cs.width);
+   return(s->bottom + (size_t)(y - (height - s->radius)) * s->cs.width);
+}
+
+static void stream_row(normalmap_stream *s, unsigned char *dst)
+{
+   const void *rows[2 * MAX_KERNEL_RADIUS + 1];
+   int j, y = s->rows_out++;
+   stage_mark mark;
+
+   if(stats) stage_start(&mark);
+
+   for(j = -s->radius; j <= s->radius; ++j)
+      rows[MAX_KERNEL_RADIUS + j] = stream_heights(s, y + j);
+
+   convert_row_any(&s->cs, dst, s->dst_format,
+                   s->src_ring + (y % (s->radius + 1)) * s->src_size,
+                   s->src_format, y, 0, s->cs.width,
+                   rows + MAX_KERNEL_RADIUS);
+
+   if(stats)
+   {
+      stats->total_ms += stage_end(&mark, &stats->convert_ms,
+                                   &stats->convert_counters);
+      count_rows(&s->cs, s->src_format, s->dst_format, 1);
+   }
+}
+
+int normalmap_stream_push(normalmap_stream *s, const unsigned char *src,
+                          unsigned char *dst)
+{
+   int y = s->rows_in, n = 2 * s->radius + 1;
+   float *h;
+   stage_mark mark;
+
+   if(y >= s->cs.height ||
+      (s->params.wrap && s->primed < min(s->radius, s->cs.height)))
+      return(-1);
+
+   memcpy(s->src_ring + (y % (s->radius + 1)) * s->src_size, src,
+          s->src_size);
+
+   if(uses_heights(&s->params))
+   {
+      if(stats) stage_start(&mark);
+      h = s->ring + (size_t)(y % n) * s->cs.width;
+      height_row_any(&s->cs, src, h, s->src_format);
+      if(y < s->radius)
+         memcpy(s->top + (size_t)y * s->cs.width, h,
+                s->cs.width * sizeof(float));
+      if(stats)
+         stats->total_ms += stage_end(&mark, &stats->heights_ms,
+                                      &stats->heights_counters);
+   }
+
+   ++s->rows_in;
+
+   if(y - s->radius < 0) return(0);
+
+   stream_row(s, dst);
+
+   return(1);
+}
+
+int normalmap_stream_flush(normalmap_stream *s, unsigned char *dst)
+{
+   if(s->rows_in < s->cs.height || s->rows_out >= s->cs.height)
+      return(0);
+
+   stream_row(s, dst);
+
+   return(1);
+}
+
+void normalmap_stream_free(normalmap_stream *s)
+{
+   if(s == 0) return;
+
+   free(s->ring);
+   free(s->top);
+   free(s->bottom);
+   free(s->src_ring);
+   free(s);
+}
+
+void normalmap_decode(unsigned char *pixels, int stride, int width,
+                      int height, int bpp, int encoding)
+{
+   unsigned char *d;
+   int x, y;
+   float n[3], t;
+
+   if(encoding != ENCODE_XY && encoding != ENCODE_OCTAHEDRAL)
+      return;
+
+   for(y = 0; y < height; ++y)
+   {
+      d = pixels + (size_t)y * stride;
+      for(x = 0; x < width; ++x, d += bpp)
+      {
+         n[0] = d[0] * (2.0f / 255.0f) - 1.0f;
+         n[1] = d[1] * (2.0f / 255.0f) - 1.0f;
+         if(encoding == ENCODE_XY)
+            n[2] = sqrtf(max(0.0f, 1.0f - n[0] * n[0] - n[1] * n[1]));
+         else
+         {
+            n[2] = 1.0f - fabsf(n[0]) - fabsf(n[1]);
+            if(n[2] < 0)
+            {
+               t = (1.0f - fabsf(n[1])) * (n[0] >= 0 ? 1.0f : -1.0f);
+               n[1] = (1.0f - fabsf(n[0])) * (n[1] >= 0 ? 1.0f : -1.0f);
+               n[0] = t;
+            }
+            NORMALIZE(n);
+         }
+         d[0] = (unsigned char)((n[0] + 1.0f) * 127.5f);
+         d[1] = (unsigned char)((n[1] + 1.0f) * 127.5f);
+         d[2] = (unsigned char)((n[2] + 1.0f) * 127.5f);
+      }
+   }
+}
+
+int normalmap_convert(unsigned char *dst, int dst_stride,
+                      const unsigned char *src, int src_stride,
+                      int width, int height, int bpp,
+                      const normalmap_params *p, float *heights,
+                      normalmap_progress_func progress, void *data)
+{
+   return(normalmap_convert_format(dst, dst_stride, NORMALMAP_U8,
+                                   src, src_stride, NORMALMAP_U8,
+                                   width, height, bpp, p, heights,
+                                   progress, data));
+}
+
+int normalmap_filter_radius(int filter)
+{
+   kernel_element kernel_du[MAX_KERNEL_ELEMENTS];
+   kernel_element kernel_dv[MAX_KERNEL_ELEMENTS];
+   int i, n, radius = 0;
+
+   if(filter < 0 || filter >= MAX_FILTER_TYPE)
+      filter = FILTER_NONE;
+
+   n = make_kernels(filter, kernel_du, kernel_dv);
+   for(i = 0; i < n; ++i)
+   {
+      radius = max(radius, abs(kernel_du[i].y));
+      radius = max(radius, abs(kernel_dv[i].y));
+   }
+
+   return(radius);
+}
+
+int normalmap_load_tiling(const char *fn)
+{
+   FILE *f;
+   int columns, rows, n;
+
+   f = fopen(fn, "r");
+   if(f == 0) return(-1);
+   n = fscanf(f, "columns %d rows %d", &columns, &rows);
+   fclose(f);
+
+   if(n != 2 || columns <= 0 || rows <= 0)
+      return(-1);
+
+   normalmap_set_tiling(columns, rows);
+   return(0);
+}
+
+int normalmap_save_tiling(const char *fn)
+{
+   char tmp[4096];
+   FILE *f;
+   int columns, rows, ret;
+
+   /* renamed into place, a process starting meanwhile finds the old file
+      or none, never half of one */
+   snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+   f = fopen(tmp, "w");
+   if(f == 0) return(-1);
+
+   normalmap_get_tiling(&columns, &rows);
+   ret = (fprintf(f, "columns %d\nrows %d\n", columns, rows) < 0) ? -1 : 0;
+   if(fclose(f) != 0) ret = -1;
+   if(ret == 0 && rename(tmp, fn) != 0) ret = -1;
+   if(ret != 0) remove(tmp);
+
+   return(ret);
+}
+
+#define TUNE_WIDTH  16384
+#define TUNE_HEIGHT 16
+#define TUNE_PASSES 3
+
+int normalmap_tune_tiling(int *columns, int *rows)
+{
+   static const int candidates[] =
+   {
+      256, 512, 1024, 2048, 4096, TUNE_WIDTH
+   };
+   const int num = (int)(sizeof(candidates) / sizeof(candidates[0]));
+   size_t size = (size_t)TUNE_WIDTH * TUNE_HEIGHT * 3;
+   unsigned char *src, *dst;
+   normalmap_stats *collecting = stats;
+   normalmap_params p;
+   double best[sizeof(candidates) / sizeof(candidates[0])], t;
+   unsigned int seed = 1;
+   size_t i;
+   int pass, k, pick = 0, ret = 0;
+
+   src = malloc(size);
+   dst = malloc(size);
+   if(src == 0 || dst == 0)
+   {
+      free(src);
+      free(dst);
+      return(-1);
+   }
+
+   for(i = 0; i < size; ++i)
+   {
+      seed = seed * 1103515245 + 12345;
+      src[i] = (unsigned char)(seed >> 16);
+   }
+
+   normalmap_default_params(&p);
+   p.filter = FILTER_9x9;
+
+   /* the trial runs are not the caller's conversions */
+   stats = 0;
+
+   /* the candidates take turns, so a slow patch of the machine's time
+      is spread over all of them, and each keeps its fastest run */
+   for(k = 0; k < num; ++k)
+      best[k] = -1;
+   for(pass = 0; pass < TUNE_PASSES && ret == 0; ++pass)
+   {
+      for(k = 0; k < num && ret == 0; ++k)
+      {
+         trial_columns = candidates[k];
+         t = stats_ms();
+         ret = normalmap_convert(dst, TUNE_WIDTH * 3, src, TUNE_WIDTH * 3,
+                                 TUNE_WIDTH, TUNE_HEIGHT, 3, &p, 0, 0, 0);
+         t = stats_ms() - t;
+         if(best[k] < 0 || t < best[k])
+            best[k] = t;
+      }
+   }
+
+   stats = collecting;
+   trial_columns = 0;
+   free(src);
+   free(dst);
+
+   for(k = 1; k < num; ++k)
+   {
+      if(best[k] < best[pick])
+         pick = k;
+   }
+
+   /* the band height only trades the kernel's rows above and below each
+      band, read twice, against how often progress is reported, the cache
+      has no say in it */
+   normalmap_set_tiling(ret == 0 ? candidates[pick] : 0, 0);
+   normalmap_get_tiling(columns, rows);
+
+   return(ret == 0 ? 0 : -1);
+}
@@ -0,0 +1,325 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __LIBNORMALMAP_H
+#define __LIBNORMALMAP_H
+
+#include "arena.h"
+
+/* The normal map conversion itself, with no dependency on GIMP, GTK or
+ * glib.  The plugin is a front end to this, other tools can link
+ * libnormalmap.a to run the same conversion on plain pixel buffers.
+ */
+
+enum FILTER_TYPE
+{
+   FILTER_NONE = 0, FILTER_SOBEL_3x3, FILTER_SOBEL_5x5, FILTER_PREWITT_3x3,
+   FILTER_PREWITT_5x5, FILTER_3x3, FILTER_5x5, FILTER_7x7, FILTER_9x9,
+   MAX_FILTER_TYPE
+};
+
+enum ALPHA_TYPE
+{
+   ALPHA_NONE = 0, ALPHA_HEIGHT, ALPHA_INVERSE_HEIGHT, ALPHA_ZERO, ALPHA_ONE,
+   ALPHA_INVERT, ALPHA_MAP, MAX_ALPHA_TYPE
+};
+
+enum CONVERSION_TYPE
+{
+   CONVERT_NONE = 0, CONVERT_BIASED_RGB, CONVERT_RED, CONVERT_GREEN,
+   CONVERT_BLUE, CONVERT_MAX_RGB, CONVERT_MIN_RGB, CONVERT_COLORSPACE,
+   CONVERT_NORMALIZE_ONLY, CONVERT_DUDV_TO_NORMAL, CONVERT_HEIGHTMAP,
+   MAX_CONVERSION_TYPE
+};
+
+enum DUDV_TYPE
+{
+   DUDV_NONE, DUDV_8BIT_SIGNED, DUDV_8BIT_UNSIGNED, DUDV_16BIT_SIGNED,
+   DUDV_16BIT_UNSIGNED,
+   MAX_DUDV_TYPE
+};
+
+/* How normals are written.  ENCODE_XY keeps x and y and leaves z to be
+ * rebuilt as sqrt(1 - x*x - y*y), ENCODE_OCTAHEDRAL maps the unit sphere
+ * onto a square and stores its two coordinates.  Both leave the third
+ * channel 0, the two channels have the precision of the destination.
+ */
+enum NORMAL_ENCODING
+{
+   ENCODE_XYZ = 0, ENCODE_XY, ENCODE_OCTAHEDRAL,
+   MAX_ENCODING
+};
+
+/* How the heights the normals are computed from are kept.  HEIGHTS_U16
+ * stores them as 16-bit fixed point, half the memory and bandwidth of
+ * floats in the filter taps.  8 and 16-bit levels are held exactly, other
+ * heights to within 1/131070.  Heights handed back to the caller, and the
+ * few rows a stream keeps, are floats either way.
+ */
+enum HEIGHT_FORMAT
+{
+   HEIGHTS_FLOAT = 0, HEIGHTS_U16,
+   MAX_HEIGHT_FORMAT
+};
+
+/* Sample formats of the pixel buffers.  U16 samples are native endian,
+ * F32 samples are 0 to 1 and clamped to it on input.
+ */
+enum NORMALMAP_FORMAT
+{
+   NORMALMAP_U8 = 0, NORMALMAP_U16, NORMALMAP_F32,
+   MAX_NORMALMAP_FORMAT
+};
+
+typedef struct
+{
+   int filter;
+   float minz;
+   float scale;
+   int wrap;
+   int height_source;
+   int alpha;
+   int conversion;
+   int dudv;
+   int xinvert;
+   int yinvert;
+   int swapRGB;
+   float contrast;
+   int encoding;
+   int height_format;
+   /* single channel image for ALPHA_MAP, resampled to the output size */
+   const unsigned char *alphamap;
+   int alphamap_width;
+   int alphamap_height;
+} normalmap_params;
+
+/* Called after every row with the fraction of the image done.  Returning
+ * non-zero cancels the conversion.
+ */
+typedef int (*normalmap_progress_func)(float progress, void *data);
+
+void normalmap_default_params(normalmap_params *p);
+
+/* Converts a width x height RGB (bpp 3) or RGBA (bpp 4) image.  Rows of src
+ * and dst are 'src_stride' and 'dst_stride' bytes apart.  dst may be src
+ * itself, with the same stride, to convert in place without a second copy
+ * of the image.  Otherwise it must not overlap src.  Parameters that do
+ * not apply to the image (height from alpha or 16-bit DU/DV without an
+ * alpha channel, an unknown filter) are ignored the same way the plugin
+ * always has.
+ *
+ * A 16-bit DU/DV map has nowhere to go in an 8-bit image, so du and dv are
+ * packed as little endian 16-bit values, du in red and green and dv in
+ * blue and alpha.  normalmap_convert_format() with a U16 or F32
+ * destination writes them as samples of their own instead.
+ *
+ * When 'heights' is non-NULL it receives the width * height heights in
+ * 0 to 1 the normals were computed from.  It is left untouched for the
+ * conversions that do not derive normals from heights, which need no
+ * heights of their own either, and alpha from heights is 0 for them.
+ *
+ * 'progress' may be NULL.  Returns 0 on success, -1 if memory could not be
+ * allocated and 1 if the conversion was cancelled.
+ */
+int normalmap_convert(unsigned char *dst, int dst_stride,
+                      const unsigned char *src, int src_stride,
+                      int width, int height, int bpp,
+                      const normalmap_params *p, float *heights,
+                      normalmap_progress_func progress, void *data);
+
+/* normalmap_convert() for sources and destinations with wider samples.
+ * 'bpp' is still the number of channels, strides are in bytes.  Heights
+ * are taken from the source at its full precision, and the results are
+ * quantized only once, to 'dst_format'.  Converting in place needs the
+ * two formats to be the same.
+ *
+ * A DU/DV map in a U16 or F32 destination has du and dv in the first two
+ * channels at that precision, as two's complement or -1 to 1 floats for
+ * the signed types and biased to the unsigned range for the others.  The
+ * 8 and 16-bit DU/DV types only differ for U8 destinations.
+ *
+ * The normal encoding is ignored for DU/DV maps and height maps.  Written
+ * to a U16 destination, ENCODE_OCTAHEDRAL gives 2 x 16-bit normals.
+ */
+int normalmap_convert_format(unsigned char *dst, int dst_stride,
+                             int dst_format,
+                             const unsigned char *src, int src_stride,
+                             int src_format,
+                             int width, int height, int bpp,
+                             const normalmap_params *p, float *heights,
+                             normalmap_progress_func progress, void *data);
+
+/* Rows above and below a pixel 'filter' reads heights from. */
+int normalmap_filter_radius(int filter);
+
+/* The filter pass of normalmap_convert() goes over the image in tiles of
+ * 'columns' by 'rows' when the filter radius is 2 or more, so the rows of
+ * heights the kernel spans stay in the cache however wide the image is.
+ * 0 picks the default.  Set it before converting, it is shared by every
+ * thread.  Streams go a whole row at a time.
+ */
+void normalmap_set_tiling(int columns, int rows);
+void normalmap_get_tiling(int *columns, int *rows);
+
+/* Times the filter pass at a few tile widths on a wide synthetic image, a
+ * second or so, and sets the fastest.  The trial runs do not change the
+ * tiling other threads convert with, only the result is set.  Returns 0,
+ * or -1 if memory could not be allocated.  The front ends run it once per
+ * machine and keep the result with normalmap_save_tiling(), a two line
+ * text file read back by normalmap_load_tiling().  Both return 0 on
+ * success and -1 on failure, loading leaves the tiling alone if the file
+ * is missing or malformed.
+ */
+int normalmap_tune_tiling(int *columns, int *rows);
+int normalmap_load_tiling(const char *fn);
+int normalmap_save_tiling(const char *fn);
+
+/* Row by row conversion, for images that are decoded and encoded as they
+ * go and never held whole.  Only the rows the filter kernel spans are
+ * kept.  The biased RGB and height map conversions need the whole image
+ * and cannot be streamed.
+ */
+typedef struct normalmap_stream normalmap_stream;
+
+int normalmap_stream_supported(const normalmap_params *p);
+
+/* Returns NULL if the parameters cannot be streamed or memory could not be
+ * allocated.  The parameters, alpha map included, must stay valid until
+ * the stream is freed.
+ */
+normalmap_stream *normalmap_stream_new(int width, int height, int bpp,
+                                       int src_format, int dst_format,
+                                       const normalmap_params *p);
+
+/* Rows of the source a row of output depends on, above and below it.
+ * Output lags that many rows behind the source.
+ */
+int normalmap_stream_radius(const normalmap_stream *s);
+
+/* With wrap set the top rows depend on the bottom ones, the last
+ * min(radius, height) source rows have to be primed, in order, before the
+ * first is pushed.
+ */
+int normalmap_stream_prime(normalmap_stream *s, const unsigned char *src);
+
+/* Takes the next source row.  Returns 1 if the next row of output was
+ * written to 'dst', 0 if it still needs more source rows and -1 if the
+ * stream was not primed or has all its rows.
+ */
+int normalmap_stream_push(normalmap_stream *s, const unsigned char *src,
+                          unsigned char *dst);
+
+/* Once every source row has been pushed, writes the rows of output left
+ * over one at a time.  Returns 1 for a row, 0 when there are none left.
+ */
+int normalmap_stream_flush(normalmap_stream *s, unsigned char *dst);
+
+void normalmap_stream_free(normalmap_stream *s);
+
+/* Hardware counts of a stage of the conversions, see normalmap_profile(). */
+typedef struct
+{
+   long long cycles;
+   long long instructions;
+   long long cache_misses;
+   long long branch_misses;
+} normalmap_counters;
+
+/* Where the conversions spend their time and how much work they do, for
+ * finding out why a bake is slow.  Times are in milliseconds.
+ */
+typedef struct
+{
+   double total_ms;
+   double bias_ms;          /* average color for CONVERT_BIASED_RGB */
+   double heights_ms;       /* heights from the source */
+   double convert_ms;       /* kernels, alpha and writing the rows */
+   double heightmap_ms;     /* integrating normals for CONVERT_HEIGHTMAP */
+   double progress_ms;      /* spent in the progress callback */
+   long long conversions;
+   long long pixels;
+   long long taps;          /* heights read by the filter kernels */
+   long long alphamap_samples;
+   long long bytes_read;
+   long long bytes_written;
+   long long allocations;
+   long long allocated_bytes;
+   /* with normalmap_profile(), NORMALMAP_COUNTED_ bits of the counters
+      that were read, the rest stay 0 */
+   int counted;
+   normalmap_counters bias_counters;
+   normalmap_counters heights_counters;
+   normalmap_counters convert_counters;
+   normalmap_counters heightmap_counters;
+} normalmap_stats;
+
+#define NORMALMAP_COUNTED_CYCLES        1
+#define NORMALMAP_COUNTED_INSTRUCTIONS  2
+#define NORMALMAP_COUNTED_CACHE_MISSES  4
+#define NORMALMAP_COUNTED_BRANCH_MISSES 8
+
+/* Adds the statistics of the conversions and streams run on the calling
+ * thread to 'stats' from now on, until called again with NULL.  Without
+ * it nothing is measured.
+ */
+void normalmap_collect_stats(normalmap_stats *stats);
+
+/* Adds hardware counters, cycles, instructions, cache and branch misses,
+ * to the statistics collected on the calling thread, per stage, until
+ * called again with 'enable' 0.  They cost a system call at every stage
+ * boundary, for the streams two a row.  Only Linux has them, through
+ * perf_event_open(), and not where the processor's counters are hidden,
+ * as in most containers and virtual machines.  Returns 0, or -1 with the
+ * reason in 'err' when none can be read, the statistics then go on
+ * without them.
+ */
+int normalmap_profile(int enable, char *err, int errlen);
+
+/* Takes the buffers the conversions need while they run, the heights
+ * when the caller has none for them, the height map integration and the
+ * average color, from 'a' on the calling thread from now on, until called
+ * again with NULL.  They are given back to it before the conversions
+ * return.  Streams keep to malloc(), they outlive the call.  Returns the
+ * arena set before, for callers that may run inside another conversion
+ * to put back when they are done.
+ */
+arena *normalmap_scratch_arena(arena *a);
+
+/* Adds the statistics in 'stats' to 'sum'. */
+void normalmap_stats_add(normalmap_stats *sum, const normalmap_stats *stats);
+
+/* Writes the members of 'stats' as JSON, without the braces, so a caller
+ * can add its own.  With counters, a "counters" object holds them per
+ * stage, with instructions per cycle and misses per thousand
+ * instructions.  Returns what snprintf() returns.
+ */
+int normalmap_stats_json(const normalmap_stats *stats, char *buf, int len);
+
+/* Rewrites the normals of an 8-bit image written with 'encoding' as
+ * plain biased x, y and z, for display.  Alpha is left alone.
+ */
+void normalmap_decode(unsigned char *pixels, int stride, int width,
+                      int height, int bpp, int encoding);
+
+/* Bytes per sample of a NORMALMAP_FORMAT. */
+int normalmap_format_size(int format);
+
+#endif
@@ -0,0 +1,366 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "meshopt.h"
+
+/* Tom Forsyth, "Linear-Speed Vertex Cache Optimisation" */
+#define CACHE_SIZE        32
+#define CACHE_DECAY_POWER 1.5f
+#define LAST_TRI_SCORE    0.75f
+#define VALENCE_SCALE     2.0f
+#define VALENCE_POWER     0.5f
+
+float mesh_acmr(const unsigned short *indices, unsigned int num_indices,
+                unsigned int num_verts, int cache_size)
+{
+   int *stamp;
+   unsigned int i, misses = 0, time = 0;
+
+   if(num_indices < 3) return(0);
+
+   stamp = malloc(num_verts * sizeof(int));
+   if(stamp == 0) return(0);
+
+   /* a vertex is in a FIFO cache if it was pushed less than cache_size
+      misses ago */
+   for(i = 0; i < num_verts; ++i)
+      stamp[i] = -cache_size - 1;
+
+   for(i = 0; i < num_indices; ++i)
+   {
+      if((int)time - stamp[indices[i]] > cache_size)
+      {
+         stamp[indices[i]] = time++;
+         ++misses;
+      }
+   }
+
+   free(stamp);
+
+   return((float)misses / (float)(num_indices / 3));
+}
+
+static float vertex_score(int cache_pos, int remaining)
+{
+   float score = 0;
+
+   if(remaining == 0) return(-1.0f);
+
+   if(cache_pos >= 0)
+   {
+      if(cache_pos < 3)
+         score = LAST_TRI_SCORE;
+      else
+      {
+         score = 1.0f - (float)(cache_pos - 3) / (float)(CACHE_SIZE - 3);
+         score = powf(score, CACHE_DECAY_POWER);
+      }
+   }
+
+   score += VALENCE_SCALE * powf((float)remaining, -VALENCE_POWER);
+
+   return(score);
+}
+
+void mesh_optimize_vertex_cache(unsigned short *indices,
+                                unsigned int num_indices,
+                                unsigned int num_verts)
+{
+   unsigned int num_tris = num_indices / 3;
+   unsigned int i, j, k, n, v, t, emitted;
+   unsigned int *offsets, *remaining, *adj, *out;
+   int *cache_pos;
+   unsigned char *added;
+   float *vscore, *tscore, best;
+   int cache[CACHE_SIZE + 3], new_cache[CACHE_SIZE + 3];
+   int cache_used = 0, new_used, best_idx, scan = 0;
+
+   if(num_tris < 2) return;
+
+   offsets = calloc(num_verts + 1, sizeof(unsigned int));
+   remaining = calloc(num_verts, sizeof(unsigned int));
+   adj = malloc(num_indices * sizeof(unsigned int));
+   out = malloc(num_indices * sizeof(unsigned int));
+   cache_pos = malloc(num_verts * sizeof(int));
+   vscore = malloc(num_verts * sizeof(float));
+   tscore = malloc(num_tris * sizeof(float));
+   added = calloc(num_tris, 1);
+
+   if(!offsets || !remaining || !adj || !out || !cache_pos || !vscore ||
+      !tscore || !added)
+      goto done;
+
+   /* triangle adjacency per vertex */
+   for(i = 0; i < num_indices; ++i)
+      ++remaining[indices[i]];
+   for(i = 0; i < num_verts; ++i)
+      offsets[i + 1] = offsets[i] + remaining[i];
+   memset(remaining, 0, num_verts * sizeof(unsigned int));
+   for(i = 0; i < num_indices; ++i)
+   {
+      v = indices[i];
+      adj[offsets[v] + remaining[v]++] = i / 3;
+   }
+
+   for(i = 0; i < num_verts; ++i)
+   {
+      cache_pos[i] = -1;
+      vscore[i] = vertex_score(-1, remaining[i]);
+   }
+   for(i = 0; i < num_tris; ++i)
+   {
+      tscore[i] = vscore[indices[3 * i + 0]] +
+                  vscore[indices[3 * i + 1]] +
+                  vscore[indices[3 * i + 2]];
+   }
+
+   best_idx = -1;
+   emitted = 0;
+
+   while(emitted < num_tris)
+   {
+      if(best_idx < 0)
+      {
+         /* nothing in the cache is usable, take the best remaining
+          * triangle.  Triangles are never un-added, so the scan only
+          * moves forward. */
+         best = -1.0f;
+         while(scan < (int)num_tris && added[scan]) ++scan;
+         for(t = scan; t < num_tris; ++t)
+         {
+            if(!added[t] && tscore[t] > best)
+            {
+               best = tscore[t];
+               best_idx = t;
+            }
+         }
+         if(best_idx < 0) break;
+      }
+
+      t = best_idx;
+      added[t] = 1;
+      for(k = 0; k < 3; ++k)
+         out[3 * emitted + k] = indices[3 * t + k];
+      ++emitted;
+
+      /* remove the triangle from its vertices' adjacency lists */
+      for(k = 0; k < 3; ++k)
+      {
+         v = indices[3 * t + k];
+         for(j = offsets[v]; j < offsets[v] + remaining[v]; ++j)
+         {
+            if(adj[j] == t)
+            {
+               adj[j] = adj[offsets[v] + remaining[v] - 1];
+               break;
+            }
+         }
+         --remaining[v];
+      }
+
+      /* push the triangle's vertices to the front of the LRU cache */
+      new_used = 0;
+      for(k = 0; k < 3; ++k)
+         new_cache[new_used++] = indices[3 * t + k];
+      for(i = 0; i < (unsigned int)cache_used; ++i)
+      {
+         v = cache[i];
+         if(v != indices[3 * t + 0] && v != indices[3 * t + 1] &&
+            v != indices[3 * t + 2])
+            new_cache[new_used++] = v;
+      }
+
+      for(i = CACHE_SIZE; i < (unsigned int)new_used; ++i)
+      {
+         cache_pos[new_cache[i]] = -1;
+         vscore[new_cache[i]] = vertex_score(-1, remaining[new_cache[i]]);
+      }
+      if(new_used > CACHE_SIZE) new_used = CACHE_SIZE;
+
+      for(i = 0; i < (unsigned int)new_used; ++i)
+      {
+         v = new_cache[i];
+         cache[i] = v;
+         cache_pos[v] = i;
+         vscore[v] = vertex_score(i, remaining[v]);
+      }
+      cache_used = new_used;
+
+      /* rescore the triangles touching the cache and pick the best */
+      best = -1.0f;
+      best_idx = -1;
+      for(i = 0; i < (unsigned int)cache_used; ++i)
+      {
+         v = cache[i];
+         for(j = offsets[v]; j < offsets[v] + remaining[v]; ++j)
+         {
+            n = adj[j];
+            tscore[n] = vscore[indices[3 * n + 0]] +
+                        vscore[indices[3 * n + 1]] +
+                        vscore[indices[3 * n + 2]];
+            if(tscore[n] > best)
+            {
+               best = tscore[n];
+               best_idx = n;
+            }
+         }
+      }
+   }
+
+   if(emitted == num_tris)
+   {
+      for(i = 0; i < num_tris * 3; ++i)
+         indices[i] = out[i];
+   }
+
+done:
+   free(offsets);
+   free(remaining);
+   free(adj);
+   free(out);
+   free(cache_pos);
+   free(vscore);
+   free(tscore);
+   free(added);
+}
+
+void mesh_optimize_vertex_fetch(float *verts, unsigned short *indices,
+                                unsigned int num_indices,
+                                unsigned int num_verts)
+{
+   int *remap;
+   float *tmp;
+   unsigned int i, next = 0;
+
+   remap = malloc(num_verts * sizeof(int));
+   tmp = malloc(num_verts * MESH_VERTEX_SIZE * sizeof(float));
+   if(remap == 0 || tmp == 0)
+   {
+      free(remap);
+      free(tmp);
+      return;
+   }
+
+   /* renumber vertices in order of first use */
+   for(i = 0; i < num_verts; ++i)
+      remap[i] = -1;
+   for(i = 0; i < num_indices; ++i)
+   {
+      if(remap[indices[i]] < 0)
+         remap[indices[i]] = next++;
+      indices[i] = remap[indices[i]];
+   }
+   /* unreferenced vertices go last */
+   for(i = 0; i < num_verts; ++i)
+   {
+      if(remap[i] < 0)
+         remap[i] = next++;
+   }
+
+   for(i = 0; i < num_verts; ++i)
+   {
+      memcpy(&tmp[remap[i] * MESH_VERTEX_SIZE], &verts[i * MESH_VERTEX_SIZE],
+             MESH_VERTEX_SIZE * sizeof(float));
+   }
+   memcpy(verts, tmp, num_verts * MESH_VERTEX_SIZE * sizeof(float));
+
+   free(remap);
+   free(tmp);
+}
+
+static short pack_snorm16(float v)
+{
+   if(v < -1.0f) v = -1.0f;
+   if(v >  1.0f) v =  1.0f;
+   return((short)lrintf(v * 32767.0f));
+}
+
+static void oct_encode(short *e, const float *v)
+{
+   float x, y, t, l1 = fabsf(v[0]) + fabsf(v[1]) + fabsf(v[2]);
+
+   if(l1 < 1e-6f)
+   {
+      e[0] = e[1] = 0;
+      return;
+   }
+
+   x = v[0] / l1;
+   y = v[1] / l1;
+
+   if(v[2] < 0)
+   {
+      t = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+      y = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+      x = t;
+   }
+
+   e[0] = pack_snorm16(x);
+   e[1] = pack_snorm16(y);
+}
+
+void mesh_unpack_direction(float *v, const short *e)
+{
+   float len, t;
+
+   v[0] = (float)e[0] / 32767.0f;
+   v[1] = (float)e[1] / 32767.0f;
+   v[2] = 1.0f - fabsf(v[0]) - fabsf(v[1]);
+
+   if(v[2] < 0)
+   {
+      t    = (1.0f - fabsf(v[1])) * (v[0] >= 0 ? 1.0f : -1.0f);
+      v[1] = (1.0f - fabsf(v[0])) * (v[1] >= 0 ? 1.0f : -1.0f);
+      v[0] = t;
+   }
+
+   len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+   v[0] /= len;
+   v[1] /= len;
+   v[2] /= len;
+}
+
+void mesh_pack_vertices(packed_vertex *dst, const float *verts,
+                        unsigned int num_verts)
+{
+   unsigned int i;
+   const float *v;
+
+   for(i = 0; i < num_verts; ++i)
+   {
+      v = &verts[i * MESH_VERTEX_SIZE];
+
+      dst[i].pos[0] = v[MESH_VERTEX_POS + 0];
+      dst[i].pos[1] = v[MESH_VERTEX_POS + 1];
+      dst[i].pos[2] = v[MESH_VERTEX_POS + 2];
+
+      dst[i].uv[0] = (short)lrintf(v[MESH_VERTEX_UV + 0] * MESH_UV_SCALE);
+      dst[i].uv[1] = (short)lrintf(v[MESH_VERTEX_UV + 1] * MESH_UV_SCALE);
+
+      oct_encode(&dst[i].frame[0], &v[MESH_VERTEX_TANGENT]);
+      oct_encode(&dst[i].frame[2], &v[MESH_VERTEX_BINORMAL]);
+      oct_encode(&dst[i].frame[4], &v[MESH_VERTEX_NORMAL]);
+   }
+}
@@ -0,0 +1,62 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __MESHOPT_H
+#define __MESHOPT_H
+
+/* layout of the vertices in objects/ *.h */
+#define MESH_VERTEX_SIZE      16
+#define MESH_VERTEX_POS       0
+#define MESH_VERTEX_UV        4
+#define MESH_VERTEX_TANGENT   6
+#define MESH_VERTEX_BINORMAL  9
+#define MESH_VERTEX_NORMAL    12
+
+/* FIFO size used when reporting the average cache miss ratio */
+#define MESH_ACMR_CACHE_SIZE  16
+
+/* texture coordinates are stored as 4.12 fixed point */
+#define MESH_UV_SCALE         4096.0f
+
+/* Compact vertex uploaded to the VBO.  The tangent frame is stored as three
+ * octahedral-encoded unit vectors (tangent.xy, binormal.xy, normal.xy) and
+ * decoded in the vertex shader.
+ */
+typedef struct
+{
+   float pos[3];
+   short uv[2];
+   short frame[6];
+} packed_vertex;
+
+float mesh_acmr(const unsigned short *indices, unsigned int num_indices,
+                unsigned int num_verts, int cache_size);
+void mesh_optimize_vertex_cache(unsigned short *indices,
+                                unsigned int num_indices,
+                                unsigned int num_verts);
+void mesh_optimize_vertex_fetch(float *verts, unsigned short *indices,
+                                unsigned int num_indices,
+                                unsigned int num_verts);
+void mesh_pack_vertices(packed_vertex *dst, const float *verts,
+                        unsigned int num_verts);
+void mesh_unpack_direction(float *v, const short *e);
+
+#endif
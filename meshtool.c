@@ -0,0 +1,198 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+/* Offline report for the preview objects: runs the same optimization the 3D
+ * preview does at load time and prints the cache miss ratio and vertex size
+ * before and after.  "meshtool --dump <object>" writes the optimized object
+ * as a header to stdout, in the format used in objects/.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "meshopt.h"
+
+#include "objects/quad.h"
+#include "objects/cube.h"
+#include "objects/sphere.h"
+#include "objects/torus.h"
+#include "objects/teapot.h"
+
+static struct
+{
+   const char *name;
+   float *verts;
+   unsigned short *indices;
+   unsigned int num_verts;
+   unsigned int num_indices;
+} objects[] =
+{
+   {"quad",   quad_verts,   quad_indices,   QUAD_NUM_VERTS,   QUAD_NUM_INDICES},
+   {"cube",   cube_verts,   cube_indices,   CUBE_NUM_VERTS,   CUBE_NUM_INDICES},
+   {"sphere", sphere_verts, sphere_indices, SPHERE_NUM_VERTS, SPHERE_NUM_INDICES},
+   {"torus",  torus_verts,  torus_indices,  TORUS_NUM_VERTS,  TORUS_NUM_INDICES},
+   {"teapot", teapot_verts, teapot_indices, TEAPOT_NUM_VERTS, TEAPOT_NUM_INDICES}
+};
+
+#define NUM_OBJECTS (sizeof(objects) / sizeof(objects[0]))
+
+static float frame_error(const float *verts, const packed_vertex *packed,
+                         unsigned int num_verts)
+{
+   unsigned int i, k;
+   float v[3], d, err = 0;
+   const float *src;
+   static const int offsets[3] =
+   {
+      MESH_VERTEX_TANGENT, MESH_VERTEX_BINORMAL, MESH_VERTEX_NORMAL
+   };
+
+   for(i = 0; i < num_verts; ++i)
+   {
+      for(k = 0; k < 3; ++k)
+      {
+         src = &verts[i * MESH_VERTEX_SIZE + offsets[k]];
+         if(fabsf(src[0]) + fabsf(src[1]) + fabsf(src[2]) < 1e-6f)
+            continue;
+         mesh_unpack_direction(v, &packed[i].frame[2 * k]);
+         d = (v[0] * src[0] + v[1] * src[1] + v[2] * src[2]) /
+            sqrtf(src[0] * src[0] + src[1] * src[1] + src[2] * src[2]);
+         if(d > 1.0f) d = 1.0f;
+         d = acosf(d) * (180.0f / M_PI);
+         if(d > err) err = d;
+      }
+   }
+
+   return(err);
+}
+
+static void dump_object(int n, float *verts, unsigned short *indices)
+{
+   unsigned int i, k;
+   char name[32];
+
+   for(i = 0; objects[n].name[i] && i < sizeof(name) - 1; ++i)
+      name[i] = toupper(objects[n].name[i]);
+   name[i] = 0;
+
+   printf("#ifndef __%s_H\n#define __%s_H\n\n", name, name);
+   printf("#define %s_NUM_VERTS %u\n", name, objects[n].num_verts);
+   printf("static float %s_verts[%s_NUM_VERTS * 16] =\n{\n",
+          objects[n].name, name);
+   for(i = 0; i < objects[n].num_verts; ++i)
+   {
+      printf("  ");
+      for(k = 0; k < MESH_VERTEX_SIZE; ++k)
+         printf(" %f,", verts[i * MESH_VERTEX_SIZE + k]);
+      printf("\n");
+   }
+   printf("};\n\n");
+   printf("#define %s_NUM_INDICES %u\n", name, objects[n].num_indices);
+   printf("static unsigned short %s_indices[%s_NUM_INDICES] =\n{\n",
+          objects[n].name, name);
+   for(i = 0; i < objects[n].num_indices; ++i)
+   {
+      if((i % 9) == 0) printf("  ");
+      printf(" %u,", indices[i]);
+      if((i % 9) == 8 || i == objects[n].num_indices - 1) printf(" \n");
+   }
+   printf("};\n\n#endif\n");
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int n;
+   int dump = -1;
+   float *verts, before, after;
+   unsigned short *indices;
+   packed_vertex *packed;
+
+   if(argc == 3 && !strcmp(argv[1], "--dump"))
+   {
+      for(n = 0; n < NUM_OBJECTS; ++n)
+      {
+         if(!strcmp(argv[2], objects[n].name))
+            dump = n;
+      }
+      if(dump < 0)
+      {
+         fprintf(stderr, "unknown object '%s'\n", argv[2]);
+         return(1);
+      }
+   }
+   else if(argc != 1)
+   {
+      fprintf(stderr, "usage: %s [--dump <object>]\n", argv[0]);
+      return(1);
+   }
+
+   if(dump < 0)
+   {
+      printf("%-8s %6s %6s %10s %10s %12s %12s %10s\n",
+             "object", "verts", "tris", "ACMR", "ACMR opt",
+             "bytes", "bytes opt", "max err");
+   }
+
+   for(n = 0; n < NUM_OBJECTS; ++n)
+   {
+      if(dump >= 0 && dump != (int)n) continue;
+
+      verts = malloc(objects[n].num_verts * MESH_VERTEX_SIZE * sizeof(float));
+      indices = malloc(objects[n].num_indices * sizeof(unsigned short));
+      packed = malloc(objects[n].num_verts * sizeof(packed_vertex));
+      memcpy(verts, objects[n].verts,
+             objects[n].num_verts * MESH_VERTEX_SIZE * sizeof(float));
+      memcpy(indices, objects[n].indices,
+             objects[n].num_indices * sizeof(unsigned short));
+
+      before = mesh_acmr(indices, objects[n].num_indices,
+                         objects[n].num_verts, MESH_ACMR_CACHE_SIZE);
+      mesh_optimize_vertex_cache(indices, objects[n].num_indices,
+                                 objects[n].num_verts);
+      mesh_optimize_vertex_fetch(verts, indices, objects[n].num_indices,
+                                 objects[n].num_verts);
+      after = mesh_acmr(indices, objects[n].num_indices,
+                        objects[n].num_verts, MESH_ACMR_CACHE_SIZE);
+      mesh_pack_vertices(packed, verts, objects[n].num_verts);
+
+      if(dump >= 0)
+         dump_object(n, verts, indices);
+      else
+      {
+         printf("%-8s %6u %6u %10.3f %10.3f %12lu %12lu %9.3f\n",
+                objects[n].name, objects[n].num_verts,
+                objects[n].num_indices / 3, before, after,
+                (unsigned long)(objects[n].num_verts * MESH_VERTEX_SIZE *
+                                sizeof(float)),
+                (unsigned long)(objects[n].num_verts * sizeof(packed_vertex)),
+                frame_error(verts, packed, objects[n].num_verts));
+      }
+
+      free(verts);
+      free(indices);
+      free(packed);
+   }
+
+   return(0);
+}
@@ -0,0 +1,1177 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+/* Command line front end to libnormalmap for batch conversion.  Inputs are
+ * files, directories (every supported image in them) or quoted glob
+ * patterns, which are expanded here so huge batches do not run into the
+ * shell's argument limits.  Files are converted concurrently on a work
+ * stealing thread pool, and a timing line is printed for each one as it
+ * finishes.  16-bit and float sources are read at their full precision.
+ *
+ * Without --output the result is written next to the input as
+ * NAME_normal.EXT, with --output DIR it is written to DIR/NAME.EXT.  With
+ * --compress EXT becomes .dds, with --format it is replaced by the one
+ * given.  --depth 16 or float writes the results at that precision.
+ *
+ * Non-interlaced PNG converted to PNG, TGA, netpbm or raw goes through the
+ * row pipeline in pipeline.c, so textures of any size convert in a few
+ * megabytes.  Cone maps, DDS output and the conversions that need the
+ * whole image load it instead.
+ *
+ * With --cache DIR, or NORMALMAP_CACHE_DIR set, results are kept in a bake
+ * cache keyed by the bytes of the input file and every option that changes
+ * the output, and an input converted before is copied out of it instead.
+ * Raw files are left out, their sidecars are not part of the key.
+ *
+ * With NORMALMAP_STATS set a JSON line is written for every file with the
+ * timings above and what the library measured, see normalmap_stats.  It is
+ * a file name to append to, or "1", "-" or "stderr" for standard error.
+ * NORMALMAP_PROFILE=1 adds hardware counters to them, and prints a table
+ * of the time, instructions per cycle and miss rates of every stage of
+ * the conversions over the whole run at the end.
+ *
+ * The tiles the 5x5 and larger filters go by are timed for the machine the
+ * first time one of them is used, and kept in $XDG_CACHE_HOME/normalmap/
+ * tiling, ~/.cache by default.  Remove the file to time them again.
+ *
+ * On NUMA machines --numa node keeps every worker on one node, spread
+ * round robin, and --numa core pins each to a processor of its own.  A
+ * file's buffers are allocated and filled by the worker converting it, so
+ * its pixels then sit in that node's memory.  NORMALMAP_NUMA gives the
+ * default.  The reader and writer threads of a streamed file run anywhere
+ * on the worker's node, with core only the conversion keeps to its
+ * processor.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libnormalmap.h"
+#include "bakecache.h"
+#include "conemap.h"
+#include "bcenc.h"
+#include "dds.h"
+#include "imageio.h"
+#include "pipeline.h"
+#include "threadpool.h"
+#include "topology.h"
+
+typedef struct
+{
+   const char *input;
+   int failed;
+} file_job;
+
+static normalmap_params params;
+static int conemap = 0;
+static int compress = -1;
+static int depth = NORMALMAP_U8;
+static const char *format_ext = 0;
+static int mips = 1;
+static int stream = 1;
+static int quiet = 0;
+static const char *output_dir = 0;
+static bake_cache *cache = 0;
+static FILE *stats_file = 0;
+static int profile = 0;
+static int profile_failed = 0;
+static normalmap_stats profile_sum;
+
+/* one scratch arena per worker, made by the worker on its first file so
+   its pages are on the worker's node, and kept for the files after */
+static arena **worker_scratch = 0;
+
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long total_pixels = 0;
+static int total_cached = 0;
+
+static char **files = 0;
+static int num_files = 0;
+static int max_files = 0;
+
+static const char *filter_names[MAX_FILTER_TYPE] =
+{
+   "4sample", "sobel3x3", "sobel5x5", "prewitt3x3", "prewitt5x5",
+   "3x3", "5x5", "7x7", "9x9"
+};
+
+static const char *alpha_names[MAX_ALPHA_TYPE] =
+{
+   "none", "height", "inverse-height", "zero", "one", "invert", "map"
+};
+
+static const char *conversion_names[MAX_CONVERSION_TYPE] =
+{
+   "none", "biased", "red", "green", "blue", "max", "min", "colorspace",
+   "normalize", "dudv-to-normal", "heightmap"
+};
+
+static const char *dudv_names[MAX_DUDV_TYPE] =
+{
+   "none", "8bit", "8bit-unsigned", "16bit", "16bit-unsigned"
+};
+
+static const char *encoding_names[MAX_ENCODING] =
+{
+   "xyz", "xy", "octahedral"
+};
+
+static const char *depth_names[MAX_NORMALMAP_FORMAT] =
+{
+   "8", "16", "float"
+};
+
+static const char *height_format_names[MAX_HEIGHT_FORMAT] =
+{
+   "float", "16"
+};
+
+static const char *placement_names[MAX_PLACEMENT] =
+{
+   "none", "node", "core"
+};
+
+static const char *compress_names[MAX_BC_FORMAT] =
+{
+   "bc5", "bc3nm"
+};
+
+static double now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0);
+}
+
+/* accepts a name from 'names' or its index, like the PDB takes */
+static int parse_enum(const char *arg, const char **names, int count,
+                      const char *what)
+{
+   char *end;
+   int i;
+
+   for(i = 0; i < count; ++i)
+   {
+      if(!strcmp(arg, names[i]))
+         return(i);
+   }
+
+   i = (int)strtol(arg, &end, 10);
+   if(*arg && *end == 0 && i >= 0 && i < count)
+      return(i);
+
+   fprintf(stderr, "unknown %s '%s', one of:", what, arg);
+   for(i = 0; i < count; ++i)
+      fprintf(stderr, " %s", names[i]);
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+static void add_file(const char *fn)
+{
+   char **tmp;
+
+   if(num_files == max_files)
+   {
+      max_files = max_files ? max_files * 2 : 256;
+      tmp = realloc(files, max_files * sizeof(char *));
+      if(tmp == 0)
+      {
+         fprintf(stderr, "out of memory\n");
+         exit(1);
+      }
+      files = tmp;
+   }
+
+   files[num_files] = strdup(fn);
+   if(files[num_files] == 0)
+   {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   ++num_files;
+}
+
+/* true for names this tool writes, so a second run over the same
+   directory does not convert its own output */
+static int is_output_name(const char *name)
+{
+   const char *ext = strrchr(name, '.');
+   int len = ext ? (int)(ext - name) : (int)strlen(name);
+
+   return((len >= 7 && !strncmp(name + len - 7, "_normal", 7)) ||
+          (len >= 5 && !strncmp(name + len - 5, "_cone", 5)));
+}
+
+typedef struct
+{
+   char *name;
+   off_t size;
+} sized_name;
+
+static int compare_sized_names(const void *a, const void *b)
+{
+   const sized_name *sa = (const sized_name *)a, *sb = (const sized_name *)b;
+
+   if(sa->size != sb->size) return(sa->size > sb->size ? -1 : 1);
+   return(strcmp(sa->name, sb->name));
+}
+
+static int compare_sized_names_by_name(const void *a, const void *b)
+{
+   return(strcmp(((const sized_name *)a)->name,
+                 ((const sized_name *)b)->name));
+}
+
+/* Drops duplicate inputs, two jobs writing the same output would race, and
+   queues the largest files first so the pool does not end on one big file
+   while the other workers sit idle.
+ */
+static void sort_files(void)
+{
+   sized_name *sn;
+   struct stat st;
+   int i, n;
+
+   sn = malloc(num_files * sizeof(sized_name));
+   if(sn == 0) return;
+
+   for(i = 0; i < num_files; ++i)
+   {
+      sn[i].name = files[i];
+      sn[i].size = (stat(files[i], &st) == 0) ? st.st_size : 0;
+   }
+
+   qsort(sn, num_files, sizeof(sized_name), compare_sized_names_by_name);
+   for(i = n = 0; i < num_files; ++i)
+   {
+      if(n > 0 && !strcmp(sn[n - 1].name, sn[i].name))
+         free(sn[i].name);
+      else
+         sn[n++] = sn[i];
+   }
+   num_files = n;
+
+   qsort(sn, num_files, sizeof(sized_name), compare_sized_names);
+   for(i = 0; i < num_files; ++i)
+      files[i] = sn[i].name;
+
+   free(sn);
+}
+
+static void add_directory(const char *path)
+{
+   DIR *dir;
+   struct dirent *de;
+   char fn[4096];
+
+   dir = opendir(path);
+   if(dir == 0)
+   {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return;
+   }
+
+   while((de = readdir(dir)) != 0)
+   {
+      if(de->d_name[0] == '.' || !image_format_supported(de->d_name) ||
+         is_output_name(de->d_name))
+         continue;
+      snprintf(fn, sizeof(fn), "%s/%s", path, de->d_name);
+      add_file(fn);
+   }
+
+   closedir(dir);
+}
+
+static void add_input(const char *arg)
+{
+   struct stat st;
+   glob_t g;
+   size_t i;
+
+   if(stat(arg, &st) == 0)
+   {
+      if(S_ISDIR(st.st_mode))
+         add_directory(arg);
+      else
+         add_file(arg);
+      return;
+   }
+
+   if(strpbrk(arg, "*?[") && glob(arg, 0, 0, &g) == 0)
+   {
+      for(i = 0; i < g.gl_pathc; ++i)
+      {
+         if(image_format_supported(g.gl_pathv[i]))
+            add_file(g.gl_pathv[i]);
+      }
+      globfree(&g);
+      return;
+   }
+
+   fprintf(stderr, "%s: %s\n", arg, strerror(ENOENT));
+}
+
+static void add_list(const char *fn)
+{
+   FILE *fp;
+   char line[4096];
+   int len;
+
+   fp = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+   if(fp == 0)
+   {
+      fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+      exit(1);
+   }
+
+   while(fgets(line, sizeof(line), fp))
+   {
+      len = strlen(line);
+      while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+         line[--len] = 0;
+      if(len > 0)
+         add_input(line);
+   }
+
+   if(fp != stdin)
+      fclose(fp);
+}
+
+/* NAME_<suffix>.EXT next to the input, or in the output directory, where
+   'keep_name' drops the suffix */
+/* 'new_ext' replaces the extension of the input when not NULL */
+static void output_name(char *dst, int len, const char *input,
+                        const char *suffix, int keep_name,
+                        const char *new_ext)
+{
+   const char *base, *ext;
+
+   ext = strrchr(input, '.');
+   if(ext == 0) ext = input + strlen(input);
+
+   base = strrchr(input, '/');
+   base = base ? base + 1 : input;
+   if(ext < base) ext = base + strlen(base);
+
+   if(output_dir)
+   {
+      if(keep_name)
+         snprintf(dst, len, "%s/%.*s%s", output_dir, (int)(ext - base),
+                  base, new_ext ? new_ext : ext);
+      else
+         snprintf(dst, len, "%s/%.*s_%s%s", output_dir, (int)(ext - base),
+                  base, suffix, new_ext ? new_ext : ext);
+   }
+   else
+      snprintf(dst, len, "%.*s_%s%s", (int)(ext - input), input, suffix,
+               new_ext ? new_ext : ext);
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+   fputc('"', f);
+   for(; *s; ++s)
+   {
+      if(*s == '"' || *s == '\\')
+         fprintf(f, "\\%c", *s);
+      else if((unsigned char)*s < 0x20)
+         fprintf(f, "\\u%04x", (unsigned char)*s);
+      else
+         fputc(*s, f);
+   }
+   fputc('"', f);
+}
+
+/* the NORMALMAP_STATS line, called with print_lock held */
+static void write_stats(const file_job *job, int width, int height,
+                        const double ms[3], int ret, int cached,
+                        const normalmap_stats *st)
+{
+   char buf[4096];
+
+   normalmap_stats_json(st, buf, sizeof(buf));
+
+   fprintf(stats_file, "{\"tool\": \"normalmap-cli\", \"file\": ");
+   write_json_string(stats_file, job->input);
+   fprintf(stats_file, ", \"status\": \"%s\", \"width\": %d, "
+           "\"height\": %d, \"load_ms\": %.3f, \"bake_ms\": %.3f, "
+           "\"save_ms\": %.3f, %s}\n",
+           ret != 0 ? "failed" : cached ? "cached" : "ok",
+           width, height, ms[0], ms[1], ms[2], buf);
+   fflush(stats_file);
+}
+
+/* the timing line, or the error */
+static void report_file(file_job *job, int width, int height,
+                        const double ms[3], int ret, const char *err,
+                        int cached, const normalmap_stats *st)
+{
+   pthread_mutex_lock(&print_lock);
+   if(stats_file)
+      write_stats(job, width, height, ms, ret, cached, st);
+   if(profile)
+      normalmap_stats_add(&profile_sum, st);
+   if(ret != 0)
+   {
+      fprintf(stderr, "%s: %s\n", job->input, err);
+      job->failed = 1;
+   }
+   else if(cached)
+   {
+      ++total_cached;
+      if(!quiet)
+      {
+         printf("%11s %9.1f %9.1f %9.1f %9.1f  %s\n", "cached",
+                ms[0], ms[1], ms[2], ms[0] + ms[1] + ms[2], job->input);
+         fflush(stdout);
+      }
+   }
+   else
+   {
+      total_pixels += (long long)width * height;
+      if(!quiet)
+      {
+         printf("%5dx%-5d %9.1f %9.1f %9.1f %9.1f  %s\n",
+                width, height, ms[0], ms[1], ms[2], ms[0] + ms[1] + ms[2],
+                job->input);
+         fflush(stdout);
+      }
+   }
+   pthread_mutex_unlock(&print_lock);
+}
+
+static int is_raw_name(const char *fn)
+{
+   const char *ext = strrchr(fn, '.');
+
+   return(ext && !strcmp(ext, ".raw"));
+}
+
+/* Keys the outputs of a job by the input file and the options, the normal
+   map in keys[0] and the cone map in keys[1].  Returns -1 if the input
+   cannot be read.
+ */
+static int cache_keys(bake_key keys[2], const char *input,
+                      const char *dst_fn, const char *cone_fn, int bake_cone)
+{
+   struct stat st;
+   void *map = 0;
+   char tag[256];
+   int fd;
+
+   fd = open(input, O_RDONLY);
+   if(fd < 0) return(-1);
+   if(fstat(fd, &st) != 0)
+   {
+      close(fd);
+      return(-1);
+   }
+   if(st.st_size > 0)
+   {
+      map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(map == MAP_FAILED)
+      {
+         close(fd);
+         return(-1);
+      }
+   }
+   close(fd);
+
+   snprintf(tag, sizeof(tag), "normal %s depth %d compress %d mips %d",
+            strrchr(dst_fn, '.') ? strrchr(dst_fn, '.') : "",
+            depth, compress, mips);
+   bake_cache_key(&keys[0], map ? map : "", st.st_size, &params, tag);
+
+   if(bake_cone)
+   {
+      snprintf(tag, sizeof(tag), "cone %s",
+               strrchr(cone_fn, '.') ? strrchr(cone_fn, '.') : "");
+      bake_cache_key(&keys[1], map ? map : "", st.st_size, &params, tag);
+   }
+
+   if(map) munmap(map, st.st_size);
+
+   return(0);
+}
+
+/* copies a job's outputs out of the cache, all of them or none */
+static int fetch_cached(const bake_key keys[2], const char *dst_fn,
+                        const char *cone_fn, int bake_cone)
+{
+   if(bake_cache_get_file(cache, &keys[0], dst_fn) != 0)
+      return(-1);
+   if(bake_cone && bake_cache_get_file(cache, &keys[1], cone_fn) != 0)
+   {
+      remove(dst_fn);
+      return(-1);
+   }
+   return(0);
+}
+
+static void store_cached(const bake_key keys[2], const char *dst_fn,
+                         const char *cone_fn, int bake_cone)
+{
+   if(bake_cache_put_file(cache, &keys[0], dst_fn) == 0 && bake_cone)
+      bake_cache_put_file(cache, &keys[1], cone_fn);
+}
+
+static void bake_file(file_job *job, const normalmap_stats *st)
+{
+   image_data src, dst, cone;
+   char dst_fn[4096], cone_fn[4096], err[256];
+   float *heights = 0;
+   double t0, t1, t2, ms[3];
+   bake_key keys[2];
+   size_t i, n;
+   int ret, bake_cone, cached = 0, in_place = 0;
+
+   /* only when the normals were computed from heights */
+   bake_cone = conemap && !params.dudv &&
+      params.conversion != CONVERT_NORMALIZE_ONLY &&
+      params.conversion != CONVERT_DUDV_TO_NORMAL &&
+      params.conversion != CONVERT_HEIGHTMAP;
+
+   output_name(dst_fn, sizeof(dst_fn), job->input, "normal", 1,
+               (compress >= 0) ? ".dds" : format_ext);
+   output_name(cone_fn, sizeof(cone_fn), job->input, "cone", 0, format_ext);
+
+   if(cache && strcmp(dst_fn, job->input) && !is_raw_name(job->input) &&
+      !is_raw_name(dst_fn))
+   {
+      t0 = now_ms();
+      cached = (cache_keys(keys, job->input, dst_fn, cone_fn,
+                           bake_cone) == 0);
+      t1 = now_ms();
+      if(cached && fetch_cached(keys, dst_fn, cone_fn, bake_cone) == 0)
+      {
+         ms[0] = t1 - t0;
+         ms[1] = 0;
+         ms[2] = now_ms() - t1;
+         report_file(job, 0, 0, ms, 0, 0, 1, st);
+         return;
+      }
+   }
+
+   /* when both ends go by rows the image is never held whole, decoding,
+      converting and encoding overlap */
+   if(stream && compress < 0 && !bake_cone && strcmp(dst_fn, job->input))
+   {
+      /* a file that fails to open reports as 0x0 with no time taken */
+      memset(&src, 0, sizeof(src));
+      memset(ms, 0, sizeof(ms));
+      ret = pipeline_convert(job->input, dst_fn, depth, &params, &src, ms,
+                             err, sizeof(err));
+      if(ret != 1)
+      {
+         if(ret == 0 && cached)
+            store_cached(keys, dst_fn, cone_fn, bake_cone);
+         report_file(job, src.width, src.height, ms, ret, err, 0, st);
+         return;
+      }
+   }
+
+   t0 = now_ms();
+
+   if(image_load(&src, job->input, 1, err, sizeof(err)) != 0)
+   {
+      memset(ms, 0, sizeof(ms));
+      report_file(job, 0, 0, ms, -1, err, 0, st);
+      return;
+   }
+
+   t1 = now_ms();
+
+   n = (size_t)src.width * src.height;
+   memset(&dst, 0, sizeof(dst));
+   memset(&cone, 0, sizeof(cone));
+
+   /* the input may be mapped, truncating it for the output would pull the
+      pages out from under the converter */
+   if(!strcmp(dst_fn, job->input))
+   {
+      snprintf(err, sizeof(err), "output would overwrite the input");
+      ret = -1;
+   }
+   else if(src.map == 0 && src.sample_format == depth)
+   {
+      /* a decoded input is converted where it is, a mapped one would only
+         have its pages copied as they are written */
+      dst = src;
+      in_place = 1;
+      ret = 0;
+   }
+   else
+      ret = image_create(&dst, (compress >= 0) ? 0 : dst_fn,
+                         src.width, src.height, src.bpp, depth,
+                         err, sizeof(err));
+
+   if(ret == 0 && bake_cone)
+   {
+      ret = image_create(&cone, cone_fn, src.width, src.height, 1,
+                         NORMALMAP_U8, err, sizeof(err));
+      if(ret == 0)
+      {
+         heights = malloc(n * sizeof(float));
+         if(heights == 0)
+         {
+            snprintf(err, sizeof(err), "out of memory");
+            ret = -1;
+         }
+      }
+   }
+
+   if(ret == 0)
+   {
+      ret = normalmap_convert_format(dst.pixels, image_stride(&dst),
+                                     dst.sample_format,
+                                     src.pixels, image_stride(&src),
+                                     src.sample_format,
+                                     src.width, src.height, src.bpp,
+                                     &params, heights, 0, 0);
+      if(ret != 0)
+         snprintf(err, sizeof(err), "out of memory");
+   }
+
+   if(ret == 0 && bake_cone)
+   {
+      /* as depth, the way the relief shaders read alpha */
+      if(params.alpha != ALPHA_HEIGHT)
+      {
+         for(i = 0; i < n; ++i)
+            heights[i] = 1.0f - heights[i];
+      }
+      /* the files are the parallelism here */
+      ret = conemap_bake(cone.pixels, 1, heights, cone.width, cone.height,
+                         params.wrap, 1);
+      if(ret != 0)
+         snprintf(err, sizeof(err), "out of memory");
+   }
+
+   t2 = now_ms();
+
+   if(ret == 0)
+   {
+      /* the files are the parallelism here as well */
+      if(compress >= 0)
+         ret = dds_save(&dst, dst_fn, compress, mips, 1, err, sizeof(err));
+      else
+         ret = image_save(&dst, dst_fn, err, sizeof(err));
+      if(ret == 0 && bake_cone)
+         ret = image_save(&cone, cone_fn, err, sizeof(err));
+   }
+
+   /* mapped outputs are written through the mapping, unmap them before
+      the files are read back */
+   if(ret == 0 && cached)
+   {
+      if(!in_place) image_free(&dst);
+      image_free(&cone);
+      store_cached(keys, dst_fn, cone_fn, bake_cone);
+   }
+
+   ms[0] = t1 - t0;
+   ms[1] = t2 - t1;
+   ms[2] = now_ms() - t2;
+   report_file(job, src.width, src.height, ms, ret, err, 0, st);
+
+   /* mapped outputs exist from image_create on, do not leave them behind
+      half written */
+   if(ret != 0 && dst.writeback) remove(dst_fn);
+   if(ret != 0 && cone.writeback) remove(cone_fn);
+
+   free(heights);
+   image_free(&cone);
+   if(!in_place) image_free(&dst);
+   image_free(&src);
+}
+
+static void convert_file(void *arg, int worker)
+{
+   normalmap_stats st;
+   arena *prev_scratch;
+   char err[256];
+
+   /* without one the library keeps to malloc() */
+   if(worker_scratch[worker] == 0)
+      worker_scratch[worker] = arena_new();
+   prev_scratch = normalmap_scratch_arena(worker_scratch[worker]);
+
+   memset(&st, 0, sizeof(st));
+   if(stats_file || profile) normalmap_collect_stats(&st);
+   if(profile && normalmap_profile(1, err, sizeof(err)) != 0)
+   {
+      pthread_mutex_lock(&print_lock);
+      if(!profile_failed)
+         fprintf(stderr, "%s, timing stages only\n", err);
+      profile_failed = 1;
+      pthread_mutex_unlock(&print_lock);
+   }
+   bake_file((file_job *)arg, &st);
+   normalmap_profile(0, 0, 0);
+   normalmap_collect_stats(0);
+   normalmap_scratch_arena(prev_scratch);
+}
+
+static void print_count(long long count, int counted)
+{
+   if(counted)
+      fprintf(stderr, " %14lld", count);
+   else
+      fprintf(stderr, " %14s", "-");
+}
+
+static void print_ratio(double a, double b, int counted)
+{
+   if(counted && b > 0)
+      fprintf(stderr, " %11.2f", a / b);
+   else
+      fprintf(stderr, " %11s", "-");
+}
+
+/* the NORMALMAP_PROFILE table */
+static void print_profile(const normalmap_stats *s)
+{
+   static const char *names[] = {"bias", "heights", "convert", "heightmap"};
+   const normalmap_counters *c[4];
+   double ms[4];
+   int i, cycles, instructions;
+
+   c[0] = &s->bias_counters;
+   c[1] = &s->heights_counters;
+   c[2] = &s->convert_counters;
+   c[3] = &s->heightmap_counters;
+   ms[0] = s->bias_ms;
+   ms[1] = s->heights_ms;
+   ms[2] = s->convert_ms;
+   ms[3] = s->heightmap_ms;
+
+   cycles = s->counted & NORMALMAP_COUNTED_CYCLES;
+   instructions = s->counted & NORMALMAP_COUNTED_INSTRUCTIONS;
+
+   fprintf(stderr, "%-10s %10s %14s %14s %11s %11s %11s\n", "stage", "ms",
+           "cycles", "instructions", "IPC", "cache MPKI", "branch MPKI");
+   for(i = 0; i < 4; ++i)
+   {
+      if(ms[i] == 0) continue;
+      fprintf(stderr, "%-10s %10.1f", names[i], ms[i]);
+      print_count(c[i]->cycles, cycles);
+      print_count(c[i]->instructions, instructions);
+      print_ratio(c[i]->instructions, c[i]->cycles, cycles && instructions);
+      print_ratio(c[i]->cache_misses * 1000.0, c[i]->instructions,
+                  instructions &&
+                  (s->counted & NORMALMAP_COUNTED_CACHE_MISSES));
+      print_ratio(c[i]->branch_misses * 1000.0, c[i]->instructions,
+                  instructions &&
+                  (s->counted & NORMALMAP_COUNTED_BRANCH_MISSES));
+      fprintf(stderr, "\n");
+   }
+}
+
+/* the file the filter tiles of this machine are kept in */
+static int tiling_file(char *fn, int len)
+{
+   const char *base = getenv("XDG_CACHE_HOME");
+   char dir[4096];
+
+   if(base && *base)
+      snprintf(dir, sizeof(dir), "%s", base);
+   else if((base = getenv("HOME")) != 0 && *base)
+      snprintf(dir, sizeof(dir), "%s/.cache", base);
+   else
+      return(-1);
+
+   if(mkdir(dir, 0777) != 0 && errno != EEXIST)
+      return(-1);
+   strncat(dir, "/normalmap", sizeof(dir) - strlen(dir) - 1);
+   if(mkdir(dir, 0777) != 0 && errno != EEXIST)
+      return(-1);
+
+   snprintf(fn, len, "%s/tiling", dir);
+   return(0);
+}
+
+/* Loads the filter tiles, timing them first if they never were.  Without
+   anywhere to keep them the defaults are used, rather than timing them on
+   every run. */
+static void load_tiling(void)
+{
+   char fn[4096];
+   int columns, rows;
+
+   if(tiling_file(fn, sizeof(fn)) != 0 || normalmap_load_tiling(fn) == 0)
+      return;
+
+   if(normalmap_tune_tiling(&columns, &rows) != 0)
+      return;
+   if(!quiet)
+      printf("filter tiles of %d x %d for this machine, kept in %s\n",
+             columns, rows, fn);
+   normalmap_save_tiling(fn);
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr,
+           "usage: %s [options] FILE|DIR|'GLOB'...\n"
+           "\n"
+           "  -j, --jobs N           files converted at once (default: one per processor)\n"
+           "  --numa none|node|core  keep each worker on a NUMA node or pin it to a\n"
+           "                         processor (default: $NORMALMAP_NUMA or none)\n"
+           "  -o, --output DIR       write results to DIR\n"
+           "  -l, --list FILE        read inputs from FILE, one per line, - for stdin\n"
+           "  -q, --quiet            no per file timings\n"
+           "  -f, --format EXT       write png, tga, pnm, pam, raw, pfm or exr files\n"
+           "  --depth 8|16|float     sample precision of the results (default 8)\n"
+           "\n"
+           "  --filter F             4sample, sobel3x3, sobel5x5, prewitt3x3, prewitt5x5,\n"
+           "                         3x3, 5x5, 7x7, 9x9\n"
+           "  --minz Z               minimum Z (0 to 1)\n"
+           "  --scale S              scale (> 0)\n"
+           "  --wrap                 wrap around the image edges\n"
+           "  --height-source rgb|alpha\n"
+           "  --alpha A              none, height, inverse-height, zero, one, invert, map\n"
+           "  --conversion C         none, biased, red, green, blue, max, min, colorspace,\n"
+           "                         normalize, dudv-to-normal, heightmap\n"
+           "  --dudv D               none, 8bit, 8bit-unsigned, 16bit, 16bit-unsigned\n"
+           "  --xinvert, --yinvert   invert the X or Y component of the normal\n"
+           "  --swaprgb              swap the X and Z components\n"
+           "  --contrast C           height contrast (0 to 1)\n"
+           "  --encoding E           xyz, xy (z left for the shader to rebuild) or\n"
+           "                         octahedral, the last two in red and green\n"
+           "  --heights float|16     precision the heights are kept at while\n"
+           "                         converting, 16 halves their memory (default float)\n"
+           "  --alphamap FILE        alpha values for --alpha map\n"
+           "  --conemap              also write a cone step map as NAME_cone.EXT\n"
+           "  --compress bc5|bc3nm   write the normal map as a block compressed DDS\n"
+           "                         with mipmaps, x and y in red and green (BC5) or\n"
+           "                         alpha and green (BC3nm)\n"
+           "  --no-mips              only the top level in the DDS\n"
+           "  --no-stream            load whole images even where they could be\n"
+           "                         converted row by row\n"
+           "  --cache DIR            reuse results of earlier runs kept in DIR\n"
+           "                         (default: $NORMALMAP_CACHE_DIR)\n"
+           "  --cache-size MB        size the cache is trimmed to (default: 1024)\n"
+           "\n"
+           "NORMALMAP_STATS=FILE appends a JSON line of timings and counters for\n"
+           "every file to FILE, or to standard error when it is 1.  NORMALMAP_PROFILE=1\n"
+           "adds hardware counters and prints them per stage at the end.\n",
+           prog);
+}
+
+static const char *next_arg(int argc, char **argv, int *i)
+{
+   if(*i + 1 >= argc)
+   {
+      usage(argv[0]);
+      exit(1);
+   }
+   return(argv[++*i]);
+}
+
+int main(int argc, char **argv)
+{
+   int i, jobs = 0, failed = 0;
+   const char *alphamap_fn = 0;
+   const char *cache_dir = getenv("NORMALMAP_CACHE_DIR");
+   const char *stats_fn = getenv("NORMALMAP_STATS");
+   const char *profile_env = getenv("NORMALMAP_PROFILE");
+   const char *numa_env = getenv("NORMALMAP_NUMA");
+   int placement = PLACE_NONE;
+   size_t k, n;
+   long long cache_size = 0;
+   image_data alphamap;
+   unsigned char *amap = 0;
+   char err[256];
+   file_job *file_jobs;
+   threadpool *pool;
+   double t;
+
+   normalmap_default_params(&params);
+
+   if(numa_env && *numa_env)
+      placement = parse_enum(numa_env, placement_names, MAX_PLACEMENT,
+                             "NORMALMAP_NUMA policy");
+
+   for(i = 1; i < argc; ++i)
+   {
+      if(!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs"))
+         jobs = atoi(next_arg(argc, argv, &i));
+      else if(!strcmp(argv[i], "--numa"))
+         placement = parse_enum(next_arg(argc, argv, &i), placement_names,
+                                MAX_PLACEMENT, "NUMA policy");
+      else if(!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output"))
+         output_dir = next_arg(argc, argv, &i);
+      else if(!strcmp(argv[i], "-l") || !strcmp(argv[i], "--list"))
+         add_list(next_arg(argc, argv, &i));
+      else if(!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quiet"))
+         quiet = 1;
+      else if(!strcmp(argv[i], "-f") || !strcmp(argv[i], "--format"))
+      {
+         static char ext[16];
+         snprintf(ext, sizeof(ext), ".%s", next_arg(argc, argv, &i));
+         if(!image_format_writable(ext))
+         {
+            fprintf(stderr, "unknown image format '%s'\n", ext + 1);
+            return(1);
+         }
+         format_ext = ext;
+      }
+      else if(!strcmp(argv[i], "--depth"))
+         depth = parse_enum(next_arg(argc, argv, &i), depth_names,
+                            MAX_NORMALMAP_FORMAT, "depth");
+      else if(!strcmp(argv[i], "--filter"))
+         params.filter = parse_enum(next_arg(argc, argv, &i), filter_names,
+                                    MAX_FILTER_TYPE, "filter");
+      else if(!strcmp(argv[i], "--minz"))
+         params.minz = atof(next_arg(argc, argv, &i));
+      else if(!strcmp(argv[i], "--scale"))
+         params.scale = atof(next_arg(argc, argv, &i));
+      else if(!strcmp(argv[i], "--wrap"))
+         params.wrap = 1;
+      else if(!strcmp(argv[i], "--height-source"))
+      {
+         static const char *names[] = {"rgb", "alpha"};
+         params.height_source = parse_enum(next_arg(argc, argv, &i),
+                                           names, 2, "height source");
+      }
+      else if(!strcmp(argv[i], "--alpha"))
+         params.alpha = parse_enum(next_arg(argc, argv, &i), alpha_names,
+                                   MAX_ALPHA_TYPE, "alpha");
+      else if(!strcmp(argv[i], "--conversion"))
+         params.conversion = parse_enum(next_arg(argc, argv, &i),
+                                        conversion_names,
+                                        MAX_CONVERSION_TYPE, "conversion");
+      else if(!strcmp(argv[i], "--dudv"))
+         params.dudv = parse_enum(next_arg(argc, argv, &i), dudv_names,
+                                  MAX_DUDV_TYPE, "DU/DV type");
+      else if(!strcmp(argv[i], "--xinvert"))
+         params.xinvert = 1;
+      else if(!strcmp(argv[i], "--yinvert"))
+         params.yinvert = 1;
+      else if(!strcmp(argv[i], "--swaprgb"))
+         params.swapRGB = 1;
+      else if(!strcmp(argv[i], "--contrast"))
+         params.contrast = atof(next_arg(argc, argv, &i));
+      else if(!strcmp(argv[i], "--encoding"))
+         params.encoding = parse_enum(next_arg(argc, argv, &i),
+                                      encoding_names, MAX_ENCODING,
+                                      "encoding");
+      else if(!strcmp(argv[i], "--heights"))
+         params.height_format = parse_enum(next_arg(argc, argv, &i),
+                                           height_format_names,
+                                           MAX_HEIGHT_FORMAT, "heights");
+      else if(!strcmp(argv[i], "--alphamap"))
+         alphamap_fn = next_arg(argc, argv, &i);
+      else if(!strcmp(argv[i], "--conemap"))
+         conemap = 1;
+      else if(!strcmp(argv[i], "--compress"))
+         compress = parse_enum(next_arg(argc, argv, &i), compress_names,
+                               MAX_BC_FORMAT, "compression");
+      else if(!strcmp(argv[i], "--no-mips"))
+         mips = 0;
+      else if(!strcmp(argv[i], "--no-stream"))
+         stream = 0;
+      else if(!strcmp(argv[i], "--cache"))
+         cache_dir = next_arg(argc, argv, &i);
+      else if(!strcmp(argv[i], "--cache-size"))
+         cache_size = atoll(next_arg(argc, argv, &i)) * 1024 * 1024;
+      else if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+      {
+         usage(argv[0]);
+         return(0);
+      }
+      else if(argv[i][0] == '-' && argv[i][1] != 0)
+      {
+         usage(argv[0]);
+         return(1);
+      }
+      else
+         add_input(argv[i]);
+   }
+
+   if(num_files == 0)
+   {
+      usage(argv[0]);
+      return(1);
+   }
+
+   if(compress >= 0 &&
+      (params.dudv || params.conversion == CONVERT_HEIGHTMAP))
+   {
+      fprintf(stderr, "--compress needs normals, not DU/DV or height maps\n");
+      return(1);
+   }
+   if(compress >= 0 && depth != NORMALMAP_U8)
+   {
+      fprintf(stderr, "--compress works from 8-bit normals, not --depth %s\n",
+              depth_names[depth]);
+      return(1);
+   }
+   if(compress >= 0 && params.encoding == ENCODE_OCTAHEDRAL)
+   {
+      fprintf(stderr, "--compress stores x and y, it cannot take octahedral "
+              "normals\n");
+      return(1);
+   }
+   if(compress >= 0 && params.swapRGB)
+   {
+      fprintf(stderr, "--compress stores x and y, --swaprgb would put z in "
+              "their place\n");
+      return(1);
+   }
+
+   if(params.alpha == ALPHA_MAP)
+   {
+      if(alphamap_fn == 0)
+      {
+         fprintf(stderr, "--alpha map needs --alphamap\n");
+         return(1);
+      }
+      if(image_load(&alphamap, alphamap_fn, 0, err, sizeof(err)) != 0)
+      {
+         fprintf(stderr, "%s: %s\n", alphamap_fn, err);
+         return(1);
+      }
+
+      /* grey images come back expanded to RGB, use the first channel */
+      amap = malloc((size_t)alphamap.width * alphamap.height);
+      if(amap == 0)
+      {
+         fprintf(stderr, "out of memory\n");
+         return(1);
+      }
+      n = (size_t)alphamap.width * alphamap.height;
+      for(k = 0; k < n; ++k)
+         amap[k] = alphamap.pixels[k * alphamap.bpp];
+
+      params.alphamap = amap;
+      params.alphamap_width = alphamap.width;
+      params.alphamap_height = alphamap.height;
+      image_free(&alphamap);
+   }
+
+   if(output_dir && mkdir(output_dir, 0777) != 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "%s: %s\n", output_dir, strerror(errno));
+      return(1);
+   }
+
+   if(cache_dir && *cache_dir)
+   {
+      cache = bake_cache_open(cache_dir, cache_size, err, sizeof(err));
+      if(cache == 0)
+      {
+         fprintf(stderr, "%s\n", err);
+         return(1);
+      }
+   }
+
+   if(stats_fn && *stats_fn && strcmp(stats_fn, "0"))
+   {
+      if(!strcmp(stats_fn, "1") || !strcmp(stats_fn, "-") ||
+         !strcmp(stats_fn, "stderr"))
+         stats_file = stderr;
+      else if((stats_file = fopen(stats_fn, "a")) == 0)
+      {
+         fprintf(stderr, "%s: %s\n", stats_fn, strerror(errno));
+         return(1);
+      }
+   }
+
+   profile = profile_env && *profile_env && strcmp(profile_env, "0");
+
+   if(normalmap_filter_radius(params.filter) >= 2)
+      load_tiling();
+
+   sort_files();
+
+   file_jobs = calloc(num_files, sizeof(file_job));
+   pool = threadpool_new_placed(jobs, placement);
+   if(pool)
+      worker_scratch = calloc(threadpool_num_threads(pool), sizeof(arena *));
+   if(file_jobs == 0 || pool == 0 || worker_scratch == 0)
+   {
+      fprintf(stderr, "unable to start the worker threads\n");
+      return(1);
+   }
+
+   if(!quiet)
+      printf("%11s %9s %9s %9s %9s  %s\n", "size", "load ms", "convert",
+             "save ms", "total ms", "file");
+
+   t = now_ms();
+
+   for(i = 0; i < num_files; ++i)
+   {
+      file_jobs[i].input = files[i];
+      if(threadpool_push(pool, convert_file, &file_jobs[i]) != 0)
+         file_jobs[i].failed = 1;
+   }
+
+   threadpool_wait(pool);
+
+   t = now_ms() - t;
+
+   for(i = 0; i < num_files; ++i)
+   {
+      failed += file_jobs[i].failed;
+      free(files[i]);
+   }
+
+   printf("%d files, ", num_files);
+   if(cache)
+      printf("%d cached, ", total_cached);
+   printf("%d failed, %d threads", failed, threadpool_num_threads(pool));
+   if(placement != PLACE_NONE)
+      printf(" by %s on %d nodes", placement_names[placement],
+             topology_num_nodes());
+   printf(", %.2f s, %.1f Mpixels/s\n", t / 1000.0,
+          t > 0 ? (double)total_pixels / (t * 1000.0) : 0.0);
+
+   if(profile)
+      print_profile(&profile_sum);
+
+   /* the workers are idle, their arenas can go */
+   for(i = 0; i < threadpool_num_threads(pool); ++i)
+      arena_free(worker_scratch[i]);
+   threadpool_free(pool);
+   bake_cache_close(cache);
+   if(stats_file && stats_file != stderr) fclose(stats_file);
+   free(file_jobs);
+   free(worker_scratch);
+   free(files);
+   free(amap);
+
+   return(failed ? 1 : 0);
+}
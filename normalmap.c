@@ -28,39 +28,16 @@
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 
+#include "libnormalmap.h"
+#include "bakecache.h"
 #include "scale.h"
+#include "conemap.h"
 #include "preview3d.h"
+#include "progress.h"
+#include "threadpool.h"
 
 #define PREVIEW_SIZE 150
 
-enum FILTER_TYPE
-{
-   FILTER_NONE = 0, FILTER_SOBEL_3x3, FILTER_SOBEL_5x5, FILTER_PREWITT_3x3,
-   FILTER_PREWITT_5x5, FILTER_3x3, FILTER_5x5, FILTER_7x7, FILTER_9x9,
-   MAX_FILTER_TYPE
-};
-
-enum ALPHA_TYPE
-{
-   ALPHA_NONE = 0, ALPHA_HEIGHT, ALPHA_INVERSE_HEIGHT, ALPHA_ZERO, ALPHA_ONE,
-   ALPHA_INVERT, ALPHA_MAP, MAX_ALPHA_TYPE
-};
-
-enum CONVERSION_TYPE
-{
-   CONVERT_NONE = 0, CONVERT_BIASED_RGB, CONVERT_RED, CONVERT_GREEN,
-   CONVERT_BLUE, CONVERT_MAX_RGB, CONVERT_MIN_RGB, CONVERT_COLORSPACE,
-   CONVERT_NORMALIZE_ONLY, CONVERT_DUDV_TO_NORMAL, CONVERT_HEIGHTMAP,
-   MAX_CONVERSION_TYPE
-};
-
-enum DUDV_TYPE
-{
-   DUDV_NONE, DUDV_8BIT_SIGNED, DUDV_8BIT_UNSIGNED, DUDV_16BIT_SIGNED,
-   DUDV_16BIT_UNSIGNED,
-   MAX_DUDV_TYPE
-};
-
 typedef struct
 {
    gint filter;
@@ -76,6 +53,8 @@ typedef struct
    gint swapRGB;
    gdouble contrast;
    gint32 alphamap_id;
+   gint conemap;
+   gint encoding;
 } NormalmapVals;
 
 static void query(void);
@@ -83,6 +62,7 @@ static void run(const gchar *name, gint params, const GimpParam *param,
                 gint *nreturn_vals, GimpParam **return_vals);
 
 static gint32 normalmap(GimpDrawable *drawable, gboolean preview_mode);
+static int normalmap_layers(const gint32 *ids, int count);
 
 static gint normalmap_dialog(GimpDrawable *drawable);
 
@@ -105,17 +85,21 @@ NormalmapVals nmapvals =
    .yinvert = 0,
    .swapRGB = 0,
    .contrast = 0.0,
-   .alphamap_id = 0
+   .alphamap_id = 0,
+   .conemap = 0,
+   .encoding = ENCODE_XYZ
 };
 
-static const float oneover255 = 1.0f / 255.0f;
-
 gint runme = 0;
 
 static GtkWidget *dialog;
 static GtkWidget *preview;
 static GtkWidget *btn3DP;
 
+/* the buffers of a run, kept from one preview refresh to the next and for
+   the final run after them */
+static arena *scratch = 0;
+
 MAIN()
 
 static void query(void)
@@ -132,15 +116,27 @@ static void query(void)
       {GIMP_PDB_INT32, "height_source", "Height source (0 = average RGB, 1 = alpha channel)"},
       {GIMP_PDB_INT32, "alpha", "Alpha (0 = unchanged, 1 = set to height, 2 = set to inverse height, 3 = set to 0, 4 = set to 1, 5 = invert, 6 = set to alpha map value)"},
       {GIMP_PDB_INT32, "conversion", "Conversion (0 = normalize only, 1 = Biased RGB, 2 = Red, 3 = Green, 4 = Blue, 5 = Max RGB, 6 = Min RGB, 7 = Colorspace, 8 = Normalize only, 9 = Convert to height map)"},
-      {GIMP_PDB_INT32, "dudv", "DU/DV map (0 = none, 1 = 8-bit, 2 = 8-bit unsigned, 3 = 16-bit, 4 = 16-bit unsigned)"},
+      {GIMP_PDB_INT32, "dudv", "DU/DV map (0 = none, 1 = 8-bit, 2 = 8-bit unsigned, 3 = 16-bit, 4 = 16-bit unsigned). 16-bit maps need RGBA and are packed little endian, du in red and green, dv in blue and alpha"},
       {GIMP_PDB_INT32, "xinvert", "Invert X component of normal"},
       {GIMP_PDB_INT32, "yinvert", "Invert Y component of normal"},
       {GIMP_PDB_INT32, "swapRGB", "Swap RGB components"},
       {GIMP_PDB_FLOAT, "contrast", "Height contrast (0 to 1). If converting to a height map, this value is applied to the results"},
-      {GIMP_PDB_DRAWABLE, "alphamap", "Alpha map drawable"}
+      {GIMP_PDB_DRAWABLE, "alphamap", "Alpha map drawable"},
+      {GIMP_PDB_INT32, "encoding", "Normal encoding (0 = XYZ, 1 = XY, Z reconstructed, 2 = octahedral)"}
    };
    static gint nargs = sizeof(args) / sizeof(args[0]);
+   static GimpParamDef layer_args[] =
+   {
+      {GIMP_PDB_INT32, "run_mode", "Non-interactive, or the last values used"},
+      {GIMP_PDB_IMAGE, "image", "Input image"},
+      {GIMP_PDB_INT32, "num_drawables", "Number of drawables, 0 for every layer of the image"},
+      {GIMP_PDB_INT32ARRAY, "drawables", "Drawables to convert, those that are not RGB are skipped"}
+   };
+   static gint nlayer_args = sizeof(layer_args) / sizeof(layer_args[0]);
+   GimpParamDef *all_args;
 
+   /* scripts written for the first 16 arguments keep working, the
+      encoding is only taken by plug_in_normalmap2 */
    gimp_install_procedure("plug_in_normalmap",
                           "Converts image to an RGB normalmap",
                           "foo!",
@@ -150,8 +146,106 @@ static void query(void)
                           "<Image>/Filters/Map/Normalmap...",
                           "RGB*",
                           GIMP_PLUGIN,
+                          nargs - 1, 0,
+                          args, NULL);
+
+   gimp_install_procedure("plug_in_normalmap2",
+                          "Converts image to an RGB normalmap",
+                          "plug_in_normalmap with the normal encoding as "
+                          "a last argument.",
+                          "Shawn Kirst",
+                          "Shawn Kirst",
+                          "February 2002",
+                          NULL,
+                          "RGB*",
+                          GIMP_PLUGIN,
                           nargs, 0,
                           args, NULL);
+
+   /* the same settings after the drawables */
+   all_args = g_new(GimpParamDef, nlayer_args + nargs - 3);
+   memcpy(all_args, layer_args, nlayer_args * sizeof(GimpParamDef));
+   memcpy(all_args + nlayer_args, args + 3, (nargs - 3) * sizeof(GimpParamDef));
+
+   gimp_install_procedure("plug_in_normalmap_layers",
+                          "Converts several drawables to RGB normalmaps",
+                          "Converts every layer of an image, or the drawables "
+                          "given, with the settings of plug_in_normalmap in "
+                          "one call.  The drawables are converted concurrently.",
+                          "Shawn Kirst",
+                          "Shawn Kirst",
+                          "February 2002",
+                          NULL,
+                          "RGB*",
+                          GIMP_PLUGIN,
+                          nlayer_args + nargs - 3, 0,
+                          all_args, NULL);
+
+   g_free(all_args);
+}
+
+/* The settings from the non-interactive arguments, 'param' pointing at
+ * the filter.  'nparams' counts from there.
+ */
+static void get_pdb_vals(gint nparams, const GimpParam *param)
+{
+   nmapvals.filter = param[0].data.d_int32;
+   nmapvals.minz = param[1].data.d_float;
+   nmapvals.scale = param[2].data.d_float;
+   nmapvals.wrap = param[3].data.d_int32;
+   nmapvals.height_source = param[4].data.d_int32;
+   nmapvals.alpha = param[5].data.d_int32;
+   nmapvals.conversion = param[6].data.d_int32;
+   nmapvals.dudv = param[7].data.d_int32;
+   nmapvals.xinvert = param[8].data.d_int32;
+   nmapvals.yinvert = param[9].data.d_int32;
+   nmapvals.swapRGB = param[10].data.d_int32;
+   nmapvals.contrast = param[11].data.d_float;
+   nmapvals.alphamap_id = param[12].data.d_int32;
+   if(nmapvals.alphamap_id != 0)
+      nmapvals.alphamap_id = gimp_drawable_get(param[12].data.d_drawable)->drawable_id;
+   nmapvals.encoding = (nparams > 13) ? param[13].data.d_int32 : ENCODE_XYZ;
+}
+
+static void run_layers(gint nparams, const GimpParam *param,
+                       GimpPDBStatusType *status)
+{
+   GimpRunMode run_mode = param[0].data.d_int32;
+   gint32 image_id = param[1].data.d_image;
+   gint32 *ids;
+   gint count;
+
+   if(run_mode == GIMP_RUN_NONINTERACTIVE)
+   {
+      if(nparams != 17 && nparams != 18)
+      {
+         *status = GIMP_PDB_CALLING_ERROR;
+         return;
+      }
+      get_pdb_vals(nparams - 4, param + 4);
+   }
+   else
+      gimp_get_data("plug_in_normalmap", &nmapvals);
+
+   count = param[2].data.d_int32;
+   if(count > 0)
+      ids = g_memdup(param[3].data.d_int32array, count * sizeof(gint32));
+   else
+      ids = gimp_image_get_layers(image_id, &count);
+
+   gimp_image_undo_group_start(image_id);
+   gimp_progress_init("Creating normalmaps...");
+
+   if(normalmap_layers(ids, count) != 0)
+      *status = GIMP_PDB_EXECUTION_ERROR;
+
+   gimp_progress_end();
+   gimp_image_undo_group_end(image_id);
+
+   if(run_mode != GIMP_RUN_NONINTERACTIVE)
+      gimp_displays_flush();
+
+   g_free(ids);
 }
 
 static void run(const gchar *name, gint nparams, const GimpParam *param,
@@ -170,6 +264,13 @@ static void run(const gchar *name, gint nparams, const GimpParam *param,
    values[0].type = GIMP_PDB_STATUS;
    values[0].data.d_status = status;
 
+   if(!strcmp(name, "plug_in_normalmap_layers"))
+   {
+      run_layers(nparams, param, &status);
+      values[0].data.d_status = status;
+      return;
+   }
+
    drawable = gimp_drawable_get(param[2].data.d_drawable);
 
    switch(run_mode)
@@ -184,26 +285,10 @@ static void run(const gchar *name, gint nparams, const GimpParam *param,
          }
          break;
       case GIMP_RUN_NONINTERACTIVE:
-         if(nparams != 16)
+         if(nparams != (strcmp(name, "plug_in_normalmap2") ? 16 : 17))
             status=GIMP_PDB_CALLING_ERROR;
          else
-         {
-            nmapvals.filter = param[3].data.d_int32;
-            nmapvals.minz = param[4].data.d_float;
-            nmapvals.scale = param[5].data.d_float;
-            nmapvals.wrap = param[6].data.d_int32;
-            nmapvals.height_source = param[7].data.d_int32;
-            nmapvals.alpha = param[8].data.d_int32;
-            nmapvals.conversion = param[9].data.d_int32;
-            nmapvals.dudv = param[10].data.d_int32;
-            nmapvals.xinvert = param[11].data.d_int32;
-            nmapvals.yinvert = param[12].data.d_int32;
-            nmapvals.swapRGB = param[13].data.d_int32;
-            nmapvals.contrast = param[14].data.d_float;
-            nmapvals.alphamap_id = param[15].data.d_int32;
-            if(nmapvals.alphamap_id != 0)
-               nmapvals.alphamap_id = gimp_drawable_get(param[15].data.d_drawable)->drawable_id;
-         }
+            get_pdb_vals(nparams - 3, param + 3);
          break;
       case GIMP_RUN_WITH_LAST_VALS:
          gimp_get_data("plug_in_normalmap", &nmapvals);
@@ -230,282 +315,323 @@ static void run(const gchar *name, gint nparams, const GimpParam *param,
    gimp_drawable_detach(drawable);
 }
 
-#ifndef min
-# ifdef __GNUC__
-#  define min(a,b)  ({typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b;})
-# else
-#  define min(a,b)  ((a)<(b) ? (a) : (b))
-# endif
-#endif
+/* Memory from an arena, failing the way g_malloc() does. */
+static gpointer arena_get(arena *a, gsize size)
+{
+   gpointer p = arena_alloc(a, size);
 
-#ifndef max
-# ifdef __GNUC__
-#  define max(a,b)  ({typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b;})
-# else
-#  define max(a,b)  ((a)>(b) ? (a) : (b))
-# endif
-#endif
+   if(p == 0)
+      g_error("%s: failed to allocate %lu bytes", G_STRLOC, (gulong)size);
+   return(p);
+}
 
-#define SQR(x)      ((x) * (x))
-#define LERP(a,b,c) ((a) + ((b) - (a)) * (c))
+static arena *get_scratch(void)
+{
+   if(scratch == 0 && (scratch = arena_new()) == 0)
+      g_error("%s: failed to allocate an arena", G_STRLOC);
+   return(scratch);
+}
 
-static inline void NORMALIZE(float *v)
+/* Bakes a cone step map for the relief shaders from the heights and adds it
+ * to the image as a channel.  The depth it is built from is what ends up in
+ * alpha, so it matches the "Relief" and "Cone step" 3D preview modes.
+ */
+static void add_conemap_channel(GimpDrawable *drawable, float *heights,
+                                int width, int height)
 {
-   float len = sqrtf(SQR(v[0]) + SQR(v[1]) + SQR(v[2]));
+   gint32 image_id, channel_id;
+   GimpDrawable *channel;
+   GimpPixelRgn rgn;
+   GimpRGB black;
+   float *depth;
+   guchar *cone;
+   int i;
+   size_t mark = arena_mark(get_scratch());
+
+   depth = arena_get(scratch, width * height * sizeof(float));
+   cone = arena_get(scratch, width * height);
+
+   for(i = 0; i < width * height; ++i)
+   {
+      if(nmapvals.alpha == ALPHA_HEIGHT)
+         depth[i] = heights[i];
+      else
+         depth[i] = 1.0f - heights[i];
+   }
+
+   gimp_progress_set_text("Baking cone map...");
 
-   if(len > 1e-04f)
+   if(conemap_bake(cone, 1, depth, width, height, nmapvals.wrap, 0) == 0)
    {
-      len = 1.0f / len;
-      v[0] *= len;
-      v[1] *= len;
-      v[2] *= len;
+      image_id = gimp_drawable_get_image(drawable->drawable_id);
+      gimp_rgb_set(&black, 0, 0, 0);
+      channel_id = gimp_channel_new(image_id, "Cone map", width, height,
+                                    100.0, &black);
+      gimp_image_add_channel(image_id, channel_id, 0);
+
+      channel = gimp_drawable_get(channel_id);
+      gimp_pixel_rgn_init(&rgn, channel, 0, 0, width, height, 1, 0);
+      gimp_pixel_rgn_set_rect(&rgn, cone, 0, 0, width, height);
+      gimp_drawable_flush(channel);
+      gimp_drawable_update(channel_id, 0, 0, width, height);
+      gimp_drawable_detach(channel);
    }
    else
-      v[0] = v[1] = v[2] = 0;
+      g_message("Memory allocation error!");
+
+   arena_release(scratch, mark);
 }
 
-typedef struct
+static int preview_progress(float progress, void *data)
 {
-   int x,y;
-   float w;
-} kernel_element;
+   while(gtk_events_pending())
+      gtk_main_iteration();
+   return(0);
+}
 
-static void make_kernel(kernel_element *k, float *weights, int size)
+static int plugin_progress(float progress, void *data)
 {
-   int x, y, idx;
-
-   for(y = 0; y < size; ++y)
-   {
-      for(x = 0; x < size; ++x)
-      {
-         idx = x + y * size;
-         k[idx].x = x - (size / 2);
-         k[idx].y = (size / 2) - y;
-         k[idx].w = weights[idx];
-      }
-   }
+   gimp_progress_update(progress);
+   return(0);
 }
 
-static void rotate_array(float *dst, float *src, int size)
+/* The bake cache named by NORMALMAP_CACHE_DIR, trimmed to
+ * NORMALMAP_CACHE_SIZE megabytes, or NULL when there is none.
+ */
+static bake_cache *open_cache(void)
 {
-   int x, y, newx, newy;
-
-   for(y = 0; y < size; ++y)
-   {
-      for(x = 0; x < size; ++x)
-      {
-         newy = size - x - 1;
-         newx = y;
-         dst[newx + newy * size] = src[x + y * size];
-      }
-   }
+   const gchar *dir = g_getenv("NORMALMAP_CACHE_DIR");
+   const gchar *size = g_getenv("NORMALMAP_CACHE_SIZE");
+   char err[256];
+
+   if(dir == 0 || *dir == 0)
+      return(0);
+   return(bake_cache_open(dir, size ? g_ascii_strtoll(size, 0, 10) << 20 : 0,
+                          err, sizeof(err)));
 }
 
-static int sample_alpha_map(unsigned char *pixels, int x, int y,
-                            int w, int h, int sw, int sh)
+/* Loads the tiles the 5x5 and larger filters go by from the GIMP
+ * directory, timing them for this machine the first time with 'tune' set.
+ * The preview does not wait the second that takes, it converts with the
+ * defaults until a render has timed them.
+ */
+static void load_tiling(gboolean tune)
 {
-   int ix, iy, wx, wy, v;
-   int a, b, c, d;
-   unsigned char *s;
+   static gboolean loaded = FALSE;
+   gchar *fn;
+   int columns, rows;
 
-   if(sh > 1)
-   {
-      iy = (((h - 1) * y) << 7) / (sh - 1);
-      if(y == sh - 1) --iy;
-      wy = iy & 0x7f;
-      iy >>= 7;
-   }
-   else
-      iy = wy = 0;
+   if(loaded || normalmap_filter_radius(nmapvals.filter) < 2)
+      return;
 
-   if(sw > 1)
+   fn = gimp_personal_rc_file("normalmap-tiling");
+   if(normalmap_load_tiling(fn) == 0)
+      loaded = TRUE;
+   else if(tune)
    {
-      ix = (((w - 1) * x) << 7) / (sw - 1);
-      if(x == sw - 1) --ix;
-      wx = ix & 0x7f;
-      ix >>= 7;
+      loaded = TRUE;
+      if(normalmap_tune_tiling(&columns, &rows) == 0)
+         normalmap_save_tiling(fn);
    }
-   else
-      ix = wx = 0;
+   g_free(fn);
+}
 
-   s = pixels + ((iy - 1) * w + (ix - 1));
+/* Where NORMALMAP_STATS says the JSON lines of timings and counters go, a
+ * file to append to or standard error for "1", "-" and "stderr".  NULL
+ * when it is not set.
+ */
+static FILE *open_stats(void)
+{
+   const gchar *fn = g_getenv("NORMALMAP_STATS");
 
-   b = icerp(s[w + 0],
-             s[w + 1],
-             s[w + 2],
-             s[w + 3], wx);
-   if(iy > 0)
-   {
-      a = icerp(s[0],
-                s[1],
-                s[2],
-                s[3], wx);
-   }
-   else
-      a = b;
+   if(fn == 0 || *fn == 0 || !strcmp(fn, "0"))
+      return(0);
+   if(!strcmp(fn, "1") || !strcmp(fn, "-") || !strcmp(fn, "stderr"))
+      return(stderr);
+   return(fopen(fn, "a"));
+}
 
-   c = icerp(s[2 * w + 0],
-             s[2 * w + 1],
-             s[2 * w + 2],
-             s[2 * w + 3], wx);
-   if(iy < sh - 1)
-   {
-      d = icerp(s[3 * w + 0],
-                s[3 * w + 1],
-                s[3 * w + 2],
-                s[3 * w + 3], wx);
-   }
-   else
-      d = c;
+static void close_stats(FILE *f)
+{
+   if(f && f != stderr) fclose(f);
+}
 
-   v = icerp(a, b, c, d, wy);
+/* Adds hardware counters to the statistics of the calling thread when
+ * NORMALMAP_PROFILE is set.  Where there are none that is said once and
+ * the timings go on without them.
+ */
+static void start_profile(void)
+{
+   static volatile gint warned = 0;
+   const gchar *env = g_getenv("NORMALMAP_PROFILE");
+   char err[256];
 
-   if(v <   0) v = 0;
-   if(v > 255) v = 255;
+   if(env == 0 || *env == 0 || !strcmp(env, "0"))
+      return;
+   if(normalmap_profile(1, err, sizeof(err)) != 0 &&
+      g_atomic_int_compare_and_exchange(&warned, 0, 1))
+      g_printerr("normalmap: %s\n", err);
+}
 
-   return((unsigned char)v);
+/* One line for a drawable, 'ms' holds the reading, baking, writing back
+ * and cone map times.
+ */
+static void write_stats(FILE *f, const gchar *procedure,
+                        GimpDrawable *drawable, const double ms[4],
+                        int ret, int cached, const normalmap_stats *st)
+{
+   char buf[4096];
+
+   normalmap_stats_json(st, buf, sizeof(buf));
+
+   fprintf(f, "{\"tool\": \"%s\", \"drawable\": %d, "
+           "\"status\": \"%s\", \"width\": %d, \"height\": %d, "
+           "\"bpp\": %d, \"read_ms\": %.3f, \"bake_ms\": %.3f, "
+           "\"write_ms\": %.3f, \"conemap_ms\": %.3f, %s}\n",
+           procedure, drawable->drawable_id,
+           ret != 0 ? "failed" : cached ? "cached" : "ok",
+           drawable->width, drawable->height, drawable->bpp,
+           ms[0], ms[1], ms[2], ms[3], buf);
+   fflush(f);
 }
 
-static void make_heightmap(unsigned char *image, int w, int h, int bpp)
+/* The settings for a drawable with 'bpp' bytes per pixel.  The alpha map
+ * is left for read_alphamap().
+ */
+static void get_params(normalmap_params *p, int bpp)
 {
-   unsigned int i, num_pixels = w * h;
-   int x, y;
-   float v, hmin, hmax;
-   float *s, *r;
+   normalmap_default_params(p);
+   p->filter = nmapvals.filter;
+   p->minz = nmapvals.minz;
+   p->scale = nmapvals.scale;
+   p->wrap = nmapvals.wrap;
+   p->height_source = (bpp == 4) ? nmapvals.height_source : 0;
+   p->alpha = nmapvals.alpha;
+   p->conversion = nmapvals.conversion;
+   p->dudv = nmapvals.dudv;
+   if(bpp != 4 && (p->dudv == DUDV_16BIT_SIGNED ||
+                   p->dudv == DUDV_16BIT_UNSIGNED))
+      p->dudv = DUDV_NONE;
+   p->xinvert = nmapvals.xinvert;
+   p->yinvert = nmapvals.yinvert;
+   p->swapRGB = nmapvals.swapRGB;
+   p->contrast = nmapvals.contrast;
+   p->encoding = nmapvals.encoding;
+}
 
-   s = (float*)g_malloc(w * h * 3 * sizeof(float));
-   if(s == 0)
-   {
-      g_message("Memory allocation error!");
-      return;
-   }
-   r = (float*)g_malloc(w * h * 4 * sizeof(float));
-   if(r == 0)
-   {
-      g_free(s);
-      g_message("Memory allocation error!");
-      return;
-   }
+/* Reads the alpha map drawable into 'p' when the settings use it.  Returns
+ * the pixels, or NULL.  They come from 'a', or without it from g_malloc()
+ * to be freed with g_free().
+ */
+static guchar *read_alphamap(normalmap_params *p, arena *a)
+{
+   GimpDrawable *alphamap;
+   GimpPixelRgn amap_rgn;
+   guchar *amap;
 
-   /* scale into 0 to 1 range, make signed -1 to 1 */
-   for(i = 0; i < num_pixels; ++i)
-   {
-      s[3 * i + 0] = (((float)image[bpp * i + 0] / 255.0f) - 0.5) * 2.0f;
-      s[3 * i + 1] = (((float)image[bpp * i + 1] / 255.0f) - 0.5) * 2.0f;
-      s[3 * i + 2] = (((float)image[bpp * i + 2] / 255.0f) - 0.5) * 2.0f;
-   }
+   if(p->dudv || nmapvals.alpha != ALPHA_MAP || nmapvals.alphamap_id == 0)
+      return(0);
 
-   memset(r, 0, w * h * 4 * sizeof(float));
+   alphamap = gimp_drawable_get(nmapvals.alphamap_id);
 
-#define S(x, y, n) s[(y) * (w * 3) + ((x) * 3) + (n)]
-#define R(x, y, n) r[(y) * (w * 4) + ((x) * 4) + (n)]
+   p->alphamap_width = alphamap->width;
+   p->alphamap_height = alphamap->height;
 
-   /* top-left to bottom-right */
-   for(x = 1; x < w; ++x)
-      R(x, 0, 0) = R(x - 1, 0, 0) + S(x - 1, 0, 0);
-   for(y = 1; y < h; ++y)
-      R(0, y, 0) = R(0, y - 1, 0) + S(0, y - 1, 1);
-   for(y = 1; y < h; ++y)
-   {
-      for(x = 1; x < w; ++x)
-      {
-         R(x, y, 0) = (R(x, y - 1, 0) + R(x - 1, y, 0) +
-                       S(x - 1, y, 0) + S(x, y - 1, 1)) * 0.5f;
-      }
-   }
+   if(a)
+      amap = arena_get(a, p->alphamap_width * p->alphamap_height);
+   else
+      amap = g_malloc(p->alphamap_width * p->alphamap_height);
 
-   /* top-right to bottom-left */
-   for(x = w - 2; x >= 0; --x)
-      R(x, 0, 1) = R(x + 1, 0, 1) - S(x + 1, 0, 0);
-   for(y = 1; y < h; ++y)
-      R(0, y, 1) = R(0, y - 1, 1) + S(0, y - 1, 1);
-   for(y = 1; y < h; ++y)
-   {
-      for(x = w - 2; x >= 0; --x)
-      {
-         R(x, y, 1) = (R(x, y - 1, 1) + R(x + 1, y, 1) -
-                       S(x + 1, y, 0) + S(x, y - 1, 1)) * 0.5f;
-      }
-   }
+   gimp_pixel_rgn_init(&amap_rgn, alphamap, 0, 0, p->alphamap_width,
+                       p->alphamap_height, 0, 0);
+   gimp_pixel_rgn_get_rect(&amap_rgn, amap, 0, 0, p->alphamap_width,
+                           p->alphamap_height);
+   p->alphamap = amap;
 
-   /* bottom-left to top-right */
-   for(x = 1; x < w; ++x)
-      R(x, 0, 2) = R(x - 1, 0, 2) + S(x - 1, 0, 0);
-   for(y = h - 2; y >= 0; --y)
-      R(0, y, 2) = R(0, y + 1, 2) - S(0, y + 1, 1);
-   for(y = h - 2; y >= 0; --y)
-   {
-      for(x = 1; x < w; ++x)
-      {
-         R(x, y, 2) = (R(x, y + 1, 2) + R(x - 1, y, 2) +
-                       S(x - 1, y, 0) - S(x, y + 1, 1)) * 0.5f;
-      }
-   }
+   return(amap);
+}
+
+/* only when the normals were computed from heights */
+static int wants_conemap(void)
+{
+   return(nmapvals.conemap && !nmapvals.dudv &&
+          nmapvals.conversion != CONVERT_NORMALIZE_ONLY &&
+          nmapvals.conversion != CONVERT_DUDV_TO_NORMAL &&
+          nmapvals.conversion != CONVERT_HEIGHTMAP);
+}
 
-   /* bottom-right to top-left */
-   for(x = w - 2; x >= 0; --x)
-      R(x, 0, 3) = R(x + 1, 0, 3) - S(x + 1, 0, 0);
-   for(y = h - 2; y >= 0; --y)
-      R(0, y, 3) = R(0, y + 1, 3) - S(0, y + 1, 1);
-   for(y = h - 2; y >= 0; --y)
+/* normalmap_convert() through the bake cache, when there is one.  'hit'
+ * is set if the result came out of the cache.  dst may be src, the key is
+ * taken before anything is written, and an entry is then read aside and
+ * only copied over the source once all of it has been read, so one cut
+ * short leaves the source to convert.
+ */
+static int convert_cached(bake_cache *cache, guchar *dst, const guchar *src,
+                          gint width, gint height, gint bpp,
+                          const normalmap_params *p, float *heights,
+                          normalmap_progress_func progress, void *data,
+                          int *hit)
+{
+   size_t size = (size_t)width * height * bpp;
+   bake_key key;
+   guchar *entry;
+   char tag[64];
+   int ret;
+
+   *hit = 0;
+   if(cache)
    {
-      for(x = w - 2; x >= 0; --x)
-      {
-         R(x, y, 3) = (R(x, y + 1, 3) + R(x + 1, y, 3) -
-                       S(x + 1, y, 0) - S(x, y + 1, 1)) * 0.5f;
-      }
+      g_snprintf(tag, sizeof(tag), "plugin %dx%d bpp %d", width, height, bpp);
+      bake_cache_key(&key, src, size, p, tag);
+      entry = (dst == src) ? g_try_malloc(size) : dst;
+      if(entry && bake_cache_get(cache, &key, entry, size) == 0)
+         *hit = 1;
+      if(*hit && entry != dst)
+         memcpy(dst, entry, size);
+      if(entry != dst)
+         g_free(entry);
+      if(*hit)
+         return(0);
    }
 
-#undef S
-#undef R
+   ret = normalmap_convert(dst, width * bpp, src, width * bpp, width, height,
+                           bpp, p, heights, progress, data);
+   if(ret == 0 && cache)
+      bake_cache_put(cache, &key, dst, size);
 
-   /* accumulate, find min/max */
-   hmin =  1e10f;
-   hmax = -1e10f;
-   for(i = 0; i < num_pixels; ++i)
-   {
-      r[4 * i] += r[4 * i + 1] + r[4 * i + 2] + r[4 * i + 3];
-      if(r[4 * i] < hmin) hmin = r[4 * i];
-      if(r[4 * i] > hmax) hmax = r[4 * i];
-   }
+   return(ret);
+}
 
-   /* scale into 0 - 1 range */
-   for(i = 0; i < num_pixels; ++i)
-   {
-      v = (r[4 * i] - hmin) / (hmax - hmin);
-      /* adjust contrast */
-      v = (v - 0.5f) * nmapvals.contrast + v;
-      if(v < 0) v = 0;
-      if(v > 1) v = 1;
-      r[4 * i] = v;
-   }
+static void write_drawable(GimpDrawable *drawable, const guchar *dst)
+{
+   GimpPixelRgn dst_rgn;
+   gint width = drawable->width, height = drawable->height;
 
-   /* write out results */
-   for(i = 0; i < num_pixels; ++i)
-   {
-      v = r[4 * i] * 255.0f;
-      image[bpp * i + 0] = (unsigned char)v;
-      image[bpp * i + 1] = (unsigned char)v;
-      image[bpp * i + 2] = (unsigned char)v;
-   }
+   gimp_pixel_rgn_init(&dst_rgn, drawable, 0, 0, width, height, 1, 1);
+   gimp_pixel_rgn_set_rect(&dst_rgn, dst, 0, 0, width, height);
 
-   g_free(s);
-   g_free(r);
+   gimp_drawable_flush(drawable);
+   gimp_drawable_merge_shadow(drawable->drawable_id, 1);
+   gimp_drawable_update(drawable->drawable_id, 0, 0, width, height);
 }
 
 static gint32 normalmap(GimpDrawable *drawable, gboolean preview_mode)
 {
-   gint x, y;
-   gint width, height, bpp, rowbytes, pw, ph, amap_w = 0, amap_h = 0;
-   guchar *d, *dst, *s, *src, *tmp, *amap = 0;
+   gint width, height, bpp, rowbytes, pw, ph;
+   guchar *pixels, *tmp;
    float *heights;
-   float val, du, dv, n[3], weight;
-   float rgb_bias[3];
-   int i, num_elements = 0;
-   kernel_element *kernel_du = 0;
-   kernel_element *kernel_dv = 0;
-   GimpPixelRgn src_rgn, dst_rgn, amap_rgn;
+   int ret, bake_cone, cached;
+   normalmap_params p;
+   normalmap_stats st;
+   GimpPixelRgn src_rgn;
    GdkCursor *cursor = 0;
+   bake_cache *cache = 0;
+   arena *prev_scratch;
+   progress_meter meter;
+   FILE *stats_file = 0;
+   GTimer *timer = 0;
+   double ms[4] = {0, 0, 0, 0};
+   size_t mark;
 
    if(nmapvals.filter < 0 || nmapvals.filter >= MAX_FILTER_TYPE)
       nmapvals.filter = FILTER_NONE;
@@ -513,653 +639,414 @@ static gint32 normalmap(GimpDrawable *drawable, gboolean preview_mode)
    if(drawable->bpp != 4 && (nmapvals.dudv == DUDV_16BIT_SIGNED ||
                              nmapvals.dudv == DUDV_16BIT_UNSIGNED))
       nmapvals.dudv = DUDV_NONE;
+   if(nmapvals.encoding < 0 || nmapvals.encoding >= MAX_ENCODING)
+      nmapvals.encoding = ENCODE_XYZ;
 
    width = drawable->width;
    height = drawable->height;
    bpp = drawable->bpp;
    rowbytes = width * bpp;
 
-   dst = g_malloc(width * height * bpp);
-   if(dst == 0)
+   get_params(&p, bpp);
+   load_tiling(!preview_mode);
+
+   mark = arena_mark(get_scratch());
+
+   bake_cone = !preview_mode && wants_conemap();
+
+   /* converted in place, with heights only kept for the cone map, that is
+      width * height * bpp for most conversions, plus 4 bytes a pixel for
+      the heights the library works from */
+   pixels = arena_get(scratch, width * height * bpp);
+   heights = bake_cone ?
+      arena_get(scratch, width * height * sizeof(float)) : 0;
+
+   if(bpp == 4)
+      read_alphamap(&p, scratch);
+
+   if(!preview_mode && (stats_file = open_stats()) != 0)
    {
-      g_message("Memory allocation error!");
-      return(-1);
+      memset(&st, 0, sizeof(st));
+      normalmap_collect_stats(&st);
+      start_profile();
+      timer = g_timer_new();
    }
 
-   src = g_malloc(width * height * bpp);
-   if(src == 0)
+   gimp_pixel_rgn_init(&src_rgn, drawable, 0, 0, width, height, 0, 0);
+   gimp_pixel_rgn_get_rect(&src_rgn, pixels, 0, 0, width, height);
+
+   if(timer)
    {
-      g_message("Memory allocation error!");
-      return(-1);
+      ms[0] = g_timer_elapsed(timer, 0) * 1000.0;
+      g_timer_start(timer);
    }
 
-   heights = g_new(float, width * height);
-   if(heights == 0)
+   if(preview_mode)
    {
-      g_message("Memory allocation error!");
-      return(-1);
+      cursor = gdk_cursor_new(GDK_WATCH);
+      gdk_window_set_cursor(GDK_WINDOW(dialog->window), cursor);
+      gdk_cursor_unref(cursor);
    }
 
-   if(!nmapvals.dudv && drawable->bpp == 4 && nmapvals.alpha == ALPHA_MAP &&
-      nmapvals.alphamap_id != 0)
-   {
-      GimpDrawable *alphamap = gimp_drawable_get(nmapvals.alphamap_id);
+   /* the cone map needs the heights, which are not kept */
+   if(!preview_mode && !bake_cone)
+      cache = open_cache();
 
-      amap_w = alphamap->width;
-      amap_h = alphamap->height;
+   /* a report per row would be a round trip to GIMP, or a trip through
+      the main loop, for every one of them */
+   progress_meter_init(&meter, height,
+                       preview_mode ? preview_progress : plugin_progress, 0);
 
-      amap = g_malloc(amap_w * amap_h);
+   /* the preview's progress runs the main loop, which may get here again */
+   prev_scratch = normalmap_scratch_arena(scratch);
+   ret = convert_cached(cache, pixels, pixels, width, height, bpp, &p,
+                        heights, progress_meter_func, &meter, &cached);
+   normalmap_scratch_arena(prev_scratch);
+   bake_cache_close(cache);
 
-      gimp_pixel_rgn_init(&amap_rgn, alphamap, 0, 0, amap_w, amap_h, 0, 0);
-      gimp_pixel_rgn_get_rect(&amap_rgn, amap, 0, 0, amap_w, amap_h);
+   if(timer)
+   {
+      ms[1] = g_timer_elapsed(timer, 0) * 1000.0;
+      g_timer_start(timer);
    }
 
-   gimp_pixel_rgn_init(&src_rgn, drawable, 0, 0, width, height, 0, 0);
-   gimp_pixel_rgn_get_rect(&src_rgn, src, 0, 0, width, height);
-
-   switch(nmapvals.filter)
+   if(ret != 0)
    {
-      case FILTER_NONE:
-         num_elements = 2;
-         kernel_du = (kernel_element*)g_malloc(2 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(2 * sizeof(kernel_element));
-
-         kernel_du[0].x = -1; kernel_du[0].y = 0; kernel_du[0].w = -0.5f;
-         kernel_du[1].x =  1; kernel_du[1].y = 0; kernel_du[1].w =  0.5f;
+      if(preview_mode)
+         gdk_window_set_cursor(GDK_WINDOW(dialog->window), 0);
+      else
+         g_message("Memory allocation error!");
+   }
+   else if(preview_mode)
+   {
+      /* the 3D preview shades with plain xyz normals */
+      if(p.encoding != ENCODE_XYZ && !p.dudv &&
+         p.conversion != CONVERT_HEIGHTMAP)
+      {
+         tmp = arena_get(scratch, width * height * bpp);
+         memcpy(tmp, pixels, width * height * bpp);
+         normalmap_decode(tmp, rowbytes, width, height, bpp, p.encoding);
+         update_3D_preview(width, height, bpp, tmp);
+      }
+      else
+         update_3D_preview(width, height, bpp, pixels);
 
-         kernel_dv[0].x = 0; kernel_dv[0].y =  1; kernel_dv[0].w =  0.5f;
-         kernel_dv[1].x = 0; kernel_dv[1].y = -1; kernel_dv[1].w = -0.5f;
+      pw = GIMP_PREVIEW_AREA(preview)->width;
+      ph = GIMP_PREVIEW_AREA(preview)->height;
+      rowbytes = pw * bpp;
 
-         break;
-      case FILTER_SOBEL_3x3:
-         num_elements = 6;
-         kernel_du = (kernel_element*)g_malloc(6 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(6 * sizeof(kernel_element));
-
-         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -1.0f;
-         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -2.0f;
-         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -1.0f;
-         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  1.0f;
-         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  2.0f;
-         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  1.0f;
-
-         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  1.0f;
-         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  2.0f;
-         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  1.0f;
-         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -1.0f;
-         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -2.0f;
-         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -1.0f;
+      tmp = arena_get(scratch, pw * ph * bpp);
+      scale_pixels(tmp, pw, ph, pixels, width, height, bpp);
 
-         break;
-      case FILTER_SOBEL_5x5:
-         num_elements = 20;
-         kernel_du = (kernel_element*)g_malloc(20 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(20 * sizeof(kernel_element));
-
-         kernel_du[ 0].x = -2; kernel_du[ 0].y =  2; kernel_du[ 0].w =  -1.0f;
-         kernel_du[ 1].x = -2; kernel_du[ 1].y =  1; kernel_du[ 1].w =  -4.0f;
-         kernel_du[ 2].x = -2; kernel_du[ 2].y =  0; kernel_du[ 2].w =  -6.0f;
-         kernel_du[ 3].x = -2; kernel_du[ 3].y = -1; kernel_du[ 3].w =  -4.0f;
-         kernel_du[ 4].x = -2; kernel_du[ 4].y = -2; kernel_du[ 4].w =  -1.0f;
-         kernel_du[ 5].x = -1; kernel_du[ 5].y =  2; kernel_du[ 5].w =  -2.0f;
-         kernel_du[ 6].x = -1; kernel_du[ 6].y =  1; kernel_du[ 6].w =  -8.0f;
-         kernel_du[ 7].x = -1; kernel_du[ 7].y =  0; kernel_du[ 7].w = -12.0f;
-         kernel_du[ 8].x = -1; kernel_du[ 8].y = -1; kernel_du[ 8].w =  -8.0f;
-         kernel_du[ 9].x = -1; kernel_du[ 9].y = -2; kernel_du[ 9].w =  -2.0f;
-         kernel_du[10].x =  1; kernel_du[10].y =  2; kernel_du[10].w =   2.0f;
-         kernel_du[11].x =  1; kernel_du[11].y =  1; kernel_du[11].w =   8.0f;
-         kernel_du[12].x =  1; kernel_du[12].y =  0; kernel_du[12].w =  12.0f;
-         kernel_du[13].x =  1; kernel_du[13].y = -1; kernel_du[13].w =   8.0f;
-         kernel_du[14].x =  1; kernel_du[14].y = -2; kernel_du[14].w =   2.0f;
-         kernel_du[15].x =  2; kernel_du[15].y =  2; kernel_du[15].w =   1.0f;
-         kernel_du[16].x =  2; kernel_du[16].y =  1; kernel_du[16].w =   4.0f;
-         kernel_du[17].x =  2; kernel_du[17].y =  0; kernel_du[17].w =   6.0f;
-         kernel_du[18].x =  2; kernel_du[18].y = -1; kernel_du[18].w =   4.0f;
-         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =   1.0f;
-
-         kernel_dv[ 0].x = -2; kernel_dv[ 0].y =  2; kernel_dv[ 0].w =   1.0f;
-         kernel_dv[ 1].x = -1; kernel_dv[ 1].y =  2; kernel_dv[ 1].w =   4.0f;
-         kernel_dv[ 2].x =  0; kernel_dv[ 2].y =  2; kernel_dv[ 2].w =   6.0f;
-         kernel_dv[ 3].x =  1; kernel_dv[ 3].y =  2; kernel_dv[ 3].w =   4.0f;
-         kernel_dv[ 4].x =  2; kernel_dv[ 4].y =  2; kernel_dv[ 4].w =   1.0f;
-         kernel_dv[ 5].x = -2; kernel_dv[ 5].y =  1; kernel_dv[ 5].w =   2.0f;
-         kernel_dv[ 6].x = -1; kernel_dv[ 6].y =  1; kernel_dv[ 6].w =   8.0f;
-         kernel_dv[ 7].x =  0; kernel_dv[ 7].y =  1; kernel_dv[ 7].w =  12.0f;
-         kernel_dv[ 8].x =  1; kernel_dv[ 8].y =  1; kernel_dv[ 8].w =   8.0f;
-         kernel_dv[ 9].x =  2; kernel_dv[ 9].y =  1; kernel_dv[ 9].w =   2.0f;
-         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w =  -2.0f;
-         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w =  -8.0f;
-         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -12.0f;
-         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w =  -8.0f;
-         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w =  -2.0f;
-         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w =  -1.0f;
-         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w =  -4.0f;
-         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w =  -6.0f;
-         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w =  -4.0f;
-         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w =  -1.0f;
+      gimp_preview_area_draw(GIMP_PREVIEW_AREA(preview), 0, 0, pw, ph,
+                             (bpp == 4) ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
+                             tmp, rowbytes);
 
-         break;
-      case FILTER_PREWITT_3x3:
-         num_elements = 6;
-         kernel_du = (kernel_element*)g_malloc(6 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(6 * sizeof(kernel_element));
-
-         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -1.0f;
-         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -1.0f;
-         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -1.0f;
-         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  1.0f;
-         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  1.0f;
-         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  1.0f;
-
-         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  1.0f;
-         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  1.0f;
-         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  1.0f;
-         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -1.0f;
-         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -1.0f;
-         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -1.0f;
+      gdk_window_set_cursor(GDK_WINDOW(dialog->window), 0);
+   }
+   else
+   {
+      progress_meter_finish(&meter);
 
-         break;
-      case FILTER_PREWITT_5x5:
-         num_elements = 20;
-         kernel_du = (kernel_element*)g_malloc(20 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(20 * sizeof(kernel_element));
-
-         kernel_du[ 0].x = -2; kernel_du[ 0].y =  2; kernel_du[ 0].w = -1.0f;
-         kernel_du[ 1].x = -2; kernel_du[ 1].y =  1; kernel_du[ 1].w = -1.0f;
-         kernel_du[ 2].x = -2; kernel_du[ 2].y =  0; kernel_du[ 2].w = -1.0f;
-         kernel_du[ 3].x = -2; kernel_du[ 3].y = -1; kernel_du[ 3].w = -1.0f;
-         kernel_du[ 4].x = -2; kernel_du[ 4].y = -2; kernel_du[ 4].w = -1.0f;
-         kernel_du[ 5].x = -1; kernel_du[ 5].y =  2; kernel_du[ 5].w = -2.0f;
-         kernel_du[ 6].x = -1; kernel_du[ 6].y =  1; kernel_du[ 6].w = -2.0f;
-         kernel_du[ 7].x = -1; kernel_du[ 7].y =  0; kernel_du[ 7].w = -2.0f;
-         kernel_du[ 8].x = -1; kernel_du[ 8].y = -1; kernel_du[ 8].w = -2.0f;
-         kernel_du[ 9].x = -1; kernel_du[ 9].y = -2; kernel_du[ 9].w = -2.0f;
-         kernel_du[10].x =  1; kernel_du[10].y =  2; kernel_du[10].w =  2.0f;
-         kernel_du[11].x =  1; kernel_du[11].y =  1; kernel_du[11].w =  2.0f;
-         kernel_du[12].x =  1; kernel_du[12].y =  0; kernel_du[12].w =  2.0f;
-         kernel_du[13].x =  1; kernel_du[13].y = -1; kernel_du[13].w =  2.0f;
-         kernel_du[14].x =  1; kernel_du[14].y = -2; kernel_du[14].w =  2.0f;
-         kernel_du[15].x =  2; kernel_du[15].y =  2; kernel_du[15].w =  1.0f;
-         kernel_du[16].x =  2; kernel_du[16].y =  1; kernel_du[16].w =  1.0f;
-         kernel_du[17].x =  2; kernel_du[17].y =  0; kernel_du[17].w =  1.0f;
-         kernel_du[18].x =  2; kernel_du[18].y = -1; kernel_du[18].w =  1.0f;
-         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =  1.0f;
-
-         kernel_dv[ 0].x = -2; kernel_dv[ 0].y =  2; kernel_dv[ 0].w =  1.0f;
-         kernel_dv[ 1].x = -1; kernel_dv[ 1].y =  2; kernel_dv[ 1].w =  1.0f;
-         kernel_dv[ 2].x =  0; kernel_dv[ 2].y =  2; kernel_dv[ 2].w =  1.0f;
-         kernel_dv[ 3].x =  1; kernel_dv[ 3].y =  2; kernel_dv[ 3].w =  1.0f;
-         kernel_dv[ 4].x =  2; kernel_dv[ 4].y =  2; kernel_dv[ 4].w =  1.0f;
-         kernel_dv[ 5].x = -2; kernel_dv[ 5].y =  1; kernel_dv[ 5].w =  2.0f;
-         kernel_dv[ 6].x = -1; kernel_dv[ 6].y =  1; kernel_dv[ 6].w =  2.0f;
-         kernel_dv[ 7].x =  0; kernel_dv[ 7].y =  1; kernel_dv[ 7].w =  2.0f;
-         kernel_dv[ 8].x =  1; kernel_dv[ 8].y =  1; kernel_dv[ 8].w =  2.0f;
-         kernel_dv[ 9].x =  2; kernel_dv[ 9].y =  1; kernel_dv[ 9].w =  2.0f;
-         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w = -2.0f;
-         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w = -2.0f;
-         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -2.0f;
-         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w = -2.0f;
-         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w = -2.0f;
-         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w = -1.0f;
-         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w = -1.0f;
-         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w = -1.0f;
-         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w = -1.0f;
-         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w = -1.0f;
+      write_drawable(drawable, pixels);
 
-         break;
-      case FILTER_3x3:
-         num_elements = 6;
-         kernel_du = (kernel_element*)g_malloc(6 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(6 * sizeof(kernel_element));
-
-         weight = 1.0f / 6.0f;
-
-         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -weight;
-         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -weight;
-         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -weight;
-         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  weight;
-         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  weight;
-         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  weight;
-
-         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  weight;
-         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  weight;
-         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  weight;
-         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -weight;
-         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -weight;
-         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -weight;
-         break;
-      case FILTER_5x5:
+      if(timer)
       {
-         int n;
-         float usum = 0, vsum = 0;
-         float wt22 = 1.0f / 16.0f;
-         float wt12 = 1.0f / 10.0f;
-         float wt02 = 1.0f / 8.0f;
-         float wt11 = 1.0f / 2.8f;
-         num_elements = 20;
-         kernel_du = (kernel_element*)g_malloc(20 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(20 * sizeof(kernel_element));
-
-         kernel_du[0 ].x = -2; kernel_du[0 ].y =  2; kernel_du[0 ].w = -wt22;
-         kernel_du[1 ].x = -1; kernel_du[1 ].y =  2; kernel_du[1 ].w = -wt12;
-         kernel_du[2 ].x =  1; kernel_du[2 ].y =  2; kernel_du[2 ].w =  wt12;
-         kernel_du[3 ].x =  2; kernel_du[3 ].y =  2; kernel_du[3 ].w =  wt22;
-         kernel_du[4 ].x = -2; kernel_du[4 ].y =  1; kernel_du[4 ].w = -wt12;
-         kernel_du[5 ].x = -1; kernel_du[5 ].y =  1; kernel_du[5 ].w = -wt11;
-         kernel_du[6 ].x =  1; kernel_du[6 ].y =  1; kernel_du[6 ].w =  wt11;
-         kernel_du[7 ].x =  2; kernel_du[7 ].y =  1; kernel_du[7 ].w =  wt12;
-         kernel_du[8 ].x = -2; kernel_du[8 ].y =  0; kernel_du[8 ].w = -wt02;
-         kernel_du[9 ].x = -1; kernel_du[9 ].y =  0; kernel_du[9 ].w = -0.5f;
-         kernel_du[10].x =  1; kernel_du[10].y =  0; kernel_du[10].w =  0.5f;
-         kernel_du[11].x =  2; kernel_du[11].y =  0; kernel_du[11].w =  wt02;
-         kernel_du[12].x = -2; kernel_du[12].y = -1; kernel_du[12].w = -wt12;
-         kernel_du[13].x = -1; kernel_du[13].y = -1; kernel_du[13].w = -wt11;
-         kernel_du[14].x =  1; kernel_du[14].y = -1; kernel_du[14].w =  wt11;
-         kernel_du[15].x =  2; kernel_du[15].y = -1; kernel_du[15].w =  wt12;
-         kernel_du[16].x = -2; kernel_du[16].y = -2; kernel_du[16].w = -wt22;
-         kernel_du[17].x = -1; kernel_du[17].y = -2; kernel_du[17].w = -wt12;
-         kernel_du[18].x =  1; kernel_du[18].y = -2; kernel_du[18].w =  wt12;
-         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =  wt22;
-
-         kernel_dv[0 ].x = -2; kernel_dv[0 ].y =  2; kernel_dv[0 ].w =  wt22;
-         kernel_dv[1 ].x = -1; kernel_dv[1 ].y =  2; kernel_dv[1 ].w =  wt12;
-         kernel_dv[2 ].x =  0; kernel_dv[2 ].y =  2; kernel_dv[2 ].w =  0.25f;
-         kernel_dv[3 ].x =  1; kernel_dv[3 ].y =  2; kernel_dv[3 ].w =  wt12;
-         kernel_dv[4 ].x =  2; kernel_dv[4 ].y =  2; kernel_dv[4 ].w =  wt22;
-         kernel_dv[5 ].x = -2; kernel_dv[5 ].y =  1; kernel_dv[5 ].w =  wt12;
-         kernel_dv[6 ].x = -1; kernel_dv[6 ].y =  1; kernel_dv[6 ].w =  wt11;
-         kernel_dv[7 ].x =  0; kernel_dv[7 ].y =  1; kernel_dv[7 ].w =  0.5f;
-         kernel_dv[8 ].x =  1; kernel_dv[8 ].y =  1; kernel_dv[8 ].w =  wt11;
-         kernel_dv[9 ].x =  2; kernel_dv[9 ].y =  1; kernel_dv[9 ].w =  wt22;
-         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w = -wt22;
-         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w = -wt11;
-         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -0.5f;
-         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w = -wt11;
-         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w = -wt12;
-         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w = -wt22;
-         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w = -wt12;
-         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w = -0.25f;
-         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w = -wt12;
-         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w = -wt22;
-
-         for(n = 0; n < 20; ++n)
-         {
-            usum += fabsf(kernel_du[n].w);
-            vsum += fabsf(kernel_dv[n].w);
-         }
-         for(n = 0; n < 20; ++n)
-         {
-            kernel_du[n].w /= usum;
-            kernel_dv[n].w /= vsum;
-         }
-
-         break;
+         ms[2] = g_timer_elapsed(timer, 0) * 1000.0;
+         g_timer_start(timer);
       }
-      case FILTER_7x7:
-      {
-         float du_weights[]=
-         {
-            -1, -2, -3, 0, 3, 2, 1,
-            -2, -3, -4, 0, 4, 3, 2,
-            -3, -4, -5, 0, 5, 4, 3,
-            -4, -5, -6, 0, 6, 5, 4,
-            -3, -4, -5, 0, 5, 4, 3,
-            -2, -3, -4, 0, 4, 3, 2,
-            -1, -2, -3, 0, 3, 2, 1
-         };
-         float dv_weights[49];
-         int n;
-         float usum = 0, vsum = 0;
-
-         num_elements = 49;
-         kernel_du = (kernel_element*)g_malloc(49 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(49 * sizeof(kernel_element));
-
-         make_kernel(kernel_du, du_weights, 7);
-         rotate_array(dv_weights, du_weights, 7);
-         make_kernel(kernel_dv, dv_weights, 7);
-
-         for(n = 0; n < 49; ++n)
-         {
-            usum += fabsf(kernel_du[n].w);
-            vsum += fabsf(kernel_dv[n].w);
-         }
-         for(n = 0; n < 49; ++n)
-         {
-            kernel_du[n].w /= usum;
-            kernel_dv[n].w /= vsum;
-         }
 
-         break;
-      }
-      case FILTER_9x9:
+      if(bake_cone)
       {
-         float du_weights[]=
-         {
-            -1, -2, -3, -4, 0, 4, 3, 2, 1,
-            -2, -3, -4, -5, 0, 5, 4, 3, 2,
-            -3, -4, -5, -6, 0, 6, 5, 4, 3,
-            -4, -5, -6, -7, 0, 7, 6, 5, 4,
-            -5, -6, -7, -8, 0, 8, 7, 6, 5,
-            -4, -5, -6, -7, 0, 7, 6, 5, 4,
-            -3, -4, -5, -6, 0, 6, 5, 4, 3,
-            -2, -3, -4, -5, 0, 5, 4, 3, 2,
-            -1, -2, -3, -4, 0, 4, 3, 2, 1
-         };
-         float dv_weights[81];
-         int n;
-         float usum = 0, vsum = 0;
-
-         num_elements = 81;
-         kernel_du = (kernel_element*)g_malloc(81 * sizeof(kernel_element));
-         kernel_dv = (kernel_element*)g_malloc(81 * sizeof(kernel_element));
-
-         make_kernel(kernel_du, du_weights, 9);
-         rotate_array(dv_weights, du_weights, 9);
-         make_kernel(kernel_dv, dv_weights, 9);
-
-         for(n = 0; n < 81; ++n)
-         {
-            usum += fabsf(kernel_du[n].w);
-            vsum += fabsf(kernel_dv[n].w);
-         }
-         for(n = 0; n < 81; ++n)
-         {
-            kernel_du[n].w /= usum;
-            kernel_dv[n].w /= vsum;
-         }
-
-         break;
+         add_conemap_channel(drawable, heights, width, height);
+         if(timer) ms[3] = g_timer_elapsed(timer, 0) * 1000.0;
       }
    }
 
-   if(nmapvals.conversion == CONVERT_BIASED_RGB)
+   if(stats_file)
    {
-      /* approximated average color of the image
-       * scale to 16x16, accumulate the pixels and average */
-      unsigned int sum[3];
+      normalmap_profile(0, 0, 0);
+      normalmap_collect_stats(0);
+      write_stats(stats_file, "plug_in_normalmap", drawable, ms, ret,
+                  cached, &st);
+      close_stats(stats_file);
+      g_timer_destroy(timer);
+   }
 
-      tmp = g_malloc(16 * 16 * bpp);
-      scale_pixels(tmp, 16, 16, src, width, height, bpp);
+   arena_release(scratch, mark);
 
-      sum[0] = sum[1] = sum[2] = 0;
+   return(ret == 0 ? 0 : -1);
+}
 
-      s = src;
-      for(y = 0; y < 16; ++y)
-      {
-         for(x = 0; x < 16; ++x)
-         {
-            sum[0] += *s++;
-            sum[1] += *s++;
-            sum[2] += *s++;
-            if(bpp == 4) s++;
-         }
-      }
+typedef struct
+{
+   GimpDrawable *drawable;
+   arena *scratch;          /* image, heights and the library's */
+   guchar *image;           /* the layer, converted in place */
+   float *heights;
+   normalmap_params p;
+   bake_cache *cache;
+   progress_meter *meter;
+   long long pixels;
+   long long counted;       /* pixels added to the meter so far */
+   int ret;
+   int cached;
+   FILE *stats_file;        /* NORMALMAP_STATS, or NULL */
+   normalmap_stats stats;
+   double ms[4];
+} layer_job;
+
+/* counts the rows a pool thread has done, the main thread reports them */
+static int layer_progress(float progress, void *data)
+{
+   layer_job *job = (layer_job *)data;
+   long long n = (long long)(progress * (double)job->pixels);
+
+   progress_meter_add(job->meter, n - job->counted);
+   job->counted = n;
+
+   return(0);
+}
 
-      rgb_bias[0] = (float)sum[0] / 256.0f;
-      rgb_bias[1] = (float)sum[1] / 256.0f;
-      rgb_bias[2] = (float)sum[2] / 256.0f;
+/* runs on the pool, the GIMP calls stay on the main thread */
+static void bake_layer(gpointer data, gpointer user_data)
+{
+   layer_job *job = (layer_job *)data;
+   GimpDrawable *drawable = job->drawable;
+   GTimer *timer = 0;
+   arena *prev_scratch;
 
-      g_free(tmp);
+   if(job->stats_file)
+   {
+      normalmap_collect_stats(&job->stats);
+      start_profile();
+      timer = g_timer_new();
    }
-   else
+
+   prev_scratch = normalmap_scratch_arena(job->scratch);
+   job->ret = convert_cached(job->cache, job->image, job->image,
+                             drawable->width, drawable->height,
+                             drawable->bpp, &job->p,
+                             job->heights, layer_progress, job,
+                             &job->cached);
+   normalmap_scratch_arena(prev_scratch);
+
+   /* cache hits and failures skip the rows */
+   progress_meter_add(job->meter, job->pixels - job->counted);
+
+   if(timer)
    {
-      rgb_bias[0] = 0;
-      rgb_bias[1] = 0;
-      rgb_bias[2] = 0;
+      job->ms[1] = g_timer_elapsed(timer, 0) * 1000.0;
+      g_timer_destroy(timer);
+      normalmap_profile(0, 0, 0);
+      normalmap_collect_stats(0);
    }
 
-   if(nmapvals.conversion != CONVERT_NORMALIZE_ONLY &&
-      nmapvals.conversion != CONVERT_DUDV_TO_NORMAL &&
-      nmapvals.conversion != CONVERT_HEIGHTMAP)
+   g_async_queue_push((GAsyncQueue *)user_data, job);
+}
+
+static void finish_layer(layer_job *job, int bake_cone)
+{
+   GimpDrawable *drawable = job->drawable;
+   GTimer *timer = job->stats_file ? g_timer_new() : 0;
+
+   if(job->ret == 0)
    {
-      s = src;
-      for(y = 0; y < height; ++y)
+      write_drawable(drawable, job->image);
+      if(timer)
       {
-         for(x = 0; x < width; ++x)
-         {
-            if(!nmapvals.height_source)
-            {
-               switch(nmapvals.conversion)
-               {
-                  case CONVERT_NONE:
-                     val = (float)s[0] * 0.3f +
-                           (float)s[1] * 0.59f +
-                           (float)s[2] * 0.11f;
-                     break;
-                  case CONVERT_BIASED_RGB:
-                     val = (((float)max(0, s[0] - rgb_bias[0])) * 0.3f ) +
-                           (((float)max(0, s[1] - rgb_bias[1])) * 0.59f) +
-                           (((float)max(0, s[2] - rgb_bias[2])) * 0.11f);
-                     break;
-                  case CONVERT_RED:
-                     val = (float)s[0];
-                     break;
-                  case CONVERT_GREEN:
-                     val = (float)s[1];
-                     break;
-                  case CONVERT_BLUE:
-                     val = (float)s[2];
-                     break;
-                  case CONVERT_MAX_RGB:
-                     val = (float)max(s[0], max(s[1], s[2]));
-                     break;
-                  case CONVERT_MIN_RGB:
-                     val = (float)min(s[0], min(s[1], s[2]));
-                     break;
-                  case CONVERT_COLORSPACE:
-                     val = (1.0f - ((1.0f - ((float)s[0] / 255.0f)) *
-                                    (1.0f - ((float)s[1] / 255.0f)) *
-                                    (1.0f - ((float)s[2] / 255.0f)))) * 255.0f;
-                     break;
-                  default:
-                     val = 255.0f;
-                     break;
-               }
-            }
-            else
-               val = (float)s[3];
-
-            heights[x + y * width] = val * oneover255;
-
-            s += bpp;
-         }
+         job->ms[2] = g_timer_elapsed(timer, 0) * 1000.0;
+         g_timer_start(timer);
+      }
+      if(bake_cone)
+      {
+         add_conemap_channel(drawable, job->heights, drawable->width,
+                             drawable->height);
+         if(timer) job->ms[3] = g_timer_elapsed(timer, 0) * 1000.0;
       }
    }
 
-#define HEIGHT(x,y) \
-   (heights[(max(0, min(width - 1, (x)))) + (max(0, min(height - 1, (y)))) * width])
-#define HEIGHT_WRAP(x,y) \
-   (heights[((x) < 0 ? (width + (x)) : ((x) >= width ? ((x) - width) : (x)))+ \
-            (((y) < 0 ? (height + (y)) : ((y) >= height ? ((y) - height) : (y))) * width)])
-
-   if(preview_mode)
+   if(timer)
    {
-      cursor = gdk_cursor_new(GDK_WATCH);
-      gdk_window_set_cursor(GDK_WINDOW(dialog->window), cursor);
-      gdk_cursor_unref(cursor);
+      write_stats(job->stats_file, "plug_in_normalmap_layers", drawable,
+                  job->ms, job->ret, job->cached, &job->stats);
+      g_timer_destroy(timer);
    }
 
-   for(y = 0; y < height; ++y)
-   {
-      while(gtk_events_pending())
-         gtk_main_iteration();
+   gimp_drawable_detach(drawable);
+   arena_release(job->scratch, 0);
+   g_free(job);
+}
 
-      for(x = 0; x < width; ++x)
-      {
-         d = dst + ((y * rowbytes) + (x * bpp));
-         s = src + ((y * rowbytes) + (x * bpp));
+static int is_convertible(gint32 id)
+{
+#if GIMP_CHECK_VERSION(2, 8, 0)
+   return(gimp_drawable_is_rgb(id) && !gimp_item_is_group(id));
+#else
+   return(gimp_drawable_is_rgb(id));
+#endif
+}
 
-         if(nmapvals.conversion == CONVERT_NORMALIZE_ONLY ||
-            nmapvals.conversion == CONVERT_HEIGHTMAP)
-         {
-            n[0] = (((float)s[0] * oneover255) - 0.5f) * 2.0f;
-            n[1] = (((float)s[1] * oneover255) - 0.5f) * 2.0f;
-            n[2] = (((float)s[2] * oneover255) - 0.5f) * 2.0f;
-            n[0] *= nmapvals.scale;
-            n[1] *= nmapvals.scale;
-         }
-         else if(nmapvals.conversion == CONVERT_DUDV_TO_NORMAL)
-         {
-            n[0] = (((float)s[0] * oneover255) - 0.5f) * 2.0f;
-            n[1] = (((float)s[1] * oneover255) - 0.5f) * 2.0f;
-            n[2] = sqrtf(1.0f - (n[0] * n[0] - n[1] * n[1]));
-            n[0] *= nmapvals.scale;
-            n[1] *= nmapvals.scale;
-         }
-         else
-         {
-            du = 0; dv = 0;
-            if(!nmapvals.wrap)
-            {
-               for(i = 0; i < num_elements; ++i)
-                  du += HEIGHT(x + kernel_du[i].x,
-                               y + kernel_du[i].y) * kernel_du[i].w;
-               for(i = 0; i < num_elements; ++i)
-                  dv += HEIGHT(x + kernel_dv[i].x,
-                               y + kernel_dv[i].y) * kernel_dv[i].w;
-            }
-            else
-            {
-               for(i = 0; i < num_elements; ++i)
-                  du += HEIGHT_WRAP(x + kernel_du[i].x,
-                                    y + kernel_du[i].y) * kernel_du[i].w;
-               for(i = 0; i < num_elements; ++i)
-                  dv += HEIGHT_WRAP(x + kernel_dv[i].x,
-                                    y + kernel_dv[i].y) * kernel_dv[i].w;
-            }
-
-            n[0] = -du * nmapvals.scale;
-            n[1] = -dv * nmapvals.scale;
-            n[2] = 1.0f;
-         }
+/* Waits for the next finished layer, or NULL after a progress report
+ * interval without one.
+ */
+static layer_job *wait_layer(GAsyncQueue *done)
+{
+#if GLIB_CHECK_VERSION(2, 32, 0)
+   return((layer_job *)g_async_queue_timeout_pop(done, 1000000 / 30));
+#else
+   GTimeVal end;
+
+   g_get_current_time(&end);
+   g_time_val_add(&end, 1000000 / 30);
+   return((layer_job *)g_async_queue_timed_pop(done, &end));
+#endif
+}
 
-         NORMALIZE(n);
+/* Converts the RGB drawables in 'ids' with the current settings.  A pool
+ * thread per processor bakes them while this thread reads the next ones
+ * in and writes the finished ones back, with only a few more held than
+ * there are threads.  The alpha map is read once for all of them.  Every
+ * layer in flight has an arena, handed on to the next one when it is
+ * done, so a batch of similar layers allocates once per slot.  Returns
+ * the number that failed.
+ */
+static int normalmap_layers(const gint32 *ids, int count)
+{
+   GThreadPool *pool;
+   GAsyncQueue *done;
+   GimpDrawable *drawable;
+   GimpPixelRgn src_rgn;
+   layer_job *job;
+   normalmap_params p;
+   bake_cache *cache = 0;
+   progress_meter meter;
+   FILE *stats_file;
+   GTimer *timer;
+   guchar *amap;
+   GSList *arenas = 0;
+   arena *a;
+   long long total = 0;
+   int i, nthreads, in_flight = 0, failed = 0, bake_cone;
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+   if(!g_thread_supported()) g_thread_init(0);
+#endif
 
-         if(n[2] < nmapvals.minz)
-         {
-            n[2] = nmapvals.minz;
-            NORMALIZE(n);
-         }
+   if(nmapvals.filter < 0 || nmapvals.filter >= MAX_FILTER_TYPE)
+      nmapvals.filter = FILTER_NONE;
+   if(nmapvals.encoding < 0 || nmapvals.encoding >= MAX_ENCODING)
+      nmapvals.encoding = ENCODE_XYZ;
 
-         if(nmapvals.xinvert) n[0] = -n[0];
-         if(nmapvals.yinvert) n[1] = -n[1];
-         if(nmapvals.swapRGB)
-         {
-            val = n[0];
-            n[0] = n[2];
-            n[2] = val;
-         }
+   bake_cone = wants_conemap();
+   if(!bake_cone)
+      cache = open_cache();
 
-         if(!nmapvals.dudv)
-         {
-            *d++ = (unsigned char)((n[0] + 1.0f) * 127.5f);
-            *d++ = (unsigned char)((n[1] + 1.0f) * 127.5f);
-            *d++ = (unsigned char)((n[2] + 1.0f) * 127.5f);
-
-            if(drawable->bpp == 4)
-            {
-               switch(nmapvals.alpha)
-               {
-                  case ALPHA_NONE:
-                     *d++ = s[3]; break;
-                  case ALPHA_HEIGHT:
-                     *d++ = (unsigned char)(heights[x + y * width] * 255.0f); break;
-                  case ALPHA_INVERSE_HEIGHT:
-                     *d++ = 255 - (unsigned char)(heights[x + y * width] * 255.0f); break;
-                  case ALPHA_ZERO:
-                     *d++ = 0; break;
-                  case ALPHA_ONE:
-                     *d++ = 255; break;
-                  case ALPHA_INVERT:
-                     *d++ = 255 - s[3]; break;
-                  case ALPHA_MAP:
-                     *d++ = sample_alpha_map(amap, x, y, amap_w, amap_h,
-                                             width, height); break;
-                  default:
-                     *d++ = s[3]; break;
-               }
-            }
-         }
-         else
-         {
-            if(nmapvals.dudv == DUDV_8BIT_SIGNED ||
-               nmapvals.dudv == DUDV_8BIT_UNSIGNED)
-            {
-               if(nmapvals.dudv == DUDV_8BIT_UNSIGNED)
-               {
-                  n[0] += 1.0f;
-                  n[1] += 1.0f;
-               }
-               *d++ = (unsigned char)(n[0] * 127.5f);
-               *d++ = (unsigned char)(n[1] * 127.5f);
-               *d++ = 0;
-               if(drawable->bpp == 4) *d++ = 255;
-            }
-            else if(nmapvals.dudv == DUDV_16BIT_SIGNED ||
-                    nmapvals.dudv == DUDV_16BIT_UNSIGNED)
-            {
-               unsigned short *d16 = (unsigned short*)d;
-               if(nmapvals.dudv == DUDV_16BIT_UNSIGNED)
-               {
-                  n[0] += 1.0f;
-                  n[1] += 1.0f;
-               }
-               *d16++ = (unsigned short)(n[0] * 32767.5f);
-               *d16++ = (unsigned short)(n[1] * 32767.5f);
-            }
-         }
-      }
+   get_params(&p, 4);
+   amap = read_alphamap(&p, 0);
+   load_tiling(TRUE);
 
-      if(!preview_mode)
-         gimp_progress_update((double)(y - 1) / (double)(height - 2));
-   }
+   stats_file = open_stats();
+   timer = stats_file ? g_timer_new() : 0;
 
-   if(nmapvals.conversion == CONVERT_HEIGHTMAP)
-      make_heightmap(dst, width, height, bpp);
+   /* progress by pixels, one large layer is not over when it starts */
+   for(i = 0; i < count; ++i)
+   {
+      if(is_convertible(ids[i]))
+         total += (long long)gimp_drawable_width(ids[i]) *
+            gimp_drawable_height(ids[i]);
+   }
+   progress_meter_init(&meter, total, plugin_progress, 0);
 
-#undef HEIGHT
-#undef HEIGHT_WRAP
+   nthreads = threadpool_num_processors();
+   done = g_async_queue_new();
+   pool = g_thread_pool_new(bake_layer, done, nthreads, FALSE, 0);
+   if(pool == 0)
+   {
+      g_async_queue_unref(done);
+      bake_cache_close(cache);
+      close_stats(stats_file);
+      if(timer) g_timer_destroy(timer);
+      if(amap) g_free(amap);
+      return(count);
+   }
 
-   if(preview_mode)
+   for(i = 0; i < count || in_flight > 0;)
    {
-      update_3D_preview(width, height, bpp, dst);
+      if(i < count && in_flight <= nthreads)
+      {
+         if(!is_convertible(ids[i]))
+         {
+            ++i;
+            continue;
+         }
 
-      pw = GIMP_PREVIEW_AREA(preview)->width;
-      ph = GIMP_PREVIEW_AREA(preview)->height;
-      rowbytes = pw * bpp;
+         drawable = gimp_drawable_get(ids[i++]);
+         if(timer) g_timer_start(timer);
 
-      tmp = g_malloc(pw * ph * bpp);
-      scale_pixels(tmp, pw, ph, dst, width, height, bpp);
+         if(arenas)
+         {
+            a = (arena *)arenas->data;
+            arenas = g_slist_delete_link(arenas, arenas);
+         }
+         else if((a = arena_new()) == 0)
+            g_error("%s: failed to allocate an arena", G_STRLOC);
+
+         job = g_new0(layer_job, 1);
+         job->drawable = drawable;
+         job->scratch = a;
+         job->cache = cache;
+         job->meter = &meter;
+         job->pixels = (long long)drawable->width * drawable->height;
+         job->stats_file = stats_file;
+         get_params(&job->p, drawable->bpp);
+         if(drawable->bpp == 4 && amap)
+         {
+            job->p.alphamap = p.alphamap;
+            job->p.alphamap_width = p.alphamap_width;
+            job->p.alphamap_height = p.alphamap_height;
+         }
+         job->image = arena_get(a, drawable->width * drawable->height *
+                                drawable->bpp);
+         if(bake_cone)
+            job->heights = arena_get(a, drawable->width * drawable->height *
+                                     sizeof(float));
+
+         gimp_pixel_rgn_init(&src_rgn, drawable, 0, 0, drawable->width,
+                             drawable->height, 0, 0);
+         gimp_pixel_rgn_get_rect(&src_rgn, job->image, 0, 0,
+                                 drawable->width, drawable->height);
+         if(timer) job->ms[0] = g_timer_elapsed(timer, 0) * 1000.0;
+
+         g_thread_pool_push(pool, job, 0);
+         ++in_flight;
+         progress_meter_poll(&meter);
+         continue;
+      }
 
-      gimp_preview_area_draw(GIMP_PREVIEW_AREA(preview), 0, 0, pw, ph,
-                             (bpp == 4) ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE,
-                             tmp, rowbytes);
+      while((job = wait_layer(done)) == 0)
+         progress_meter_poll(&meter);
+      --in_flight;
 
-      g_free(tmp);
+      if(job->ret != 0) ++failed;
+      arenas = g_slist_prepend(arenas, job->scratch);
+      finish_layer(job, bake_cone);
 
-      gdk_window_set_cursor(GDK_WINDOW(dialog->window), 0);
+      progress_meter_poll(&meter);
    }
-   else
-   {
-      gimp_progress_update(100.0);
-
-      gimp_pixel_rgn_init(&dst_rgn, drawable, 0, 0, width, height, 1, 1);
-      gimp_pixel_rgn_set_rect(&dst_rgn, dst, 0, 0, width, height);
 
-      gimp_drawable_flush(drawable);
-      gimp_drawable_merge_shadow(drawable->drawable_id, 1);
-      gimp_drawable_update(drawable->drawable_id, 0, 0, width, height);
-   }
+   progress_meter_finish(&meter);
 
-   g_free(heights);
-   g_free(src);
-   g_free(dst);
-   g_free(kernel_du);
-   g_free(kernel_dv);
+   g_thread_pool_free(pool, FALSE, TRUE);
+   g_async_queue_unref(done);
+   g_slist_foreach(arenas, (GFunc)arena_free, 0);
+   g_slist_free(arenas);
+   bake_cache_close(cache);
+   close_stats(stats_file);
+   if(timer) g_timer_destroy(timer);
    if(amap) g_free(amap);
 
-   return(0);
+   return(failed);
 }
 
 static void do_cleanup(gpointer data)
@@ -1172,10 +1059,16 @@ static int update_preview = 0;
 
 static gint idle_callback(gpointer data)
 {
-   if(update_preview)
+   /* the preview runs the main loop while it converts, a change made
+      meanwhile waits for it to finish */
+   static int busy = 0;
+
+   if(update_preview && !busy)
    {
+      busy = 1;
       update_preview = 0;
       normalmap((GimpDrawable*)data, TRUE);
+      busy = 0;
    }
    return(1);
 }
@@ -1285,6 +1178,12 @@ static void dudv_selected(GtkWidget *widget, gpointer data)
    update_preview = 1;
 }
 
+static void encoding_selected(GtkWidget *widget, gpointer data)
+{
+   nmapvals.encoding = (gint)((size_t)data);
+   update_preview = 1;
+}
+
 static void contrast_changed(GtkWidget *widget, gpointer data)
 {
    nmapvals.contrast = gtk_spin_button_get_value(GTK_SPIN_BUTTON(widget));
@@ -1765,6 +1664,35 @@ static gint normalmap_dialog(GimpDrawable *drawable)
 
    gtk_widget_set_sensitive(spin, nmapvals.conversion == CONVERT_HEIGHTMAP);
 
+   opt = gtk_option_menu_new();
+   gtk_widget_show(opt);
+   gimp_table_attach_aligned(GTK_TABLE(table), 0, 8, "Encoding:", 0, 0.5,
+                             opt, 1, 0);
+
+   menu = gtk_menu_new();
+
+   menuitem = gtk_menu_item_new_with_label("XYZ");
+   gtk_signal_connect(GTK_OBJECT(menuitem), "activate",
+                      GTK_SIGNAL_FUNC(encoding_selected),
+                      (gpointer)ENCODE_XYZ);
+   gtk_widget_show(menuitem);
+   gtk_menu_append(GTK_MENU(menu), menuitem);
+   menuitem = gtk_menu_item_new_with_label("XY (Z reconstructed)");
+   gtk_signal_connect(GTK_OBJECT(menuitem), "activate",
+                      GTK_SIGNAL_FUNC(encoding_selected),
+                      (gpointer)ENCODE_XY);
+   gtk_widget_show(menuitem);
+   gtk_menu_append(GTK_MENU(menu), menuitem);
+   menuitem = gtk_menu_item_new_with_label("Octahedral");
+   gtk_signal_connect(GTK_OBJECT(menuitem), "activate",
+                      GTK_SIGNAL_FUNC(encoding_selected),
+                      (gpointer)ENCODE_OCTAHEDRAL);
+   gtk_widget_show(menuitem);
+   gtk_menu_append(GTK_MENU(menu), menuitem);
+
+   gtk_menu_set_active(GTK_MENU(menu), nmapvals.encoding);
+   gtk_option_menu_set_menu(GTK_OPTION_MENU(opt), menu);
+
    curr = gtk_container_get_children(GTK_CONTAINER(conversion_menu));
    while(curr)
    {
@@ -1805,6 +1733,12 @@ static gint normalmap_dialog(GimpDrawable *drawable)
    gtk_box_pack_start(GTK_BOX(vbox), check, 0, 1, 0);
    gtk_signal_connect(GTK_OBJECT(check), "clicked",
                       GTK_SIGNAL_FUNC(toggle_clicked), &nmapvals.swapRGB);
+   check = gtk_check_button_new_with_label("Cone step map");
+   gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(check), nmapvals.conemap);
+   gtk_widget_show(check);
+   gtk_box_pack_start(GTK_BOX(vbox), check, 0, 1, 0);
+   gtk_signal_connect(GTK_OBJECT(check), "clicked",
+                      GTK_SIGNAL_FUNC(toggle_clicked), &nmapvals.conemap);
 
    gtk_widget_show(dialog);
 
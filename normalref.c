@@ -0,0 +1,1359 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "scale.h"
+#include "libnormalmap.h"
+#include "normalref.h"
+
+/* A frozen copy of libnormalmap's scalar conversion as it stood when the
+ * golden test was added, kept as the oracle normaltest.c checks the
+ * library against.  It is not the plugin's original output: the biased
+ * RGB resampling, the 16-bit and float formats and the normal encodings
+ * of the library at that point are all in it.  Do not change or speed it
+ * up, it is the definition of the right output.  scale_pixels() is copied
+ * in as ref_scale_pixels(), the biased RGB conversion goes through it.
+ */
+
+#define MAX_KERNEL_ELEMENTS 81
+/* rows above and below a pixel the largest kernel, 9x9, reaches */
+#define MAX_KERNEL_RADIUS   4
+
+static const float oneover255 = 1.0f / 255.0f;
+
+#ifndef min
+# ifdef __GNUC__
+#  define min(a,b)  ({typeof(a) _a = (a); typeof(b) _b = (b); _a < _b ? _a : _b;})
+# else
+#  define min(a,b)  ((a)<(b) ? (a) : (b))
+# endif
+#endif
+
+#ifndef max
+# ifdef __GNUC__
+#  define max(a,b)  ({typeof(a) _a = (a); typeof(b) _b = (b); _a > _b ? _a : _b;})
+# else
+#  define max(a,b)  ((a)>(b) ? (a) : (b))
+# endif
+#endif
+
+#ifdef __GNUC__
+# define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+# define ALWAYS_INLINE inline
+#endif
+
+#define SQR(x)      ((x) * (x))
+#define LERP(a,b,c) ((a) + ((b) - (a)) * (c))
+
+static inline void NORMALIZE(float *v)
+{
+   float len = sqrtf(SQR(v[0]) + SQR(v[1]) + SQR(v[2]));
+
+   if(len > 1e-04f)
+   {
+      len = 1.0f / len;
+      v[0] *= len;
+      v[1] *= len;
+      v[2] *= len;
+   }
+   else
+      v[0] = v[1] = v[2] = 0;
+}
+
+static void ref_scale_pixels(unsigned char *dst, int dw, int dh,
+                             unsigned char *src, int sw, int sh,
+                             int bpp)
+{
+   int x, y, n, ix, iy, wx, wy, v;
+   int a, b, c, d;
+   int dstride = dw * bpp;
+   unsigned char *s;
+
+   for(y = 0; y < dh; ++y)
+   {
+      if(dh > 1)
+      {
+         iy = (((sh - 1) * y) << 7) / (dh - 1);
+         if(y == dh - 1) --iy;
+         wy = iy & 0x7f;
+         iy >>= 7;
+      }
+      else
+         iy = wy = 0;
+
+      for(x = 0; x < dw; ++x)
+      {
+         if(dw > 1)
+         {
+            ix = (((sw - 1) * x) << 7) / (dw - 1);
+            if(x == dw - 1) --ix;
+            wx = ix & 0x7f;
+            ix >>= 7;
+         }
+         else
+            ix = wx = 0;
+
+         s = src + ((iy - 1) * sw + (ix - 1)) * bpp;
+
+         for(n = 0; n < bpp; ++n)
+         {
+            b = icerp(s[(sw + 0) * bpp],
+                      s[(sw + 1) * bpp],
+                      s[(sw + 2) * bpp],
+                      s[(sw + 3) * bpp], wx);
+            if(iy > 0)
+            {
+               a = icerp(s[      0],
+                         s[    bpp],
+                         s[2 * bpp],
+                         s[3 * bpp], wx);
+            }
+            else
+               a = b;
+
+            c = icerp(s[(2 * sw + 0) * bpp],
+                      s[(2 * sw + 1) * bpp],
+                      s[(2 * sw + 2) * bpp],
+                      s[(2 * sw + 3) * bpp], wx);
+            if(iy < dh - 1)
+            {
+               d = icerp(s[(3 * sw + 0) * bpp],
+                         s[(3 * sw + 1) * bpp],
+                         s[(3 * sw + 2) * bpp],
+                         s[(3 * sw + 3) * bpp], wx);
+            }
+            else
+               d = c;
+
+            v = icerp(a, b, c, d, wy);
+            if(v < 0) v = 0;
+            if(v > 255) v = 255;
+            dst[(y * dstride) + (x * bpp) + n] = v;
+            ++s;
+         }
+      }
+   }
+}
+
+typedef struct
+{
+   int x,y;
+   float w;
+} kernel_element;
+
+static const int format_size[MAX_NORMALMAP_FORMAT] = {1, 2, 4};
+
+/* Sample 'i' of a pixel in the 0 to 255 range the conversions were written
+ * for.  Wider samples keep their precision as fractions.
+ */
+static ALWAYS_INLINE float fetch_sample(const unsigned char *s, int i,
+                                        int format)
+{
+   float v;
+
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         return((float)((const unsigned short *)s)[i] * (255.0f / 65535.0f));
+      case NORMALMAP_F32:
+         v = ((const float *)s)[i];
+         if(!(v >= 0)) v = 0;
+         if(v > 1) v = 1;
+         return(v * 255.0f);
+      default:
+         return((float)s[i]);
+   }
+}
+
+/* Stores a 0 to 1 value as sample 'i', or one minus it when 'invert' is
+ * set, truncating the way the 8-bit output always has.
+ */
+static ALWAYS_INLINE void store_sample(unsigned char *d, int i, int format,
+                                       float v, int invert)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] = (unsigned short)(v * 65535.0f);
+         if(invert)
+            ((unsigned short *)d)[i] = 65535 - ((unsigned short *)d)[i];
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = invert ? 1.0f - v : v;
+         break;
+      default:
+         d[i] = (unsigned char)(v * 255.0f);
+         if(invert) d[i] = 255 - d[i];
+         break;
+   }
+}
+
+/* A -1 to 1 normal component, biased into the unsigned range. */
+static ALWAYS_INLINE void store_normal(unsigned char *d, int i, int format,
+                                       float n)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] = (unsigned short)((n + 1.0f) * 32767.5f);
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = (n + 1.0f) * 0.5f;
+         break;
+      default:
+         d[i] = (unsigned char)((n + 1.0f) * 127.5f);
+         break;
+   }
+}
+
+/* A -1 to 1 component of an encoded normal, rounded to the nearest code
+ * since it is all the precision the two channels have.
+ */
+static ALWAYS_INLINE void store_encoded(unsigned char *d, int i, int format,
+                                        float n)
+{
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] =
+            (unsigned short)((n + 1.0f) * 32767.5f + 0.5f);
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = (n + 1.0f) * 0.5f;
+         break;
+      default:
+         d[i] = (unsigned char)((n + 1.0f) * 127.5f + 0.5f);
+         break;
+   }
+}
+
+/* Unit vector to octahedral coordinates in n[0] and n[1], the lower
+ * hemisphere folded over the diagonals.
+ */
+static ALWAYS_INLINE void oct_encode(float *n)
+{
+   float t, l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+
+   if(l1 < 1e-6f)
+   {
+      n[0] = n[1] = 0;
+      return;
+   }
+
+   n[0] /= l1;
+   n[1] /= l1;
+
+   if(n[2] < 0)
+   {
+      t = (1.0f - fabsf(n[1])) * (n[0] >= 0 ? 1.0f : -1.0f);
+      n[1] = (1.0f - fabsf(n[0])) * (n[1] >= 0 ? 1.0f : -1.0f);
+      n[0] = t;
+   }
+}
+
+/* Copies sample 'i' between formats, inverted if asked.  Unlike computed
+ * values these are rounded, so 8 and 16-bit samples survive a round trip.
+ */
+static ALWAYS_INLINE void copy_sample(unsigned char *d, int dst_format,
+                                      const unsigned char *s, int src_format,
+                                      int i, int invert)
+{
+   float v;
+
+   if(src_format == NORMALMAP_U8 && dst_format == NORMALMAP_U8)
+   {
+      d[i] = invert ? 255 - s[i] : s[i];
+      return;
+   }
+
+   v = fetch_sample(s, i, src_format) / 255.0f;
+   if(invert) v = 1.0f - v;
+
+   switch(dst_format)
+   {
+      case NORMALMAP_U16:
+         ((unsigned short *)d)[i] = (unsigned short)(v * 65535.0f + 0.5f);
+         break;
+      case NORMALMAP_F32:
+         ((float *)d)[i] = v;
+         break;
+      default:
+         d[i] = (unsigned char)(v * 255.0f + 0.5f);
+         break;
+   }
+}
+
+static void make_kernel(kernel_element *k, float *weights, int size)
+{
+   int x, y, idx;
+
+   for(y = 0; y < size; ++y)
+   {
+      for(x = 0; x < size; ++x)
+      {
+         idx = x + y * size;
+         k[idx].x = x - (size / 2);
+         k[idx].y = (size / 2) - y;
+         k[idx].w = weights[idx];
+      }
+   }
+}
+
+static void rotate_array(float *dst, float *src, int size)
+{
+   int x, y, newx, newy;
+
+   for(y = 0; y < size; ++y)
+   {
+      for(x = 0; x < size; ++x)
+      {
+         newy = size - x - 1;
+         newx = y;
+         dst[newx + newy * size] = src[x + y * size];
+      }
+   }
+}
+
+static int sample_alpha_map(const unsigned char *pixels, int x, int y,
+                            int w, int h, int sw, int sh)
+{
+   int ix, iy, wx, wy, v;
+   int a, b, c, d;
+   const unsigned char *s;
+
+   if(sh > 1)
+   {
+      iy = (((h - 1) * y) << 7) / (sh - 1);
+      if(y == sh - 1) --iy;
+      wy = iy & 0x7f;
+      iy >>= 7;
+   }
+   else
+      iy = wy = 0;
+
+   if(sw > 1)
+   {
+      ix = (((w - 1) * x) << 7) / (sw - 1);
+      if(x == sw - 1) --ix;
+      wx = ix & 0x7f;
+      ix >>= 7;
+   }
+   else
+      ix = wx = 0;
+
+   s = pixels + ((iy - 1) * w + (ix - 1));
+
+   b = icerp(s[w + 0],
+             s[w + 1],
+             s[w + 2],
+             s[w + 3], wx);
+   if(iy > 0)
+   {
+      a = icerp(s[0],
+                s[1],
+                s[2],
+                s[3], wx);
+   }
+   else
+      a = b;
+
+   c = icerp(s[2 * w + 0],
+             s[2 * w + 1],
+             s[2 * w + 2],
+             s[2 * w + 3], wx);
+   if(iy < sh - 1)
+   {
+      d = icerp(s[3 * w + 0],
+                s[3 * w + 1],
+                s[3 * w + 2],
+                s[3 * w + 3], wx);
+   }
+   else
+      d = c;
+
+   v = icerp(a, b, c, d, wy);
+
+   if(v <   0) v = 0;
+   if(v > 255) v = 255;
+
+   return((unsigned char)v);
+}
+
+static int make_heightmap(unsigned char *image, int stride, int format,
+                          int w, int h, int bpp, float contrast)
+{
+   size_t i, num_pixels = (size_t)w * h;
+   int x, y;
+   float v, hmin, hmax;
+   float *s, *r;
+   unsigned char *p;
+   int pixel_size = bpp * format_size[format];
+
+   s = (float*)malloc((size_t)w * h * 3 * sizeof(float));
+   if(s == 0)
+      return(-1);
+   r = (float*)malloc((size_t)w * h * 4 * sizeof(float));
+   if(r == 0)
+   {
+      free(s);
+      return(-1);
+   }
+
+   /* scale into 0 to 1 range, make signed -1 to 1 */
+   for(y = 0; y < h; ++y)
+   {
+      p = image + (size_t)y * stride;
+      for(x = 0; x < w; ++x, p += pixel_size)
+      {
+         i = (size_t)y * w + x;
+         s[3 * i + 0] = ((fetch_sample(p, 0, format) / 255.0f) - 0.5) * 2.0f;
+         s[3 * i + 1] = ((fetch_sample(p, 1, format) / 255.0f) - 0.5) * 2.0f;
+         s[3 * i + 2] = ((fetch_sample(p, 2, format) / 255.0f) - 0.5) * 2.0f;
+      }
+   }
+
+   memset(r, 0, (size_t)w * h * 4 * sizeof(float));
+
+#define S(x, y, n) s[(size_t)(y) * (w * 3) + ((x) * 3) + (n)]
+#define R(x, y, n) r[(size_t)(y) * (w * 4) + ((x) * 4) + (n)]
+
+   /* top-left to bottom-right */
+   for(x = 1; x < w; ++x)
+      R(x, 0, 0) = R(x - 1, 0, 0) + S(x - 1, 0, 0);
+   for(y = 1; y < h; ++y)
+      R(0, y, 0) = R(0, y - 1, 0) + S(0, y - 1, 1);
+   for(y = 1; y < h; ++y)
+   {
+      for(x = 1; x < w; ++x)
+      {
+         R(x, y, 0) = (R(x, y - 1, 0) + R(x - 1, y, 0) +
+                       S(x - 1, y, 0) + S(x, y - 1, 1)) * 0.5f;
+      }
+   }
+
+   /* top-right to bottom-left */
+   for(x = w - 2; x >= 0; --x)
+      R(x, 0, 1) = R(x + 1, 0, 1) - S(x + 1, 0, 0);
+   for(y = 1; y < h; ++y)
+      R(0, y, 1) = R(0, y - 1, 1) + S(0, y - 1, 1);
+   for(y = 1; y < h; ++y)
+   {
+      for(x = w - 2; x >= 0; --x)
+      {
+         R(x, y, 1) = (R(x, y - 1, 1) + R(x + 1, y, 1) -
+                       S(x + 1, y, 0) + S(x, y - 1, 1)) * 0.5f;
+      }
+   }
+
+   /* bottom-left to top-right */
+   for(x = 1; x < w; ++x)
+      R(x, 0, 2) = R(x - 1, 0, 2) + S(x - 1, 0, 0);
+   for(y = h - 2; y >= 0; --y)
+      R(0, y, 2) = R(0, y + 1, 2) - S(0, y + 1, 1);
+   for(y = h - 2; y >= 0; --y)
+   {
+      for(x = 1; x < w; ++x)
+      {
+         R(x, y, 2) = (R(x, y + 1, 2) + R(x - 1, y, 2) +
+                       S(x - 1, y, 0) - S(x, y + 1, 1)) * 0.5f;
+      }
+   }
+
+   /* bottom-right to top-left */
+   for(x = w - 2; x >= 0; --x)
+      R(x, 0, 3) = R(x + 1, 0, 3) - S(x + 1, 0, 0);
+   for(y = h - 2; y >= 0; --y)
+      R(0, y, 3) = R(0, y + 1, 3) - S(0, y + 1, 1);
+   for(y = h - 2; y >= 0; --y)
+   {
+      for(x = w - 2; x >= 0; --x)
+      {
+         R(x, y, 3) = (R(x, y + 1, 3) + R(x + 1, y, 3) -
+                       S(x + 1, y, 0) - S(x, y + 1, 1)) * 0.5f;
+      }
+   }
+
+#undef S
+#undef R
+
+   /* accumulate, find min/max */
+   hmin =  1e10f;
+   hmax = -1e10f;
+   for(i = 0; i < num_pixels; ++i)
+   {
+      r[4 * i] += r[4 * i + 1] + r[4 * i + 2] + r[4 * i + 3];
+      if(r[4 * i] < hmin) hmin = r[4 * i];
+      if(r[4 * i] > hmax) hmax = r[4 * i];
+   }
+
+   /* scale into 0 - 1 range */
+   for(i = 0; i < num_pixels; ++i)
+   {
+      v = (r[4 * i] - hmin) / (hmax - hmin);
+      /* adjust contrast */
+      v = (v - 0.5f) * contrast + v;
+      if(v < 0) v = 0;
+      if(v > 1) v = 1;
+      r[4 * i] = v;
+   }
+
+   /* write out results */
+   for(y = 0; y < h; ++y)
+   {
+      p = image + (size_t)y * stride;
+      for(x = 0; x < w; ++x, p += pixel_size)
+      {
+         v = r[4 * ((size_t)y * w + x)];
+         store_sample(p, 0, format, v, 0);
+         store_sample(p, 1, format, v, 0);
+         store_sample(p, 2, format, v, 0);
+      }
+   }
+
+   free(s);
+   free(r);
+
+   return(0);
+}
+
+/* Fills in the du and dv sampling kernels for 'filter', which must have room
+ * for MAX_KERNEL_ELEMENTS each.  Returns the number of elements used.
+ */
+static int make_kernels(int filter, kernel_element *kernel_du,
+                        kernel_element *kernel_dv)
+{
+   int num_elements = 0;
+   float weight;
+
+   switch(filter)
+   {
+      case FILTER_NONE:
+         num_elements = 2;
+
+         kernel_du[0].x = -1; kernel_du[0].y = 0; kernel_du[0].w = -0.5f;
+         kernel_du[1].x =  1; kernel_du[1].y = 0; kernel_du[1].w =  0.5f;
+
+         kernel_dv[0].x = 0; kernel_dv[0].y =  1; kernel_dv[0].w =  0.5f;
+         kernel_dv[1].x = 0; kernel_dv[1].y = -1; kernel_dv[1].w = -0.5f;
+
+         break;
+      case FILTER_SOBEL_3x3:
+         num_elements = 6;
+
+         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -1.0f;
+         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -2.0f;
+         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -1.0f;
+         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  1.0f;
+         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  2.0f;
+         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  1.0f;
+
+         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  1.0f;
+         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  2.0f;
+         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  1.0f;
+         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -1.0f;
+         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -2.0f;
+         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -1.0f;
+
+         break;
+      case FILTER_SOBEL_5x5:
+         num_elements = 20;
+
+         kernel_du[ 0].x = -2; kernel_du[ 0].y =  2; kernel_du[ 0].w =  -1.0f;
+         kernel_du[ 1].x = -2; kernel_du[ 1].y =  1; kernel_du[ 1].w =  -4.0f;
+         kernel_du[ 2].x = -2; kernel_du[ 2].y =  0; kernel_du[ 2].w =  -6.0f;
+         kernel_du[ 3].x = -2; kernel_du[ 3].y = -1; kernel_du[ 3].w =  -4.0f;
+         kernel_du[ 4].x = -2; kernel_du[ 4].y = -2; kernel_du[ 4].w =  -1.0f;
+         kernel_du[ 5].x = -1; kernel_du[ 5].y =  2; kernel_du[ 5].w =  -2.0f;
+         kernel_du[ 6].x = -1; kernel_du[ 6].y =  1; kernel_du[ 6].w =  -8.0f;
+         kernel_du[ 7].x = -1; kernel_du[ 7].y =  0; kernel_du[ 7].w = -12.0f;
+         kernel_du[ 8].x = -1; kernel_du[ 8].y = -1; kernel_du[ 8].w =  -8.0f;
+         kernel_du[ 9].x = -1; kernel_du[ 9].y = -2; kernel_du[ 9].w =  -2.0f;
+         kernel_du[10].x =  1; kernel_du[10].y =  2; kernel_du[10].w =   2.0f;
+         kernel_du[11].x =  1; kernel_du[11].y =  1; kernel_du[11].w =   8.0f;
+         kernel_du[12].x =  1; kernel_du[12].y =  0; kernel_du[12].w =  12.0f;
+         kernel_du[13].x =  1; kernel_du[13].y = -1; kernel_du[13].w =   8.0f;
+         kernel_du[14].x =  1; kernel_du[14].y = -2; kernel_du[14].w =   2.0f;
+         kernel_du[15].x =  2; kernel_du[15].y =  2; kernel_du[15].w =   1.0f;
+         kernel_du[16].x =  2; kernel_du[16].y =  1; kernel_du[16].w =   4.0f;
+         kernel_du[17].x =  2; kernel_du[17].y =  0; kernel_du[17].w =   6.0f;
+         kernel_du[18].x =  2; kernel_du[18].y = -1; kernel_du[18].w =   4.0f;
+         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =   1.0f;
+
+         kernel_dv[ 0].x = -2; kernel_dv[ 0].y =  2; kernel_dv[ 0].w =   1.0f;
+         kernel_dv[ 1].x = -1; kernel_dv[ 1].y =  2; kernel_dv[ 1].w =   4.0f;
+         kernel_dv[ 2].x =  0; kernel_dv[ 2].y =  2; kernel_dv[ 2].w =   6.0f;
+         kernel_dv[ 3].x =  1; kernel_dv[ 3].y =  2; kernel_dv[ 3].w =   4.0f;
+         kernel_dv[ 4].x =  2; kernel_dv[ 4].y =  2; kernel_dv[ 4].w =   1.0f;
+         kernel_dv[ 5].x = -2; kernel_dv[ 5].y =  1; kernel_dv[ 5].w =   2.0f;
+         kernel_dv[ 6].x = -1; kernel_dv[ 6].y =  1; kernel_dv[ 6].w =   8.0f;
+         kernel_dv[ 7].x =  0; kernel_dv[ 7].y =  1; kernel_dv[ 7].w =  12.0f;
+         kernel_dv[ 8].x =  1; kernel_dv[ 8].y =  1; kernel_dv[ 8].w =   8.0f;
+         kernel_dv[ 9].x =  2; kernel_dv[ 9].y =  1; kernel_dv[ 9].w =   2.0f;
+         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w =  -2.0f;
+         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w =  -8.0f;
+         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -12.0f;
+         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w =  -8.0f;
+         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w =  -2.0f;
+         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w =  -1.0f;
+         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w =  -4.0f;
+         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w =  -6.0f;
+         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w =  -4.0f;
+         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w =  -1.0f;
+
+         break;
+      case FILTER_PREWITT_3x3:
+         num_elements = 6;
+
+         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -1.0f;
+         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -1.0f;
+         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -1.0f;
+         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  1.0f;
+         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  1.0f;
+         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  1.0f;
+
+         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  1.0f;
+         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  1.0f;
+         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  1.0f;
+         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -1.0f;
+         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -1.0f;
+         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -1.0f;
+
+         break;
+      case FILTER_PREWITT_5x5:
+         num_elements = 20;
+
+         kernel_du[ 0].x = -2; kernel_du[ 0].y =  2; kernel_du[ 0].w = -1.0f;
+         kernel_du[ 1].x = -2; kernel_du[ 1].y =  1; kernel_du[ 1].w = -1.0f;
+         kernel_du[ 2].x = -2; kernel_du[ 2].y =  0; kernel_du[ 2].w = -1.0f;
+         kernel_du[ 3].x = -2; kernel_du[ 3].y = -1; kernel_du[ 3].w = -1.0f;
+         kernel_du[ 4].x = -2; kernel_du[ 4].y = -2; kernel_du[ 4].w = -1.0f;
+         kernel_du[ 5].x = -1; kernel_du[ 5].y =  2; kernel_du[ 5].w = -2.0f;
+         kernel_du[ 6].x = -1; kernel_du[ 6].y =  1; kernel_du[ 6].w = -2.0f;
+         kernel_du[ 7].x = -1; kernel_du[ 7].y =  0; kernel_du[ 7].w = -2.0f;
+         kernel_du[ 8].x = -1; kernel_du[ 8].y = -1; kernel_du[ 8].w = -2.0f;
+         kernel_du[ 9].x = -1; kernel_du[ 9].y = -2; kernel_du[ 9].w = -2.0f;
+         kernel_du[10].x =  1; kernel_du[10].y =  2; kernel_du[10].w =  2.0f;
+         kernel_du[11].x =  1; kernel_du[11].y =  1; kernel_du[11].w =  2.0f;
+         kernel_du[12].x =  1; kernel_du[12].y =  0; kernel_du[12].w =  2.0f;
+         kernel_du[13].x =  1; kernel_du[13].y = -1; kernel_du[13].w =  2.0f;
+         kernel_du[14].x =  1; kernel_du[14].y = -2; kernel_du[14].w =  2.0f;
+         kernel_du[15].x =  2; kernel_du[15].y =  2; kernel_du[15].w =  1.0f;
+         kernel_du[16].x =  2; kernel_du[16].y =  1; kernel_du[16].w =  1.0f;
+         kernel_du[17].x =  2; kernel_du[17].y =  0; kernel_du[17].w =  1.0f;
+         kernel_du[18].x =  2; kernel_du[18].y = -1; kernel_du[18].w =  1.0f;
+         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =  1.0f;
+
+         kernel_dv[ 0].x = -2; kernel_dv[ 0].y =  2; kernel_dv[ 0].w =  1.0f;
+         kernel_dv[ 1].x = -1; kernel_dv[ 1].y =  2; kernel_dv[ 1].w =  1.0f;
+         kernel_dv[ 2].x =  0; kernel_dv[ 2].y =  2; kernel_dv[ 2].w =  1.0f;
+         kernel_dv[ 3].x =  1; kernel_dv[ 3].y =  2; kernel_dv[ 3].w =  1.0f;
+         kernel_dv[ 4].x =  2; kernel_dv[ 4].y =  2; kernel_dv[ 4].w =  1.0f;
+         kernel_dv[ 5].x = -2; kernel_dv[ 5].y =  1; kernel_dv[ 5].w =  2.0f;
+         kernel_dv[ 6].x = -1; kernel_dv[ 6].y =  1; kernel_dv[ 6].w =  2.0f;
+         kernel_dv[ 7].x =  0; kernel_dv[ 7].y =  1; kernel_dv[ 7].w =  2.0f;
+         kernel_dv[ 8].x =  1; kernel_dv[ 8].y =  1; kernel_dv[ 8].w =  2.0f;
+         kernel_dv[ 9].x =  2; kernel_dv[ 9].y =  1; kernel_dv[ 9].w =  2.0f;
+         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w = -2.0f;
+         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w = -2.0f;
+         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -2.0f;
+         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w = -2.0f;
+         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w = -2.0f;
+         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w = -1.0f;
+         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w = -1.0f;
+         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w = -1.0f;
+         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w = -1.0f;
+         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w = -1.0f;
+
+         break;
+      case FILTER_3x3:
+         num_elements = 6;
+
+         weight = 1.0f / 6.0f;
+
+         kernel_du[0].x = -1; kernel_du[0].y =  1; kernel_du[0].w = -weight;
+         kernel_du[1].x = -1; kernel_du[1].y =  0; kernel_du[1].w = -weight;
+         kernel_du[2].x = -1; kernel_du[2].y = -1; kernel_du[2].w = -weight;
+         kernel_du[3].x =  1; kernel_du[3].y =  1; kernel_du[3].w =  weight;
+         kernel_du[4].x =  1; kernel_du[4].y =  0; kernel_du[4].w =  weight;
+         kernel_du[5].x =  1; kernel_du[5].y = -1; kernel_du[5].w =  weight;
+
+         kernel_dv[0].x = -1; kernel_dv[0].y =  1; kernel_dv[0].w =  weight;
+         kernel_dv[1].x =  0; kernel_dv[1].y =  1; kernel_dv[1].w =  weight;
+         kernel_dv[2].x =  1; kernel_dv[2].y =  1; kernel_dv[2].w =  weight;
+         kernel_dv[3].x = -1; kernel_dv[3].y = -1; kernel_dv[3].w = -weight;
+         kernel_dv[4].x =  0; kernel_dv[4].y = -1; kernel_dv[4].w = -weight;
+         kernel_dv[5].x =  1; kernel_dv[5].y = -1; kernel_dv[5].w = -weight;
+         break;
+      case FILTER_5x5:
+      {
+         int n;
+         float usum = 0, vsum = 0;
+         float wt22 = 1.0f / 16.0f;
+         float wt12 = 1.0f / 10.0f;
+         float wt02 = 1.0f / 8.0f;
+         float wt11 = 1.0f / 2.8f;
+         num_elements = 20;
+
+         kernel_du[0 ].x = -2; kernel_du[0 ].y =  2; kernel_du[0 ].w = -wt22;
+         kernel_du[1 ].x = -1; kernel_du[1 ].y =  2; kernel_du[1 ].w = -wt12;
+         kernel_du[2 ].x =  1; kernel_du[2 ].y =  2; kernel_du[2 ].w =  wt12;
+         kernel_du[3 ].x =  2; kernel_du[3 ].y =  2; kernel_du[3 ].w =  wt22;
+         kernel_du[4 ].x = -2; kernel_du[4 ].y =  1; kernel_du[4 ].w = -wt12;
+         kernel_du[5 ].x = -1; kernel_du[5 ].y =  1; kernel_du[5 ].w = -wt11;
+         kernel_du[6 ].x =  1; kernel_du[6 ].y =  1; kernel_du[6 ].w =  wt11;
+         kernel_du[7 ].x =  2; kernel_du[7 ].y =  1; kernel_du[7 ].w =  wt12;
+         kernel_du[8 ].x = -2; kernel_du[8 ].y =  0; kernel_du[8 ].w = -wt02;
+         kernel_du[9 ].x = -1; kernel_du[9 ].y =  0; kernel_du[9 ].w = -0.5f;
+         kernel_du[10].x =  1; kernel_du[10].y =  0; kernel_du[10].w =  0.5f;
+         kernel_du[11].x =  2; kernel_du[11].y =  0; kernel_du[11].w =  wt02;
+         kernel_du[12].x = -2; kernel_du[12].y = -1; kernel_du[12].w = -wt12;
+         kernel_du[13].x = -1; kernel_du[13].y = -1; kernel_du[13].w = -wt11;
+         kernel_du[14].x =  1; kernel_du[14].y = -1; kernel_du[14].w =  wt11;
+         kernel_du[15].x =  2; kernel_du[15].y = -1; kernel_du[15].w =  wt12;
+         kernel_du[16].x = -2; kernel_du[16].y = -2; kernel_du[16].w = -wt22;
+         kernel_du[17].x = -1; kernel_du[17].y = -2; kernel_du[17].w = -wt12;
+         kernel_du[18].x =  1; kernel_du[18].y = -2; kernel_du[18].w =  wt12;
+         kernel_du[19].x =  2; kernel_du[19].y = -2; kernel_du[19].w =  wt22;
+
+         kernel_dv[0 ].x = -2; kernel_dv[0 ].y =  2; kernel_dv[0 ].w =  wt22;
+         kernel_dv[1 ].x = -1; kernel_dv[1 ].y =  2; kernel_dv[1 ].w =  wt12;
+         kernel_dv[2 ].x =  0; kernel_dv[2 ].y =  2; kernel_dv[2 ].w =  0.25f;
+         kernel_dv[3 ].x =  1; kernel_dv[3 ].y =  2; kernel_dv[3 ].w =  wt12;
+         kernel_dv[4 ].x =  2; kernel_dv[4 ].y =  2; kernel_dv[4 ].w =  wt22;
+         kernel_dv[5 ].x = -2; kernel_dv[5 ].y =  1; kernel_dv[5 ].w =  wt12;
+         kernel_dv[6 ].x = -1; kernel_dv[6 ].y =  1; kernel_dv[6 ].w =  wt11;
+         kernel_dv[7 ].x =  0; kernel_dv[7 ].y =  1; kernel_dv[7 ].w =  0.5f;
+         kernel_dv[8 ].x =  1; kernel_dv[8 ].y =  1; kernel_dv[8 ].w =  wt11;
+         kernel_dv[9 ].x =  2; kernel_dv[9 ].y =  1; kernel_dv[9 ].w =  wt22;
+         kernel_dv[10].x = -2; kernel_dv[10].y = -1; kernel_dv[10].w = -wt22;
+         kernel_dv[11].x = -1; kernel_dv[11].y = -1; kernel_dv[11].w = -wt11;
+         kernel_dv[12].x =  0; kernel_dv[12].y = -1; kernel_dv[12].w = -0.5f;
+         kernel_dv[13].x =  1; kernel_dv[13].y = -1; kernel_dv[13].w = -wt11;
+         kernel_dv[14].x =  2; kernel_dv[14].y = -1; kernel_dv[14].w = -wt12;
+         kernel_dv[15].x = -2; kernel_dv[15].y = -2; kernel_dv[15].w = -wt22;
+         kernel_dv[16].x = -1; kernel_dv[16].y = -2; kernel_dv[16].w = -wt12;
+         kernel_dv[17].x =  0; kernel_dv[17].y = -2; kernel_dv[17].w = -0.25f;
+         kernel_dv[18].x =  1; kernel_dv[18].y = -2; kernel_dv[18].w = -wt12;
+         kernel_dv[19].x =  2; kernel_dv[19].y = -2; kernel_dv[19].w = -wt22;
+
+         for(n = 0; n < 20; ++n)
+         {
+            usum += fabsf(kernel_du[n].w);
+            vsum += fabsf(kernel_dv[n].w);
+         }
+         for(n = 0; n < 20; ++n)
+         {
+            kernel_du[n].w /= usum;
+            kernel_dv[n].w /= vsum;
+         }
+
+         break;
+      }
+      case FILTER_7x7:
+      {
+         float du_weights[]=
+         {
+            -1, -2, -3, 0, 3, 2, 1,
+            -2, -3, -4, 0, 4, 3, 2,
+            -3, -4, -5, 0, 5, 4, 3,
+            -4, -5, -6, 0, 6, 5, 4,
+            -3, -4, -5, 0, 5, 4, 3,
+            -2, -3, -4, 0, 4, 3, 2,
+            -1, -2, -3, 0, 3, 2, 1
+         };
+         float dv_weights[49];
+         int n;
+         float usum = 0, vsum = 0;
+
+         num_elements = 49;
+
+         make_kernel(kernel_du, du_weights, 7);
+         rotate_array(dv_weights, du_weights, 7);
+         make_kernel(kernel_dv, dv_weights, 7);
+
+         for(n = 0; n < 49; ++n)
+         {
+            usum += fabsf(kernel_du[n].w);
+            vsum += fabsf(kernel_dv[n].w);
+         }
+         for(n = 0; n < 49; ++n)
+         {
+            kernel_du[n].w /= usum;
+            kernel_dv[n].w /= vsum;
+         }
+
+         break;
+      }
+      case FILTER_9x9:
+      {
+         float du_weights[]=
+         {
+            -1, -2, -3, -4, 0, 4, 3, 2, 1,
+            -2, -3, -4, -5, 0, 5, 4, 3, 2,
+            -3, -4, -5, -6, 0, 6, 5, 4, 3,
+            -4, -5, -6, -7, 0, 7, 6, 5, 4,
+            -5, -6, -7, -8, 0, 8, 7, 6, 5,
+            -4, -5, -6, -7, 0, 7, 6, 5, 4,
+            -3, -4, -5, -6, 0, 6, 5, 4, 3,
+            -2, -3, -4, -5, 0, 5, 4, 3, 2,
+            -1, -2, -3, -4, 0, 4, 3, 2, 1
+         };
+         float dv_weights[81];
+         int n;
+         float usum = 0, vsum = 0;
+
+         num_elements = 81;
+
+         make_kernel(kernel_du, du_weights, 9);
+         rotate_array(dv_weights, du_weights, 9);
+         make_kernel(kernel_dv, dv_weights, 9);
+
+         for(n = 0; n < 81; ++n)
+         {
+            usum += fabsf(kernel_du[n].w);
+            vsum += fabsf(kernel_dv[n].w);
+         }
+         for(n = 0; n < 81; ++n)
+         {
+            kernel_du[n].w /= usum;
+            kernel_dv[n].w /= vsum;
+         }
+
+         break;
+      }
+   }
+
+   return(num_elements);
+}
+
+/* approximated average color of the image
+ * scale to 16x16, accumulate the pixels and average */
+static int average_color(float *rgb_bias, const unsigned char *src,
+                         int stride, int format, int width, int height,
+                         int bpp)
+{
+   unsigned char *tmp, *packed = 0, *s, *d;
+   const unsigned char *p;
+   unsigned int sum[3];
+   int x, y, c;
+
+   /* ref_scale_pixels() wants tightly packed 8-bit rows */
+   if(format != NORMALMAP_U8)
+   {
+      packed = malloc((size_t)width * height * bpp);
+      if(packed == 0) return(-1);
+      d = packed;
+      for(y = 0; y < height; ++y)
+      {
+         p = src + (size_t)y * stride;
+         for(x = 0; x < width; ++x, p += bpp * format_size[format])
+         {
+            for(c = 0; c < bpp; ++c)
+               *d++ = (unsigned char)fetch_sample(p, c, format);
+         }
+      }
+   }
+   else if(stride != width * bpp)
+   {
+      packed = malloc((size_t)width * height * bpp);
+      if(packed == 0) return(-1);
+      for(y = 0; y < height; ++y)
+         memcpy(packed + (size_t)y * width * bpp, src + (size_t)y * stride,
+                width * bpp);
+   }
+
+   tmp = malloc(16 * 16 * bpp);
+   if(tmp == 0)
+   {
+      free(packed);
+      return(-1);
+   }
+   ref_scale_pixels(tmp, 16, 16, packed ? packed : (unsigned char *)src,
+                    width, height, bpp);
+
+   sum[0] = sum[1] = sum[2] = 0;
+
+   s = tmp;
+   for(y = 0; y < 16; ++y)
+   {
+      for(x = 0; x < 16; ++x)
+      {
+         sum[0] += *s++;
+         sum[1] += *s++;
+         sum[2] += *s++;
+         if(bpp == 4) s++;
+      }
+   }
+
+   rgb_bias[0] = (float)sum[0] / 256.0f;
+   rgb_bias[1] = (float)sum[1] / 256.0f;
+   rgb_bias[2] = (float)sum[2] / 256.0f;
+
+   free(tmp);
+   free(packed);
+
+   return(0);
+}
+
+typedef struct
+{
+   const normalmap_params *p;
+   int width, height, bpp, dudv, encoding;
+   const float *rgb_bias;
+   int num_elements;
+   const kernel_element *kernel_du;
+   const kernel_element *kernel_dv;
+} convert_state;
+
+/* Heights of a source row into 'h'.  Always inlined with a constant
+ * format, so the 8-bit case compiles to the plain byte loop.
+ */
+static ALWAYS_INLINE void height_row(const convert_state *cs,
+                                     const unsigned char *s, float *h,
+                                     int format)
+{
+   const normalmap_params *p = cs->p;
+   const float *rgb_bias = cs->rgb_bias;
+   int x, pixel_size = cs->bpp * format_size[format];
+   float val, r, g, b;
+
+   for(x = 0; x < cs->width; ++x, s += pixel_size)
+   {
+      if(p->height_source)
+      {
+         h[x] = fetch_sample(s, 3, format) * oneover255;
+         continue;
+      }
+
+      r = fetch_sample(s, 0, format);
+      g = fetch_sample(s, 1, format);
+      b = fetch_sample(s, 2, format);
+
+      switch(p->conversion)
+      {
+         case CONVERT_NONE:
+            val = r * 0.3f + g * 0.59f + b * 0.11f;
+            break;
+         case CONVERT_BIASED_RGB:
+            val = (((float)max(0, r - rgb_bias[0])) * 0.3f ) +
+                  (((float)max(0, g - rgb_bias[1])) * 0.59f) +
+                  (((float)max(0, b - rgb_bias[2])) * 0.11f);
+            break;
+         case CONVERT_RED:
+            val = r;
+            break;
+         case CONVERT_GREEN:
+            val = g;
+            break;
+         case CONVERT_BLUE:
+            val = b;
+            break;
+         case CONVERT_MAX_RGB:
+            val = max(r, max(g, b));
+            break;
+         case CONVERT_MIN_RGB:
+            val = min(r, min(g, b));
+            break;
+         case CONVERT_COLORSPACE:
+            val = (1.0f - ((1.0f - (r / 255.0f)) *
+                           (1.0f - (g / 255.0f)) *
+                           (1.0f - (b / 255.0f)))) * 255.0f;
+            break;
+         default:
+            val = 255.0f;
+            break;
+      }
+
+      h[x] = val * oneover255;
+   }
+}
+
+/* One row of output.  Inlined like height_row(), with constant formats for
+ * the 8-bit to 8-bit case.  'hrows[j]' is the row of heights j rows below
+ * this one, for j from -radius to radius, already clamped or wrapped at the
+ * top and bottom edges.
+ */
+static ALWAYS_INLINE void convert_row(const convert_state *cs,
+                                      unsigned char *d, int dst_format,
+                                      const unsigned char *s, int src_format,
+                                      int y, const float *const *hrows)
+{
+   const normalmap_params *p = cs->p;
+   const kernel_element *kernel_du = cs->kernel_du;
+   const kernel_element *kernel_dv = cs->kernel_dv;
+   int width = cs->width, height = cs->height, bpp = cs->bpp;
+   int dudv = cs->dudv, num_elements = cs->num_elements;
+   int src_size = bpp * format_size[src_format];
+   int dst_size = bpp * format_size[dst_format];
+   int x, i;
+   float val, du, dv, n[3];
+
+#define HEIGHT(x,y) \
+   (hrows[(y)][max(0, min(width - 1, (x)))])
+#define HEIGHT_WRAP(x,y) \
+   (hrows[(y)][(x) < 0 ? (width + (x)) : ((x) >= width ? ((x) - width) : (x))])
+
+   for(x = 0; x < width; ++x, s += src_size, d += dst_size)
+   {
+      if(p->conversion == CONVERT_NORMALIZE_ONLY ||
+         p->conversion == CONVERT_HEIGHTMAP)
+      {
+         n[0] = ((fetch_sample(s, 0, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[1] = ((fetch_sample(s, 1, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[2] = ((fetch_sample(s, 2, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[0] *= p->scale;
+         n[1] *= p->scale;
+      }
+      else if(p->conversion == CONVERT_DUDV_TO_NORMAL)
+      {
+         n[0] = ((fetch_sample(s, 0, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[1] = ((fetch_sample(s, 1, src_format) * oneover255) - 0.5f) * 2.0f;
+         n[2] = sqrtf(1.0f - (n[0] * n[0] - n[1] * n[1]));
+         n[0] *= p->scale;
+         n[1] *= p->scale;
+      }
+      else
+      {
+         du = 0; dv = 0;
+         if(!p->wrap)
+         {
+            for(i = 0; i < num_elements; ++i)
+               du += HEIGHT(x + kernel_du[i].x,
+                            kernel_du[i].y) * kernel_du[i].w;
+            for(i = 0; i < num_elements; ++i)
+               dv += HEIGHT(x + kernel_dv[i].x,
+                            kernel_dv[i].y) * kernel_dv[i].w;
+         }
+         else
+         {
+            for(i = 0; i < num_elements; ++i)
+               du += HEIGHT_WRAP(x + kernel_du[i].x,
+                                 kernel_du[i].y) * kernel_du[i].w;
+            for(i = 0; i < num_elements; ++i)
+               dv += HEIGHT_WRAP(x + kernel_dv[i].x,
+                                 kernel_dv[i].y) * kernel_dv[i].w;
+         }
+
+         n[0] = -du * p->scale;
+         n[1] = -dv * p->scale;
+         n[2] = 1.0f;
+      }
+
+      NORMALIZE(n);
+
+      if(n[2] < p->minz)
+      {
+         n[2] = p->minz;
+         NORMALIZE(n);
+      }
+
+      if(p->xinvert) n[0] = -n[0];
+      if(p->yinvert) n[1] = -n[1];
+      if(p->swapRGB)
+      {
+         val = n[0];
+         n[0] = n[2];
+         n[2] = val;
+      }
+
+      if(!dudv)
+      {
+         if(cs->encoding == ENCODE_XYZ)
+         {
+            store_normal(d, 0, dst_format, n[0]);
+            store_normal(d, 1, dst_format, n[1]);
+            store_normal(d, 2, dst_format, n[2]);
+         }
+         else
+         {
+            if(cs->encoding == ENCODE_OCTAHEDRAL)
+               oct_encode(n);
+            store_encoded(d, 0, dst_format, n[0]);
+            store_encoded(d, 1, dst_format, n[1]);
+            store_sample(d, 2, dst_format, 0.0f, 0);
+         }
+
+         if(bpp == 4)
+         {
+            val = hrows[0][x];
+            switch(p->alpha)
+            {
+               case ALPHA_NONE:
+                  copy_sample(d, dst_format, s, src_format, 3, 0); break;
+               case ALPHA_HEIGHT:
+                  store_sample(d, 3, dst_format, val, 0); break;
+               case ALPHA_INVERSE_HEIGHT:
+                  store_sample(d, 3, dst_format, val, 1); break;
+               case ALPHA_ZERO:
+                  store_sample(d, 3, dst_format, 0.0f, 0); break;
+               case ALPHA_ONE:
+                  store_sample(d, 3, dst_format, 1.0f, 0); break;
+               case ALPHA_INVERT:
+                  copy_sample(d, dst_format, s, src_format, 3, 1); break;
+               case ALPHA_MAP:
+                  if(p->alphamap)
+                  {
+                     i = sample_alpha_map(p->alphamap, x, y,
+                                          p->alphamap_width,
+                                          p->alphamap_height,
+                                          width, height);
+                     if(dst_format == NORMALMAP_U8)
+                        d[3] = (unsigned char)i;
+                     else
+                        store_sample(d, 3, dst_format, i / 255.0f, 0);
+                     break;
+                  }
+                  /* fall through */
+               default:
+                  copy_sample(d, dst_format, s, src_format, 3, 0); break;
+            }
+         }
+      }
+      else if(dst_format != NORMALMAP_U8)
+      {
+         if(dudv == DUDV_8BIT_UNSIGNED || dudv == DUDV_16BIT_UNSIGNED)
+         {
+            store_normal(d, 0, dst_format, n[0]);
+            store_normal(d, 1, dst_format, n[1]);
+         }
+         else if(dst_format == NORMALMAP_U16)
+         {
+            ((short *)d)[0] = (short)(n[0] * 32767.0f);
+            ((short *)d)[1] = (short)(n[1] * 32767.0f);
+         }
+         else
+         {
+            ((float *)d)[0] = n[0];
+            ((float *)d)[1] = n[1];
+         }
+         store_sample(d, 2, dst_format, 0.0f, 0);
+         if(bpp == 4) store_sample(d, 3, dst_format, 1.0f, 0);
+      }
+      else if(dudv == DUDV_8BIT_SIGNED || dudv == DUDV_8BIT_UNSIGNED)
+      {
+         if(dudv == DUDV_8BIT_UNSIGNED)
+         {
+            n[0] += 1.0f;
+            n[1] += 1.0f;
+         }
+         d[0] = (unsigned char)(n[0] * 127.5f);
+         d[1] = (unsigned char)(n[1] * 127.5f);
+         d[2] = 0;
+         if(bpp == 4) d[3] = 255;
+      }
+      else if(dudv == DUDV_16BIT_SIGNED || dudv == DUDV_16BIT_UNSIGNED)
+      {
+         unsigned short du16, dv16;
+
+         if(dudv == DUDV_16BIT_UNSIGNED)
+         {
+            n[0] += 1.0f;
+            n[1] += 1.0f;
+         }
+         /* little endian whatever the host, see normalmap_convert() */
+         du16 = (unsigned short)(int)(n[0] * 32767.5f);
+         dv16 = (unsigned short)(int)(n[1] * 32767.5f);
+         d[0] = du16 & 0xff;
+         d[1] = du16 >> 8;
+         d[2] = dv16 & 0xff;
+         d[3] = dv16 >> 8;
+      }
+   }
+
+#undef HEIGHT
+#undef HEIGHT_WRAP
+}
+
+static void height_row_any(const convert_state *cs, const unsigned char *s,
+                           float *h, int format)
+{
+   if(format == NORMALMAP_U8)
+      height_row(cs, s, h, NORMALMAP_U8);
+   else if(format == NORMALMAP_U16)
+      height_row(cs, s, h, NORMALMAP_U16);
+   else
+      height_row(cs, s, h, NORMALMAP_F32);
+}
+
+static void convert_row_any(const convert_state *cs, unsigned char *d,
+                            int dst_format, const unsigned char *s,
+                            int src_format, int y,
+                            const float *const *hrows)
+{
+   if(src_format == NORMALMAP_U8 && dst_format == NORMALMAP_U8)
+      convert_row(cs, d, NORMALMAP_U8, s, NORMALMAP_U8, y, hrows);
+   else
+      convert_row(cs, d, dst_format, s, src_format, y, hrows);
+}
+
+/* whether the normals come from heights rather than the source colors */
+static int uses_heights(const normalmap_params *p)
+{
+   return(p->conversion != CONVERT_NORMALIZE_ONLY &&
+          p->conversion != CONVERT_DUDV_TO_NORMAL &&
+          p->conversion != CONVERT_HEIGHTMAP);
+}
+
+/* Row 'y' moved inside the image the way the edges are handled. */
+static int edge_row(int y, int height, int wrap)
+{
+   if(y >= 0 && y < height) return(y);
+   if(!wrap) return((y < 0) ? 0 : height - 1);
+   y %= height;
+   return((y < 0) ? y + height : y);
+}
+
+/* Everything but the heights and bias, shared by the whole image and
+ * streaming conversions.  Returns the kernel radius in rows.
+ */
+static int setup_state(convert_state *cs, normalmap_params *params,
+                       const normalmap_params *p, int width, int height,
+                       int bpp, kernel_element *kernel_du,
+                       kernel_element *kernel_dv)
+{
+   int i, filter, dudv, encoding, radius = 0;
+
+   *params = *p;
+   filter = p->filter;
+   dudv = p->dudv;
+   encoding = p->encoding;
+
+   if(encoding < 0 || encoding >= MAX_ENCODING ||
+      p->conversion == CONVERT_HEIGHTMAP)
+      encoding = ENCODE_XYZ;
+   if(filter < 0 || filter >= MAX_FILTER_TYPE)
+      filter = FILTER_NONE;
+   if(bpp != 4) params->height_source = 0;
+   if(bpp != 4 && (dudv == DUDV_16BIT_SIGNED || dudv == DUDV_16BIT_UNSIGNED))
+      dudv = DUDV_NONE;
+
+   cs->p = params;
+   cs->width = width;
+   cs->height = height;
+   cs->bpp = bpp;
+   cs->dudv = dudv;
+   cs->encoding = encoding;
+   cs->rgb_bias = 0;
+   cs->num_elements = make_kernels(filter, kernel_du, kernel_dv);
+   cs->kernel_du = kernel_du;
+   cs->kernel_dv = kernel_dv;
+
+   if(uses_heights(p))
+   {
+      for(i = 0; i < cs->num_elements; ++i)
+      {
+         radius = max(radius, abs(kernel_du[i].y));
+         radius = max(radius, abs(kernel_dv[i].y));
+      }
+   }
+
+   return(radius);
+}
+
+int normalmap_reference_convert(unsigned char *dst, int dst_stride,
+                             int dst_format,
+                             const unsigned char *src, int src_stride,
+                             int src_format,
+                             int width, int height, int bpp,
+                             const normalmap_params *p, float *heights,
+                             normalmap_progress_func progress, void *data)
+{
+   int y, j, radius;
+   normalmap_params params;
+   float *own_heights = 0;
+   float rgb_bias[3];
+   const float *rows[2 * MAX_KERNEL_RADIUS + 1];
+   kernel_element kernel_du[MAX_KERNEL_ELEMENTS];
+   kernel_element kernel_dv[MAX_KERNEL_ELEMENTS];
+   convert_state cs;
+
+   if(src_format < 0 || src_format >= MAX_NORMALMAP_FORMAT ||
+      dst_format < 0 || dst_format >= MAX_NORMALMAP_FORMAT)
+      return(-1);
+
+   radius = setup_state(&cs, &params, p, width, height, bpp,
+                        kernel_du, kernel_dv);
+
+   if(heights == 0)
+   {
+      own_heights = heights = malloc((size_t)width * height * sizeof(float));
+      if(heights == 0)
+         return(-1);
+   }
+
+   if(p->conversion == CONVERT_BIASED_RGB)
+   {
+      if(average_color(rgb_bias, src, src_stride, src_format, width, height,
+                       bpp) != 0)
+      {
+         free(own_heights);
+         return(-1);
+      }
+   }
+   else
+   {
+      rgb_bias[0] = 0;
+      rgb_bias[1] = 0;
+      rgb_bias[2] = 0;
+   }
+   cs.rgb_bias = rgb_bias;
+
+   if(uses_heights(p))
+   {
+      for(y = 0; y < height; ++y)
+         height_row_any(&cs, src + (size_t)y * src_stride,
+                        heights + (size_t)y * width, src_format);
+   }
+
+   for(y = 0; y < height; ++y)
+   {
+      unsigned char *d = dst + (size_t)y * dst_stride;
+      const unsigned char *s = src + (size_t)y * src_stride;
+
+      for(j = -radius; j <= radius; ++j)
+         rows[MAX_KERNEL_RADIUS + j] = heights + (size_t)width *
+            edge_row(y + j, height, p->wrap);
+
+      convert_row_any(&cs, d, dst_format, s, src_format, y,
+                      rows + MAX_KERNEL_RADIUS);
+
+      if(progress && progress((float)(y + 1) / (float)height, data))
+      {
+         free(own_heights);
+         return(1);
+      }
+   }
+
+   free(own_heights);
+
+   if(p->conversion == CONVERT_HEIGHTMAP)
+   {
+      if(make_heightmap(dst, dst_stride, dst_format, width, height, bpp,
+                        p->contrast) != 0)
+         return(-1);
+   }
+
+   return(0);
+}
@@ -0,0 +1,39 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __NORMALREF_H
+#define __NORMALREF_H
+
+#include "libnormalmap.h"
+
+/* normalmap_convert_format() as the reference implementation in
+ * normalref.c computes it.
+ */
+int normalmap_reference_convert(unsigned char *dst, int dst_stride,
+                                int dst_format,
+                                const unsigned char *src, int src_stride,
+                                int src_format,
+                                int width, int height, int bpp,
+                                const normalmap_params *p, float *heights,
+                                normalmap_progress_func progress,
+                                void *data);
+
+#endif
@@ -0,0 +1,570 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+/* Golden output test for libnormalmap.  Every optimized path has to give
+ * the pixels the reference conversion in normalref.c gives, so each
+ * variant below is run over a corpus of generated images against it:
+ * every filter, wrap, conversion, alpha and DU/DV combination, with the
+ * remaining settings, the sample formats and the image picked per case
+ * from a fixed sequence.  The images have odd sizes down to 1x1, the
+ * destination rows are padded and the padding is checked to be left alone.
+ *
+ * Prints the largest difference per channel for each variant and
+ * destination format, in 8-bit or 16-bit levels or float units, and exits
+ * with status 1 if any is over the variant's tolerance.  The first few
+ * failing cases of each variant are described, all of them with -v.
+ *
+ * Known problems of the reference are kept out of the cases, they make
+ * the output depend on memory outside the images: heights read past the
+ * right edge when wrapping images narrower than the kernel, the
+ * uninitialized heights behind ALPHA_HEIGHT with the conversions that do
+ * not compute any, height maps included, and the reads around the image
+ * in the resampling for CONVERT_BIASED_RGB.  The last is kept
+ * deterministic by giving the sources fixed guard rows and is only run on
+ * tightly packed 8-bit sources, which both sides resample in place.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "libnormalmap.h"
+#include "arena.h"
+#include "normalref.h"
+
+#define GUARD_ROWS   4      /* fixed bytes around each source */
+#define DST_PAD      24     /* bytes of padding after each output row */
+#define PAD_BYTE     0xa5
+
+typedef struct
+{
+   int width, height, bpp, format;
+   int stride;
+   unsigned char *alloc;
+   unsigned char *pixels;
+} test_image;
+
+/* Writes the conversion of 'img' to 'dst'.  Returns 0, 1 if the variant
+   does not handle these settings and -1 on failure. */
+typedef int (*variant_func)(unsigned char *dst, int dst_stride,
+                            int dst_format, const test_image *img,
+                            const normalmap_params *p);
+
+typedef struct
+{
+   const char *name;
+   variant_func func;
+   double tolerance[MAX_NORMALMAP_FORMAT];
+   int cases, skipped, failed;
+   double max_err[MAX_NORMALMAP_FORMAT][4];
+} variant;
+
+#define VARIANT(name, func) {name, func, {0, 0, 0}, 0, 0, 0, {{0}}}
+
+static const char *format_names[MAX_NORMALMAP_FORMAT] =
+{
+   "u8", "u16", "f32"
+};
+
+static const int sizes[][2] =
+{
+   {1, 1}, {2, 3}, {3, 2}, {5, 7}, {9, 9}, {16, 5}, {4, 17}, {17, 13},
+   {33, 20}
+};
+#define NUM_SIZES (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+   seed = seed * 1103515245 + 12345;
+   return((seed >> 8) & 0xffffff);
+}
+
+static float frnd(void)
+{
+   return((float)rnd() / (float)0xffffff);
+}
+
+static int convert_lib(unsigned char *dst, int dst_stride, int dst_format,
+                       const test_image *img, const normalmap_params *p)
+{
+   return(normalmap_convert_format(dst, dst_stride, dst_format, img->pixels,
+                                   img->stride, img->format, img->width,
+                                   img->height, img->bpp, p, 0, 0, 0));
+}
+
+static int convert_u8(unsigned char *dst, int dst_stride, int dst_format,
+                      const test_image *img, const normalmap_params *p)
+{
+   if(img->format != NORMALMAP_U8 || dst_format != NORMALMAP_U8)
+      return(1);
+   return(normalmap_convert(dst, dst_stride, img->pixels, img->stride,
+                            img->width, img->height, img->bpp, p, 0, 0, 0));
+}
+
+static int convert_stream(unsigned char *dst, int dst_stride, int dst_format,
+                          const test_image *img, const normalmap_params *p)
+{
+   normalmap_stream *s;
+   int y, out = 0, r, n, ret = 0;
+
+   if(!normalmap_stream_supported(p))
+      return(1);
+
+   s = normalmap_stream_new(img->width, img->height, img->bpp, img->format,
+                            dst_format, p);
+   if(s == 0) return(-1);
+
+   if(p->wrap)
+   {
+      r = normalmap_stream_radius(s);
+      n = (r < img->height) ? r : img->height;
+      for(y = img->height - n; y < img->height && ret == 0; ++y)
+         ret = normalmap_stream_prime(s, img->pixels + y * img->stride);
+   }
+
+   for(y = 0; y < img->height && ret >= 0; ++y)
+   {
+      ret = normalmap_stream_push(s, img->pixels + y * img->stride,
+                                  dst + out * dst_stride);
+      if(ret == 1) ++out;
+   }
+   while(ret >= 0 && normalmap_stream_flush(s, dst + out * dst_stride) == 1)
+      ++out;
+
+   normalmap_stream_free(s);
+
+   return((ret < 0 || out != img->height) ? -1 : 0);
+}
+
+/* tiles far smaller than the images, so every edge of them is crossed */
+static int convert_tiled(unsigned char *dst, int dst_stride, int dst_format,
+                         const test_image *img, const normalmap_params *p)
+{
+   int ret;
+
+   if(normalmap_filter_radius(p->filter) < 2)
+      return(1);
+
+   normalmap_set_tiling(3, 2);
+   ret = convert_lib(dst, dst_stride, dst_format, img, p);
+   normalmap_set_tiling(0, 0);
+
+   return(ret);
+}
+
+/* Heights kept at 16 bits, off the reference by their quantization.  Only
+   where the output is continuous in the heights: signed DU/DV wraps from
+   -1 to 0 at the bytes, packed 16-bit DU/DV splits values across
+   channels, and octahedral normals fold where swapping puts z < 0. */
+static int convert_u16_heights(unsigned char *dst, int dst_stride,
+                               int dst_format, const test_image *img,
+                               const normalmap_params *p)
+{
+   normalmap_params q = *p;
+
+   if(p->dudv || (p->encoding == ENCODE_OCTAHEDRAL && p->swapRGB))
+      return(1);
+
+   q.height_format = HEIGHTS_U16;
+   return(convert_lib(dst, dst_stride, dst_format, img, &q));
+}
+
+/* the source copied into dst and converted there, at the padded stride;
+   the biased RGB resampling of a padded source reads around its copy */
+static int convert_in_place(unsigned char *dst, int dst_stride,
+                            int dst_format, const test_image *img,
+                            const normalmap_params *p)
+{
+   int y;
+
+   if(img->format != dst_format || p->conversion == CONVERT_BIASED_RGB)
+      return(1);
+
+   for(y = 0; y < img->height; ++y)
+      memcpy(dst + y * dst_stride, img->pixels + y * img->stride,
+             img->stride);
+
+   return(normalmap_convert_format(dst, dst_stride, dst_format, dst,
+                                   dst_stride, dst_format, img->width,
+                                   img->height, img->bpp, p, 0, 0, 0));
+}
+
+/* A progress callback that starts a conversion of its own, the way the
+   plugin's preview can through the main loop, and switches the thread's
+   arena under the one running.  That one keeps to the arena it started
+   with. */
+static int nested_progress(float progress, void *data)
+{
+   normalmap_params q;
+   unsigned char src[4 * 4 * 4], dst[4 * 4 * 4];
+   int i;
+
+   for(i = 0; i < (int)sizeof(src); ++i)
+      src[i] = (unsigned char)(i * 37);
+   normalmap_default_params(&q);
+   normalmap_scratch_arena((arena *)data);
+   normalmap_convert(dst, 4 * 4, src, 4 * 4, 4, 4, 4, &q, 0, 0, 0);
+   normalmap_scratch_arena(0);
+
+   return(0);
+}
+
+static int convert_nested(unsigned char *dst, int dst_stride, int dst_format,
+                          const test_image *img, const normalmap_params *p)
+{
+   static arena *outer = 0, *inner = 0;
+   int ret;
+
+   if(outer == 0 && (outer = arena_new()) == 0) return(-1);
+   if(inner == 0 && (inner = arena_new()) == 0) return(-1);
+
+   normalmap_scratch_arena(outer);
+   ret = normalmap_convert_format(dst, dst_stride, dst_format, img->pixels,
+                                  img->stride, img->format, img->width,
+                                  img->height, img->bpp, p, 0,
+                                  nested_progress, inner);
+   normalmap_scratch_arena(0);
+
+   return(ret);
+}
+
+static variant variants[] =
+{
+   VARIANT("convert", convert_lib),
+   VARIANT("convert-u8", convert_u8),
+   VARIANT("stream", convert_stream),
+   VARIANT("in-place", convert_in_place),
+   VARIANT("tiled", convert_tiled),
+   VARIANT("nested", convert_nested),
+   {"u16-heights", convert_u16_heights, {1, 8, 0.001}, 0, 0, 0, {{0}}}
+};
+#define NUM_VARIANTS (int)(sizeof(variants) / sizeof(variants[0]))
+
+/* noise, ramps, flat areas and the extremes, in 'format' */
+static int make_image(test_image *img, int width, int height, int bpp,
+                      int format, int pattern)
+{
+   int size = normalmap_format_size(format);
+   int x, y, c, guard;
+   float v;
+   unsigned char *p;
+
+   img->width = width;
+   img->height = height;
+   img->bpp = bpp;
+   img->format = format;
+   img->stride = width * bpp * size;
+
+   guard = GUARD_ROWS * img->stride + 64;
+   img->alloc = malloc(2 * guard + (size_t)height * img->stride);
+   if(img->alloc == 0) return(-1);
+   for(x = 0; x < 2 * guard + height * img->stride; ++x)
+      img->alloc[x] = (unsigned char)(x * 7);
+   img->pixels = img->alloc + guard;
+
+   for(y = 0; y < height; ++y)
+   {
+      for(x = 0; x < width; ++x)
+      {
+         for(c = 0; c < bpp; ++c)
+         {
+            switch(pattern)
+            {
+               case 0:
+                  v = frnd();
+                  break;
+               case 1:
+                  v = (float)(x + y * 2 + c) / (float)(width + 2 * height + 3);
+                  break;
+               case 2:
+                  /* plateaus with cliffs, flat gradients give zero
+                     normals */
+                  v = ((x / 3 + y / 2) & 1) ? 0.8f : 0.2f;
+                  break;
+               default:
+                  v = (rnd() & 1) ? 1.0f : 0.0f;
+                  break;
+            }
+
+            p = img->pixels + y * img->stride + (x * bpp + c) * size;
+            if(format == NORMALMAP_U8)
+               *p = (unsigned char)(v * 255.0f + 0.5f);
+            else if(format == NORMALMAP_U16)
+            {
+               unsigned short s = (unsigned short)(v * 65535.0f + 0.5f);
+               memcpy(p, &s, 2);
+            }
+            else
+            {
+               /* outside 0 to 1 now and then, it is clamped */
+               if(pattern == 0 && (rnd() & 15) == 0)
+                  v = v * 1.4f - 0.2f;
+               memcpy(p, &v, 4);
+            }
+         }
+      }
+   }
+
+   return(0);
+}
+
+/* the rows above and below a pixel 'filter' reads */
+static int filter_radius(int filter)
+{
+   switch(filter)
+   {
+      case FILTER_SOBEL_5x5:
+      case FILTER_PREWITT_5x5:
+      case FILTER_5x5:
+         return(2);
+      case FILTER_7x7:
+         return(3);
+      case FILTER_9x9:
+         return(4);
+      default:
+         return(1);
+   }
+}
+
+static int known_problem(const normalmap_params *p, const test_image *img)
+{
+   int no_heights = p->conversion == CONVERT_NORMALIZE_ONLY ||
+                    p->conversion == CONVERT_DUDV_TO_NORMAL ||
+                    p->conversion == CONVERT_HEIGHTMAP;
+
+   if(p->wrap && img->width <= filter_radius(p->filter))
+      return(1);
+   if(!p->dudv && no_heights &&
+      (p->alpha == ALPHA_HEIGHT || p->alpha == ALPHA_INVERSE_HEIGHT))
+      return(1);
+   if(p->conversion == CONVERT_BIASED_RGB && img->format != NORMALMAP_U8)
+      return(1);
+   return(0);
+}
+
+static double sample_diff(const unsigned char *a, const unsigned char *b,
+                          int format)
+{
+   unsigned short ua, ub;
+   float fa, fb;
+
+   switch(format)
+   {
+      case NORMALMAP_U16:
+         memcpy(&ua, a, 2);
+         memcpy(&ub, b, 2);
+         return(fabs((double)ua - (double)ub));
+      case NORMALMAP_F32:
+         if(!memcmp(a, b, 4)) return(0);
+         memcpy(&fa, a, 4);
+         memcpy(&fb, b, 4);
+         if(isnan(fa) || isnan(fb)) return(INFINITY);
+         return(fabs((double)fa - (double)fb));
+      default:
+         return(abs((int)*a - (int)*b));
+   }
+}
+
+/* Compares 'dst' with 'ref', adding to the variant's largest errors.
+   Returns 1 if a sample is over the tolerance or the row padding was
+   written to. */
+static int compare(variant *v, const unsigned char *dst,
+                   const unsigned char *ref, int stride, int dst_format,
+                   const test_image *img)
+{
+   int size = normalmap_format_size(dst_format);
+   int row = img->width * img->bpp * size;
+   int x, y, c, bad = 0;
+   double d;
+
+   for(y = 0; y < img->height; ++y)
+   {
+      for(x = 0; x < img->width; ++x)
+      {
+         for(c = 0; c < img->bpp; ++c)
+         {
+            d = sample_diff(dst + y * stride + (x * img->bpp + c) * size,
+                            ref + y * stride + (x * img->bpp + c) * size,
+                            dst_format);
+            if(d > v->max_err[dst_format][c])
+               v->max_err[dst_format][c] = d;
+            if(d > v->tolerance[dst_format])
+               bad = 1;
+         }
+      }
+      for(x = row; x < stride; ++x)
+      {
+         if(dst[y * stride + x] != PAD_BYTE)
+            bad = 1;
+      }
+   }
+
+   return(bad);
+}
+
+static void describe(const normalmap_params *p, const test_image *img,
+                     int dst_format)
+{
+   fprintf(stderr, "  %dx%d bpp %d %s -> %s, filter %d wrap %d "
+           "conversion %d alpha %d dudv %d height_source %d encoding %d "
+           "invert %d%d%d minz %g scale %g contrast %g\n",
+           img->width, img->height, img->bpp, format_names[img->format],
+           format_names[dst_format], p->filter, p->wrap, p->conversion,
+           p->alpha, p->dudv, p->height_source, p->encoding, p->xinvert,
+           p->yinvert, p->swapRGB, p->minz, p->scale, p->contrast);
+}
+
+int main(int argc, char **argv)
+{
+   static unsigned char alphamap[32 * 32];
+   int filter, wrap, conversion, alpha, dudv, i, c, k, ret;
+   int src_format, dst_format, stride, size, cases = 0, failed = 0;
+   int verbose = (argc > 1 && !strcmp(argv[1], "-v"));
+   unsigned char *ref, *dst;
+   normalmap_params p;
+   test_image img;
+   variant *v;
+
+   for(i = 0; i < (int)sizeof(alphamap); ++i)
+      alphamap[i] = (unsigned char)rnd();
+
+   for(filter = 0; filter < MAX_FILTER_TYPE; ++filter)
+   for(wrap = 0; wrap < 2; ++wrap)
+   for(conversion = 0; conversion < MAX_CONVERSION_TYPE; ++conversion)
+   for(alpha = 0; alpha < MAX_ALPHA_TYPE; ++alpha)
+   for(dudv = 0; dudv < MAX_DUDV_TYPE; ++dudv)
+   {
+      normalmap_default_params(&p);
+      p.filter = filter;
+      p.wrap = wrap;
+      p.conversion = conversion;
+      p.alpha = alpha;
+      p.dudv = dudv;
+      p.height_source = rnd() & 1;
+      p.xinvert = rnd() & 1;
+      p.yinvert = rnd() & 1;
+      p.swapRGB = (rnd() & 3) == 0;
+      p.encoding = rnd() % MAX_ENCODING;
+      p.minz = (rnd() & 1) ? 0.0f : frnd();
+      p.scale = (rnd() & 1) ? 1.0f : 0.1f + 10.0f * frnd();
+      p.contrast = (rnd() & 1) ? 0.0f : frnd();
+      if(alpha == ALPHA_MAP)
+      {
+         p.alphamap = alphamap;
+         p.alphamap_width = 1 + rnd() % 32;
+         p.alphamap_height = 1 + rnd() % 32;
+      }
+
+      k = rnd() % NUM_SIZES;
+      src_format = cases % MAX_NORMALMAP_FORMAT;
+      dst_format = (cases / MAX_NORMALMAP_FORMAT) % MAX_NORMALMAP_FORMAT;
+      ++cases;
+
+      if(make_image(&img, sizes[k][0], sizes[k][1], 3 + (rnd() & 1),
+                    src_format, rnd() & 3) != 0)
+      {
+         fprintf(stderr, "out of memory\n");
+         return(1);
+      }
+
+      if(known_problem(&p, &img))
+      {
+         for(i = 0; i < NUM_VARIANTS; ++i)
+            ++variants[i].skipped;
+         free(img.alloc);
+         continue;
+      }
+
+      size = normalmap_format_size(dst_format);
+      stride = img.width * img.bpp * size + DST_PAD;
+      ref = malloc((size_t)stride * img.height);
+      dst = malloc((size_t)stride * img.height);
+      if(ref == 0 || dst == 0)
+      {
+         fprintf(stderr, "out of memory\n");
+         return(1);
+      }
+
+      memset(ref, PAD_BYTE, (size_t)stride * img.height);
+      if(normalmap_reference_convert(ref, stride, dst_format, img.pixels,
+                                     img.stride, img.format, img.width,
+                                     img.height, img.bpp, &p, 0, 0, 0) != 0)
+      {
+         fprintf(stderr, "reference conversion failed\n");
+         return(1);
+      }
+
+      for(i = 0; i < NUM_VARIANTS; ++i)
+      {
+         v = &variants[i];
+         memset(dst, PAD_BYTE, (size_t)stride * img.height);
+         ret = v->func(dst, stride, dst_format, &img, &p);
+         if(ret == 1)
+         {
+            ++v->skipped;
+            continue;
+         }
+         ++v->cases;
+         if(ret != 0 || compare(v, dst, ref, stride, dst_format, &img))
+         {
+            if(v->failed++ < 5 || verbose)
+            {
+               fprintf(stderr, "%s differs%s:\n", v->name,
+                       ret != 0 ? " (failed)" : "");
+               describe(&p, &img, dst_format);
+            }
+         }
+      }
+
+      free(ref);
+      free(dst);
+      free(img.alloc);
+   }
+
+   printf("%d cases\n\n", cases);
+   printf("%-12s %6s %6s %6s  %-4s %12s %12s %12s %12s\n", "variant",
+          "run", "skip", "failed", "fmt", "max err r", "g", "b", "a");
+
+   for(i = 0; i < NUM_VARIANTS; ++i)
+   {
+      v = &variants[i];
+      for(k = 0; k < MAX_NORMALMAP_FORMAT; ++k)
+      {
+         if(k == 0)
+            printf("%-12s %6d %6d %6d  ", v->name, v->cases, v->skipped,
+                   v->failed);
+         else
+            printf("%-12s %6s %6s %6s  ", "", "", "", "");
+         printf("%-4s", format_names[k]);
+         for(c = 0; c < 4; ++c)
+            printf(" %12.6g", v->max_err[k][c]);
+         printf("\n");
+      }
+      failed += v->failed;
+   }
+
+   printf("\n%s\n", failed ? "FAILED" : "passed");
+
+   return(failed ? 1 : 0);
+}
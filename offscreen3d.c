@@ -0,0 +1,268 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <string.h>
+#include <time.h>
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <glib.h>
+
+#include "render3d.h"
+#include "offscreen3d.h"
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static EGLSurface surface = EGL_NO_SURFACE;
+
+static GLuint fbo = 0;
+static GLuint color_rb = 0;
+static GLuint depth_rb = 0;
+
+static int width = 0;
+static int height = 0;
+
+static EGLDisplay get_display(int *surfaceless)
+{
+   const char *exts;
+   PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+   EGLDisplay dpy;
+
+   *surfaceless = 0;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+   exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+   if(exts && strstr(exts, "EGL_MESA_platform_surfaceless"))
+   {
+      get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+         eglGetProcAddress("eglGetPlatformDisplayEXT");
+      if(get_platform_display)
+      {
+         dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                    EGL_DEFAULT_DISPLAY, 0);
+         if(dpy != EGL_NO_DISPLAY && eglInitialize(dpy, 0, 0))
+         {
+            *surfaceless = 1;
+            return(dpy);
+         }
+      }
+   }
+#endif
+
+   dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+   if(dpy != EGL_NO_DISPLAY && !eglInitialize(dpy, 0, 0))
+      dpy = EGL_NO_DISPLAY;
+
+   return(dpy);
+}
+
+int offscreen3d_init(int w, int h)
+{
+   EGLConfig config;
+   EGLint num_configs;
+   int surfaceless;
+   const char *exts;
+   EGLint config_attribs[] =
+   {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+      EGL_DEPTH_SIZE, 24,
+      EGL_NONE
+   };
+   EGLint pbuffer_attribs[] =
+   {
+      EGL_WIDTH, 1, EGL_HEIGHT, 1,
+      EGL_NONE
+   };
+
+   width = w;
+   height = h;
+
+   display = get_display(&surfaceless);
+   if(display == EGL_NO_DISPLAY)
+   {
+      g_message("Unable to open an EGL display");
+      return(-1);
+   }
+
+   if(surfaceless)
+   {
+      exts = eglQueryString(display, EGL_EXTENSIONS);
+      if(!exts || !strstr(exts, "EGL_KHR_surfaceless_context"))
+         surfaceless = 0;
+   }
+   /* no surface needed, so accept configs without pbuffer support */
+   if(surfaceless)
+      config_attribs[1] = 0;
+
+   if(!eglBindAPI(EGL_OPENGL_API) ||
+      !eglChooseConfig(display, config_attribs, &config, 1, &num_configs) ||
+      num_configs < 1)
+   {
+      g_message("No EGL config with desktop OpenGL support");
+      offscreen3d_release();
+      return(-1);
+   }
+
+   context = eglCreateContext(display, config, EGL_NO_CONTEXT, 0);
+   if(context == EGL_NO_CONTEXT)
+   {
+      g_message("Unable to create an OpenGL context");
+      offscreen3d_release();
+      return(-1);
+   }
+
+   /* all drawing goes to the FBO, the surface only exists to make the
+      context current where surfaceless contexts are not supported */
+   if(!surfaceless)
+   {
+      surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+      if(surface == EGL_NO_SURFACE)
+      {
+         g_message("Unable to create a pbuffer surface");
+         offscreen3d_release();
+         return(-1);
+      }
+   }
+
+   if(!eglMakeCurrent(display, surface, surface, context))
+   {
+      g_message("Unable to make the OpenGL context current");
+      offscreen3d_release();
+      return(-1);
+   }
+
+   if(render3d_init() != 0)
+   {
+      offscreen3d_release();
+      return(-1);
+   }
+
+   if(!GLEW_EXT_framebuffer_object)
+   {
+      g_message("GL_EXT_framebuffer_object is required for offscreen rendering");
+      offscreen3d_release();
+      return(-1);
+   }
+
+   glGenFramebuffersEXT(1, &fbo);
+   glGenRenderbuffersEXT(1, &color_rb);
+   glGenRenderbuffersEXT(1, &depth_rb);
+
+   glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, color_rb);
+   glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, w, h);
+   glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depth_rb);
+   glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, w, h);
+   glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, 0);
+
+   glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
+   glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
+                                GL_RENDERBUFFER_EXT, color_rb);
+   glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT,
+                                GL_RENDERBUFFER_EXT, depth_rb);
+   glDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+   glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+
+   if(glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) !=
+      GL_FRAMEBUFFER_COMPLETE_EXT)
+   {
+      g_message("Offscreen framebuffer is incomplete");
+      offscreen3d_release();
+      return(-1);
+   }
+
+   render3d_resize(w, h);
+
+   return(0);
+}
+
+static double now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0);
+}
+
+void offscreen3d_render(const render3d_params *p, int frames, double *times)
+{
+   int i;
+   double t;
+
+   for(i = 0; i < frames; ++i)
+   {
+      t = now_ms();
+      render3d_draw(p);
+      glFinish();
+      if(times)
+         times[i] = now_ms() - t;
+   }
+}
+
+void offscreen3d_read_pixels(unsigned char *pixels)
+{
+   int y, stride = width * 3;
+   unsigned char *row;
+
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+
+   /* GL returns the bottom row first */
+   row = g_malloc(stride);
+   for(y = 0; y < height / 2; ++y)
+   {
+      memcpy(row, pixels + y * stride, stride);
+      memcpy(pixels + y * stride, pixels + (height - 1 - y) * stride, stride);
+      memcpy(pixels + (height - 1 - y) * stride, row, stride);
+   }
+   g_free(row);
+}
+
+void offscreen3d_release(void)
+{
+   if(context != EGL_NO_CONTEXT && eglGetCurrentContext() == context)
+   {
+      if(fbo)
+      {
+         glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+         glDeleteFramebuffersEXT(1, &fbo);
+         glDeleteRenderbuffersEXT(1, &color_rb);
+         glDeleteRenderbuffersEXT(1, &depth_rb);
+      }
+      render3d_release();
+   }
+   fbo = color_rb = depth_rb = 0;
+
+   if(display != EGL_NO_DISPLAY)
+   {
+      eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+      if(surface != EGL_NO_SURFACE)
+         eglDestroySurface(display, surface);
+      if(context != EGL_NO_CONTEXT)
+         eglDestroyContext(display, context);
+      eglTerminate(display);
+   }
+
+   display = EGL_NO_DISPLAY;
+   context = EGL_NO_CONTEXT;
+   surface = EGL_NO_SURFACE;
+}
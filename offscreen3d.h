@@ -0,0 +1,44 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __OFFSCREEN3D_H
+#define __OFFSCREEN3D_H
+
+#include "render3d.h"
+
+/* Headless render target for the 3D preview.  Creates an EGL context
+ * (surfaceless where Mesa supports it, a pbuffer otherwise) with a
+ * framebuffer object of the requested size bound, and initializes render3d
+ * in it.  Returns 0 on success, -1 if no usable context could be created.
+ */
+int offscreen3d_init(int w, int h);
+
+/* Draws the scene 'frames' times.  When 'times' is non-NULL it receives the
+ * wall time of each frame in milliseconds, measured to glFinish().
+ */
+void offscreen3d_render(const render3d_params *p, int frames, double *times);
+
+/* Reads back the last frame as tightly packed RGB, top row first. */
+void offscreen3d_read_pixels(unsigned char *pixels);
+
+void offscreen3d_release(void);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perfcount.h"
+
+#ifdef __linux__
+
+static const unsigned long long event_config[PERF_NUM_EVENTS] =
+{
+   PERF_COUNT_HW_CPU_CYCLES,
+   PERF_COUNT_HW_INSTRUCTIONS,
+   PERF_COUNT_HW_CACHE_MISSES,
+   PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static int open_event(unsigned long long config, int group_fd)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = config;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+      PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+   /* this thread, on whichever processor it runs */
+   return((int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+}
+
+int perf_group_open(perf_group *g, char *err, int errlen)
+{
+   int i, mask = 0, error = 0;
+
+   g->leader = -1;
+   for(i = 0; i < PERF_NUM_EVENTS; ++i)
+   {
+      g->fd[i] = open_event(event_config[i], g->leader);
+      if(g->fd[i] < 0)
+      {
+         if(error == 0) error = errno;
+         continue;
+      }
+      if(g->leader < 0) g->leader = g->fd[i];
+      mask |= 1 << i;
+   }
+
+   if(mask == 0)
+   {
+      /* ENOENT and EOPNOTSUPP are what a machine without a PMU gives */
+      snprintf(err, errlen, "hardware counters unavailable: %s",
+               strerror(error));
+      return(0);
+   }
+
+   ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+   ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+   return(mask);
+}
+
+int perf_group_read(const perf_group *g, long long values[PERF_NUM_EVENTS])
+{
+   /* nr, time enabled, time running, then a value per open event */
+   unsigned long long buf[3 + PERF_NUM_EVENTS];
+   double scale = 1;
+   int i, n = 0;
+
+   memset(values, 0, PERF_NUM_EVENTS * sizeof(long long));
+
+   if(read(g->leader, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(buf[0])))
+      return(-1);
+
+   if(buf[2] > 0 && buf[2] < buf[1])
+      scale = (double)buf[1] / (double)buf[2];
+
+   /* the values come in the order the events joined the group */
+   for(i = 0; i < PERF_NUM_EVENTS && n < (int)buf[0]; ++i)
+   {
+      if(g->fd[i] >= 0)
+         values[i] = (long long)(buf[3 + n++] * scale);
+   }
+
+   return(0);
+}
+
+void perf_group_close(perf_group *g)
+{
+   int i;
+
+   for(i = 0; i < PERF_NUM_EVENTS; ++i)
+   {
+      if(g->fd[i] >= 0) close(g->fd[i]);
+      g->fd[i] = -1;
+   }
+   g->leader = -1;
+}
+
+#else
+
+int perf_group_open(perf_group *g, char *err, int errlen)
+{
+   int i;
+
+   g->leader = -1;
+   for(i = 0; i < PERF_NUM_EVENTS; ++i)
+      g->fd[i] = -1;
+   snprintf(err, errlen, "hardware counters are only read on Linux");
+
+   return(0);
+}
+
+int perf_group_read(const perf_group *g, long long values[PERF_NUM_EVENTS])
+{
+   memset(values, 0, PERF_NUM_EVENTS * sizeof(long long));
+   return(-1);
+}
+
+void perf_group_close(perf_group *g)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __PERFCOUNT_H
+#define __PERFCOUNT_H
+
+/* Hardware counters of the calling thread, read through perf_event_open()
+ * on Linux.  Kernel time is left out so the default perf_event_paranoid
+ * setting allows it.  Elsewhere, or where the processor's counters are not
+ * exposed, as in most virtual machines and containers, opening fails.
+ */
+
+enum
+{
+   PERF_CYCLES = 0,
+   PERF_INSTRUCTIONS,
+   PERF_CACHE_MISSES,
+   PERF_BRANCH_MISSES,
+   PERF_NUM_EVENTS
+};
+
+typedef struct
+{
+   int leader;                    /* descriptor the group is read from */
+   int fd[PERF_NUM_EVENTS];       /* -1 for events that could not open */
+} perf_group;
+
+/* Opens what it can of the events as one group, so they are counted over
+ * the same time.  Returns a mask of (1 << event) for the events counted,
+ * or 0 with the reason in 'err'.
+ */
+int perf_group_open(perf_group *g, char *err, int errlen);
+
+/* The counts so far, scaled up if the kernel had to share the counters
+ * with other groups.  Events not counted read 0.  Returns 0, or -1 if
+ * the read failed.
+ */
+int perf_group_read(const perf_group *g, long long values[PERF_NUM_EVENTS]);
+
+void perf_group_close(perf_group *g);
+
+#endif
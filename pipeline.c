@@ -0,0 +1,361 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "topology.h"
+
+/* rows between stages, enough to ride out a slow deflate block */
+#define QUEUE_ROWS 32
+
+typedef struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   unsigned char *rows;
+   size_t row_size;
+   int head, count;
+   int closed;           /* the producer has no more rows */
+   int aborted;          /* a stage failed, everyone stops */
+} row_queue;
+
+typedef struct
+{
+   image_reader *reader;
+   image_writer *writer;
+   row_queue in, out;
+   int height;
+   int read_failed, write_failed;
+   char read_err[256], write_err[256];
+} pipeline;
+
+static double now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return((double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0);
+}
+
+static int queue_init(row_queue *q, size_t row_size)
+{
+   memset(q, 0, sizeof(row_queue));
+   q->row_size = row_size;
+   q->rows = malloc(QUEUE_ROWS * row_size);
+   if(q->rows == 0) return(-1);
+   pthread_mutex_init(&q->lock, 0);
+   pthread_cond_init(&q->cond, 0);
+   return(0);
+}
+
+static void queue_destroy(row_queue *q)
+{
+   if(q->rows == 0) return;
+   pthread_mutex_destroy(&q->lock);
+   pthread_cond_destroy(&q->cond);
+   free(q->rows);
+}
+
+/* Producer side.  The slot stays the same until it is committed, NULL once
+   the queue is aborted. */
+static unsigned char *queue_slot(row_queue *q)
+{
+   unsigned char *row = 0;
+
+   pthread_mutex_lock(&q->lock);
+   while(q->count == QUEUE_ROWS && !q->aborted)
+      pthread_cond_wait(&q->cond, &q->lock);
+   if(!q->aborted)
+      row = q->rows + ((q->head + q->count) % QUEUE_ROWS) * q->row_size;
+   pthread_mutex_unlock(&q->lock);
+
+   return(row);
+}
+
+static void queue_commit(row_queue *q)
+{
+   pthread_mutex_lock(&q->lock);
+   ++q->count;
+   pthread_cond_broadcast(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+}
+
+/* Consumer side.  NULL when the producer is done and the queue drained, or
+   it was aborted. */
+static unsigned char *queue_next(row_queue *q)
+{
+   unsigned char *row = 0;
+
+   pthread_mutex_lock(&q->lock);
+   while(q->count == 0 && !q->closed && !q->aborted)
+      pthread_cond_wait(&q->cond, &q->lock);
+   if(q->count > 0 && !q->aborted)
+      row = q->rows + q->head * q->row_size;
+   pthread_mutex_unlock(&q->lock);
+
+   return(row);
+}
+
+static void queue_release(row_queue *q)
+{
+   pthread_mutex_lock(&q->lock);
+   q->head = (q->head + 1) % QUEUE_ROWS;
+   --q->count;
+   pthread_cond_broadcast(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_close(row_queue *q, int abort)
+{
+   pthread_mutex_lock(&q->lock);
+   q->closed = 1;
+   if(abort) q->aborted = 1;
+   pthread_cond_broadcast(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+}
+
+static void *read_rows(void *data)
+{
+   pipeline *pl = (pipeline *)data;
+   unsigned char *row;
+   int y;
+
+   /* decoding overlaps the conversion, off the worker's own processor */
+   topology_widen_to_node();
+
+   for(y = 0; y < pl->height; ++y)
+   {
+      if((row = queue_slot(&pl->in)) == 0)
+         break;
+      if(image_reader_read(pl->reader, row, pl->read_err,
+                           sizeof(pl->read_err)) != 0)
+      {
+         pl->read_failed = 1;
+         queue_close(&pl->in, 1);
+         return(0);
+      }
+      queue_commit(&pl->in);
+   }
+   queue_close(&pl->in, 0);
+
+   return(0);
+}
+
+static void *write_rows(void *data)
+{
+   pipeline *pl = (pipeline *)data;
+   unsigned char *row;
+
+   topology_widen_to_node();
+
+   while((row = queue_next(&pl->out)) != 0)
+   {
+      if(image_writer_write(pl->writer, row, pl->write_err,
+                            sizeof(pl->write_err)) != 0)
+      {
+         pl->write_failed = 1;
+         queue_close(&pl->out, 1);
+         break;
+      }
+      queue_release(&pl->out);
+   }
+
+   return(0);
+}
+
+/* With wrap the first rows need the last ones, read through the file once
+   to hand them over before the real pass. */
+static int prime_stream(normalmap_stream *s, const char *src_fn,
+                        const image_data *img, char *err, int errlen)
+{
+   image_reader *r;
+   image_data tmp;
+   unsigned char *row;
+   int y, first, ret = 0;
+
+   first = img->height - normalmap_stream_radius(s);
+   if(first < 0) first = 0;
+
+   if(image_reader_open(&r, src_fn, 1, &tmp, err, errlen) != 0)
+      return(-1);
+   row = malloc(image_stride(img));
+   if(row == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      image_reader_close(r);
+      return(-1);
+   }
+
+   for(y = 0; y < img->height && ret == 0; ++y)
+   {
+      ret = image_reader_read(r, row, err, errlen);
+      if(ret == 0 && y >= first)
+         normalmap_stream_prime(s, row);
+   }
+
+   free(row);
+   image_reader_close(r);
+
+   return(ret);
+}
+
+/* the middle stage, on the caller's thread */
+static int bake_rows(pipeline *pl, normalmap_stream *s)
+{
+   unsigned char *src, *dst;
+   int y, ret;
+
+   for(y = 0; y < pl->height; ++y)
+   {
+      if((src = queue_next(&pl->in)) == 0 ||
+         (dst = queue_slot(&pl->out)) == 0)
+         return(-1);
+      ret = normalmap_stream_push(s, src, dst);
+      queue_release(&pl->in);
+      if(ret < 0) return(-1);
+      if(ret > 0) queue_commit(&pl->out);
+   }
+
+   for(;;)
+   {
+      if((dst = queue_slot(&pl->out)) == 0)
+         return(-1);
+      if(!normalmap_stream_flush(s, dst))
+         break;
+      queue_commit(&pl->out);
+   }
+
+   return(0);
+}
+
+int pipeline_convert(const char *src_fn, const char *dst_fn, int dst_format,
+                     const normalmap_params *p, image_data *img,
+                     double ms[3], char *err, int errlen)
+{
+   pipeline pl;
+   image_data dst;
+   normalmap_stream *s = 0;
+   pthread_t reader_thread, writer_thread;
+   double t0, t1, t2;
+   int ret;
+
+   t0 = now_ms();
+
+   if(!normalmap_stream_supported(p))
+      return(1);
+
+   memset(&pl, 0, sizeof(pl));
+
+   ret = image_reader_open(&pl.reader, src_fn, 1, img, err, errlen);
+   if(ret != 0)
+      return(ret);
+
+   dst = *img;
+   dst.sample_format = dst_format;
+   pl.height = img->height;
+
+   s = normalmap_stream_new(img->width, img->height, img->bpp,
+                            img->sample_format, dst_format, p);
+   if(s == 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      image_reader_close(pl.reader);
+      return(-1);
+   }
+
+   if(p->wrap && prime_stream(s, src_fn, img, err, errlen) != 0)
+   {
+      normalmap_stream_free(s);
+      image_reader_close(pl.reader);
+      return(-1);
+   }
+
+   ret = image_writer_open(&pl.writer, dst_fn, &dst, err, errlen);
+   if(ret != 0)
+   {
+      normalmap_stream_free(s);
+      image_reader_close(pl.reader);
+      return(ret);
+   }
+
+   if(queue_init(&pl.in, image_stride(img)) != 0 ||
+      queue_init(&pl.out, image_stride(&dst)) != 0)
+   {
+      snprintf(err, errlen, "out of memory");
+      queue_destroy(&pl.in);
+      normalmap_stream_free(s);
+      image_reader_close(pl.reader);
+      image_writer_close(pl.writer, 0, 0);
+      return(-1);
+   }
+
+   t1 = now_ms();
+
+   ret = -1;
+   if(pthread_create(&reader_thread, 0, read_rows, &pl) == 0)
+   {
+      if(pthread_create(&writer_thread, 0, write_rows, &pl) == 0)
+      {
+         ret = bake_rows(&pl, s);
+
+         /* a failed bake stops both ends, otherwise the writer drains */
+         queue_close(&pl.out, ret != 0);
+         pthread_join(writer_thread, 0);
+      }
+      if(ret != 0)
+         queue_close(&pl.in, 1);
+      pthread_join(reader_thread, 0);
+   }
+
+   t2 = now_ms();
+
+   if(pl.read_failed)
+      snprintf(err, errlen, "%s", pl.read_err);
+   else if(pl.write_failed)
+      snprintf(err, errlen, "%s", pl.write_err);
+   else if(ret != 0)
+      snprintf(err, errlen, "could not start the pipeline threads");
+
+   if(pl.read_failed || pl.write_failed)
+      ret = -1;
+
+   /* removes the file if it is short of rows */
+   if(image_writer_close(pl.writer, ret == 0 ? err : 0, errlen) != 0)
+      ret = -1;
+   else if(ret != 0)
+      remove(dst_fn);
+
+   normalmap_stream_free(s);
+   image_reader_close(pl.reader);
+   queue_destroy(&pl.in);
+   queue_destroy(&pl.out);
+
+   ms[0] = t1 - t0;
+   ms[1] = t2 - t1;
+   ms[2] = now_ms() - t2;
+
+   return(ret);
+}
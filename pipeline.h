@@ -0,0 +1,45 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include "libnormalmap.h"
+#include "imageio.h"
+
+/* Streaming conversion for images too large to hold whole.  One thread
+ * decodes rows, the caller's thread runs them through a normalmap_stream
+ * and another encodes the results, with a bounded queue of rows between
+ * each.  Memory use is the queues plus the rows the filter kernel spans,
+ * whatever the size of the image.
+ */
+
+/* Converts 'src_fn' to 'dst_fn' with results in 'dst_format'.  'img' gets
+ * the size of the image, and 'ms' the time spent opening the files, in the
+ * pipeline and finishing the output.  Returns 0 on success, 1 if the files
+ * or parameters cannot be streamed, nothing having been written, and -1
+ * on failure with a message in 'err'.
+ */
+int pipeline_convert(const char *src_fn, const char *dst_fn, int dst_format,
+                     const normalmap_params *p, image_data *img,
+                     double ms[3], char *err, int errlen);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <time.h>
+
+#include "progress.h"
+
+#define REPORT_INTERVAL_MS (1000.0 / 30.0)
+#define REPORT_STEP (1.0f / 200.0f)
+
+static double now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+void progress_meter_init(progress_meter *m, long long total,
+                         normalmap_progress_func report, void *data)
+{
+   m->total = total > 0 ? total : 1;
+   m->done = 0;
+   m->cancelled = 0;
+   m->interval_ms = REPORT_INTERVAL_MS;
+   m->step = REPORT_STEP;
+   m->last_ms = report ? now_ms() : 0;
+   m->last = 0;
+   m->report = report;
+   m->data = data;
+}
+
+int progress_meter_add(progress_meter *m, long long n)
+{
+   if(m->report) __sync_add_and_fetch(&m->done, n);
+   return(m->cancelled);
+}
+
+static void report(progress_meter *m, float f, double t)
+{
+   m->last = f;
+   m->last_ms = t;
+   if(m->report(f, m->data))
+      m->cancelled = 1;
+}
+
+int progress_meter_poll(progress_meter *m)
+{
+   float f;
+   double t;
+
+   if(m->report == 0) return(m->cancelled);
+
+   f = (float)((double)__sync_add_and_fetch(&m->done, 0) /
+               (double)m->total);
+   if(f > 1) f = 1;
+
+   /* the cheap test first, the clock is only read when there is news */
+   if(f - m->last >= m->step)
+   {
+      t = now_ms();
+      if(t - m->last_ms >= m->interval_ms)
+         report(m, f, t);
+   }
+
+   return(m->cancelled);
+}
+
+void progress_meter_finish(progress_meter *m)
+{
+   if(m->report && m->last < 1)
+      report(m, 1, now_ms());
+}
+
+int progress_meter_func(float progress, void *data)
+{
+   progress_meter *m = (progress_meter *)data;
+
+   m->done = (long long)(progress * m->total);
+   return(progress_meter_poll(m));
+}
@@ -0,0 +1,75 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __PROGRESS_H
+#define __PROGRESS_H
+
+#include "libnormalmap.h"
+
+/* Rate limited progress reporting.  Work is counted in whatever units the
+ * caller likes with progress_meter_add(), from any thread, and the report
+ * callback only runs from progress_meter_poll() on the thread that may
+ * talk to the user interface, and only once the fraction done has moved by
+ * a step and enough time has passed since the last report.  That keeps a
+ * progress bar fed with a few dozen updates a second however many rows go
+ * by.
+ */
+
+typedef struct
+{
+   long long total;
+   volatile long long done;
+   volatile int cancelled;
+   double interval_ms;      /* least time between reports */
+   float step;              /* least change of the fraction between them */
+   double last_ms;
+   float last;
+   normalmap_progress_func report;
+   void *data;
+} progress_meter;
+
+/* 'total' units of work, reported through 'report' at most 30 times a
+ * second and every 1/200th of the work.  'report' may be NULL, then
+ * nothing is measured.
+ */
+void progress_meter_init(progress_meter *m, long long total,
+                         normalmap_progress_func report, void *data);
+
+/* Counts 'n' more units done.  Returns non-zero once a report asked to
+ * cancel.
+ */
+int progress_meter_add(progress_meter *m, long long n);
+
+/* Reports if it is time to.  Returns non-zero once a report asked to
+ * cancel.
+ */
+int progress_meter_poll(progress_meter *m);
+
+/* Reports the end of the work, whatever the time. */
+void progress_meter_finish(progress_meter *m);
+
+/* A normalmap_progress_func taking a progress_meter as 'data', for a single
+ * conversion on the reporting thread.  The fraction is of the meter's
+ * total.
+ */
+int progress_meter_func(float progress, void *data);
+
+#endif
@@ -0,0 +1,1462 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <string.h>
+#include <math.h>
+#include <GL/glew.h>
+#include <glib.h>
+
+#include "scale.h"
+#include "arena.h"
+#include "meshopt.h"
+#include "conemap.h"
+#include "render3d.h"
+
+#include "objects/quad.h"
+#include "objects/cube.h"
+#include "objects/sphere.h"
+#include "objects/torus.h"
+#include "objects/teapot.h"
+
+#define IS_POT(x)  (((x) & ((x) - 1)) == 0)
+
+typedef float matrix[16];
+typedef float vec4[4];
+typedef float vec3[3];
+typedef float vec2[2];
+
+static int _gl_error = 0;
+
+static GLuint diffuse_tex = 0;
+static GLuint gloss_tex = 0;
+static GLuint normal_tex = 0;
+static GLuint white_tex = 0;
+static GLuint cone_tex = 0;
+
+static struct
+{
+   float *verts;
+   unsigned short *indices;
+   unsigned int num_verts;
+   unsigned int num_indices;
+   GLuint vbo;
+} object_info[OBJECT_MAX] =
+{
+   {quad_verts,   quad_indices,   QUAD_NUM_VERTS,   QUAD_NUM_INDICES,   0},
+   {cube_verts,   cube_indices,   CUBE_NUM_VERTS,   CUBE_NUM_INDICES,   0},
+   {sphere_verts, sphere_indices, SPHERE_NUM_VERTS, SPHERE_NUM_INDICES, 0},
+   {torus_verts,  torus_indices,  TORUS_NUM_VERTS,  TORUS_NUM_INDICES,  0},
+   {teapot_verts, teapot_indices, TEAPOT_NUM_VERTS, TEAPOT_NUM_INDICES, 0}
+};
+
+static int objects_optimized = 0;
+
+/* rescaled images, mipmaps and cone maps on their way to the textures,
+   kept so a preview refreshing all the time is not allocating all the
+   time */
+static arena *upload_scratch = 0;
+
+static const float anisotropy = 4.0f;
+
+static int has_glsl = 0;
+static int has_npot = 0;
+static int has_generate_mipmap = 0;
+static int has_aniso = 0;
+static int has_texture_lod = 0;
+static int num_mtus = 0;
+
+static int max_instructions = 0;
+static int max_indirections = 0;
+
+static GLhandleARB programs[BUMPMAP_MAX];
+
+static const char *vert_source =
+   "varying vec2 tex;\n"
+   "varying vec3 vpos;\n"
+   "varying vec3 normal;\n"
+   "varying vec3 tangent;\n"
+   "varying vec3 binormal;\n"
+   "\n"
+   "uniform vec2 uvscale;\n"
+   "\n"
+   "vec3 oct_decode(vec2 e)\n"
+   "{\n"
+   "   e *= 1.0 / 32767.0;\n"
+   "   vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));\n"
+   "   if(v.z < 0.0)\n"
+   "   {\n"
+   "      v.xy = (1.0 - abs(v.yx)) *\n"
+   "         vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);\n"
+   "   }\n"
+   "   return(normalize(v));\n"
+   "}\n"
+   "\n"
+   "void main()\n"
+   "{\n"
+   "   gl_Position = ftransform();\n"
+   "   tex = gl_MultiTexCoord0.xy * (1.0 / 4096.0) * uvscale;\n"
+   "   vpos = (gl_ModelViewMatrix * gl_Vertex).xyz;\n"
+   "   tangent  = gl_NormalMatrix * oct_decode(gl_MultiTexCoord3.xy);\n"
+   "   binormal = gl_NormalMatrix * oct_decode(gl_MultiTexCoord3.zw);\n"
+   "   normal   = gl_NormalMatrix * oct_decode(gl_MultiTexCoord4.xy);\n"
+   "}\n";
+
+static const char *normal_frag_source =
+   "varying vec2 tex;\n"
+   "varying vec3 vpos;\n"
+   "varying vec3 normal;\n"
+   "varying vec3 tangent;\n"
+   "varying vec3 binormal;\n"
+
+   "uniform sampler2D sNormal;\n"
+   "uniform sampler2D sDiffuse;\n"
+   "uniform sampler2D sGloss;\n\n"
+
+   "uniform vec3 lightDir;\n"
+   "uniform bool specular;\n"
+   "uniform float specular_exp;\n"
+   "uniform vec3 ambient_color;\n"
+   "uniform vec3 diffuse_color;\n"
+   "uniform vec3 specular_color;\n\n"
+
+   "void main()\n"
+   "{\n"
+   "   vec3 V = normalize(vpos);\n"
+   "   vec3 N = texture2D(sNormal, tex).rgb * 2.0 - 1.0;\n"
+   "   N = normalize(N.x * tangent + N.y * binormal + N.z * normal);\n"
+   "   vec3 diffuse = texture2D(sDiffuse, tex).rgb;\n"
+   "   float NdotL = clamp(dot(N, lightDir), 0.0, 1.0);\n"
+   "   vec3 color = diffuse * diffuse_color * NdotL;\n"
+   "   if(specular)\n"
+   "   {\n"
+   "      vec3 gloss = texture2D(sGloss, tex).rgb;\n"
+   "      vec3 R = reflect(V, N);\n"
+   "      float RdotL = clamp(dot(R, lightDir), 0.0, 1.0);\n"
+   "      color += gloss * specular_color * pow(RdotL, specular_exp);\n"
+   "   }\n"
+   "   gl_FragColor.rgb = ambient_color * diffuse + color;\n"
+   "}\n";
+
+static const char *parallax_frag_source =
+   "varying vec2 tex;\n"
+   "varying vec3 vpos;\n"
+   "varying vec3 normal;\n"
+   "varying vec3 tangent;\n"
+   "varying vec3 binormal;\n"
+
+   "uniform sampler2D sNormal;\n"
+   "uniform sampler2D sDiffuse;\n"
+   "uniform sampler2D sGloss;\n\n"
+
+   "uniform vec3 lightDir;\n"
+   "uniform bool specular;\n"
+   "uniform float specular_exp;\n"
+   "uniform vec3 ambient_color;\n"
+   "uniform vec3 diffuse_color;\n"
+   "uniform vec3 specular_color;\n\n"
+
+   "void main()\n"
+   "{\n"
+   "   mat3 TBN = mat3(tangent, binormal, normal);\n"
+   "   vec3 V = normalize(vpos);\n"
+   "   vec3 V_ts = V * TBN;\n"
+   "   float height = texture2D(sNormal, tex).a;\n"
+   "   float offset = height * 0.025 - 0.0125;\n"
+   "   vec2 tc = tex + offset * V_ts.xy;\n"
+   "   height += texture2D(sNormal, tc).a;\n"
+   "   offset = 0.025 * (height - 1.0);\n"
+   "   tc = tex + offset * V_ts.xy;\n"
+   "   vec3 N = texture2D(sNormal, tc).rgb * 2.0 - 1.0;\n"
+   "   N = normalize(N.x * tangent + N.y * binormal + N.z * normal);\n"
+   "   vec3 diffuse = texture2D(sDiffuse, tc).rgb;\n"
+   "   float NdotL = clamp(dot(N, lightDir), 0.0, 1.0);\n"
+   "   vec3 color = diffuse * diffuse_color * NdotL;\n"
+   "   if(specular)\n"
+   "   {\n"
+   "      vec3 gloss = texture2D(sGloss, tc).rgb;\n"
+   "      vec3 R = reflect(V, N);\n"
+   "      float RdotL = clamp(dot(R, lightDir), 0.0, 1.0);\n"
+   "      color += gloss * specular_color * pow(RdotL, specular_exp);\n"
+   "   }\n"
+   "   gl_FragColor.rgb = ambient_color * diffuse + color;\n"
+   "}\n";
+
+/* Prepended to the parallax occlusion and relief shaders.  Chooses the
+ * number of linear search steps per fragment: more at grazing angles, where
+ * the ray crosses more of the height field, but never more than one per
+ * texel of the mip level being sampled, scaled by the quality setting.
+ */
+static const char *search_steps_source =
+   "#define MIN_SEARCH_STEPS 4\n"
+   "#define MAX_SEARCH_STEPS 64\n"
+   "\n"
+
+   "uniform float quality;\n"
+   "uniform vec2 texsize;\n"
+   "\n"
+   "int search_steps(vec2 ds, float NdotV, vec2 dx, vec2 dy)\n"
+   "{\n"
+   "   vec2 tdx = dx * texsize;\n"
+   "   vec2 tdy = dy * texsize;\n"
+   "   float lod = max(0.0, 0.5 * log2(max(dot(tdx, tdx), dot(tdy, tdy))));\n"
+   "   float texels = length(ds * texsize) / exp2(lod);\n"
+   "   float n = mix(float(MIN_SEARCH_STEPS), float(MAX_SEARCH_STEPS), quality);\n"
+   "   n = mix(n * 0.25, n, clamp(1.0 - NdotV, 0.0, 1.0));\n"
+   "   n = min(n, texels + 1.0);\n"
+   "   return(int(clamp(n, float(MIN_SEARCH_STEPS), float(MAX_SEARCH_STEPS))));\n"
+   "}\n"
+   "\n";
+
+static const char *pom_frag_source =
+   "varying vec2 tex;\n"
+   "varying vec3 vpos;\n"
+   "varying vec3 normal;\n"
+   "varying vec3 tangent;\n"
+   "varying vec3 binormal;\n"
+   "\n"
+   "uniform sampler2D sNormal;\n"
+   "uniform sampler2D sDiffuse;\n"
+   "uniform sampler2D sGloss;\n"
+   "\n"
+   "uniform vec3 lightDir;\n"
+   "uniform bool specular;\n"
+   "uniform vec3 ambient_color;\n"
+   "uniform vec3 diffuse_color;\n"
+   "uniform vec3 specular_color;\n"
+   "uniform float specular_exp;\n"
+   "uniform vec2 planes;\n"
+   "uniform float depth_factor;\n"
+   "\n"
+   "void ray_intersect(sampler2D reliefMap, inout vec4 p, inout vec3 v,\n"
+   "                   int steps, vec2 dx, vec2 dy)\n"
+   "{\n"
+   "   v /= float(steps);\n"
+   "\n"
+   "   vec4 pp = p;\n"
+   "   for(int i = 0; i < MAX_SEARCH_STEPS - 1; ++i)\n"
+   "   {\n"
+   "      if(i >= steps - 1) break;\n"
+   "      p.w = SAMPLE_GRAD(reliefMap, p.xy, dx, dy).w;\n"
+   "      if(p.w <= p.z) break;\n"
+   "      pp = p;\n"
+   "      p.xyz += v;\n"
+   "   }\n"
+   "\n"
+   "   float f = (pp.w - pp.z) / (p.z - pp.z - p.w + pp.w);\n"
+   "   p = mix(pp, p, f);\n"
+   "}\n"
+   "\n"
+   "void ray_intersect_ATI(sampler2D reliefMap, inout vec4 p, inout vec3 v)"
+   "{\n"
+   "   float h0 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 1.000).a;\n"
+   "   float h1 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.875).a;\n"
+   "   float h2 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.750).a;\n"
+   "   float h3 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.625).a;\n"
+   "   float h4 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.500).a;\n"
+   "   float h5 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.375).a;\n"
+   "   float h6 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.250).a;\n"
+   "   float h7 = 1.0 - texture2D(reliefMap, p.xy + v.xy * 0.125).a;\n"
+   "\n"
+   "   float x, y, xh, yh;\n"
+   "   if     (h7 > 0.875) { x = 0.937; y = 0.938; xh = h7; yh = h7; }\n"
+   "   else if(h6 > 0.750) { x = 0.750; y = 0.875; xh = h6; yh = h7; }\n"
+   "   else if(h5 > 0.625) { x = 0.625; y = 0.750; xh = h5; yh = h6; }\n"
+   "   else if(h4 > 0.500) { x = 0.500; y = 0.625; xh = h4; yh = h5; }\n"
+   "   else if(h3 > 0.375) { x = 0.375; y = 0.500; xh = h3; yh = h4; }\n"
+   "   else if(h2 > 0.250) { x = 0.250; y = 0.375; xh = h2; yh = h3; }\n"
+   "   else if(h1 > 0.125) { x = 0.125; y = 0.250; xh = h1; yh = h2; }\n"
+   "   else                { x = 0.000; y = 0.125; xh = h0; yh = h1; }\n"
+   "\n"
+   "   float parallax = (x * (y - yh) - y * (x - xh)) / ((y - yh) - (x - xh));\n"
+   "   p.xyz += v * (1.0 - parallax);\n"
+   "}\n"
+   "\n"
+   "void main()\n"
+   "{\n"
+   "\n"
+   "   vec2 dx = dFdx(tex);\n"
+   "   vec2 dy = dFdy(tex);\n"
+   "   /* the height search does not need anisotropic filtering */\n"
+   "   float g = max(length(dx), length(dy));\n"
+   "   vec2 gx = vec2(g, 0.0);\n"
+   "   vec2 gy = vec2(0.0, g);\n"
+   "   vec3 V = normalize(vpos);\n"
+   "   float a = dot(normal, -V);\n"
+   "   vec3 v = vec3(dot(V, tangent), dot(V, binormal), a);\n"
+   "   vec3 scale = vec3(1.0, 1.0, depth_factor);\n"
+   "   v *= scale.z / (scale * v.z);\n"
+   "   vec4 p = vec4(tex, vec2(0.0, 1.0));\n"
+   "#ifdef ATI\n"
+   "   ray_intersect_ATI(sNormal, p, v);\n"
+   "#else\n"
+   "   ray_intersect(sNormal, p, v, search_steps(v.xy, a, dx, dy),\n"
+   "                 gx, gy);\n"
+   "#endif\n"
+   "\n"
+   "   vec2 uv = p.xy;\n"
+   "   vec3 N = SAMPLE_GRAD(sNormal, uv, dx, dy).xyz * 2.0 - 1.0;\n"
+   "   vec3 diffuse = SAMPLE_GRAD(sDiffuse, uv, dx, dy).rgb;\n"
+   "\n"
+   "   N.z = sqrt(1.0 - dot(N.xy, N.xy));\n"
+   "   N = normalize(N.x * tangent + N.y * binormal + N.z * normal);\n"
+   "\n"
+   "   float NdotL = clamp(dot(N, lightDir), 0.0, 1.0);\n"
+   "\n"
+   "   vec3 color = diffuse * diffuse_color * NdotL;\n"
+   "\n"
+   "   if(specular)\n"
+   "   {\n"
+   "      vec3 gloss = SAMPLE_GRAD(sGloss, uv, dx, dy).rgb;\n"
+   "      vec3 R = reflect(V, N);\n"
+   "      float RdotL = clamp(dot(R, lightDir), 0.0, 1.0);\n"
+   "      color += gloss * specular_color * pow(RdotL, specular_exp);\n"
+   "   }\n"
+   "\n"
+   "   gl_FragColor.rgb = ambient_color * diffuse + color;\n"
+   "}\n";
+
+static const char *relief_frag_source =
+   "varying vec2 tex;\n"
+   "varying vec3 vpos;\n"
+   "varying vec3 normal;\n"
+   "varying vec3 tangent;\n"
+   "varying vec3 binormal;\n"
+   "\n"
+   "uniform sampler2D sNormal;\n"
+   "uniform sampler2D sDiffuse;\n"
+   "uniform sampler2D sGloss;\n"
+   "\n"
+   "uniform vec3 lightDir;\n"
+   "uniform bool specular;\n"
+   "uniform vec3 ambient_color;\n"
+   "uniform vec3 diffuse_color;\n"
+   "uniform vec3 specular_color;\n"
+   "uniform float specular_exp;\n"
+   "uniform vec2 planes;\n"
+   "uniform float depth_factor;\n"
+   "\n"
+   "float ray_intersect(sampler2D reliefMap, vec2 dp, vec2 ds, int steps,\n"
+   "                    vec2 dx, vec2 dy)\n"
+   "{\n"
+   "   float size = 1.0 / float(steps);\n"
+   "   float depth = 0.0;\n"
+   "   float best_depth = 1.0;\n"
+   "\n"
+   "   for(int i = 0; i < MAX_SEARCH_STEPS - 1; ++i)\n"
+   "   {\n"
+   "      if(i >= steps - 1) break;\n"
+   "      depth += size;\n"
+   "      float t = SAMPLE_GRAD(reliefMap, dp + ds * depth, dx, dy).a;\n"
+   "      if(depth >= t)\n"
+   "      {\n"
+   "         best_depth = depth;\n"
+   "         break;\n"
+   "      }\n"
+   "   }\n"
+   "   depth = best_depth;\n"
+   "\n"
+   "   const int binary_search_steps = 5;\n"
+   "\n"
+   "   for(int i = 0; i < binary_search_steps; ++i)\n"
+   "   {\n"
+   "      size *= 0.5;\n"
+   "      float t = SAMPLE_GRAD(reliefMap, dp + ds * depth, dx, dy).a;\n"
+   "      if(depth >= t)\n"
+   "      {\n"
+   "         best_depth = depth;\n"
+   "         depth -= 2.0 * size;\n"
+   "      }\n"
+   "      depth += size;\n"
+   "   }\n"
+   "\n"
+   "   return(best_depth);\n"
+   "}\n"
+   "\n"
+   "void main()\n"
+   "{\n"
+   "\n"
+   "   vec2 dx = dFdx(tex);\n"
+   "   vec2 dy = dFdy(tex);\n"
+   "   /* the height search does not need anisotropic filtering */\n"
+   "   float g = max(length(dx), length(dy));\n"
+   "   vec2 gx = vec2(g, 0.0);\n"
+   "   vec2 gy = vec2(0.0, g);\n"
+   "   vec3 V = normalize(vpos);\n"
+   "   float a = dot(normal, -V);\n"
+   "   vec2 s = vec2(dot(V, tangent), dot(V, binormal));\n"
+   "   s *= depth_factor / a;\n"
+   "   vec2 ds = s;\n"
+   "   vec2 dp = tex;\n"
+   "   float d = ray_intersect(sNormal, dp, ds, search_steps(ds, a, dx, dy),\n"
+   "                           gx, gy);\n"
+   "\n"
+   "   vec2 uv = dp + ds * d;\n"
+   "   vec3 N = SAMPLE_GRAD(sNormal, uv, dx, dy).xyz * 2.0 - 1.0;\n"
+   "   vec3 diffuse = SAMPLE_GRAD(sDiffuse, uv, dx, dy).rgb;\n"
+   "\n"
+   "   N.z = sqrt(1.0 - dot(N.xy, N.xy));\n"
+   "   N = normalize(N.x * tangent + N.y * binormal + N.z * normal);\n"
+   "\n"
+   "   float NdotL = clamp(dot(N, lightDir), 0.0, 1.0);\n"
+   "\n"
+   "   vec3 color = diffuse * diffuse_color * NdotL;\n"
+   "\n"
+   "   if(specular)\n"
+   "   {\n"
+   "      vec3 gloss = SAMPLE_GRAD(sGloss, uv, dx, dy).rgb;\n"
+   "      vec3 R = reflect(V, N);\n"
+   "      float RdotL = clamp(dot(R, lightDir), 0.0, 1.0);\n"
+   "      color += gloss * specular_color * pow(RdotL, specular_exp);\n"
+   "   }\n"
+   "\n"
+   "   gl_FragColor.rgb = ambient_color * diffuse + color;\n"
+   "}\n";
+
+static const char *cone_frag_source =
+   "varying vec2 tex;\n"
+   "varying vec3 vpos;\n"
+   "varying vec3 normal;\n"
+   "varying vec3 tangent;\n"
+   "varying vec3 binormal;\n"
+   "\n"
+   "uniform sampler2D sNormal;\n"
+   "uniform sampler2D sDiffuse;\n"
+   "uniform sampler2D sGloss;\n"
+   "uniform sampler2D sCone;\n"
+   "\n"
+   "uniform vec3 lightDir;\n"
+   "uniform bool specular;\n"
+   "uniform vec3 ambient_color;\n"
+   "uniform vec3 diffuse_color;\n"
+   "uniform vec3 specular_color;\n"
+   "uniform float specular_exp;\n"
+   "uniform float depth_factor;\n"
+   "\n"
+   "/* sCone holds sqrt(cone ratio) in luminance and depth in alpha */\n"
+   "float cone_step(vec2 dp, vec3 ds, int steps, vec2 dx, vec2 dy)\n"
+   "{\n"
+   "   float ray_ratio = length(ds.xy);\n"
+   "   vec3 p = vec3(dp, 0.0);\n"
+   "\n"
+   "   for(int i = 0; i < MAX_SEARCH_STEPS; ++i)\n"
+   "   {\n"
+   "      if(i >= steps) break;\n"
+   "      vec4 t = SAMPLE_GRAD(sCone, p.xy, dx, dy);\n"
+   "      float cone_ratio = t.r * t.r;\n"
+   "      float height = max(t.a - p.z, 0.0);\n"
+   "      float d = cone_ratio * height / (ray_ratio + cone_ratio);\n"
+   "      if(d < 0.001) break;\n"
+   "      p += ds * d;\n"
+   "   }\n"
+   "\n"
+   "   return(p.z);\n"
+   "}\n"
+   "\n"
+   "void main()\n"
+   "{\n"
+   "   vec2 dx = dFdx(tex);\n"
+   "   vec2 dy = dFdy(tex);\n"
+   "   float g = max(length(dx), length(dy));\n"
+   "   vec2 gx = vec2(g, 0.0);\n"
+   "   vec2 gy = vec2(0.0, g);\n"
+   "   vec3 V = normalize(vpos);\n"
+   "   float a = dot(normal, -V);\n"
+   "   vec2 s = vec2(dot(V, tangent), dot(V, binormal));\n"
+   "   s *= depth_factor / a;\n"
+   "   float d = cone_step(tex, vec3(s, 1.0), search_steps(s, a, dx, dy),\n"
+   "                       gx, gy);\n"
+   "\n"
+   "   vec2 uv = tex + s * d;\n"
+   "   vec3 N = SAMPLE_GRAD(sNormal, uv, dx, dy).xyz * 2.0 - 1.0;\n"
+   "   vec3 diffuse = SAMPLE_GRAD(sDiffuse, uv, dx, dy).rgb;\n"
+   "\n"
+   "   N.z = sqrt(1.0 - dot(N.xy, N.xy));\n"
+   "   N = normalize(N.x * tangent + N.y * binormal + N.z * normal);\n"
+   "\n"
+   "   float NdotL = clamp(dot(N, lightDir), 0.0, 1.0);\n"
+   "\n"
+   "   vec3 color = diffuse * diffuse_color * NdotL;\n"
+   "\n"
+   "   if(specular)\n"
+   "   {\n"
+   "      vec3 gloss = SAMPLE_GRAD(sGloss, uv, dx, dy).rgb;\n"
+   "      vec3 R = reflect(V, N);\n"
+   "      float RdotL = clamp(dot(R, lightDir), 0.0, 1.0);\n"
+   "      color += gloss * specular_color * pow(RdotL, specular_exp);\n"
+   "   }\n"
+   "\n"
+   "   gl_FragColor.rgb = ambient_color * diffuse + color;\n"
+   "}\n";
+
+static const float depth_factor = 0.05f;
+
+static unsigned int normalmap_width = 1;
+static unsigned int normalmap_height = 1;
+
+/* alpha of the normal map, kept to bake the cone map on first use */
+static unsigned char *normalmap_alpha = 0;
+static int conemap_dirty = 1;
+
+static struct
+{
+   float *attribs;
+   unsigned int size;
+   int obj;
+   vec3 l;
+   matrix m;
+   vec2 uvscale;
+} fallback = {0, 0, -1};
+
+#define M(r,c) m[(c << 2) + r]
+#define T(r,c) t[(c << 2) + r]
+
+static void mat_invert(matrix m)
+{
+   float invdet;
+   matrix t;
+
+   invdet = (float)1.0 / (M(0, 0) * (M(1, 1) * M(2, 2) - M(1, 2) * M(2, 1)) -
+                          M(0, 1) * (M(1, 0) * M(2, 2) - M(1, 2) * M(2, 0)) +
+                          M(0, 2) * (M(1, 0) * M(2, 1) - M(1, 1) * M(2, 0)));
+
+   T(0,0) =  invdet * (M(1, 1) * M(2, 2) - M(1, 2) * M(2, 1));
+   T(0,1) = -invdet * (M(0, 1) * M(2, 2) - M(0, 2) * M(2, 1));
+   T(0,2) =  invdet * (M(0, 1) * M(1, 2) - M(0, 2) * M(1, 1));
+   T(0,3) = 0;
+
+   T(1,0) = -invdet * (M(1, 0) * M(2, 2) - M(1, 2) * M(2, 0));
+   T(1,1) =  invdet * (M(0, 0) * M(2, 2) - M(0, 2) * M(2, 0));
+   T(1,2) = -invdet * (M(0, 0) * M(1, 2) - M(0, 2) * M(1, 0));
+   T(1,3) = 0;
+
+   T(2,0) =  invdet * (M(1, 0) * M(2, 1) - M(1, 1) * M(2, 0));
+   T(2,1) = -invdet * (M(0, 0) * M(2, 1) - M(0, 1) * M(2, 0));
+   T(2,2) =  invdet * (M(0, 0) * M(1, 1) - M(0, 1) * M(1, 0));
+   T(2,3) = 0;
+
+   T(3,0) = -(M(3, 0) * T(0, 0) + M(3, 1) * T(1, 0) + M(3, 2) * T(2, 0));
+   T(3,1) = -(M(3, 0) * T(0, 1) + M(3, 1) * T(1, 1) + M(3, 2) * T(2, 1));
+   T(3,2) = -(M(3, 0) * T(0, 2) + M(3, 1) * T(1, 2) + M(3, 2) * T(2, 2));
+   T(3,3) = 1;
+
+   memcpy(m, t, 16 * sizeof(float));
+}
+
+static void mat_transpose(matrix m)
+{
+   matrix t;
+   t[0 ] = m[0 ]; t[1 ] = m[4 ]; t[2 ] = m[8 ]; t[3 ] = m[12];
+   t[4 ] = m[1 ]; t[5 ] = m[5 ]; t[6 ] = m[9 ]; t[7 ] = m[13];
+   t[8 ] = m[2 ]; t[9 ] = m[6 ]; t[10] = m[10]; t[11] = m[14];
+   t[12] = m[3 ]; t[13] = m[7 ]; t[14] = m[11]; t[15] = m[15];
+   memcpy(m, t, sizeof(matrix));
+}
+
+static void mat_mult_vec(vec3 v, matrix m)
+{
+   vec3 t;
+   t[0] = M(0, 0) * v[0] + M(0, 1) * v[1] + M(0, 2) * v[2];
+   t[1] = M(1, 0) * v[0] + M(1, 1) * v[1] + M(1, 2) * v[2];
+   t[2] = M(2, 0) * v[0] + M(2, 1) * v[1] + M(2, 2) * v[2];
+
+   v[0] = t[0];
+   v[1] = t[1];
+   v[2] = t[2];
+}
+
+static inline void vec3_set(vec3 v, float x, float y, float z)
+{
+   v[0] = x;
+   v[1] = y;
+   v[2] = z;
+}
+
+static inline void vec3_copy(vec3 r, vec3 v)
+{
+   r[0] = v[0];
+   r[1] = v[1];
+   r[2] = v[2];
+}
+
+static void vec4_normalize(vec4 r, vec4 v)
+{
+   float len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2] + v[3] * v[3]);
+   if(len != 0)
+   {
+      float ilen = 1.0f / len;
+      r[0] = v[0] * ilen;
+      r[1] = v[1] * ilen;
+      r[2] = v[2] * ilen;
+      r[3] = v[3] * ilen;
+   }
+   else
+      r[0] = r[1] = r[2] = r[3] = 0;
+}
+
+static void vec3_normalize(vec3 r, vec3 v)
+{
+   float len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+   if(len != 0.0f)
+   {
+      float ilen = 1.0f / len;
+      r[0] = v[0] * ilen;
+      r[1] = v[1] * ilen;
+      r[2] = v[2] * ilen;
+   }
+   else
+      r[0] = r[1] = r[2] = 0;
+}
+
+static inline void quat_ident(vec4 q)
+{
+   q[0] = q[1] = q[2] = 0;
+   q[3] = 1;
+}
+
+static void quat_mul(vec4 r, vec4 a, vec4 b)
+{
+   r[0] = a[0] * b[3] + b[0] * a[3] + a[1] * b[2] - a[2] * b[1];
+   r[1] = a[1] * b[3] + b[1] * a[3] + a[2] * b[0] - a[0] * b[2];
+   r[2] = a[2] * b[3] + b[2] * a[3] + a[0] * b[1] - a[1] * b[0];
+   r[3] = a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2];
+}
+
+static void quat_rotate(vec4 q, float a, float x, float y, float z)
+{
+   float hs, len, ilen;
+
+   len = sqrtf(x * x + y * y + z * z);
+   if(len == 0) return;
+   ilen = 1.0f / len;
+   x *= ilen;
+   y *= ilen;
+   z *= ilen;
+
+   a = (a * (M_PI / 180.0f)) * 0.5f;
+
+   hs = sinf(a);
+   q[0] = x * hs;
+   q[1] = y * hs;
+   q[2] = z * hs;
+   q[3] = cosf(a);
+}
+
+static void quat_get_direction(vec3 v, vec4 q)
+{
+   v[0] = 2.0f * (q[0] * q[2] - q[3] * q[1]);
+   v[1] = 2.0f * (q[1] * q[2] + q[3] * q[0]);
+   v[2] = 1.0f - 2.0f * (q[0] * q[0] + q[1] * q[1]);
+}
+
+#undef M
+#undef T
+
+static GLhandleARB create_program(GLhandleARB vert_shader, const char *name,
+                                  int num_sources, const char **sources)
+{
+   GLhandleARB prog, frag_shader;
+   int res, len, loc;
+   char *info;
+
+   prog = glCreateProgramObjectARB();
+   glAttachObjectARB(prog, vert_shader);
+
+   frag_shader = glCreateShaderObjectARB(GL_FRAGMENT_SHADER_ARB);
+   glShaderSourceARB(frag_shader, num_sources, sources, 0);
+   glCompileShaderARB(frag_shader);
+   glGetObjectParameterivARB(frag_shader, GL_OBJECT_COMPILE_STATUS_ARB, &res);
+   if(res)
+      glAttachObjectARB(prog, frag_shader);
+   else
+   {
+      glGetObjectParameterivARB(frag_shader, GL_OBJECT_INFO_LOG_LENGTH_ARB, &len);
+      info = g_malloc(len + 1);
+      glGetInfoLogARB(frag_shader, len, 0, info);
+      g_message("%s fragment shader failed to compile:\n%s\n", name, info);
+      g_free(info);
+      glDeleteObjectARB(prog);
+      prog = 0;
+   }
+   glDeleteObjectARB(frag_shader);
+
+   if(prog)
+   {
+      glLinkProgramARB(prog);
+      glGetObjectParameterivARB(prog, GL_OBJECT_LINK_STATUS_ARB, &res);
+
+      if(!res)
+      {
+         glGetObjectParameterivARB(prog, GL_OBJECT_INFO_LOG_LENGTH_ARB, &len);
+         info = g_malloc(len + 1);
+         glGetInfoLogARB(prog, len, 0, info);
+         g_message("%s program failed to link:\n%s\n", name, info);
+         g_free(info);
+         glDeleteObjectARB(prog);
+         prog = 0;
+      }
+   }
+
+   if(prog)
+   {
+      glUseProgramObjectARB(prog);
+      loc = glGetUniformLocationARB(prog, "sNormal");
+      glUniform1iARB(loc, 0);
+      loc = glGetUniformLocationARB(prog, "sDiffuse");
+      glUniform1iARB(loc, 1);
+      loc = glGetUniformLocationARB(prog, "sGloss");
+      glUniform1iARB(loc, 2);
+      loc = glGetUniformLocationARB(prog, "sCone");
+      if(loc != -1)
+         glUniform1iARB(loc, 3);
+      loc = glGetUniformLocationARB(prog, "depth_factor");
+      if(loc != -1)
+         glUniform1fARB(loc, depth_factor);
+      glUseProgramObjectARB(0);
+   }
+
+   return(prog);
+}
+
+int render3d_init(void)
+{
+   int i, err;
+   unsigned char white[16] = {0xff, 0xff, 0xff, 0xff,
+                              0xff, 0xff, 0xff, 0xff,
+                              0xff, 0xff, 0xff, 0xff,
+                              0xff, 0xff, 0xff, 0xff};
+
+   _gl_error = 0;
+
+   err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+   /* GLEW built for GLX still initializes the core entry points under EGL */
+   if(err == GLEW_ERROR_NO_GLX_DISPLAY) err = GLEW_OK;
+#endif
+   if(err != GLEW_OK)
+   {
+      g_message("%s", (char *)glewGetErrorString(err));
+      _gl_error = 1;
+      return(-1);
+   }
+
+   glClearColor(0, 0, 0.4f, 0);
+   glDepthFunc(GL_LEQUAL);
+   glEnable(GL_DEPTH_TEST);
+
+   glLineWidth(3);
+
+   if(!GLEW_ARB_multitexture)
+   {
+      g_message("GL_ARB_multitexture is required for the 3D preview");
+      _gl_error = 1;
+   }
+
+   if(!GLEW_ARB_texture_env_combine)
+   {
+      g_message("GL_ARB_texture_env_combine is required for the 3D preview");
+      _gl_error = 1;
+   }
+
+   if(!GLEW_ARB_texture_env_dot3)
+   {
+      g_message("GL_ARB_texture_env_dot3 is required for the 3D preview");
+      _gl_error = 1;
+   }
+
+   if(_gl_error) return(-1);
+
+   glGenTextures(1, &diffuse_tex);
+   glGenTextures(1, &gloss_tex);
+   glGenTextures(1, &normal_tex);
+   glGenTextures(1, &white_tex);
+   glGenTextures(1, &cone_tex);
+   conemap_dirty = 1;
+
+   glGetIntegerv(GL_MAX_TEXTURE_UNITS, &num_mtus);
+
+   glActiveTexture(GL_TEXTURE0);
+   glEnable(GL_TEXTURE_2D);
+   glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+   glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_DOT3_RGB);
+   glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_PRIMARY_COLOR);
+   glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+   glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_TEXTURE);
+   glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_COLOR);
+
+   glActiveTexture(GL_TEXTURE1);
+   glEnable(GL_TEXTURE_2D);
+   glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+   glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_MODULATE);
+   glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_PREVIOUS);
+   glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+   glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_TEXTURE);
+   glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_COLOR);
+
+   glBindTexture(GL_TEXTURE_2D, white_tex);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, 4, 4, 0,
+                GL_LUMINANCE, GL_UNSIGNED_BYTE, white);
+
+   if(num_mtus > 2)
+   {
+      glActiveTexture(GL_TEXTURE2);
+      glEnable(GL_TEXTURE_2D);
+      glBindTexture(GL_TEXTURE_2D, white_tex);
+   }
+
+   /* reorder the embedded meshes for the post-transform vertex cache, then
+    * renumber the vertices in the order they are fetched */
+   if(!objects_optimized)
+   {
+      for(i = 0; i < OBJECT_MAX; ++i)
+      {
+         mesh_optimize_vertex_cache(object_info[i].indices,
+                                    object_info[i].num_indices,
+                                    object_info[i].num_verts);
+         mesh_optimize_vertex_fetch(object_info[i].verts,
+                                    object_info[i].indices,
+                                    object_info[i].num_indices,
+                                    object_info[i].num_verts);
+      }
+      objects_optimized = 1;
+   }
+
+   has_glsl = GLEW_ARB_shader_objects && GLEW_ARB_vertex_shader &&
+      GLEW_ARB_fragment_shader;
+   has_npot = GLEW_ARB_texture_non_power_of_two;
+   has_generate_mipmap = GLEW_SGIS_generate_mipmap;
+   has_aniso = GLEW_EXT_texture_filter_anisotropic;
+   has_texture_lod = GLEW_ARB_shader_texture_lod;
+
+   for(i = 0; i < BUMPMAP_MAX; ++i)
+      programs[i] = 0;
+
+   if(has_glsl)
+   {
+      GLhandleARB vert_shader;
+      int res, len;
+      const char *sources[4];
+      char *info;
+
+      /* Get max # of instructions and indirections supported by the hardware.
+       * Used to determine if parallax occlusion and relief mapping should be
+       * enabled and if the "ATI" version of parallax occlusion mapping should
+       * be used.
+       */
+      if(GLEW_ARB_fragment_program)
+      {
+         glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, 1);
+         glGetProgramivARB(GL_FRAGMENT_PROGRAM_ARB,
+                           GL_MAX_PROGRAM_NATIVE_ALU_INSTRUCTIONS_ARB,
+                           &max_instructions);
+         glGetProgramivARB(GL_FRAGMENT_PROGRAM_ARB,
+                           GL_MAX_PROGRAM_NATIVE_TEX_INDIRECTIONS_ARB,
+                           &max_indirections);
+         glBindProgramARB(GL_FRAGMENT_PROGRAM_ARB, 0);
+      }
+
+      vert_shader = glCreateShaderObjectARB(GL_VERTEX_SHADER_ARB);
+      glShaderSourceARB(vert_shader, 1, &vert_source, 0);
+      glCompileShaderARB(vert_shader);
+      glGetObjectParameterivARB(vert_shader, GL_OBJECT_COMPILE_STATUS_ARB, &res);
+      if(!res)
+      {
+         glGetObjectParameterivARB(vert_shader, GL_OBJECT_INFO_LOG_LENGTH_ARB, &len);
+         info = g_malloc(len + 1);
+         glGetInfoLogARB(vert_shader, len, 0, info);
+         g_message("Vertex shader failed to compile:\n%s\n", info);
+         g_free(info);
+      }
+
+      programs[BUMPMAP_NORMAL] =
+         create_program(vert_shader, "Normal mapping", 1, &normal_frag_source);
+      programs[BUMPMAP_PARALLAX] =
+         create_program(vert_shader, "Parallax mapping", 1,
+                        &parallax_frag_source);
+
+      /* The search loops exit early, so the height samples are taken in
+       * non-uniform control flow where implicit derivatives are undefined.
+       * Pass the gradients explicitly when the driver allows it.
+       */
+      if(has_texture_lod)
+      {
+         sources[0] =
+            "#extension GL_ARB_shader_texture_lod : require\n"
+            "#define SAMPLE_GRAD(s, uv, dx, dy) texture2DGradARB(s, uv, dx, dy)\n";
+      }
+      else
+         sources[0] = "#define SAMPLE_GRAD(s, uv, dx, dy) texture2D(s, uv)\n";
+
+      sources[2] = search_steps_source;
+
+      if(max_instructions >= 200)
+      {
+         if(max_indirections < 100)
+            sources[1] = "#define ATI 1\n";
+         else
+            sources[1] = "";
+
+         sources[3] = pom_frag_source;
+
+         programs[BUMPMAP_POM] =
+            create_program(vert_shader, "Parallax Occlusion mapping", 4,
+                           sources);
+      }
+
+      if(max_instructions >= 200 && max_indirections >= 100)
+      {
+         sources[1] = "";
+         sources[3] = relief_frag_source;
+
+         programs[BUMPMAP_RELIEF] =
+            create_program(vert_shader, "Relief mapping", 4, sources);
+      }
+
+      if(max_instructions >= 200 && max_indirections >= 100)
+      {
+         sources[1] = "";
+         sources[3] = cone_frag_source;
+
+         programs[BUMPMAP_CONE] =
+            create_program(vert_shader, "Cone step mapping", 4, sources);
+      }
+
+      glDeleteObjectARB(vert_shader);
+
+      for(i = 0; i < OBJECT_MAX; ++i)
+      {
+         packed_vertex *packed;
+
+         packed = g_new(packed_vertex, object_info[i].num_verts);
+         mesh_pack_vertices(packed, object_info[i].verts,
+                            object_info[i].num_verts);
+
+         glGenBuffersARB(1, &object_info[i].vbo);
+         glBindBufferARB(GL_ARRAY_BUFFER_ARB, object_info[i].vbo);
+         glBufferDataARB(GL_ARRAY_BUFFER_ARB,
+                         object_info[i].num_verts * sizeof(packed_vertex),
+                         packed, GL_STATIC_DRAW_ARB);
+
+         g_free(packed);
+      }
+
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+   }
+
+   return(0);
+}
+
+/* Fixed function path: the tangent space light vector (stored as the primary
+ * color for the DOT3 combiner) and the scaled texture coordinates of every
+ * unique vertex.  Only rebuilt when the object, light direction, object
+ * transform or UV scale change.
+ */
+static void update_fallback_attribs(int obj, vec3 l, matrix m,
+                                    const float *uvscale)
+{
+   unsigned int i;
+   vec3 c, t, b, n;
+   float *verts, *attr;
+
+   if(fallback.attribs != 0 && fallback.obj == obj &&
+      memcmp(fallback.l, l, sizeof(vec3)) == 0 &&
+      memcmp(fallback.m, m, sizeof(matrix)) == 0 &&
+      memcmp(fallback.uvscale, uvscale, sizeof(vec2)) == 0)
+      return;
+
+   if(fallback.size < object_info[obj].num_verts)
+   {
+      fallback.attribs = g_renew(float, fallback.attribs,
+                                 object_info[obj].num_verts * 5);
+      fallback.size = object_info[obj].num_verts;
+   }
+
+   verts = object_info[obj].verts;
+   attr = fallback.attribs;
+
+   for(i = 0; i < object_info[obj].num_verts; ++i)
+   {
+      vec3_copy(t, &verts[16 * i +  6]);
+      vec3_copy(b, &verts[16 * i +  9]);
+      vec3_copy(n, &verts[16 * i + 12]);
+      mat_mult_vec(t, m);
+      mat_mult_vec(b, m);
+      mat_mult_vec(n, m);
+      c[0] = (l[0] * t[0] + l[1] * t[1] + l[2] * t[2]);
+      c[1] = (l[0] * b[0] + l[1] * b[1] + l[2] * b[2]);
+      c[2] = (l[0] * n[0] + l[1] * n[1] + l[2] * n[2]);
+      vec3_normalize(c, c);
+
+      attr[0] = c[0] * 0.5f + 0.5f;
+      attr[1] = c[1] * 0.5f + 0.5f;
+      attr[2] = c[2] * 0.5f + 0.5f;
+      attr[3] = verts[16 * i + 4] * uvscale[0];
+      attr[4] = verts[16 * i + 5] * uvscale[1];
+      attr += 5;
+   }
+
+   fallback.obj = obj;
+   vec3_copy(fallback.l, l);
+   memcpy(fallback.m, m, sizeof(matrix));
+   fallback.uvscale[0] = uvscale[0];
+   fallback.uvscale[1] = uvscale[1];
+}
+
+static void draw_object(int obj, vec3 l, matrix m, const float *uvscale)
+{
+   const int vsize = sizeof(packed_vertex);
+   const int vsize_fixed = 16 * sizeof(float);
+   int i;
+   float *verts;
+   unsigned short *indices;
+
+   if(obj < 0 || obj >= OBJECT_MAX) return;
+
+   if(has_glsl)
+   {
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, object_info[obj].vbo);
+
+#define OFFSET(x) ((void*)G_STRUCT_OFFSET(packed_vertex, x))
+
+      glVertexPointer(3, GL_FLOAT, vsize, OFFSET(pos));
+      glClientActiveTexture(GL_TEXTURE4);
+      glTexCoordPointer(2, GL_SHORT, vsize, OFFSET(frame[4]));
+      glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+      glClientActiveTexture(GL_TEXTURE3);
+      glTexCoordPointer(4, GL_SHORT, vsize, OFFSET(frame[0]));
+      glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+      glClientActiveTexture(GL_TEXTURE0);
+      glTexCoordPointer(2, GL_SHORT, vsize, OFFSET(uv));
+      glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+      glEnableClientState(GL_VERTEX_ARRAY);
+
+#undef OFFSET
+
+      glDrawElements(GL_TRIANGLES, object_info[obj].num_indices,
+                     GL_UNSIGNED_SHORT, object_info[obj].indices);
+
+      glDisableClientState(GL_VERTEX_ARRAY);
+      glClientActiveTexture(GL_TEXTURE4);
+      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+      glClientActiveTexture(GL_TEXTURE3);
+      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+      glClientActiveTexture(GL_TEXTURE0);
+      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+      glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+   }
+   else
+   {
+      verts = object_info[obj].verts;
+      indices = object_info[obj].indices;
+
+      update_fallback_attribs(obj, l, m, uvscale);
+
+      glVertexPointer(3, GL_FLOAT, vsize_fixed, &verts[0]);
+      glNormalPointer(GL_FLOAT, vsize_fixed, &verts[12]);
+      glColorPointer(3, GL_FLOAT, 5 * sizeof(float), &fallback.attribs[0]);
+      for(i = (num_mtus > 2) ? 2 : 1; i >= 0; --i)
+      {
+         glClientActiveTexture(GL_TEXTURE0 + i);
+         glTexCoordPointer(2, GL_FLOAT, 5 * sizeof(float),
+                           &fallback.attribs[3]);
+         glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+      }
+      glEnableClientState(GL_VERTEX_ARRAY);
+      glEnableClientState(GL_NORMAL_ARRAY);
+      glEnableClientState(GL_COLOR_ARRAY);
+
+      glDrawElements(GL_TRIANGLES, object_info[obj].num_indices,
+                     GL_UNSIGNED_SHORT, indices);
+
+      glDisableClientState(GL_VERTEX_ARRAY);
+      glDisableClientState(GL_NORMAL_ARRAY);
+      glDisableClientState(GL_COLOR_ARRAY);
+      for(i = (num_mtus > 2) ? 2 : 1; i >= 0; --i)
+      {
+         glClientActiveTexture(GL_TEXTURE0 + i);
+         glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+      }
+   }
+}
+
+void render3d_default_params(render3d_params *p)
+{
+   memset(p, 0, sizeof(render3d_params));
+
+   p->object = OBJECT_QUAD;
+   p->bumpmapping = BUMPMAP_NORMAL;
+   p->specular = 0;
+   p->specular_exp = 32.0f;
+   p->ambient_color[0] = p->ambient_color[1] = p->ambient_color[2] = 0.2f;
+   p->diffuse_color[0] = p->diffuse_color[1] = p->diffuse_color[2] = 1.0f;
+   p->specular_color[0] = p->specular_color[1] = p->specular_color[2] = 1.0f;
+   p->uvscale[0] = p->uvscale[1] = 1;
+   p->quality = 0.5f;
+   p->zoom = 2;
+}
+
+void render3d_resize(int w, int h)
+{
+   glViewport(0, 0, w, h);
+
+   glMatrixMode(GL_PROJECTION);
+   glLoadIdentity();
+   gluPerspective(60, (float)w / (float)h, 0.1f, 100);
+
+   glMatrixMode(GL_MODELVIEW);
+   glLoadIdentity();
+}
+
+static void update_conemap(void);
+
+void render3d_draw(const render3d_params *p)
+{
+   matrix m;
+   vec3 l;
+   vec4 qx, qy, qz, qt, qrot;
+   int loc;
+   GLhandleARB prog = 0;
+
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+   if(_gl_error) return;
+
+   glMatrixMode(GL_MODELVIEW);
+   glLoadIdentity();
+   glRotatef(p->scene_rot[0], 1, 0, 0);
+   glRotatef(p->scene_rot[1], 0, 1, 0);
+   glRotatef(p->scene_rot[2], 0, 0, 1);
+   glTranslatef(0, 0, -p->zoom);
+   glRotatef(p->object_rot[0], 1, 0, 0);
+   glRotatef(p->object_rot[1], 0, 1, 0);
+   glRotatef(p->object_rot[2], 0, 0, 1);
+
+   glGetFloatv(GL_MODELVIEW_MATRIX, m);
+   mat_invert(m);
+   mat_transpose(m);
+
+   quat_ident(qx);
+   quat_ident(qy);
+   quat_ident(qz);
+   quat_rotate(qx, -p->light_rot[0], 1, 0, 0);
+   quat_rotate(qy, -p->light_rot[1], 0, 1, 0);
+   quat_rotate(qz, -p->light_rot[2], 0, 0, 1);
+   quat_mul(qt, qx, qy);
+   quat_mul(qrot, qt, qz);
+   vec4_normalize(qrot, qrot);
+   quat_get_direction(l, qrot);
+
+   if(has_glsl && p->bumpmapping == BUMPMAP_CONE && conemap_dirty)
+      update_conemap();
+
+   if(has_glsl)
+   {
+      prog = programs[p->bumpmapping];
+      glUseProgramObjectARB(prog);
+      loc = glGetUniformLocationARB(prog, "specular");
+      glUniform1iARB(loc, p->specular);
+      loc = glGetUniformLocationARB(prog, "ambient_color");
+      glUniform3fvARB(loc, 1, p->ambient_color);
+      loc = glGetUniformLocationARB(prog, "diffuse_color");
+      glUniform3fvARB(loc, 1, p->diffuse_color);
+      loc = glGetUniformLocationARB(prog, "specular_color");
+      glUniform3fvARB(loc, 1, p->specular_color);
+      loc = glGetUniformLocationARB(prog, "specular_exp");
+      glUniform1fARB(loc, p->specular_exp);
+      loc = glGetUniformLocationARB(prog, "lightDir");
+      glUniform3fvARB(loc, 1, l);
+      loc = glGetUniformLocationARB(prog, "uvscale");
+      glUniform2fvARB(loc, 1, p->uvscale);
+      loc = glGetUniformLocationARB(prog, "quality");
+      if(loc != -1)
+      {
+         glUniform1fARB(loc, p->quality);
+         loc = glGetUniformLocationARB(prog, "texsize");
+         glUniform2fARB(loc, (float)normalmap_width, (float)normalmap_height);
+      }
+   }
+
+   draw_object(p->object, l, m, p->uvscale);
+
+   if(has_glsl)
+      glUseProgramObjectARB(0);
+}
+
+static void get_nearest_pot(int w, int h, int *w_pot, int *h_pot)
+{
+   int n, next_pot, prev_pot, d1, d2;
+
+   if(!IS_POT(w))
+   {
+      next_pot = 1;
+      for(n = 1; n <= 12; ++n)
+      {
+         prev_pot = next_pot;
+         next_pot = 1 << n;
+         if(next_pot >= w) break;
+      }
+
+      if(next_pot < w)
+         *w_pot = next_pot;
+      else
+      {
+         d1 = w - prev_pot;
+         d2 = next_pot - w;
+         if(d1 < d2)
+            *w_pot = prev_pot;
+         else
+            *w_pot = next_pot;
+      }
+   }
+   else
+      *w_pot = w;
+
+   if(!IS_POT(h))
+   {
+      next_pot = 1;
+      for(n = 1; n <= 12; ++n)
+      {
+         prev_pot = next_pot;
+         next_pot = 1 << n;
+         if(next_pot >= h) break;
+      }
+
+      if(next_pot < h)
+         *h_pot = next_pot;
+      else
+      {
+         d1 = h - prev_pot;
+         d2 = next_pot - h;
+         if(d1 < d2)
+            *h_pot = prev_pot;
+         else
+            *h_pot = next_pot;
+      }
+   }
+   else
+      *h_pot = h;
+}
+
+static void *scratch_get(size_t size)
+{
+   void *p = 0;
+
+   if(upload_scratch == 0)
+      upload_scratch = arena_new();
+   if(upload_scratch)
+      p = arena_alloc(upload_scratch, size);
+   if(p == 0)
+      g_error("%s: failed to allocate %lu bytes", G_STRLOC, (gulong)size);
+   return(p);
+}
+
+static void upload_texture(GLuint tex, GLenum unit, unsigned int w,
+                           unsigned int h, int bpp, unsigned char *image)
+{
+   int w_pot, h_pot, mipw, miph, n;
+   unsigned char *pixels = image;
+   unsigned char *mip;
+   GLenum type = 0;
+   size_t mark = upload_scratch ? arena_mark(upload_scratch) : 0;
+
+   switch(bpp)
+   {
+      case 1: type = GL_LUMINANCE;       break;
+      case 2: type = GL_LUMINANCE_ALPHA; break;
+      case 3: type = GL_RGB;             break;
+      case 4: type = GL_RGBA;            break;
+   }
+
+   if(!has_npot && !(IS_POT(w) && IS_POT(h)))
+   {
+      get_nearest_pot(w, h, &w_pot, &h_pot);
+      pixels = scratch_get(h_pot * w_pot * bpp);
+      scale_pixels(pixels, w_pot, h_pot, image, w, h, bpp);
+      w = w_pot;
+      h = h_pot;
+   }
+
+   glActiveTexture(unit);
+   glBindTexture(GL_TEXTURE_2D, tex);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+   if(has_aniso)
+      glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, &anisotropy);
+   if(has_generate_mipmap)
+      glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP_SGIS, GL_TRUE);
+   glTexImage2D(GL_TEXTURE_2D, 0, type, w, h, 0,
+                type, GL_UNSIGNED_BYTE, pixels);
+
+   if(!has_generate_mipmap)
+   {
+      mipw = w;
+      miph = h;
+      n = 0;
+      /* every level fits where the first one went */
+      mip = scratch_get(((w + 1) / 2) * ((h + 1) / 2) * bpp);
+      while((mipw != 1) && (miph != 1))
+      {
+         if(mipw > 1) mipw >>= 1;
+         if(miph > 1) miph >>= 1;
+         ++n;
+         scale_pixels(mip, mipw, miph, pixels, w, h, bpp);
+         glTexImage2D(GL_TEXTURE_2D, n, type, mipw, miph, 0,
+                      type, GL_UNSIGNED_BYTE, mip);
+      }
+   }
+
+   if(upload_scratch)
+      arena_release(upload_scratch, mark);
+}
+
+/* Bakes the cone map for the current normal map and uploads it with the
+ * depth in alpha.  The cone ratios are not valid for other resolutions, so
+ * non-power-of-two maps are rescaled before baking and no mipmaps are made.
+ */
+static void update_conemap(void)
+{
+   int i, w = normalmap_width, h = normalmap_height;
+   unsigned char *alpha = normalmap_alpha, *pixels;
+   float *depth;
+   size_t mark = upload_scratch ? arena_mark(upload_scratch) : 0;
+
+   conemap_dirty = 0;
+
+   if(!has_npot && !(IS_POT(w) && IS_POT(h)))
+   {
+      get_nearest_pot(w, h, &w, &h);
+      alpha = scratch_get(w * h);
+      scale_pixels(alpha, w, h, normalmap_alpha,
+                   normalmap_width, normalmap_height, 1);
+   }
+
+   depth = scratch_get(w * h * sizeof(float));
+   pixels = scratch_get(w * h * 2);
+
+   for(i = 0; i < w * h; ++i)
+   {
+      pixels[2 * i + 1] = alpha ? alpha[i] : 0;
+      depth[i] = (float)pixels[2 * i + 1] / 255.0f;
+   }
+
+   /* the preview textures repeat */
+   conemap_bake(pixels, 2, depth, w, h, 1, 0);
+
+   glActiveTexture(GL_TEXTURE3);
+   glBindTexture(GL_TEXTURE_2D, cone_tex);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, w, h, 0,
+                GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, pixels);
+   glActiveTexture(GL_TEXTURE0);
+
+   if(upload_scratch)
+      arena_release(upload_scratch, mark);
+}
+
+void render3d_set_normalmap(unsigned int w, unsigned int h, int bpp,
+                            unsigned char *image)
+{
+   unsigned int i;
+
+   if(_gl_error) return;
+   normalmap_width = w;
+   normalmap_height = h;
+   upload_texture(normal_tex, GL_TEXTURE0, w, h, bpp, image);
+
+   g_free(normalmap_alpha);
+   normalmap_alpha = 0;
+   if(bpp == 4)
+   {
+      normalmap_alpha = g_malloc(w * h);
+      for(i = 0; i < w * h; ++i)
+         normalmap_alpha[i] = image[4 * i + 3];
+   }
+   conemap_dirty = 1;
+}
+
+/* a NULL image selects plain white */
+void render3d_set_diffusemap(unsigned int w, unsigned int h, int bpp,
+                             unsigned char *image)
+{
+   if(_gl_error) return;
+
+   if(image == 0)
+   {
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, white_tex);
+      return;
+   }
+
+   upload_texture(diffuse_tex, GL_TEXTURE1, w, h, bpp, image);
+}
+
+void render3d_set_glossmap(unsigned int w, unsigned int h, int bpp,
+                           unsigned char *image)
+{
+   if(_gl_error) return;
+   if(num_mtus < 3) return;
+
+   if(image == 0)
+   {
+      glActiveTexture(GL_TEXTURE2);
+      glBindTexture(GL_TEXTURE_2D, white_tex);
+      return;
+   }
+
+   upload_texture(gloss_tex, GL_TEXTURE2, w, h, bpp, image);
+}
+
+int render3d_has_glsl(void)
+{
+   return(has_glsl);
+}
+
+int render3d_has_program(int bumpmapping)
+{
+   if(bumpmapping < 0 || bumpmapping >= BUMPMAP_MAX) return(0);
+   return(has_glsl && programs[bumpmapping] != 0);
+}
+
+int render3d_error(void)
+{
+   return(_gl_error);
+}
+
+void render3d_release(void)
+{
+   g_free(normalmap_alpha);
+   normalmap_alpha = 0;
+   g_free(fallback.attribs);
+   fallback.attribs = 0;
+   fallback.size = 0;
+   fallback.obj = -1;
+   arena_free(upload_scratch);
+   upload_scratch = 0;
+}
@@ -0,0 +1,78 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __RENDER3D_H
+#define __RENDER3D_H
+
+/* OpenGL side of the 3D preview.  Everything here expects a current GL
+ * context and is independent of the toolkit that created it, so the same
+ * code draws into the GtkGLExt widget and into an offscreen framebuffer.
+ */
+
+typedef enum
+{
+   BUMPMAP_NORMAL = 0, BUMPMAP_PARALLAX, BUMPMAP_POM, BUMPMAP_RELIEF,
+   BUMPMAP_CONE,
+   BUMPMAP_MAX
+} BUMPMAP_TYPE;
+
+typedef enum
+{
+   OBJECT_QUAD = 0, OBJECT_CUBE, OBJECT_SPHERE, OBJECT_TORUS, OBJECT_TEAPOT,
+   OBJECT_MAX
+} OBJECT_TYPE;
+
+typedef struct
+{
+   int object;
+   int bumpmapping;
+   int specular;
+   float specular_exp;
+   float ambient_color[3];
+   float diffuse_color[3];
+   float specular_color[3];
+   float uvscale[2];
+   float quality;       /* 0..1, search steps for POM, relief and cone */
+   float object_rot[3];
+   float light_rot[3];
+   float scene_rot[3];
+   float zoom;
+} render3d_params;
+
+void render3d_default_params(render3d_params *p);
+
+int render3d_init(void);
+void render3d_resize(int w, int h);
+void render3d_draw(const render3d_params *p);
+
+void render3d_set_normalmap(unsigned int w, unsigned int h, int bpp,
+                            unsigned char *image);
+void render3d_set_diffusemap(unsigned int w, unsigned int h, int bpp,
+                             unsigned char *image);
+void render3d_set_glossmap(unsigned int w, unsigned int h, int bpp,
+                           unsigned char *image);
+
+int render3d_has_glsl(void);
+int render3d_has_program(int bumpmapping);
+int render3d_error(void);
+void render3d_release(void);
+
+#endif
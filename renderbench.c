@@ -0,0 +1,293 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+/* Headless benchmark for the 3D preview.  Renders every object with every
+ * bumpmapping program the driver supports into an offscreen framebuffer,
+ * using a synthetic normal map, and prints per-frame timings.
+ *
+ * "--dump DIR" writes the last frame of each run to DIR/<object>-<mode>.ppm,
+ * "--reference DIR" compares against frames written earlier and exits with
+ * status 1 if any pixel differs by more than the tolerance.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "render3d.h"
+#include "offscreen3d.h"
+
+#define NORMALMAP_SIZE 256
+
+static const char *object_names[OBJECT_MAX] =
+{
+   "quad", "cube", "sphere", "torus", "teapot"
+};
+
+static const char *bumpmap_names[BUMPMAP_MAX] =
+{
+   "normal", "parallax", "pom", "relief", "cone"
+};
+
+/* a grid of round bumps with the height in alpha, the way the plugin
+   writes it for the parallax modes */
+static unsigned char *make_normalmap(int size)
+{
+   unsigned char *pixels, *p;
+   int x, y;
+   float fx, fy, h, dx, dy, len;
+   const float f = 2.0f * M_PI * 8.0f / (float)size;
+
+   pixels = malloc(size * size * 4);
+   if(pixels == 0) return(0);
+
+   for(y = 0; y < size; ++y)
+   {
+      for(x = 0; x < size; ++x)
+      {
+         fx = (float)x * f;
+         fy = (float)y * f;
+         h = 0.5f + 0.25f * (sinf(fx) + sinf(fy));
+         dx = -0.25f * f * cosf(fx) * 16.0f;
+         dy = -0.25f * f * cosf(fy) * 16.0f;
+         len = sqrtf(dx * dx + dy * dy + 1.0f);
+
+         p = &pixels[(y * size + x) * 4];
+         p[0] = (unsigned char)((dx / len * 0.5f + 0.5f) * 255.0f);
+         p[1] = (unsigned char)((dy / len * 0.5f + 0.5f) * 255.0f);
+         p[2] = (unsigned char)((1.0f / len * 0.5f + 0.5f) * 255.0f);
+         p[3] = (unsigned char)(h * 255.0f);
+      }
+   }
+
+   return(pixels);
+}
+
+static int write_ppm(const char *fn, const unsigned char *pixels,
+                     int w, int h)
+{
+   FILE *fp;
+   size_t n;
+
+   fp = fopen(fn, "wb");
+   if(fp == 0) return(-1);
+   fprintf(fp, "P6\n%d %d\n255\n", w, h);
+   n = fwrite(pixels, 3, w * h, fp);
+   fclose(fp);
+
+   return(n == (size_t)(w * h) ? 0 : -1);
+}
+
+static unsigned char *read_ppm(const char *fn, int w, int h)
+{
+   FILE *fp;
+   int pw, ph, maxval;
+   unsigned char *pixels = 0;
+
+   fp = fopen(fn, "rb");
+   if(fp == 0) return(0);
+
+   if(fscanf(fp, "P6 %d %d %d", &pw, &ph, &maxval) == 3 &&
+      pw == w && ph == h && maxval == 255 && fgetc(fp) != EOF)
+   {
+      pixels = malloc(w * h * 3);
+      if(pixels && fread(pixels, 3, w * h, fp) != (size_t)(w * h))
+      {
+         free(pixels);
+         pixels = 0;
+      }
+   }
+
+   fclose(fp);
+
+   return(pixels);
+}
+
+/* returns the number of pixels with a channel off by more than tolerance */
+static int compare_pixels(const unsigned char *a, const unsigned char *b,
+                          int n, int tolerance, int *max_diff)
+{
+   int i, k, d, bad = 0, over;
+
+   *max_diff = 0;
+   for(i = 0; i < n; ++i)
+   {
+      over = 0;
+      for(k = 0; k < 3; ++k)
+      {
+         d = abs((int)a[3 * i + k] - (int)b[3 * i + k]);
+         if(d > *max_diff) *max_diff = d;
+         if(d > tolerance) over = 1;
+      }
+      bad += over;
+   }
+
+   return(bad);
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr,
+           "usage: %s [--size WxH] [--frames N] [--quality Q] [--dump DIR]\n"
+           "          [--reference DIR] [--tolerance N]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+   int i, obj, mode, w = 512, h = 512, frames = 100, tolerance = 2;
+   int bad, max_diff, failed = 0;
+   float quality = 0.5f;
+   const char *dump_dir = 0, *ref_dir = 0;
+   char fn[1024];
+   unsigned char *normalmap, *pixels, *ref;
+   double *times, sum, tmin, tmax;
+   render3d_params p;
+
+   for(i = 1; i < argc; ++i)
+   {
+      if(!strcmp(argv[i], "--size") && i + 1 < argc)
+      {
+         if(sscanf(argv[++i], "%dx%d", &w, &h) != 2 || w < 1 || h < 1)
+         {
+            usage(argv[0]);
+            return(1);
+         }
+      }
+      else if(!strcmp(argv[i], "--frames") && i + 1 < argc)
+         frames = atoi(argv[++i]);
+      else if(!strcmp(argv[i], "--quality") && i + 1 < argc)
+         quality = atof(argv[++i]);
+      else if(!strcmp(argv[i], "--dump") && i + 1 < argc)
+         dump_dir = argv[++i];
+      else if(!strcmp(argv[i], "--reference") && i + 1 < argc)
+         ref_dir = argv[++i];
+      else if(!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+         tolerance = atoi(argv[++i]);
+      else
+      {
+         usage(argv[0]);
+         return(1);
+      }
+   }
+   if(frames < 1) frames = 1;
+
+   if(offscreen3d_init(w, h) != 0)
+      return(1);
+
+   normalmap = make_normalmap(NORMALMAP_SIZE);
+   pixels = malloc(w * h * 3);
+   times = malloc(frames * sizeof(double));
+   if(normalmap == 0 || pixels == 0 || times == 0)
+   {
+      fprintf(stderr, "out of memory\n");
+      offscreen3d_release();
+      return(1);
+   }
+
+   render3d_set_normalmap(NORMALMAP_SIZE, NORMALMAP_SIZE, 4, normalmap);
+
+   printf("%-8s %-9s %7s %10s %10s %10s %10s\n",
+          "object", "mode", "frames", "mean ms", "min ms", "max ms",
+          "max diff");
+
+   for(obj = 0; obj < OBJECT_MAX; ++obj)
+   {
+      for(mode = 0; mode < BUMPMAP_MAX; ++mode)
+      {
+         /* without GLSL only the fixed function path is available */
+         if(render3d_has_glsl() ? !render3d_has_program(mode) : mode > 0)
+            continue;
+
+         render3d_default_params(&p);
+         p.object = obj;
+         p.bumpmapping = mode;
+         p.specular = render3d_has_glsl();
+         p.object_rot[0] = 25;
+         p.object_rot[1] = -35;
+         p.light_rot[0] = -30;
+         p.light_rot[1] = 30;
+         p.zoom = 3;
+         p.quality = quality;
+
+         /* one untimed frame so shader compilation and uploads done
+            lazily by the driver do not end up in the numbers */
+         offscreen3d_render(&p, 1, 0);
+         offscreen3d_render(&p, frames, times);
+
+         sum = 0;
+         tmin = tmax = times[0];
+         for(i = 0; i < frames; ++i)
+         {
+            sum += times[i];
+            if(times[i] < tmin) tmin = times[i];
+            if(times[i] > tmax) tmax = times[i];
+         }
+
+         printf("%-8s %-9s %7d %10.3f %10.3f %10.3f",
+                object_names[obj], bumpmap_names[mode], frames,
+                sum / (double)frames, tmin, tmax);
+
+         if(dump_dir || ref_dir)
+            offscreen3d_read_pixels(pixels);
+
+         if(ref_dir)
+         {
+            snprintf(fn, sizeof(fn), "%s/%s-%s.ppm", ref_dir,
+                     object_names[obj], bumpmap_names[mode]);
+            ref = read_ppm(fn, w, h);
+            if(ref == 0)
+            {
+               printf(" %10s\n", "missing");
+               failed = 1;
+            }
+            else
+            {
+               bad = compare_pixels(pixels, ref, w * h, tolerance, &max_diff);
+               printf(" %10d%s\n", max_diff, bad ? "  FAIL" : "");
+               if(bad) failed = 1;
+               free(ref);
+            }
+         }
+         else
+            printf(" %10s\n", "-");
+
+         if(dump_dir)
+         {
+            snprintf(fn, sizeof(fn), "%s/%s-%s.ppm", dump_dir,
+                     object_names[obj], bumpmap_names[mode]);
+            if(write_ppm(fn, pixels, w, h) != 0)
+            {
+               fprintf(stderr, "unable to write %s\n", fn);
+               failed = 1;
+            }
+         }
+      }
+   }
+
+   free(normalmap);
+   free(pixels);
+   free(times);
+
+   offscreen3d_release();
+
+   return(failed);
+}
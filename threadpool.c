@@ -0,0 +1,344 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "threadpool.h"
+#include "topology.h"
+
+#define MAX_THREADS 256
+
+typedef struct
+{
+   threadpool_func func;
+   void *arg;
+} task;
+
+/* ring buffer, the owner works at the tail, thieves at the head */
+typedef struct
+{
+   pthread_mutex_t lock;
+   task *tasks;
+   int head, count, size;
+} task_queue;
+
+typedef struct
+{
+   threadpool *pool;
+   int index;
+} worker_info;
+
+struct threadpool
+{
+   int nthreads;
+   int placement;              /* PLACEMENT_POLICY of the workers */
+   pthread_t *threads;
+   worker_info *workers;
+   task_queue *queues;
+
+   pthread_mutex_t lock;
+   pthread_cond_t work_cond;   /* signalled when tasks are queued */
+   pthread_cond_t done_cond;   /* signalled when pending drops to 0 */
+   int queued;                 /* tasks sitting in queues */
+   int pending;                /* queued plus running */
+   int quit;
+   unsigned int next_queue;
+};
+
+static __thread worker_info *current_worker = 0;
+
+int threadpool_num_processors(void)
+{
+#ifdef WIN32
+   SYSTEM_INFO si;
+
+   GetSystemInfo(&si);
+   return((int)si.dwNumberOfProcessors);
+#else
+   long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+   return(n > 0 ? (int)n : 1);
+#endif
+}
+
+static int queue_push(task_queue *q, const task *t)
+{
+   task *tasks;
+   int i;
+
+   pthread_mutex_lock(&q->lock);
+   if(q->count == q->size)
+   {
+      tasks = malloc((q->size ? q->size * 2 : 16) * sizeof(task));
+      if(tasks == 0)
+      {
+         pthread_mutex_unlock(&q->lock);
+         return(-1);
+      }
+      for(i = 0; i < q->count; ++i)
+         tasks[i] = q->tasks[(q->head + i) % q->size];
+      free(q->tasks);
+      q->tasks = tasks;
+      q->head = 0;
+      q->size = q->size ? q->size * 2 : 16;
+   }
+   q->tasks[(q->head + q->count) % q->size] = *t;
+   ++q->count;
+   pthread_mutex_unlock(&q->lock);
+
+   return(0);
+}
+
+static int queue_pop_back(task_queue *q, task *t)
+{
+   int ret = 0;
+
+   pthread_mutex_lock(&q->lock);
+   if(q->count > 0)
+   {
+      --q->count;
+      *t = q->tasks[(q->head + q->count) % q->size];
+      ret = 1;
+   }
+   pthread_mutex_unlock(&q->lock);
+
+   return(ret);
+}
+
+static int queue_pop_front(task_queue *q, task *t)
+{
+   int ret = 0;
+
+   pthread_mutex_lock(&q->lock);
+   if(q->count > 0)
+   {
+      *t = q->tasks[q->head];
+      q->head = (q->head + 1) % q->size;
+      --q->count;
+      ret = 1;
+   }
+   pthread_mutex_unlock(&q->lock);
+
+   return(ret);
+}
+
+static int take_task(threadpool *pool, int index, task *t)
+{
+   int i;
+
+   if(queue_pop_back(&pool->queues[index], t))
+      return(1);
+
+   for(i = 1; i < pool->nthreads; ++i)
+   {
+      if(queue_pop_front(&pool->queues[(index + i) % pool->nthreads], t))
+         return(1);
+   }
+
+   return(0);
+}
+
+static void *worker_thread(void *data)
+{
+   worker_info *w = (worker_info *)data;
+   threadpool *pool = w->pool;
+   task t;
+
+   current_worker = w;
+
+   /* a worker that cannot be bound still works, only not where planned */
+   topology_place_thread(pool->placement, w->index);
+
+   for(;;)
+   {
+      if(take_task(pool, w->index, &t))
+      {
+         pthread_mutex_lock(&pool->lock);
+         --pool->queued;
+         pthread_mutex_unlock(&pool->lock);
+
+         t.func(t.arg, w->index);
+
+         pthread_mutex_lock(&pool->lock);
+         if(--pool->pending == 0)
+            pthread_cond_broadcast(&pool->done_cond);
+         pthread_mutex_unlock(&pool->lock);
+         continue;
+      }
+
+      pthread_mutex_lock(&pool->lock);
+      /* queued can dip below zero while a task is stolen before its
+         push is counted, it is only a hint to go look again */
+      while(pool->queued <= 0 && !pool->quit)
+         pthread_cond_wait(&pool->work_cond, &pool->lock);
+      if(pool->queued <= 0 && pool->quit)
+      {
+         pthread_mutex_unlock(&pool->lock);
+         break;
+      }
+      pthread_mutex_unlock(&pool->lock);
+   }
+
+   return(0);
+}
+
+threadpool *threadpool_new(int nthreads)
+{
+   return(threadpool_new_placed(nthreads, PLACE_NONE));
+}
+
+threadpool *threadpool_new_placed(int nthreads, int placement)
+{
+   threadpool *pool;
+   int i;
+
+   if(nthreads <= 0) nthreads = threadpool_num_processors();
+   if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+   pool = calloc(1, sizeof(threadpool));
+   if(pool == 0) return(0);
+
+   pool->threads = calloc(nthreads, sizeof(pthread_t));
+   pool->workers = calloc(nthreads, sizeof(worker_info));
+   pool->queues = calloc(nthreads, sizeof(task_queue));
+   if(pool->threads == 0 || pool->workers == 0 || pool->queues == 0)
+   {
+      free(pool->threads);
+      free(pool->workers);
+      free(pool->queues);
+      free(pool);
+      return(0);
+   }
+
+   pool->placement = placement;
+
+   pthread_mutex_init(&pool->lock, 0);
+   pthread_cond_init(&pool->work_cond, 0);
+   pthread_cond_init(&pool->done_cond, 0);
+
+   for(i = 0; i < nthreads; ++i)
+   {
+      pthread_mutex_init(&pool->queues[i].lock, 0);
+      pool->workers[i].pool = pool;
+      pool->workers[i].index = i;
+   }
+
+   for(i = 0; i < nthreads; ++i)
+   {
+      if(pthread_create(&pool->threads[i], 0, worker_thread,
+                        &pool->workers[i]) != 0)
+         break;
+      pool->nthreads = i + 1;
+   }
+
+   if(pool->nthreads == 0)
+   {
+      threadpool_free(pool);
+      return(0);
+   }
+
+   return(pool);
+}
+
+int threadpool_num_threads(threadpool *pool)
+{
+   return(pool->nthreads);
+}
+
+int threadpool_push(threadpool *pool, threadpool_func func, void *arg)
+{
+   task t;
+   int index;
+
+   t.func = func;
+   t.arg = arg;
+
+   if(current_worker && current_worker->pool == pool)
+      index = current_worker->index;
+   else
+      index = __sync_fetch_and_add(&pool->next_queue, 1) % pool->nthreads;
+
+   /* counted before it becomes visible so a thief can never take pending
+      below zero */
+   pthread_mutex_lock(&pool->lock);
+   ++pool->pending;
+   pthread_mutex_unlock(&pool->lock);
+
+   if(queue_push(&pool->queues[index], &t) != 0)
+   {
+      pthread_mutex_lock(&pool->lock);
+      if(--pool->pending == 0)
+         pthread_cond_broadcast(&pool->done_cond);
+      pthread_mutex_unlock(&pool->lock);
+      return(-1);
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   ++pool->queued;
+   pthread_cond_signal(&pool->work_cond);
+   pthread_mutex_unlock(&pool->lock);
+
+   return(0);
+}
+
+void threadpool_wait(threadpool *pool)
+{
+   pthread_mutex_lock(&pool->lock);
+   while(pool->pending > 0)
+      pthread_cond_wait(&pool->done_cond, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void threadpool_free(threadpool *pool)
+{
+   int i;
+
+   if(pool == 0) return;
+
+   threadpool_wait(pool);
+
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->work_cond);
+   pthread_mutex_unlock(&pool->lock);
+
+   for(i = 0; i < pool->nthreads; ++i)
+      pthread_join(pool->threads[i], 0);
+
+   for(i = 0; i < pool->nthreads; ++i)
+      free(pool->queues[i].tasks);
+
+   pthread_mutex_destroy(&pool->lock);
+   pthread_cond_destroy(&pool->work_cond);
+   pthread_cond_destroy(&pool->done_cond);
+
+   free(pool->threads);
+   free(pool->workers);
+   free(pool->queues);
+   free(pool);
+}
@@ -0,0 +1,64 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+/* Work stealing thread pool.  Every worker has its own queue, takes work
+ * from its back and, once it is empty, steals from the front of the
+ * others, so a few long tasks do not leave the rest of the workers idle
+ * behind them.
+ */
+
+typedef struct threadpool threadpool;
+
+/* 'worker' is the index of the thread running the task, 0 to nthreads-1 */
+typedef void (*threadpool_func)(void *arg, int worker);
+
+/* nthreads <= 0 starts one thread per processor.  Returns NULL if the
+ * pool could not be created.
+ */
+threadpool *threadpool_new(int nthreads);
+
+/* Like threadpool_new, with every worker bound by the PLACEMENT_POLICY in
+ * topology.h as it starts, worker i as index i.  Memory a task allocates
+ * and fills then stays on the node its worker runs on.
+ */
+threadpool *threadpool_new_placed(int nthreads, int placement);
+
+int threadpool_num_threads(threadpool *pool);
+
+/* Queues a task.  Tasks queued from a worker go to that worker's queue,
+ * others are spread round robin.  Returns 0, or -1 if memory could not be
+ * allocated.
+ */
+int threadpool_push(threadpool *pool, threadpool_func func, void *arg);
+
+/* Waits until every queued task has finished. */
+void threadpool_wait(threadpool *pool);
+
+/* Waits for the queued tasks, then stops the workers. */
+void threadpool_free(threadpool *pool);
+
+/* Number of processors online, at least 1. */
+int threadpool_num_processors(void);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#include "topology.h"
+
+#ifdef __linux__
+
+#define MAX_NODES 64
+
+typedef struct
+{
+   cpu_set_t cpus;
+   int count;
+} node_info;
+
+static node_info nodes[MAX_NODES];
+static int num_nodes = 0;
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+
+/* parses a kernel cpu list such as "0-3,8-11" into 'set' */
+static void parse_cpulist(const char *s, cpu_set_t *set)
+{
+   int first, last, n;
+
+   CPU_ZERO(set);
+   while(sscanf(s, "%d%n", &first, &n) == 1)
+   {
+      s += n;
+      last = first;
+      if(*s == '-' && sscanf(s + 1, "%d%n", &last, &n) == 1)
+         s += 1 + n;
+      for(; first <= last && first < CPU_SETSIZE; ++first)
+         CPU_SET(first, set);
+      if(*s != ',') break;
+      ++s;
+   }
+}
+
+static void read_nodes(void)
+{
+   cpu_set_t allowed;
+   char fn[64], buf[1024];
+   FILE *fp;
+   int i;
+
+   if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+   {
+      num_nodes = 1;
+      nodes[0].count = 0;
+      return;
+   }
+
+   /* node numbers can have gaps, only those with usable processors count */
+   for(i = 0; i < MAX_NODES; ++i)
+   {
+      snprintf(fn, sizeof(fn), "/sys/devices/system/node/node%d/cpulist", i);
+      fp = fopen(fn, "r");
+      if(fp == 0) continue;
+      if(fgets(buf, sizeof(buf), fp) != 0)
+      {
+         parse_cpulist(buf, &nodes[num_nodes].cpus);
+         CPU_AND(&nodes[num_nodes].cpus, &nodes[num_nodes].cpus, &allowed);
+         nodes[num_nodes].count = CPU_COUNT(&nodes[num_nodes].cpus);
+         if(nodes[num_nodes].count > 0) ++num_nodes;
+      }
+      fclose(fp);
+   }
+
+   /* kernels without NUMA support have no node directory */
+   if(num_nodes == 0)
+   {
+      nodes[0].cpus = allowed;
+      nodes[0].count = CPU_COUNT(&allowed);
+      num_nodes = 1;
+   }
+}
+
+int topology_num_nodes(void)
+{
+   pthread_once(&nodes_once, read_nodes);
+   return(num_nodes);
+}
+
+int topology_place_thread(int policy, int index)
+{
+   const node_info *node;
+   cpu_set_t set;
+   int i, k;
+
+   if(policy <= PLACE_NONE || policy >= MAX_PLACEMENT || index < 0)
+      return(0);
+
+   pthread_once(&nodes_once, read_nodes);
+   node = &nodes[index % num_nodes];
+   if(node->count == 0) return(-1);
+
+   if(policy == PLACE_NODES)
+      set = node->cpus;
+   else
+   {
+      /* the (index / nodes)th processor of the node, wrapping around once
+         there are more workers than processors */
+      k = (index / num_nodes) % node->count;
+      for(i = 0; i < CPU_SETSIZE; ++i)
+      {
+         if(CPU_ISSET(i, &node->cpus) && k-- == 0)
+            break;
+      }
+      CPU_ZERO(&set);
+      CPU_SET(i, &set);
+   }
+
+   if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      return(-1);
+
+   return(0);
+}
+
+int topology_widen_to_node(void)
+{
+   cpu_set_t set, common;
+   int i;
+
+   if(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      return(-1);
+
+   pthread_once(&nodes_once, read_nodes);
+   for(i = 0; i < num_nodes; ++i)
+   {
+      CPU_AND(&common, &set, &nodes[i].cpus);
+      if(CPU_COUNT(&common) == CPU_COUNT(&set))
+      {
+         if(CPU_EQUAL(&set, &nodes[i].cpus))
+            return(0);
+         if(pthread_setaffinity_np(pthread_self(), sizeof(nodes[i].cpus),
+                                   &nodes[i].cpus) != 0)
+            return(-1);
+         return(0);
+      }
+   }
+
+   return(0);
+}
+
+#else
+
+int topology_num_nodes(void)
+{
+   return(1);
+}
+
+int topology_place_thread(int policy, int index)
+{
+   return(policy > PLACE_NONE && policy < MAX_PLACEMENT ? -1 : 0);
+}
+
+int topology_widen_to_node(void)
+{
+   return(0);
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+   normalmap GIMP plugin
+
+   Copyright (C) 2002-2012 Shawn Kirst <skirst@gmail.com>
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; see the file COPYING.  If not, write to
+   the Free Software Foundation, 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef __TOPOLOGY_H
+#define __TOPOLOGY_H
+
+/* Processor placement for worker threads on NUMA machines.  The nodes and
+ * their processors are read from /sys/devices/system/node on Linux, left
+ * out of it are the processors this process may not run on.  Linux puts a
+ * page on the node of the thread that first touches it, so a worker kept
+ * on one node finds the buffers it allocated and filled in local memory.
+ * Elsewhere there is a single node and threads are not moved.
+ */
+
+enum PLACEMENT_POLICY
+{
+   PLACE_NONE = 0,    /* leave the threads to the scheduler */
+   PLACE_NODES,       /* worker i on any processor of node i % nodes */
+   PLACE_CORES,       /* worker i on one processor, filling the nodes
+                         round robin */
+   MAX_PLACEMENT
+};
+
+/* Number of nodes with processors this process may use, at least 1. */
+int topology_num_nodes(void);
+
+/* Binds the calling thread as worker 'index' by 'policy'.  Threads it
+ * starts afterwards inherit the binding.  Returns 0, or -1 if the thread
+ * could not be bound, where it is left as it was.
+ */
+int topology_place_thread(int policy, int index);
+
+/* Widens the binding of the calling thread to the whole node when it is
+ * bound to processors of one node, for helper threads started by a
+ * worker pinned to a processor, which should not share it.  A thread
+ * that is not bound within a node is left alone.  Returns 0, or -1 if the
+ * binding could not be changed.
+ */
+int topology_widen_to_node(void);
+
+#endif